@@ -0,0 +1,1332 @@
+// Microbenchmarks for the tunnel hot path: framing, parsing/dispatch, stream
+// IDs and read-buffer handling, plus a steady-state allocation check for the
+// whole forwarding path, bonded throughput over bandwidth-capped lanes,
+// TCPServer's accept rate under a connection burst, its local broadcast with
+// a slow receiver, and an epoll vs io_uring comparison of the local socket
+// backends. Results go to connecttool_bench.json unless --benchmark_out is given.
+#include <benchmark/benchmark.h>
+#include <boost/asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include "latency_histogram.h"
+#include "logger.h"
+#include "loopback_transport.h"
+#include "mpsc_ring.h"
+#include "multiplex_manager.h"
+#include "poll_thread.h"
+#include "steam/local_lobby_directory.h"
+#include "tcp_server.h"
+#include "uring_engine.h"
+
+#ifdef __linux__
+#include <algorithm>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "shm_server.h"
+#include "shim/connecttool_shim.h"
+#endif
+
+using boost::asio::ip::tcp;
+
+// Every heap allocation in the process, for BM_ForwardingAllocations
+static std::atomic<uint64_t> g_allocations{0};
+static bool g_allocationCheckFailed = false;
+
+// Kept out of line: once inlined into callers (Boost's exception clone()),
+// GCC sees malloc paired with operator delete's free and warns with
+// -Wmismatched-new-delete
+#ifdef _MSC_VER
+#define BENCH_NOINLINE __declspec(noinline)
+#else
+#define BENCH_NOINLINE __attribute__((noinline))
+#endif
+
+BENCH_NOINLINE void* operator new(std::size_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+BENCH_NOINLINE void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+BENCH_NOINLINE void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+namespace {
+
+// Stand-in for ISteamNetworkingSockets: only records what would be sent
+class RecordingTransport : public TunnelTransport {
+public:
+    EResult send(HSteamNetConnection, const void*, uint32 size, int) override
+    {
+        ++messages;
+        bytes += size;
+        return k_EResultOK;
+    }
+
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+};
+
+// A connected loopback socket pair: `local` is handed to MultiplexManager,
+// `peer` plays the game and drains what gets written.
+struct SocketPair {
+    explicit SocketPair(boost::asio::io_context& io) : local(std::make_shared<tcp::socket>(io)), peer(io)
+    {
+        tcp::acceptor acceptor(io, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+        peer.connect(acceptor.local_endpoint());
+        acceptor.accept(*local);
+        peer.non_blocking(true);
+    }
+
+    void drain()
+    {
+        char sink[64 * 1024];
+        boost::system::error_code ec;
+        while (peer.read_some(boost::asio::buffer(sink), ec) > 0)
+        {
+        }
+    }
+
+    std::shared_ptr<tcp::socket> local;
+    tcp::socket peer;
+};
+
+std::vector<char> makeDataFrame(StreamId id, size_t payload, bool compact = false)
+{
+    std::vector<char> frame(kMaxFrameHeaderSize + payload, 'x');
+    size_t headerSize = encodeFrameHeader(frame.data(), id, 0, compact);
+    frame.erase(frame.begin() + static_cast<std::ptrdiff_t>(headerSize),
+                frame.begin() + static_cast<std::ptrdiff_t>(kMaxFrameHeaderSize));
+    return frame;
+}
+
+// A host's welcome that advertises compact headers, as a client would get
+// it after its hello: session control, so it's always a legacy frame
+void negotiateCompact(MultiplexManager& manager)
+{
+    const uint32_t kTypeWelcome = 4;
+    std::vector<char> frame(kLegacyHeaderSize + sizeof(uint64_t) + sizeof(uint32_t) + kCapabilitiesWireSize, 0);
+    encodeFrameHeader(frame.data(), 0, kTypeWelcome, false);
+    frame[kLegacyHeaderSize + sizeof(uint64_t)] = 1; // Resumed, nothing received yet
+    writeCapabilities(frame.data() + kLegacyHeaderSize + sizeof(uint64_t) + sizeof(uint32_t), Capabilities::local());
+    manager.handleTunnelPacket(frame.data(), frame.size());
+}
+
+// The peer acknowledging every frame sent so far, as it does every 64
+// frames; without it the client's replay buffer fills and stops recording
+void acknowledgeAll(MultiplexManager& manager)
+{
+    const uint32_t kTypeAck = 5;
+    char frame[kLegacyHeaderSize + sizeof(uint64_t)];
+    encodeFrameHeader(frame, 0, kTypeAck, false);
+    uint64_t count = UINT64_MAX; // Clamped to what was sent
+    std::memcpy(frame + kLegacyHeaderSize, &count, sizeof(count));
+    manager.handleTunnelPacket(frame, sizeof(frame));
+}
+
+// Acknowledges from a thread of its own every millisecond, for benchmarks
+// whose sends happen inside TCPServer
+class PeerAcknowledger {
+public:
+    explicit PeerAcknowledger(MultiplexManager& manager)
+        : thread_([this, &manager]() {
+              while (!stop_)
+              {
+                  acknowledgeAll(manager);
+                  std::this_thread::sleep_for(std::chrono::milliseconds(1));
+              }
+          })
+    {
+    }
+    ~PeerAcknowledger()
+    {
+        stop_ = true;
+        thread_.join();
+    }
+
+private:
+    std::atomic<bool> stop_{false};
+    std::thread thread_;
+};
+
+void BM_SendTunnelPacket(benchmark::State& state)
+{
+    boost::asio::io_context io;
+    RecordingTransport transport;
+    bool isHost = false;
+    int localPort = 0;
+    MultiplexManager manager(&transport, 1, io, isHost, localPort);
+    if (state.range(1))
+    {
+        negotiateCompact(manager);
+    }
+    std::vector<char> payload(static_cast<size_t>(state.range(0)), 'x');
+    StreamId id = streamIdFromWire("abcdef");
+    size_t n = 0;
+    for (auto _ : state)
+    {
+        manager.sendTunnelPacket(id, payload.data(), payload.size(), 0);
+        if (++n % 64 == 0)
+        {
+            acknowledgeAll(manager);
+        }
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(transport.bytes));
+    state.counters["frame_bytes"] = static_cast<double>(transport.bytes) / static_cast<double>(transport.messages);
+}
+BENCHMARK(BM_SendTunnelPacket)
+    ->ArgNames({"payload", "compact"})
+    ->Args({64, 0})
+    ->Args({64, 1})
+    ->Args({512, 0})
+    ->Args({1024, 0})
+    ->Args({1024, 1});
+
+// Parse a data frame, look up its stream and queue the local write
+void BM_HandleTunnelPacket(benchmark::State& state)
+{
+    boost::asio::io_context io;
+    RecordingTransport transport;
+    bool isHost = false;
+    int localPort = 0;
+    MultiplexManager manager(&transport, 1, io, isHost, localPort);
+    SocketPair pair(io);
+    StreamId id = manager.addClient(pair.local);
+    std::vector<char> frame = makeDataFrame(id, static_cast<size_t>(state.range(0)), state.range(1) != 0);
+    size_t n = 0;
+    for (auto _ : state)
+    {
+        manager.handleTunnelPacket(frame.data(), frame.size());
+        if (++n % 64 == 0)
+        {
+            io.poll();
+            pair.drain();
+        }
+    }
+    io.poll();
+    state.SetBytesProcessed(static_cast<int64_t>(n * static_cast<size_t>(state.range(0))));
+}
+BENCHMARK(BM_HandleTunnelPacket)->ArgNames({"payload", "compact"})->Args({64, 0})->Args({64, 1})->Args({1024, 0});
+
+// Registering a stream: ID generation plus the per-stream state
+void BM_StreamOpen(benchmark::State& state)
+{
+    boost::asio::io_context io; // never run: the pending reads stay parked
+    RecordingTransport transport;
+    bool isHost = false;
+    int localPort = 0;
+    MultiplexManager manager(&transport, 1, io, isHost, localPort);
+    std::vector<StreamId> ids;
+    for (auto _ : state)
+    {
+        ids.push_back(manager.addClient(std::make_shared<tcp::socket>(io)));
+        if (ids.size() == 1024)
+        {
+            state.PauseTiming();
+            for (StreamId id : ids)
+            {
+                manager.removeClient(id);
+            }
+            ids.clear();
+            io.poll();
+            state.ResumeTiming();
+        }
+    }
+}
+BENCHMARK(BM_StreamOpen);
+
+// getClient() with N streams registered (the stream lookup done per packet)
+void BM_StreamLookup(benchmark::State& state)
+{
+    boost::asio::io_context io; // never run: the pending reads stay parked
+    RecordingTransport transport;
+    bool isHost = false;
+    int localPort = 0;
+    MultiplexManager manager(&transport, 1, io, isHost, localPort);
+    std::vector<StreamId> ids;
+    for (int64_t i = 0; i < state.range(0); ++i)
+    {
+        ids.push_back(manager.addClient(std::make_shared<tcp::socket>(io)));
+    }
+    size_t i = 0;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(manager.getClient(ids[i++ % ids.size()]));
+    }
+}
+BENCHMARK(BM_StreamLookup)->Arg(16)->Arg(256)->Arg(4096);
+
+// A fresh shared buffer for every read, as TCPServer::start_read used to do...
+void BM_ReadBufferPerRead(benchmark::State& state)
+{
+    for (auto _ : state)
+    {
+        auto buffer = std::make_shared<std::vector<char>>(1024);
+        benchmark::DoNotOptimize(buffer->data());
+    }
+}
+BENCHMARK(BM_ReadBufferPerRead);
+
+// ...versus one buffer reused across reads of the same stream
+void BM_ReadBufferReused(benchmark::State& state)
+{
+    auto buffer = std::make_shared<std::vector<char>>(1024);
+    for (auto _ : state)
+    {
+        auto ref = buffer;
+        benchmark::DoNotOptimize(ref->data());
+    }
+}
+BENCHMARK(BM_ReadBufferReused);
+
+// Full forwarding path between two in-process managers:
+//   game client -> client manager (TCP read, framing) -> LoopbackTransport
+//     -> host manager (dispatch, write queue) -> game server
+// The managers pick their local socket backend (epoll or io_uring) when
+// they are constructed.
+class ForwardingRig {
+public:
+    ForwardingRig()
+        : clientWork_(boost::asio::make_work_guard(clientIo_)), hostWork_(boost::asio::make_work_guard(hostIo_)),
+          serverAcceptor_(hostIo_, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+          serverPort_(serverAcceptor_.local_endpoint().port()), toHost_(hostIo_), toClient_(clientIo_),
+          clientManager_(&toHost_, 1, clientIo_, clientIsHost_, clientPort_),
+          hostManager_(&toClient_, 1, hostIo_, hostIsHost_, serverPort_), gameClient_(clientIo_)
+    {
+        // Game server: accepts the host manager's connection and counts bytes
+        server_ = std::thread([this]() {
+            tcp::socket conn(hostIo_);
+            serverAcceptor_.accept(conn);
+            char sink[64 * 1024];
+            boost::system::error_code ec;
+            size_t n;
+            while ((n = conn.read_some(boost::asio::buffer(sink), ec)) > 0)
+            {
+                serverBytes_.fetch_add(n, std::memory_order_relaxed);
+            }
+        });
+        toHost_.setPeer(&hostManager_);
+        toClient_.setPeer(&clientManager_);
+
+        // Game client socket, the other end registered with the client manager
+        {
+            tcp::acceptor acceptor(clientIo_, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+            auto local = std::make_shared<tcp::socket>(clientIo_);
+            gameClient_.connect(acceptor.local_endpoint());
+            acceptor.accept(*local);
+            clientManager_.addClient(local);
+        }
+        gameClient_.set_option(tcp::no_delay(true));
+
+        clientThread_ = std::thread([this]() { clientIo_.run(); });
+        hostThread_ = std::thread([this]() { hostIo_.run(); });
+    }
+
+    ~ForwardingRig()
+    {
+        gameClient_.close();
+        while (clientManager_.getClientCount() > 0 || hostManager_.getClientCount() > 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        server_.join();
+        clientWork_.reset();
+        hostWork_.reset();
+        clientIo_.stop();
+        hostIo_.stop();
+        clientThread_.join();
+        hostThread_.join();
+    }
+
+    // Writes `chunk`-sized blocks from the game client until `done()`, never
+    // more than maxInFlight bytes ahead of the server (like a game waiting on
+    // replies; keeps queue depths bounded), then waits for the server to
+    // catch up
+    template <typename Done>
+    void forward(const char* chunk, size_t chunkSize, uint64_t maxInFlight, Done done)
+    {
+        while (!done())
+        {
+            if (written_ - serverBytes_.load(std::memory_order_relaxed) > maxInFlight)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            written_ += boost::asio::write(gameClient_, boost::asio::buffer(chunk, chunkSize));
+        }
+        while (serverBytes_.load(std::memory_order_relaxed) < written_)
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    uint64_t frames() const { return toHost_.messageCount(); }
+    uint64_t written() const { return written_; }
+
+private:
+    boost::asio::io_context clientIo_;
+    boost::asio::io_context hostIo_;
+    boost::asio::executor_work_guard<boost::asio::io_context::executor_type> clientWork_;
+    boost::asio::executor_work_guard<boost::asio::io_context::executor_type> hostWork_;
+    bool clientIsHost_ = false;
+    bool hostIsHost_ = true;
+    int clientPort_ = 0;
+    tcp::acceptor serverAcceptor_;
+    int serverPort_;
+    std::atomic<uint64_t> serverBytes_{0};
+    std::thread server_;
+    LoopbackTransport toHost_;
+    LoopbackTransport toClient_;
+    MultiplexManager clientManager_;
+    MultiplexManager hostManager_;
+    tcp::socket gameClient_;
+    std::thread clientThread_;
+    std::thread hostThread_;
+    uint64_t written_ = 0;
+};
+
+// After a warm-up that opens the stream and grows the pools, forwarding
+// range(0) more frames must not allocate at all.
+void BM_ForwardingAllocations(benchmark::State& state)
+{
+    const uint64_t packets = static_cast<uint64_t>(state.range(0));
+    const uint64_t warmup = 200000;
+    for (auto _ : state)
+    {
+        UringEngine::setRequested(false);
+        ForwardingRig rig;
+        char payload[64];
+        std::memset(payload, 'x', sizeof(payload));
+        auto forwardFrames = [&](uint64_t count, uint64_t maxInFlight) {
+            uint64_t target = rig.frames() + count;
+            rig.forward(payload, sizeof(payload), maxInFlight, [&]() { return rig.frames() >= target; });
+        };
+
+        // Pools only grow on a new record queue depth, so warm up with deeper
+        // queues than the measured run can reach
+        forwardFrames(warmup, 256 * 1024);
+        uint64_t before = g_allocations.load();
+        uint64_t framesBefore = rig.frames();
+        forwardFrames(packets, 64 * 1024);
+        uint64_t allocations = g_allocations.load() - before;
+        uint64_t frames = rig.frames() - framesBefore;
+
+        state.counters["frames"] = static_cast<double>(frames);
+        state.counters["allocations"] = static_cast<double>(allocations);
+        state.counters["allocs_per_frame"] = static_cast<double>(allocations) / static_cast<double>(frames);
+        if (allocations > 0)
+        {
+            g_allocationCheckFailed = true;
+            state.SkipWithError("steady-state forwarding allocated");
+        }
+    }
+}
+BENCHMARK(BM_ForwardingAllocations)->Arg(1000000)->Iterations(1)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Two managers bonded over `lanes` LoopbackTransports per direction, the
+// client->host ones capped at kLaneCaps (uneven, like routes through
+// different relays). `streams` game clients send to one game server.
+class BondedRig {
+public:
+    static constexpr uint64_t kLaneCaps[MultiplexManager::kMaxLanes] = {8 << 20, 4 << 20, 2 << 20, 2 << 20};
+    static constexpr HSteamNetConnection kClientConn = 1;   // Lane i is kClientConn + i
+    static constexpr HSteamNetConnection kHostConn = 101;   // Lane i is kHostConn + i
+
+    BondedRig(int lanes, int streams, bool striped)
+        : clientWork_(boost::asio::make_work_guard(clientIo_)), hostWork_(boost::asio::make_work_guard(hostIo_)),
+          serverAcceptor_(hostIo_, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+          serverPort_(serverAcceptor_.local_endpoint().port()),
+          clientManager_(&clientLanes_, kClientConn, clientIo_, clientIsHost_, clientPort_),
+          hostManager_(&hostLanes_, kHostConn, hostIo_, hostIsHost_, serverPort_)
+    {
+        for (int i = 0; i < lanes; ++i)
+        {
+            toHost_.emplace_back(new LoopbackTransport(hostIo_));
+            toClient_.emplace_back(new LoopbackTransport(clientIo_));
+            toHost_[i]->setPeer(&hostManager_, i);
+            toHost_[i]->setBandwidth(kLaneCaps[i]);
+            toClient_[i]->setPeer(&clientManager_, i);
+            clientLanes_.addLink(kClientConn + i, toHost_[i].get());
+            hostLanes_.addLink(kHostConn + i, toClient_[i].get());
+            capacity_ += kLaneCaps[i];
+        }
+        server_ = std::thread([this, streams]() {
+            std::vector<std::thread> readers;
+            for (int i = 0; i < streams; ++i)
+            {
+                auto conn = std::make_shared<tcp::socket>(hostIo_);
+                serverAcceptor_.accept(*conn);
+                readers.emplace_back([this, conn]() {
+                    char sink[64 * 1024];
+                    boost::system::error_code ec;
+                    size_t n;
+                    while ((n = conn->read_some(boost::asio::buffer(sink), ec)) > 0)
+                    {
+                        serverBytes_.fetch_add(n, std::memory_order_relaxed);
+                    }
+                });
+            }
+            for (auto& reader : readers)
+            {
+                reader.join();
+            }
+        });
+        clientThread_ = std::thread([this]() { clientIo_.run(); });
+        hostThread_ = std::thread([this]() { hostIo_.run(); });
+
+        // Lanes join an established session
+        clientManager_.openSession();
+        while (!clientManager_.sessionEstablished())
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        for (int i = 1; i < lanes; ++i)
+        {
+            clientManager_.addLane(kClientConn + i);
+            hostManager_.attachLane(i, kHostConn + i); // SteamMessageHandler's job, from the lane join
+        }
+        clientManager_.setStriping(striped);
+
+        tcp::acceptor acceptor(clientIo_, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+        for (int i = 0; i < streams; ++i)
+        {
+            auto local = std::make_shared<tcp::socket>(clientIo_);
+            gameClients_.emplace_back(new tcp::socket(clientIo_));
+            gameClients_.back()->connect(acceptor.local_endpoint());
+            acceptor.accept(*local);
+            clientManager_.addClient(local);
+        }
+    }
+
+    ~BondedRig()
+    {
+        for (auto& client : gameClients_)
+        {
+            client->close();
+        }
+        while (clientManager_.getClientCount() > 0 || hostManager_.getClientCount() > 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        server_.join();
+        clientWork_.reset();
+        hostWork_.reset();
+        clientIo_.stop();
+        hostIo_.stop();
+        clientThread_.join();
+        hostThread_.join();
+    }
+
+    // Sends `total` bytes spread evenly over the game clients, at most
+    // maxInFlight ahead of the server, and waits for all of it to arrive
+    void transfer(uint64_t total, uint64_t maxInFlight)
+    {
+        char chunk[16 * 1024];
+        std::memset(chunk, 'x', sizeof(chunk));
+        uint64_t target = written_ + total;
+        for (size_t next = 0; written_ < target; next = (next + 1) % gameClients_.size())
+        {
+            while (written_ - serverBytes_.load(std::memory_order_relaxed) > maxInFlight)
+            {
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            }
+            written_ += boost::asio::write(*gameClients_[next], boost::asio::buffer(chunk));
+        }
+        while (serverBytes_.load(std::memory_order_relaxed) < written_)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }
+
+    uint64_t capacity() const { return capacity_; }
+
+private:
+    boost::asio::io_context clientIo_;
+    boost::asio::io_context hostIo_;
+    boost::asio::executor_work_guard<boost::asio::io_context::executor_type> clientWork_;
+    boost::asio::executor_work_guard<boost::asio::io_context::executor_type> hostWork_;
+    bool clientIsHost_ = false;
+    bool hostIsHost_ = true;
+    int clientPort_ = 0;
+    tcp::acceptor serverAcceptor_;
+    int serverPort_;
+    std::atomic<uint64_t> serverBytes_{0};
+    std::thread server_;
+    std::vector<std::unique_ptr<LoopbackTransport>> toHost_;
+    std::vector<std::unique_ptr<LoopbackTransport>> toClient_;
+    LoopbackLanes clientLanes_;
+    LoopbackLanes hostLanes_;
+    MultiplexManager clientManager_;
+    MultiplexManager hostManager_;
+    std::vector<std::unique_ptr<tcp::socket>> gameClients_;
+    std::thread clientThread_;
+    std::thread hostThread_;
+    uint64_t written_ = 0;
+    uint64_t capacity_ = 0;
+};
+
+constexpr uint64_t BondedRig::kLaneCaps[];
+
+// range(0) lanes; range(1) = 0 for four streams each pinned to a lane, 1 for
+// one stream striped over all of them. Reports MB/s against the sum of the
+// lanes' caps.
+void BM_BondedThroughput(benchmark::State& state)
+{
+    const int lanes = static_cast<int>(state.range(0));
+    const bool striped = state.range(1) != 0;
+    const uint64_t total = 24ull << 20;
+    UringEngine::setRequested(false);
+    for (auto _ : state)
+    {
+        BondedRig rig(lanes, striped ? 1 : 4, striped);
+        rig.transfer(1 << 20, 1 << 20); // Opens the streams and settles the lane weights
+        auto start = std::chrono::steady_clock::now();
+        rig.transfer(total, 2 << 20);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        state.SetIterationTime(seconds);
+        state.counters["MBps"] = static_cast<double>(total) / seconds / (1 << 20);
+        state.counters["cap_MBps"] = static_cast<double>(rig.capacity()) / (1 << 20);
+    }
+}
+BENCHMARK(BM_BondedThroughput)
+    ->ArgNames({"lanes", "striped"})
+    ->Args({1, 0})
+    ->Args({2, 0})
+    ->Args({4, 0})
+    ->Args({2, 1})
+    ->Args({4, 1})
+    ->Iterations(1)
+    ->UseManualTime()
+    ->Unit(benchmark::kMillisecond);
+
+// Drops everything; unlike RecordingTransport it can be sent to from several threads
+class DiscardTransport : public TunnelTransport {
+public:
+    EResult send(HSteamNetConnection, const void*, uint32, int) override { return k_EResultOK; }
+};
+
+// A launcher opening kBurst connections at once: how long until TCPServer has
+// accepted them all and registered each with the tunnel. range(0) is the
+// number of outstanding accepts, range(1) the I/O threads, range(2) one
+// SO_REUSEPORT acceptor per thread. Reports connections per second and the
+// clients' connect latency.
+void BM_AcceptBurst(benchmark::State& state)
+{
+    const int kBurst = 512;
+    boost::asio::io_context tunnelIo;
+    DiscardTransport transport;
+    bool isHost = false;
+    int localPort = 0;
+    auto manager = std::make_shared<MultiplexManager>(&transport, 1, tunnelIo, isHost, localPort);
+    TCPServer::AcceptOptions options;
+    options.pendingAccepts = static_cast<int>(state.range(0));
+    options.threads = static_cast<int>(state.range(1));
+    options.reusePort = state.range(2) != 0;
+    TCPServer server(0, [manager](uint64_t) { return manager; });
+    server.setLocalBroadcast(false);
+    server.setAcceptOptions(options);
+    if (!server.start())
+    {
+        state.SkipWithError("listen failed");
+        return;
+    }
+    tcp::endpoint target(boost::asio::ip::address_v4::loopback(),
+                         static_cast<unsigned short>(server.getListeningMappings()[0].localPort));
+    auto waitFor = [](const std::function<bool()>& done) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (!done() && std::chrono::steady_clock::now() < deadline)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        return done();
+    };
+
+    boost::asio::io_context clientIo;
+    LatencyHistogram connectLatency;
+    double connections = 0;
+    double seconds = 0;
+    for (auto _ : state)
+    {
+        std::vector<std::unique_ptr<tcp::socket>> sockets;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < kBurst; ++i)
+        {
+            sockets.emplace_back(new tcp::socket(clientIo));
+            sockets.back()->async_connect(target, [&connectLatency, start](const boost::system::error_code& ec) {
+                if (!ec)
+                {
+                    connectLatency.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - start).count()));
+                }
+            });
+        }
+        clientIo.restart();
+        clientIo.run();
+        if (!waitFor([&server, kBurst]() { return server.getClientCount() == kBurst; }))
+        {
+            state.SkipWithError("not every connection was registered");
+            break;
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        state.SetIterationTime(elapsed);
+        connections += kBurst;
+        seconds += elapsed;
+
+        sockets.clear();
+        if (!waitFor([&server]() { return server.getClientCount() == 0; }))
+        {
+            state.SkipWithError("closed connections stayed registered");
+            break;
+        }
+    }
+    state.counters["conns_per_s"] = seconds > 0 ? connections / seconds : 0;
+    state.counters["connect_p50_us"] = static_cast<double>(connectLatency.percentile(50));
+    state.counters["connect_p99_us"] = static_cast<double>(connectLatency.percentile(99));
+    server.stop();
+}
+BENCHMARK(BM_AcceptBurst)
+    ->ArgNames({"pending", "threads", "reuseport"})
+    ->Args({1, 1, 0})
+    ->Args({4, 1, 0})
+    ->Args({16, 1, 0})
+    ->Args({4, 2, 0})
+    ->Args({4, 2, 1})
+    ->Iterations(20)
+    ->UseManualTime()
+    ->Unit(benchmark::kMillisecond);
+
+// TCPServer's local broadcast: one client sends, range(0) others on the
+// same port receive it. With range(2) set the last of them is slow (small
+// receive buffer, reads 8 KB a millisecond) and range(1) picks the
+// SlowConsumerPolicy. Reports what the fast receivers got per second, heap
+// allocations per chunk and what the policy did.
+void BM_LocalFanout(benchmark::State& state)
+{
+    const int recipients = static_cast<int>(state.range(0));
+    const auto policy = static_cast<TCPServer::SlowConsumerPolicy>(state.range(1));
+    const bool slowReader = state.range(2) != 0;
+    const size_t kChunk = 1024;
+    // Past what the kernel buffers for the slow receiver, so its queue fills
+    const size_t kTotal = (slowReader ? 16 : 4) * 1024 * 1024;
+    boost::asio::io_context tunnelIo;
+    DiscardTransport transport;
+    bool isHost = false;
+    int localPort = 0;
+    auto manager = std::make_shared<MultiplexManager>(&transport, 1, tunnelIo, isHost, localPort);
+    TCPServer::BroadcastOptions options;
+    options.maxQueuedBytes = 256 * 1024;
+    options.policy = policy;
+    TCPServer server(0, [manager](uint64_t) { return manager; });
+    server.setBroadcastOptions(options);
+    if (!server.start())
+    {
+        state.SkipWithError("listen failed");
+        return;
+    }
+    tcp::endpoint target(boost::asio::ip::address_v4::loopback(),
+                         static_cast<unsigned short>(server.getListeningMappings()[0].localPort));
+
+    boost::asio::io_context clientIo;
+    double fastBytes = 0;
+    double seconds = 0;
+    double allocationsPerChunk = 0;
+    for (auto _ : state)
+    {
+        // All registered before the first chunk, so every receiver gets all of it
+        std::vector<std::unique_ptr<tcp::socket>> sockets;
+        for (int i = 0; i <= recipients; ++i)
+        {
+            sockets.emplace_back(new tcp::socket(clientIo));
+            sockets.back()->open(tcp::v4());
+            if (slowReader && i == recipients)
+            {
+                sockets.back()->set_option(boost::asio::socket_base::receive_buffer_size(16 * 1024));
+            }
+            sockets.back()->connect(target);
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+            while (server.getClientCount() < i + 1 && std::chrono::steady_clock::now() < deadline)
+            {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+        std::atomic<int> fastDone{0};
+        std::vector<std::thread> readers;
+        for (int i = 1; i <= recipients; ++i)
+        {
+            bool slow = slowReader && i == recipients;
+            readers.emplace_back([&sockets, &fastDone, i, slow, kTotal]() {
+                std::vector<char> buffer(slow ? 8 * 1024 : 64 * 1024);
+                size_t received = 0;
+                boost::system::error_code ec;
+                while (received < kTotal && !ec)
+                {
+                    received += sockets[i]->read_some(boost::asio::buffer(buffer), ec);
+                    if (slow)
+                    {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    }
+                }
+                if (!slow && received >= kTotal)
+                {
+                    ++fastDone;
+                }
+            });
+        }
+        std::vector<char> chunk(kChunk, 'x');
+        PeerAcknowledger acknowledger(*manager);
+        uint64_t allocationsBefore = g_allocations.load();
+        auto start = std::chrono::steady_clock::now();
+        for (size_t sent = 0; sent < kTotal; sent += kChunk)
+        {
+            boost::asio::write(*sockets[0], boost::asio::buffer(chunk));
+        }
+        int fast = slowReader ? recipients - 1 : recipients;
+        auto deadline = start + std::chrono::seconds(30);
+        while (fastDone < fast && std::chrono::steady_clock::now() < deadline &&
+               server.getClientCount() > fast) // Stop early once a fast receiver was cut off
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        allocationsPerChunk += static_cast<double>(g_allocations.load() - allocationsBefore) / (kTotal / kChunk);
+        fastBytes += static_cast<double>(kTotal) * fast;
+        seconds += elapsed;
+        state.SetIterationTime(elapsed);
+
+        for (auto& socket : sockets)
+        {
+            boost::system::error_code ec;
+            socket->shutdown(tcp::socket::shutdown_both, ec);
+            socket->close(ec);
+        }
+        for (auto& reader : readers)
+        {
+            reader.join();
+        }
+        auto closeDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (server.getClientCount() > 0 && std::chrono::steady_clock::now() < closeDeadline)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+        if (fastDone < fast)
+        {
+            state.SkipWithError("a fast receiver didn't get everything");
+            break;
+        }
+    }
+    TCPServer::BroadcastStats stats = server.getBroadcastStats();
+    double iterations = static_cast<double>(state.iterations());
+    state.counters["fast_MB_per_s"] = seconds > 0 ? fastBytes / seconds / (1024 * 1024) : 0;
+    state.counters["allocs_per_chunk"] = iterations > 0 ? allocationsPerChunk / iterations : 0;
+    state.counters["dropped"] = static_cast<double>(stats.dropped);
+    state.counters["disconnected"] = static_cast<double>(stats.disconnected);
+    state.counters["stalls"] = static_cast<double>(stats.stalls);
+    server.stop();
+}
+BENCHMARK(BM_LocalFanout)
+    ->ArgNames({"recipients", "policy", "slow"})
+    ->Args({2, 1, 0})
+    ->Args({8, 1, 0})
+    ->Args({32, 1, 0})
+    ->Args({8, 0, 1})
+    ->Args({8, 1, 1})
+    ->Args({8, 2, 1})
+    ->Iterations(3)
+    ->UseManualTime()
+    ->Unit(benchmark::kMillisecond);
+
+// Wake-up latency of the Steam poll thread's wait strategies: a producer
+// publishes a timestamp every range(1) microseconds into a ring the poll
+// thread drains. range(0) is the PollThread::WaitStrategy. The intervals sit
+// inside Hybrid's spin window (20 us), inside its yield window (100 us) and
+// past both (2 ms, a quiet game's packet rate), so Hybrid shows up as
+// busy-spin, in between, and timed in turn. Intervals under a millisecond are
+// paced by yielding, as a sleep that short overshoots by more than the
+// interval. Reports publish-to-pop percentiles and the poll thread's CPU use;
+// busy-spin needs a core of its own to mean anything.
+void BM_PollWakeLatency(benchmark::State& state)
+{
+    PollThread::Options options;
+    options.wait = static_cast<PollThread::WaitStrategy>(state.range(0));
+    const auto interval = std::chrono::microseconds(state.range(1));
+    const int messages = 500;
+    for (auto _ : state)
+    {
+        MpscRing<int64_t> ring(1024);
+        PollThread thread("bench", std::chrono::hours(1));
+        auto nowNanos = []() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now().time_since_epoch())
+                .count();
+        };
+        thread.start(options, [&]() {
+            size_t found = 0;
+            while (ring.tryPop([&](int64_t& sent) {
+                thread.recordLatency(static_cast<uint64_t>((nowNanos() - sent) / 1000));
+            }))
+            {
+                ++found;
+            }
+            return found;
+        });
+        auto due = std::chrono::steady_clock::now();
+        for (int i = 0; i < messages; ++i)
+        {
+            due += interval;
+            if (interval >= std::chrono::milliseconds(1))
+            {
+                std::this_thread::sleep_until(due);
+            }
+            else
+            {
+                while (std::chrono::steady_clock::now() < due)
+                {
+                    std::this_thread::yield();
+                }
+            }
+            int64_t sent = nowNanos();
+            ring.tryPush([sent](int64_t& slot) { slot = sent; });
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        thread.stop();
+        PollThread::Snapshot snapshot = thread.snapshot();
+        state.counters["p50_us"] = static_cast<double>(snapshot.latencyP50Us);
+        state.counters["p99_us"] = static_cast<double>(snapshot.latencyP99Us);
+        state.counters["max_us"] = static_cast<double>(snapshot.latencyMaxUs);
+        state.counters["cpu_percent"] = snapshot.cpuPercent;
+        state.counters["polls_per_msg"] = static_cast<double>(snapshot.polls) / messages;
+    }
+}
+BENCHMARK(BM_PollWakeLatency)
+    ->ArgNames({"strategy", "interval_us"})
+    ->ArgsProduct({{static_cast<int>(PollThread::WaitStrategy::BusySpin),
+                    static_cast<int>(PollThread::WaitStrategy::Hybrid),
+                    static_cast<int>(PollThread::WaitStrategy::Timed)},
+                   {20, 100, 2000}})
+    ->Iterations(1)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+// Lobbies with room first, then nearest first by LobbyBrowser's buckets
+bool sortedForPicking(const std::vector<LobbyEntry>& results)
+{
+    auto bucket = [](const LobbyEntry& entry) {
+        return entry.rttMs < 0 ? INT32_MAX : entry.rttMs / LobbyBrowser::kRttBucketMs;
+    };
+    for (size_t i = 1; i < results.size(); ++i)
+    {
+        const LobbyEntry& a = results[i - 1];
+        const LobbyEntry& b = results[i];
+        bool aFull = a.spare() == 0;
+        bool bFull = b.spare() == 0;
+        if ((aFull && !bFull) || (aFull == bFull && bucket(a) > bucket(b)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The lobby browser against the local matchmaking stand-in: one search,
+// every result's data requested in one go, then the sort. range(0)
+// lobbies, a quarter of them full and a tenth without a ping location.
+// Fails if the results aren't in picking order.
+void BM_LobbyBrowse(benchmark::State& state)
+{
+    const size_t count = static_cast<size_t>(state.range(0));
+    LocalLobbyDirectory directory;
+    for (size_t i = 0; i < count; ++i)
+    {
+        LocalLobbyDirectory::Lobby lobby;
+        lobby.memberLimit = 8;
+        lobby.members = i % 4 == 0 ? 8 : 1 + static_cast<int>(i % 7);
+        lobby.data[kLobbyKeyHostName] = "host" + std::to_string(i);
+        if (i % 10 != 0)
+        {
+            lobby.data[kLobbyKeyPingLocation] = std::to_string((i * 37) % 300);
+        }
+        directory.addLobby(1000 + i, lobby);
+    }
+    LobbyBrowser browser(&directory);
+    bool ordered = true;
+    for (auto _ : state)
+    {
+        browser.refresh();
+        directory.deliver(); // The list, which requests every lobby's data
+        size_t answers = directory.deliver();
+        const std::vector<LobbyEntry>& results = browser.results();
+        benchmark::DoNotOptimize(results.data());
+        ordered = ordered && answers == count && results.size() == count && sortedForPicking(results);
+    }
+    if (!ordered)
+    {
+        state.SkipWithError("lobby results out of order or incomplete");
+        return;
+    }
+    state.counters["data_requests_per_search"] =
+        static_cast<double>(directory.dataRequests()) / static_cast<double>(state.iterations());
+}
+BENCHMARK(BM_LobbyBrowse)->ArgName("lobbies")->Arg(50)->Arg(500);
+
+#ifdef __linux__
+// Bulk transfer through the same pipeline on each local socket backend:
+// range(0) = 0 for Asio's epoll reactor, 1 for io_uring. Reports process CPU
+// seconds per GB forwarded and context switches; the io_uring run also
+// reports its io_uring_enter calls per MB (the epoll equivalent needs
+// `perf stat -e raw_syscalls:sys_enter` or strace).
+void BM_LocalForward(benchmark::State& state)
+{
+    const bool uring = state.range(0) != 0;
+    const uint64_t total = 512ull * 1024 * 1024;
+    UringEngine::setRequested(uring);
+    if (uring && !UringEngine::instance())
+    {
+        state.SkipWithError("io_uring not available");
+        UringEngine::setRequested(false);
+        return;
+    }
+    std::vector<char> chunk(16 * 1024, 'x');
+    for (auto _ : state)
+    {
+        ForwardingRig rig;
+        UringEngine::Stats engineBefore = uring ? UringEngine::instance()->stats() : UringEngine::Stats();
+        rusage before{};
+        getrusage(RUSAGE_SELF, &before);
+        uint64_t target = rig.written() + total;
+        rig.forward(chunk.data(), chunk.size(), 1024 * 1024, [&]() { return rig.written() >= target; });
+        rusage after{};
+        getrusage(RUSAGE_SELF, &after);
+
+        auto seconds = [](const timeval& tv) { return static_cast<double>(tv.tv_sec) + tv.tv_usec / 1e6; };
+        double cpu = seconds(after.ru_utime) - seconds(before.ru_utime) + seconds(after.ru_stime) -
+                     seconds(before.ru_stime);
+        double gb = static_cast<double>(total) / (1024.0 * 1024 * 1024);
+        state.SetBytesProcessed(static_cast<int64_t>(total));
+        state.counters["cpu_s_per_GB"] = cpu / gb;
+        state.counters["sys_s_per_GB"] = (seconds(after.ru_stime) - seconds(before.ru_stime)) / gb;
+        state.counters["ctx_switches_per_MB"] =
+            static_cast<double>(after.ru_nvcsw - before.ru_nvcsw + after.ru_nivcsw - before.ru_nivcsw) / (gb * 1024);
+        if (uring)
+        {
+            UringEngine::Stats engineAfter = UringEngine::instance()->stats();
+            state.counters["enter_calls_per_MB"] =
+                static_cast<double>(engineAfter.enterCalls - engineBefore.enterCalls) / (gb * 1024);
+            state.counters["completions_per_MB"] =
+                static_cast<double>(engineAfter.completions - engineBefore.completions) / (gb * 1024);
+        }
+    }
+    UringEngine::setRequested(false);
+}
+BENCHMARK(BM_LocalForward)->ArgName("uring")->Arg(0)->Arg(1)->Iterations(1)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// How the game on each side of the tunnel reaches ConnectTool
+enum class LocalLink { Tcp = 0, Shm = 1, InProcess = 2 };
+
+// Small request/reply exchanges between a game client and a game server,
+// through two managers and a loopback link, with the games on either side
+// attached over loopback TCP, the shared-memory rings, or in-process
+// StreamEndpoints (what a game linking connecttool_core gets). The link is
+// the same in all three, so the difference is the cost of the local hops.
+class RoundTripRig {
+public:
+    explicit RoundTripRig(LocalLink link)
+        : link_(link), clientWork_(boost::asio::make_work_guard(clientIo_)),
+          hostWork_(boost::asio::make_work_guard(hostIo_)),
+          serverAcceptor_(hostIo_, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+          serverPort_(link == LocalLink::Tcp ? serverAcceptor_.local_endpoint().port() : 0), toHost_(hostIo_), toClient_(clientIo_),
+          clientManager_(std::make_shared<MultiplexManager>(&toHost_, 1, clientIo_, clientIsHost_, clientPort_)),
+          hostManager_(std::make_shared<MultiplexManager>(&toClient_, 1, hostIo_, hostIsHost_, serverPort_)),
+          gameClient_(clientIo_)
+    {
+        toHost_.setPeer(hostManager_.get());
+        toClient_.setPeer(clientManager_.get());
+        std::string suffix = std::to_string(getpid());
+        if (link_ == LocalLink::InProcess)
+        {
+            // Game server: echoes from the data callback, on the host io thread
+            hostManager_->setEndpointAcceptor([this](MultiplexManager& manager, StreamId id) {
+                return std::make_shared<CallbackEndpoint>([&manager, id](const char* data, size_t len) {
+                    manager.sendFromEndpoint(id, data, len);
+                });
+            });
+            clientStreamId_ = clientManager_->addEndpoint(std::make_shared<CallbackEndpoint>([this](const char*, size_t len) {
+                std::lock_guard<std::mutex> lock(replyMutex_);
+                replyBytes_ += len;
+                replyReady_.notify_one();
+            }));
+        }
+        else if (link_ == LocalLink::Shm)
+        {
+            clientShm_ = std::make_unique<ShmServer>("/ctbench_client_" + suffix,
+                                                     [this]() { return clientManager_; });
+            hostShm_ = std::make_unique<ShmServer>("/ctbench_host_" + suffix, []() { return nullptr; });
+            ok_ = clientShm_->start() && hostShm_->start();
+            if (!ok_)
+            {
+                return;
+            }
+            hostManager_->setEndpointAcceptor(hostShm_->acceptor());
+            serverShim_ = ct_shim_attach(hostShm_->name().c_str(), CT_SHIM_SERVER);
+            clientShim_ = ct_shim_attach(clientShm_->name().c_str(), CT_SHIM_CLIENT);
+            ok_ = serverShim_ && clientShim_;
+            if (!ok_)
+            {
+                return;
+            }
+            // Game server: echoes every stream's data back
+            server_ = std::thread([this]() {
+                std::vector<char> buffer(CT_SHIM_MAX_PAYLOAD);
+                ct_shim_event event;
+                while (ct_shim_poll(serverShim_, &event, buffer.data(), buffer.size(), -1) == 1)
+                {
+                    if (event.type == CT_SHIM_EVENT_DATA)
+                    {
+                        ct_shim_send(serverShim_, event.stream, buffer.data(), event.len, -1);
+                    }
+                    else if (event.type == CT_SHIM_EVENT_CLOSE)
+                    {
+                        break;
+                    }
+                }
+            });
+            clientStream_ = ct_shim_open(clientShim_);
+        }
+        else
+        {
+            server_ = std::thread([this]() {
+                tcp::socket conn(hostIo_);
+                serverAcceptor_.accept(conn);
+                conn.set_option(tcp::no_delay(true));
+                char buffer[16 * 1024];
+                boost::system::error_code ec;
+                size_t n;
+                while ((n = conn.read_some(boost::asio::buffer(buffer), ec)) > 0)
+                {
+                    boost::asio::write(conn, boost::asio::buffer(buffer, n), ec);
+                }
+            });
+            tcp::acceptor acceptor(clientIo_, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+            auto local = std::make_shared<tcp::socket>(clientIo_);
+            gameClient_.connect(acceptor.local_endpoint());
+            acceptor.accept(*local);
+            local->set_option(tcp::no_delay(true));
+            clientManager_->addClient(local);
+            gameClient_.set_option(tcp::no_delay(true));
+        }
+        clientThread_ = std::thread([this]() { clientIo_.run(); });
+        hostThread_ = std::thread([this]() { hostIo_.run(); });
+    }
+
+    ~RoundTripRig()
+    {
+        if (link_ == LocalLink::InProcess)
+        {
+            clientManager_->closeFromEndpoint(clientStreamId_);
+        }
+        else if (link_ == LocalLink::Shm)
+        {
+            if (clientShim_)
+            {
+                ct_shim_close(clientShim_, clientStream_);
+            }
+            if (server_.joinable())
+            {
+                server_.join();
+            }
+            ct_shim_detach(clientShim_);
+            ct_shim_detach(serverShim_);
+            // Before the managers: the servers hold raw pointers to them
+            clientShm_.reset();
+            hostShm_.reset();
+        }
+        else
+        {
+            gameClient_.close();
+            server_.join();
+        }
+        while (clientManager_->getClientCount() > 0 || hostManager_->getClientCount() > 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        clientWork_.reset();
+        hostWork_.reset();
+        clientIo_.stop();
+        hostIo_.stop();
+        if (clientThread_.joinable())
+        {
+            clientThread_.join();
+            hostThread_.join();
+        }
+    }
+
+    bool ok() const { return ok_; }
+
+    // Sends `len` bytes and waits until all of them came back
+    void roundTrip(const char* data, size_t len)
+    {
+        if (link_ == LocalLink::InProcess)
+        {
+            uint64_t target;
+            {
+                std::lock_guard<std::mutex> lock(replyMutex_);
+                target = replyBytes_ + len;
+            }
+            clientManager_->sendFromEndpoint(clientStreamId_, data, len);
+            std::unique_lock<std::mutex> lock(replyMutex_);
+            replyReady_.wait(lock, [&]() { return replyBytes_ >= target; });
+        }
+        else if (link_ == LocalLink::Shm)
+        {
+            ct_shim_send(clientShim_, clientStream_, data, len, -1);
+            ct_shim_event event;
+            for (size_t received = 0; received < len;)
+            {
+                if (ct_shim_poll(clientShim_, &event, reply_, sizeof(reply_), -1) == 1 &&
+                    event.type == CT_SHIM_EVENT_DATA)
+                {
+                    received += event.len;
+                }
+            }
+        }
+        else
+        {
+            boost::asio::write(gameClient_, boost::asio::buffer(data, len));
+            boost::asio::read(gameClient_, boost::asio::buffer(reply_, len));
+        }
+    }
+
+private:
+    class CallbackEndpoint : public StreamEndpoint {
+    public:
+        explicit CallbackEndpoint(std::function<void(const char*, size_t)> onData) : onData_(std::move(onData)) {}
+        void write(const char* data, size_t len) override { onData_(data, len); }
+        void close() override {}
+
+    private:
+        std::function<void(const char*, size_t)> onData_;
+    };
+
+    LocalLink link_;
+    bool ok_ = true;
+    boost::asio::io_context clientIo_;
+    boost::asio::io_context hostIo_;
+    boost::asio::executor_work_guard<boost::asio::io_context::executor_type> clientWork_;
+    boost::asio::executor_work_guard<boost::asio::io_context::executor_type> hostWork_;
+    bool clientIsHost_ = false;
+    bool hostIsHost_ = true;
+    int clientPort_ = 0;
+    tcp::acceptor serverAcceptor_;
+    int serverPort_;
+    LoopbackTransport toHost_;
+    LoopbackTransport toClient_;
+    std::shared_ptr<MultiplexManager> clientManager_;
+    std::shared_ptr<MultiplexManager> hostManager_;
+    tcp::socket gameClient_;
+    std::unique_ptr<ShmServer> clientShm_;
+    std::unique_ptr<ShmServer> hostShm_;
+    ct_shim* clientShim_ = nullptr;
+    ct_shim* serverShim_ = nullptr;
+    uint32_t clientStream_ = 0;
+    StreamId clientStreamId_ = 0;
+    std::mutex replyMutex_;
+    std::condition_variable replyReady_;
+    uint64_t replyBytes_ = 0;
+    std::thread server_;
+    std::thread clientThread_;
+    std::thread hostThread_;
+    char reply_[CT_SHIM_MAX_PAYLOAD];
+};
+
+// range(0) is the LocalLink. Reports the median and p99 round trip and
+// process CPU per round trip
+void BM_LocalRoundTrip(benchmark::State& state)
+{
+    const auto link = static_cast<LocalLink>(state.range(0));
+    const int count = 20000;
+    UringEngine::setRequested(false);
+    char request[64];
+    std::memset(request, 'x', sizeof(request));
+    for (auto _ : state)
+    {
+        RoundTripRig rig(link);
+        if (!rig.ok())
+        {
+            state.SkipWithError("shared-memory transport unavailable");
+            break;
+        }
+        for (int i = 0; i < 1000; ++i)
+        {
+            rig.roundTrip(request, sizeof(request));
+        }
+        std::vector<double> samples(count);
+        rusage before{};
+        getrusage(RUSAGE_SELF, &before);
+        for (int i = 0; i < count; ++i)
+        {
+            auto start = std::chrono::steady_clock::now();
+            rig.roundTrip(request, sizeof(request));
+            samples[i] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        }
+        rusage after{};
+        getrusage(RUSAGE_SELF, &after);
+
+        auto seconds = [](const timeval& tv) { return static_cast<double>(tv.tv_sec) + tv.tv_usec / 1e6; };
+        double cpu = seconds(after.ru_utime) - seconds(before.ru_utime) + seconds(after.ru_stime) -
+                     seconds(before.ru_stime);
+        std::sort(samples.begin(), samples.end());
+        state.counters["rtt_p50_us"] = samples[count / 2];
+        state.counters["rtt_p99_us"] = samples[count * 99 / 100];
+        state.counters["cpu_us_per_rt"] = cpu * 1e6 / count;
+    }
+}
+BENCHMARK(BM_LocalRoundTrip)->ArgName("link")->Arg(0)->Arg(1)->Arg(2)->Iterations(1)->Unit(benchmark::kMillisecond)->UseRealTime();
+#endif
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    Logger::setLevel(LogLevel::Warn); // Keep per-stream info logs out of the timings
+    // Default to a JSON result file so runs can be diffed before/after
+    std::vector<char*> args(argv, argv + argc);
+    bool hasOut = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        hasOut = hasOut || std::strncmp(argv[i], "--benchmark_out=", 16) == 0;
+    }
+    std::string outArg = "--benchmark_out=connecttool_bench.json";
+    std::string formatArg = "--benchmark_out_format=json";
+    if (!hasOut)
+    {
+        args.push_back(&outArg[0]);
+        args.push_back(&formatArg[0]);
+    }
+    int count = static_cast<int>(args.size());
+    benchmark::Initialize(&count, args.data());
+    if (benchmark::ReportUnrecognizedArguments(count, args.data()))
+    {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return g_allocationCheckFailed ? 1 : 0;
+}
@@ -0,0 +1,302 @@
+#include "connecttool.h"
+#include "../net/logger.h"
+#include "../net/memory_budget.h"
+#include "../net/multiplex_manager.h"
+#include "../net/tcp_server.h"
+#include "../steam/steam_networking_manager.h"
+#include "../steam/steam_room_manager.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <boost/asio.hpp>
+
+namespace {
+std::atomic<bool> g_coreExists{false};
+} // namespace
+
+struct ct_core {
+    // A stream's manager stays valid while its entry exists: the manager
+    // closes its endpoints (which erases the entries) before it goes away
+    struct StreamEntry {
+        MultiplexManager* manager;
+        StreamId id;
+    };
+
+    class Endpoint : public StreamEndpoint {
+    public:
+        Endpoint(ct_core* core, ct_stream stream) : core_(core), stream_(stream) {}
+
+        void write(const char* data, size_t len) override
+        {
+            if (core_->callbacks.on_stream_data)
+            {
+                core_->callbacks.on_stream_data(core_->callbacks.user, stream_, data, len);
+            }
+        }
+
+        void close() override
+        {
+            {
+                std::lock_guard<std::mutex> lock(core_->streamsMutex);
+                if (core_->streams.erase(stream_) == 0)
+                {
+                    return;
+                }
+            }
+            if (core_->callbacks.on_stream_closed)
+            {
+                core_->callbacks.on_stream_closed(core_->callbacks.user, stream_);
+            }
+        }
+
+    private:
+        ct_core* core_;
+        ct_stream stream_;
+    };
+
+    ct_core_callbacks callbacks{};
+    std::mutex streamsMutex;
+    std::unordered_map<ct_stream, StreamEntry> streams;
+    ct_stream nextStream = 1; // Under streamsMutex
+
+    // Declared after the stream table: the managers (inside steamManager)
+    // close their endpoints while being destroyed
+    boost::asio::io_context ioContext;
+    boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work{boost::asio::make_work_guard(ioContext)};
+    std::unique_ptr<TCPServer> server; // Stays empty: games talk to the core directly
+    int localPort = 0;
+    std::thread ioThread;
+    SteamNetworkingManager steamManager;
+    std::unique_ptr<SteamRoomManager> roomManager;
+
+    ct_stream addStream(MultiplexManager& manager, StreamId id)
+    {
+        std::lock_guard<std::mutex> lock(streamsMutex);
+        ct_stream stream = nextStream++;
+        streams[stream] = {&manager, id};
+        return stream;
+    }
+
+    std::shared_ptr<StreamEndpoint> acceptStream(MultiplexManager& manager, StreamId id)
+    {
+        ct_stream stream = addStream(manager, id);
+        if (callbacks.on_stream_open(callbacks.user, stream))
+        {
+            return std::make_shared<Endpoint>(this, stream);
+        }
+        std::lock_guard<std::mutex> lock(streamsMutex);
+        streams.erase(stream);
+        return nullptr;
+    }
+};
+
+extern "C" {
+
+ct_core* ct_core_create(const ct_core_callbacks* callbacks)
+{
+    if (g_coreExists.exchange(true))
+    {
+        LOG_ERROR("connecttool_core: only one core may exist at a time");
+        return nullptr;
+    }
+    auto core = std::make_unique<ct_core>();
+    if (callbacks)
+    {
+        core->callbacks = *callbacks;
+    }
+    if (!core->steamManager.initialize())
+    {
+        g_coreExists = false;
+        return nullptr;
+    }
+    core->roomManager = std::make_unique<SteamRoomManager>(&core->steamManager);
+    ct_core* raw = core.get();
+    core->steamManager.setStateChangedCallback([raw]() {
+        if (raw->callbacks.on_state_changed)
+        {
+            raw->callbacks.on_state_changed(raw->callbacks.user);
+        }
+    });
+    core->steamManager.setMessageHandlerDependencies(core->ioContext, core->server, core->localPort);
+    // No loopback listener on lobby join either
+    core->steamManager.getServer() = nullptr;
+    if (core->callbacks.on_stream_open)
+    {
+        core->steamManager.setEndpointAcceptor([raw](MultiplexManager& manager, StreamId id) {
+            return raw->acceptStream(manager, id);
+        });
+    }
+    core->ioThread = std::thread([raw]() { raw->ioContext.run(); });
+    core->steamManager.startMessageHandler();
+    LOG_INFO("connecttool_core started");
+    return core.release();
+}
+
+void ct_core_destroy(ct_core* core)
+{
+    if (!core)
+    {
+        return;
+    }
+    core->steamManager.stopMessageHandler();
+    core->roomManager->leaveLobby();
+    core->steamManager.disconnect();
+    core->work.reset();
+    core->ioContext.stop();
+    if (core->ioThread.joinable())
+    {
+        core->ioThread.join();
+    }
+    core->steamManager.shutdown();
+    delete core;
+    g_coreExists = false;
+}
+
+void ct_core_run_callbacks(ct_core* core)
+{
+    SteamAPI_RunCallbacks();
+    core->steamManager.update();
+}
+
+int ct_core_host(ct_core* core)
+{
+    return core->roomManager->startHosting() ? 0 : -1;
+}
+
+int ct_core_join(ct_core* core, uint64_t host_steam_id)
+{
+    return core->steamManager.joinHost(host_steam_id) ? 0 : -1;
+}
+
+int ct_core_join_lobby(ct_core* core, uint64_t lobby_id)
+{
+    return core->roomManager->joinLobby(CSteamID(static_cast<uint64>(lobby_id))) ? 0 : -1;
+}
+
+void ct_core_disconnect(ct_core* core)
+{
+    core->roomManager->leaveLobby();
+    core->steamManager.disconnect();
+}
+
+int ct_core_is_host(ct_core* core)
+{
+    return core->steamManager.isHost() ? 1 : 0;
+}
+
+int ct_core_is_connected(ct_core* core)
+{
+    return core->steamManager.isConnected() ? 1 : 0;
+}
+
+uint64_t ct_core_lobby_id(ct_core* core)
+{
+    CSteamID lobby = core->roomManager->getCurrentLobby();
+    return lobby.IsValid() ? lobby.ConvertToUint64() : 0;
+}
+
+void ct_core_set_max_members(ct_core* core, int members)
+{
+    core->roomManager->setMaxMembers(members);
+}
+
+void ct_core_set_local_port(ct_core* core, int port)
+{
+    core->localPort = port;
+}
+
+int ct_core_set_backends(ct_core* core, int port, const char* backends, int policy)
+{
+    if (policy < 0 || policy > static_cast<int>(BackendPool::Policy::PeerHash))
+    {
+        return -1;
+    }
+    return core->steamManager.setBackendPool(port, backends ? backends : "", static_cast<BackendPool::Policy>(policy)) ? 0 : -1;
+}
+
+void ct_core_set_mesh(ct_core* core, int enabled)
+{
+    core->steamManager.setMeshMode(enabled != 0);
+}
+
+void ct_core_set_bonding(ct_core* core, int lanes, int stripe)
+{
+    core->steamManager.setBonding(lanes, stripe != 0);
+}
+
+void ct_core_set_memory_budget(ct_core*, int limit_mb, int policy, int idle_timeout_s)
+{
+    MemoryBudget& budget = MemoryBudget::instance();
+    budget.setLimit(static_cast<size_t>(std::max(0, limit_mb)) * 1024 * 1024);
+    budget.setPolicy(policy == 1 ? MemoryBudget::Policy::Backpressure : MemoryBudget::Policy::ShedIdle);
+    budget.setIdleTimeout(std::chrono::seconds(std::max(0, idle_timeout_s)));
+}
+
+void ct_core_set_network_thread(ct_core* core, int wait, int cpu, int priority)
+{
+    PollThread::Options options = core->steamManager.getPollOptions();
+    options.wait = static_cast<PollThread::WaitStrategy>(std::min(std::max(wait, 0), 2));
+    options.cpu = std::max(-1, cpu);
+    options.priority = static_cast<PollThread::Priority>(std::min(std::max(priority, 0), 2));
+    core->steamManager.setPollOptions(options);
+}
+
+void ct_core_get_network_stats(ct_core* core, ct_network_stats* stats)
+{
+    PollThread::Snapshot snapshot = core->steamManager.getPollStats();
+    stats->latency_p50_us = snapshot.latencyP50Us;
+    stats->latency_p99_us = snapshot.latencyP99Us;
+    stats->latency_max_us = snapshot.latencyMaxUs;
+    stats->messages = snapshot.samples;
+    stats->cpu_percent = snapshot.cpuPercent;
+}
+
+ct_stream ct_core_open_stream(ct_core* core)
+{
+    return ct_core_open_stream_to(core, 0);
+}
+
+ct_stream ct_core_open_stream_to(ct_core* core, uint64_t peer_steam_id)
+{
+    auto manager = core->steamManager.getTunnel(peer_steam_id);
+    if (!manager)
+    {
+        return 0;
+    }
+    // Registered before the manager can deliver anything to the endpoint
+    std::lock_guard<std::mutex> lock(core->streamsMutex);
+    ct_stream stream = core->nextStream++;
+    StreamId id = manager->addEndpoint(std::make_shared<ct_core::Endpoint>(core, stream));
+    core->streams[stream] = {manager.get(), id};
+    return stream;
+}
+
+int ct_core_send(ct_core* core, ct_stream stream, const void* data, size_t len)
+{
+    // Under the lock, so the manager can't go away meanwhile
+    std::lock_guard<std::mutex> lock(core->streamsMutex);
+    auto it = core->streams.find(stream);
+    if (it == core->streams.end())
+    {
+        return -1;
+    }
+    it->second.manager->sendFromEndpoint(it->second.id, static_cast<const char*>(data), len);
+    return 0;
+}
+
+void ct_core_close_stream(ct_core* core, ct_stream stream)
+{
+    std::lock_guard<std::mutex> lock(core->streamsMutex);
+    auto it = core->streams.find(stream);
+    if (it != core->streams.end())
+    {
+        it->second.manager->closeFromEndpoint(it->second.id);
+        core->streams.erase(it);
+    }
+}
+
+} // extern "C"
@@ -0,0 +1,129 @@
+#ifndef CONNECTTOOL_H
+#define CONNECTTOOL_H
+
+/*
+ * connecttool_core C API: host or join a ConnectTool room from inside a game
+ * or launcher and exchange stream data with the tunnel directly, without a
+ * loopback TCP connection to 127.0.0.1:8888.
+ *
+ * The embedding process owns the Steam API: call SteamAPI_Init before
+ * ct_core_create and SteamAPI_Shutdown after ct_core_destroy, and call
+ * ct_core_run_callbacks regularly (it runs SteamAPI_RunCallbacks). Only one
+ * core may exist at a time.
+ *
+ * Threads: create/destroy/host/join/disconnect/run_callbacks from one thread
+ * (the game's main loop); open/send/close_stream from any thread. Callbacks
+ * run on ConnectTool's networking thread: copy the data and return quickly,
+ * and don't call ct_core_destroy from them.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32) && defined(CONNECTTOOL_CORE_SHARED)
+#ifdef CONNECTTOOL_CORE_BUILD
+#define CT_API __declspec(dllexport)
+#else
+#define CT_API __declspec(dllimport)
+#endif
+#elif defined(CONNECTTOOL_CORE_SHARED)
+#define CT_API __attribute__((visibility("default")))
+#else
+#define CT_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ct_core ct_core;
+
+/* Stream handle, local to this core; 0 is never a valid stream */
+typedef uint64_t ct_stream;
+
+typedef struct {
+    void* user;
+    /* Host: a remote player opened a stream. Return nonzero to take it;
+       0 (or a NULL callback) leaves it to the TCP connection to the local
+       port set with ct_core_set_local_port. */
+    int (*on_stream_open)(void* user, ct_stream stream);
+    /* Data from the tunnel for one of our streams */
+    void (*on_stream_data)(void* user, ct_stream stream, const void* data, size_t len);
+    /* The stream ended from the tunnel side (peer closed, disconnect) */
+    void (*on_stream_closed)(void* user, ct_stream stream);
+    /* Room or connection state changed; poll the getters below */
+    void (*on_state_changed)(void* user);
+} ct_core_callbacks;
+
+/* Returns NULL if Steam isn't running or a core already exists */
+CT_API ct_core* ct_core_create(const ct_core_callbacks* callbacks);
+CT_API void ct_core_destroy(ct_core* core);
+CT_API void ct_core_run_callbacks(ct_core* core);
+
+/* Creates a lobby and accepts connections. Returns 0 on success. */
+CT_API int ct_core_host(ct_core* core);
+/* Connects to a host by Steam ID, or enters its lobby. Returns 0 once
+   the attempt started; ct_core_is_connected tells when it completed. */
+CT_API int ct_core_join(ct_core* core, uint64_t host_steam_id);
+CT_API int ct_core_join_lobby(ct_core* core, uint64_t lobby_id);
+CT_API void ct_core_disconnect(ct_core* core);
+
+CT_API int ct_core_is_host(ct_core* core);
+CT_API int ct_core_is_connected(ct_core* core);
+/* Current lobby (to show or invite to), 0 if none */
+CT_API uint64_t ct_core_lobby_id(ct_core* core);
+/* Host: lobby size for the next ct_core_host, host included (2-250, default 4) */
+CT_API void ct_core_set_max_members(ct_core* core, int members);
+/* Host: local port streams not taken by on_stream_open connect to */
+CT_API void ct_core_set_local_port(ct_core* core, int port);
+/* Host: spread TCP streams to `port` over several local servers, e.g.
+   "27015,27016,10.0.0.2:27015". policy: 0 round robin, 1 least connections,
+   2 by client Steam ID. Backends failing their health checks get no new
+   streams until they pass again. Empty `backends` removes the pool.
+   Returns 0, or -1 if `backends` doesn't parse. */
+CT_API int ct_core_set_backends(ct_core* core, int port, const char* backends, int policy);
+/* Client: open up to `lanes` Steam connections to the host (1-4) and, if
+   stripe is non-zero, spread each stream over all of them. Applies to the
+   next join. */
+CT_API void ct_core_set_bonding(ct_core* core, int lanes, int stripe);
+/* Memory the tunnels may hold across the process (stream state, data
+   queued for local sockets, sessions' replay buffers), in MB, 0 for no
+   limit (default 1024). Over it, policy 0 closes the streams idle longest,
+   policy 1 stops reading local sockets until usage drops. Streams idle for
+   idle_timeout_s seconds are closed either way (0 keeps them; default 1800). */
+CT_API void ct_core_set_memory_budget(ct_core* core, int limit_mb, int policy, int idle_timeout_s);
+/* The thread that receives from Steam. wait: 0 busy-spins (lowest latency,
+   one core at 100%), 1 spins briefly then sleeps (default), 2 only sleeps
+   (1 ms between idle polls). cpu pins it to that CPU, -1 doesn't. priority:
+   0 normal, 1 high, 2 realtime (falls back to high without the rights). */
+CT_API void ct_core_set_network_thread(ct_core* core, int wait, int cpu, int priority);
+
+typedef struct {
+    uint64_t latency_p50_us; /* Steam receiving a message to us handling it */
+    uint64_t latency_p99_us;
+    uint64_t latency_max_us;
+    uint64_t messages;
+    double cpu_percent; /* Of one core, 0 where unknown */
+} ct_network_stats;
+
+/* Over the last 5 s window */
+CT_API void ct_core_get_network_stats(ct_core* core, ct_network_stats* stats);
+
+/* Client: opens a stream to the host, like a TCP connection to
+   127.0.0.1:8888. Returns 0 when not connected. */
+CT_API ct_stream ct_core_open_stream(ct_core* core);
+/* Same, to another member of the lobby by Steam ID when mesh mode is on
+   (directly, or through the host if there's no direct route) */
+CT_API ct_stream ct_core_open_stream_to(ct_core* core, uint64_t peer_steam_id);
+/* Client: connect to the other lobby members too. Applies to the next join. */
+CT_API void ct_core_set_mesh(ct_core* core, int enabled);
+/* Returns 0, or -1 if the stream is gone */
+CT_API int ct_core_send(ct_core* core, ct_stream stream, const void* data, size_t len);
+/* on_stream_closed is not called for streams closed here */
+CT_API void ct_core_close_stream(ct_core* core, ct_stream stream);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CONNECTTOOL_H */
@@ -0,0 +1,325 @@
+#include "backend_pool.h"
+#include "logger.h"
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+
+namespace {
+const int kVirtualNodes = 64; // Ring points per backend, so peers spread evenly
+
+uint64_t mix64(uint64_t x)
+{
+    // splitmix64 finalizer
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+uint64_t hashText(const std::string& text)
+{
+    uint64_t hash = 0xcbf29ce484222325ull; // FNV-1a
+    for (unsigned char c : text)
+    {
+        hash = (hash ^ c) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+std::string endpointText(const tcp::endpoint& endpoint)
+{
+    return endpoint.address().to_string() + ":" + std::to_string(endpoint.port());
+}
+} // namespace
+
+BackendPool::Lease& BackendPool::Lease::operator=(Lease&& other) noexcept
+{
+    if (this != &other)
+    {
+        release();
+        pool_ = std::move(other.pool_);
+        backend_ = other.backend_;
+        other.backend_ = -1;
+    }
+    return *this;
+}
+
+void BackendPool::Lease::release()
+{
+    if (pool_)
+    {
+        pool_->release(backend_);
+        pool_.reset();
+    }
+    backend_ = -1;
+}
+
+BackendPool::BackendPool(boost::asio::io_context& io, std::vector<tcp::endpoint> backends, Policy policy)
+    : io_(io), policy_(policy), checkTimer_(io)
+{
+    for (size_t i = 0; i < backends.size(); ++i)
+    {
+        Backend backend;
+        backend.endpoint = backends[i];
+        backends_.push_back(backend);
+        // Points depend only on the address, so a peer keeps its backend
+        // when others are added or removed
+        uint64_t seed = hashText(endpointText(backends[i]));
+        for (int node = 0; node < kVirtualNodes; ++node)
+        {
+            ring_.emplace_back(mix64(seed + node), static_cast<int>(i));
+        }
+    }
+    std::sort(ring_.begin(), ring_.end());
+}
+
+bool BackendPool::parseBackends(const std::string& text, std::vector<tcp::endpoint>& backends)
+{
+    std::stringstream ss(text);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        item.erase(0, item.find_first_not_of(" \t"));
+        item.erase(item.find_last_not_of(" \t") + 1);
+        if (item.empty())
+        {
+            continue;
+        }
+        std::string host = "127.0.0.1";
+        std::string port = item;
+        size_t colon = item.rfind(':');
+        if (colon != std::string::npos)
+        {
+            host = item.substr(0, colon);
+            port = item.substr(colon + 1);
+        }
+        char* end = nullptr;
+        long number = std::strtol(port.c_str(), &end, 10);
+        boost::system::error_code ec;
+        auto address = boost::asio::ip::make_address(host, ec);
+        if (ec || port.empty() || *end != '\0' || number <= 0 || number > 65535)
+        {
+            return false;
+        }
+        backends.emplace_back(address, static_cast<unsigned short>(number));
+    }
+    return true;
+}
+
+void BackendPool::start(std::chrono::milliseconds interval)
+{
+    auto self = shared_from_this();
+    boost::asio::post(io_, [this, self, interval]() {
+        if (running_)
+        {
+            return;
+        }
+        running_ = true;
+        interval_ = interval;
+        for (size_t i = 0; i < backends_.size(); ++i)
+        {
+            probe(i);
+        }
+        scheduleCheck();
+    });
+}
+
+void BackendPool::stop()
+{
+    auto self = shared_from_this();
+    boost::asio::post(io_, [this, self]() {
+        running_ = false;
+        checkTimer_.cancel();
+    });
+}
+
+void BackendPool::scheduleCheck()
+{
+    auto self = shared_from_this();
+    checkTimer_.expires_after(interval_);
+    checkTimer_.async_wait([this, self](const boost::system::error_code& ec) {
+        if (ec || !running_)
+        {
+            return;
+        }
+        for (size_t i = 0; i < backends_.size(); ++i)
+        {
+            probe(i);
+        }
+        scheduleCheck();
+    });
+}
+
+// backends_ never changes size after construction, so reading an endpoint
+// needs no lock
+void BackendPool::probe(size_t index)
+{
+    auto self = shared_from_this();
+    auto socket = std::make_shared<tcp::socket>(io_);
+    auto deadline = std::make_shared<boost::asio::steady_timer>(io_, kProbeTimeout);
+    deadline->async_wait([socket](const boost::system::error_code& ec) {
+        if (!ec)
+        {
+            boost::system::error_code ignored;
+            socket->close(ignored);
+        }
+    });
+    socket->async_connect(backends_[index].endpoint, [this, self, socket, deadline, index](const boost::system::error_code& ec) {
+        deadline->cancel();
+        boost::system::error_code ignored;
+        socket->close(ignored);
+        recordResult(index, !ec, false, ec ? ec.message() : std::string());
+    });
+}
+
+void BackendPool::recordResult(size_t index, bool ok, bool drainNow, const std::string& error)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    Backend& backend = backends_[index];
+    if (ok)
+    {
+        backend.failures = 0;
+        if (!backend.up && ++backend.successes >= kSuccessesToRestore)
+        {
+            backend.up = true;
+            LOG_INFO("Backend {} is back", endpointText(backend.endpoint));
+        }
+        return;
+    }
+    backend.successes = 0;
+    ++backend.failures;
+    if (backend.up && (drainNow || backend.failures >= kFailuresToDrain))
+    {
+        backend.up = false;
+        LOG_WARN("Backend {} is down ({}), draining its {} streams", endpointText(backend.endpoint), error,
+                 backend.streams);
+    }
+}
+
+void BackendPool::connect(std::shared_ptr<tcp::socket> socket, uint64_t peer, ConnectHandler handler)
+{
+    tryConnect(std::move(socket), peer, 0, std::move(handler));
+}
+
+void BackendPool::tryConnect(std::shared_ptr<tcp::socket> socket, uint64_t peer, size_t attempt, ConnectHandler handler)
+{
+    int index = -1;
+    if (attempt < backends_.size())
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        index = pickLocked(peer);
+        if (index >= 0)
+        {
+            // Counted from now, so concurrent picks see it
+            ++backends_[index].streams;
+        }
+    }
+    if (index < 0)
+    {
+        handler(false, Lease());
+        return;
+    }
+    auto self = shared_from_this();
+    auto claim = std::make_shared<Lease>(Lease(self, index));
+    // A blackholed backend would otherwise hold the stream for the OS's SYN timeout
+    auto deadline = std::make_shared<boost::asio::steady_timer>(socket->get_executor(), kConnectTimeout);
+    deadline->async_wait([socket](const boost::system::error_code& ec) {
+        if (!ec)
+        {
+            boost::system::error_code ignored;
+            socket->close(ignored);
+        }
+    });
+    socket->async_connect(backends_[index].endpoint, [this, self, socket, deadline, claim, peer, attempt, index,
+                                                      handler = std::move(handler)](const boost::system::error_code& ec) mutable {
+        bool timedOut = deadline->expiry() <= std::chrono::steady_clock::now();
+        deadline->cancel();
+        if (!ec)
+        {
+            handler(true, std::move(*claim));
+            return;
+        }
+        claim.reset(); // Before the warning, which counts the backend's streams
+        recordResult(static_cast<size_t>(index), false, true, timedOut ? "connect timed out" : ec.message());
+        boost::system::error_code ignored;
+        socket->close(ignored);
+        tryConnect(std::move(socket), peer, attempt + 1, std::move(handler));
+    });
+}
+
+int BackendPool::pick(uint64_t peer)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return pickLocked(peer);
+}
+
+int BackendPool::pickLocked(uint64_t peer)
+{
+    if (backends_.empty())
+    {
+        return -1;
+    }
+    if (policy_ == Policy::PeerHash && peer != 0)
+    {
+        // First point clockwise from the peer's whose backend is up
+        auto start = std::lower_bound(ring_.begin(), ring_.end(), std::make_pair(mix64(peer), -1));
+        for (size_t i = 0; i < ring_.size(); ++i)
+        {
+            auto it = start + static_cast<std::ptrdiff_t>(i);
+            if (it >= ring_.end())
+            {
+                it -= static_cast<std::ptrdiff_t>(ring_.size());
+            }
+            if (backends_[it->second].up)
+            {
+                return it->second;
+            }
+        }
+        return -1;
+    }
+    // Round robin; least connections takes the first of the least loaded
+    // from the cursor, so ties rotate too. PeerHash without a peer ends up here.
+    int best = -1;
+    for (size_t i = 0; i < backends_.size(); ++i)
+    {
+        size_t index = (next_ + i) % backends_.size();
+        const Backend& backend = backends_[index];
+        if (!backend.up)
+        {
+            continue;
+        }
+        if (best < 0 || (policy_ != Policy::RoundRobin && backend.streams < backends_[best].streams))
+        {
+            best = static_cast<int>(index);
+        }
+        if (policy_ == Policy::RoundRobin)
+        {
+            break;
+        }
+    }
+    if (best >= 0)
+    {
+        next_ = static_cast<size_t>(best) + 1;
+    }
+    return best;
+}
+
+void BackendPool::release(int backend)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (backend >= 0 && static_cast<size_t>(backend) < backends_.size())
+    {
+        --backends_[backend].streams;
+    }
+}
+
+std::vector<BackendPool::BackendStatus> BackendPool::status()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<BackendStatus> result;
+    for (const Backend& backend : backends_)
+    {
+        result.push_back({backend.endpoint, backend.up, backend.streams});
+    }
+    return result;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+
+using boost::asio::ip::tcp;
+
+// Several local servers behind one host port (game-server processes, lobby
+// shards). The host connects each new tunnel stream for the port to one of
+// them, by policy. A backend that fails its health checks, or a connect,
+// gets no new streams until the checks pass again; streams it already has
+// carry on (it drains).
+class BackendPool : public std::enable_shared_from_this<BackendPool> {
+public:
+    enum class Policy {
+        RoundRobin,
+        LeastConnections,
+        PeerHash // Consistent hash of the client's Steam ID: a player sticks to a backend
+    };
+
+    // A stream's claim on its backend, counted until the lease goes away
+    class Lease {
+    public:
+        Lease() = default;
+        Lease(Lease&& other) noexcept { *this = std::move(other); }
+        Lease& operator=(Lease&& other) noexcept;
+        ~Lease() { release(); }
+        int backend() const { return backend_; }
+
+    private:
+        friend class BackendPool;
+        Lease(std::shared_ptr<BackendPool> pool, int backend) : pool_(std::move(pool)), backend_(backend) {}
+        void release();
+
+        std::shared_ptr<BackendPool> pool_;
+        int backend_ = -1;
+    };
+
+    struct BackendStatus {
+        tcp::endpoint endpoint;
+        bool up;
+        int streams;
+    };
+
+    static constexpr auto kCheckInterval = std::chrono::seconds(2);
+    static constexpr auto kProbeTimeout = std::chrono::seconds(1);
+    static constexpr auto kConnectTimeout = std::chrono::seconds(2); // Per backend tried for a stream
+    static constexpr int kFailuresToDrain = 2;   // Failed checks in a row
+    static constexpr int kSuccessesToRestore = 2; // Passed checks in a row
+
+    BackendPool(boost::asio::io_context& io, std::vector<tcp::endpoint> backends, Policy policy);
+
+    // "27015,10.0.0.2:27016": port alone means 127.0.0.1. false on a bad entry.
+    static bool parseBackends(const std::string& text, std::vector<tcp::endpoint>& backends);
+
+    // Health checks are TCP connects every interval, on the pool's io_context
+    void start(std::chrono::milliseconds interval = kCheckInterval);
+    void stop();
+
+    // ok, and the lease that counts the stream on its backend
+    using ConnectHandler = std::function<void(bool ok, Lease lease)>;
+
+    // Connects socket to a backend for a new stream from peer (Steam ID, 0
+    // if unknown), asynchronously, trying the next backend when a connect
+    // fails or takes longer than kConnectTimeout. The handler runs on the
+    // socket's executor; ok is false if no backend could be reached.
+    void connect(std::shared_ptr<tcp::socket> socket, uint64_t peer, ConnectHandler handler);
+
+    // The backend the policy picks for peer, -1 if all are down
+    int pick(uint64_t peer);
+    Policy policy() const { return policy_; }
+    std::vector<BackendStatus> status();
+
+private:
+    struct Backend {
+        tcp::endpoint endpoint;
+        bool up = true; // Until proven otherwise
+        int streams = 0;
+        int failures = 0;
+        int successes = 0;
+    };
+
+    void scheduleCheck();
+    void tryConnect(std::shared_ptr<tcp::socket> socket, uint64_t peer, size_t attempt, ConnectHandler handler);
+    void probe(size_t index);
+    // A failed check or connect; a connect failure drains it right away
+    void recordResult(size_t index, bool ok, bool drainNow, const std::string& error);
+    void release(int backend);
+    int pickLocked(uint64_t peer); // mutex_ held
+
+    boost::asio::io_context& io_;
+    Policy policy_;
+    std::mutex mutex_;
+    std::vector<Backend> backends_;                // Under mutex_
+    std::vector<std::pair<uint64_t, int>> ring_;   // PeerHash: sorted (point, backend)
+    size_t next_ = 0;                              // RoundRobin cursor, under mutex_
+    boost::asio::steady_timer checkTimer_;
+    std::chrono::milliseconds interval_{kCheckInterval};
+    bool running_ = false; // Only touched on io_
+};
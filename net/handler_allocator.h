@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <boost/asio.hpp>
+
+// Recycling storage for Asio completion handlers, after Asio's "custom
+// allocation" example. Each HandlerMemory backs one kind of operation that is
+// never outstanding more than once at a time (a stream's read, its write, ...),
+// so the same block is reused for every op instead of hitting the heap.
+// Handlers that don't fit, or a second op while the block is in use, fall
+// back to operator new.
+class HandlerMemory {
+public:
+    HandlerMemory() = default;
+    HandlerMemory(const HandlerMemory&) = delete;
+    HandlerMemory& operator=(const HandlerMemory&) = delete;
+
+    void* allocate(std::size_t size)
+    {
+        if (!inUse_ && size <= sizeof(storage_))
+        {
+            inUse_ = true;
+            return &storage_;
+        }
+        return ::operator new(size);
+    }
+
+    void deallocate(void* pointer)
+    {
+        if (pointer == &storage_)
+        {
+            inUse_ = false;
+        }
+        else
+        {
+            ::operator delete(pointer);
+        }
+    }
+
+private:
+    typename std::aligned_storage<512>::type storage_;
+    bool inUse_ = false;
+};
+
+template <typename T>
+class HandlerAllocator {
+public:
+    using value_type = T;
+
+    explicit HandlerAllocator(HandlerMemory& memory) : memory_(memory) {}
+
+    template <typename U>
+    HandlerAllocator(const HandlerAllocator<U>& other) noexcept : memory_(other.memory_) {}
+
+    bool operator==(const HandlerAllocator& other) const noexcept { return &memory_ == &other.memory_; }
+    bool operator!=(const HandlerAllocator& other) const noexcept { return &memory_ != &other.memory_; }
+
+    T* allocate(std::size_t n) const { return static_cast<T*>(memory_.allocate(sizeof(T) * n)); }
+    void deallocate(T* pointer, std::size_t) const { memory_.deallocate(pointer); }
+
+private:
+    template <typename>
+    friend class HandlerAllocator;
+
+    HandlerMemory& memory_;
+};
+
+template <typename Handler>
+class CustomAllocHandler {
+public:
+    using allocator_type = HandlerAllocator<Handler>;
+
+    CustomAllocHandler(HandlerMemory& memory, Handler handler) : memory_(memory), handler_(std::move(handler)) {}
+
+    allocator_type get_allocator() const noexcept { return allocator_type(memory_); }
+
+    template <typename... Args>
+    void operator()(Args&&... args)
+    {
+        handler_(std::forward<Args>(args)...);
+    }
+
+private:
+    HandlerMemory& memory_;
+    Handler handler_;
+};
+
+template <typename Handler>
+CustomAllocHandler<std::decay_t<Handler>> makeCustomAllocHandler(HandlerMemory& memory, Handler&& handler)
+{
+    return CustomAllocHandler<std::decay_t<Handler>>(memory, std::forward<Handler>(handler));
+}
@@ -0,0 +1,115 @@
+#include "io_context_monitor.h"
+#include "logger.h"
+
+namespace {
+thread_local IoContextMonitor* tlsMonitor = nullptr;
+
+const std::chrono::seconds kExportWindow(10);
+
+uint64_t toMicros(std::chrono::steady_clock::duration d)
+{
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    return us > 0 ? static_cast<uint64_t>(us) : 0;
+}
+} // namespace
+
+IoContextMonitor::IoContextMonitor(boost::asio::io_context& io_context, std::string name,
+                                   std::chrono::milliseconds probeInterval,
+                                   std::chrono::microseconds slowHandlerThreshold)
+    : io_context_(io_context), name_(std::move(name)), probeInterval_(probeInterval),
+      slowHandlerThreshold_(slowHandlerThreshold), probeTimer_(io_context), running_(false) {}
+
+IoContextMonitor::~IoContextMonitor()
+{
+    stop();
+}
+
+void IoContextMonitor::start()
+{
+    if (running_.exchange(true))
+    {
+        return;
+    }
+    boost::asio::post(io_context_, [this]() {
+        windowStart_ = std::chrono::steady_clock::now();
+        scheduleProbe();
+    });
+}
+
+void IoContextMonitor::stop()
+{
+    if (!running_.exchange(false))
+    {
+        return;
+    }
+    // The timer is only touched on the io thread
+    boost::asio::post(io_context_, [this]() { probeTimer_.cancel(); });
+}
+
+void IoContextMonitor::bindCurrentThread()
+{
+    tlsMonitor = this;
+}
+
+IoContextMonitor* IoContextMonitor::current()
+{
+    return tlsMonitor;
+}
+
+void IoContextMonitor::recordHandler(const char* tag, std::chrono::steady_clock::duration duration)
+{
+    uint64_t us = toMicros(duration);
+    handlers_.record(us);
+    if (us >= static_cast<uint64_t>(slowHandlerThreshold_.count()))
+    {
+        slowHandlers_.fetch_add(1, std::memory_order_relaxed);
+        LOG_WARN("[{}] slow handler {} ran for {} us", name_, tag, us);
+    }
+}
+
+IoContextMonitor::Snapshot IoContextMonitor::snapshot() const
+{
+    std::lock_guard<std::mutex> lock(snapshotMutex_);
+    return snapshot_;
+}
+
+void IoContextMonitor::scheduleProbe()
+{
+    probeDeadline_ = std::chrono::steady_clock::now() + probeInterval_;
+    probeTimer_.expires_at(probeDeadline_);
+    probeTimer_.async_wait([this](const boost::system::error_code& error) {
+        if (error || !running_)
+        {
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        lag_.record(toMicros(now - probeDeadline_));
+        if (now - windowStart_ >= kExportWindow)
+        {
+            exportWindow();
+            windowStart_ = now;
+        }
+        scheduleProbe();
+    });
+}
+
+void IoContextMonitor::exportWindow()
+{
+    Snapshot snap;
+    snap.lagP50Us = lag_.percentile(50);
+    snap.lagP99Us = lag_.percentile(99);
+    snap.lagMaxUs = lag_.max();
+    snap.handlerP50Us = handlers_.percentile(50);
+    snap.handlerP99Us = handlers_.percentile(99);
+    snap.handlerMaxUs = handlers_.max();
+    snap.slowHandlers = slowHandlers_.exchange(0, std::memory_order_relaxed);
+    lag_.reset();
+    handlers_.reset();
+    {
+        std::lock_guard<std::mutex> lock(snapshotMutex_);
+        snapshot_ = snap;
+    }
+    LOG_DEBUG("[{}] loop lag p50={}us p99={}us max={}us, handlers p50={}us p99={}us max={}us slow={}",
+              name_, snap.lagP50Us, snap.lagP99Us, snap.lagMaxUs, snap.handlerP50Us, snap.handlerP99Us,
+              snap.handlerMaxUs, snap.slowHandlers);
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <boost/asio.hpp>
+#include "latency_histogram.h"
+
+// Watchdog for one io_context: measures how late a periodic probe timer fires
+// (scheduling lag, i.e. how long the reactor was blocked) and how long each
+// tracked completion handler runs. Handlers slower than the threshold are
+// logged with their call-site tag; percentiles are exported every window.
+class IoContextMonitor {
+public:
+    struct Snapshot {
+        uint64_t lagP50Us = 0;
+        uint64_t lagP99Us = 0;
+        uint64_t lagMaxUs = 0;
+        uint64_t handlerP50Us = 0;
+        uint64_t handlerP99Us = 0;
+        uint64_t handlerMaxUs = 0;
+        uint64_t slowHandlers = 0;
+    };
+
+    IoContextMonitor(boost::asio::io_context& io_context, std::string name,
+                     std::chrono::milliseconds probeInterval = std::chrono::milliseconds(100),
+                     std::chrono::microseconds slowHandlerThreshold = std::chrono::milliseconds(5));
+    ~IoContextMonitor();
+
+    void start();
+    void stop();
+
+    // Call on the thread running the io_context: handlers wrapped with
+    // trackHandler() on this thread report to this monitor
+    void bindCurrentThread();
+    static IoContextMonitor* current();
+
+    void recordHandler(const char* tag, std::chrono::steady_clock::duration duration);
+
+    // Percentiles of the last completed export window
+    Snapshot snapshot() const;
+    const std::string& name() const { return name_; }
+
+private:
+    void scheduleProbe();
+    void exportWindow();
+
+    boost::asio::io_context& io_context_;
+    std::string name_;
+    std::chrono::milliseconds probeInterval_;
+    std::chrono::microseconds slowHandlerThreshold_;
+    boost::asio::steady_timer probeTimer_;
+    std::chrono::steady_clock::time_point probeDeadline_;
+    std::chrono::steady_clock::time_point windowStart_;
+    std::atomic<bool> running_;
+
+    LatencyHistogram lag_;
+    LatencyHistogram handlers_;
+    std::atomic<uint64_t> slowHandlers_{0};
+
+    mutable std::mutex snapshotMutex_;
+    Snapshot snapshot_;
+};
+
+// Completion handler wrapper that times the wrapped handler on the current
+// io thread's monitor. The tag must be a string literal naming the call site.
+template <typename Handler>
+class TrackedHandler {
+public:
+    TrackedHandler(const char* tag, Handler handler) : tag_(tag), handler_(std::move(handler)) {}
+
+    template <typename... Args>
+    void operator()(Args&&... args)
+    {
+        IoContextMonitor* monitor = IoContextMonitor::current();
+        if (!monitor)
+        {
+            handler_(std::forward<Args>(args)...);
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        handler_(std::forward<Args>(args)...);
+        monitor->recordHandler(tag_, std::chrono::steady_clock::now() - start);
+    }
+
+    const Handler& inner() const { return handler_; }
+
+private:
+    const char* tag_;
+    Handler handler_;
+};
+
+template <typename Handler>
+TrackedHandler<std::decay_t<Handler>> trackHandler(const char* tag, Handler&& handler)
+{
+    return TrackedHandler<std::decay_t<Handler>>(tag, std::forward<Handler>(handler));
+}
+
+// Keep the wrapped handler's allocator and executor visible to Asio
+namespace boost {
+namespace asio {
+template <typename Handler, typename Allocator>
+struct associated_allocator<TrackedHandler<Handler>, Allocator> {
+    typedef typename associated_allocator<Handler, Allocator>::type type;
+    static type get(const TrackedHandler<Handler>& h, const Allocator& a = Allocator()) noexcept
+    {
+        return associated_allocator<Handler, Allocator>::get(h.inner(), a);
+    }
+};
+
+template <typename Handler, typename Executor>
+struct associated_executor<TrackedHandler<Handler>, Executor> {
+    typedef typename associated_executor<Handler, Executor>::type type;
+    static type get(const TrackedHandler<Handler>& h, const Executor& ex = Executor()) noexcept
+    {
+        return associated_executor<Handler, Executor>::get(h.inner(), ex);
+    }
+};
+} // namespace asio
+} // namespace boost
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Lock-free log-linear histogram of microsecond samples: exact below 16 us,
+// then 8 sub-buckets per power of two (~12% resolution). Safe to record from
+// any thread; readers see a slightly racy but consistent-enough view.
+class LatencyHistogram {
+public:
+    void record(uint64_t micros)
+    {
+        buckets_[bucketFor(micros)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        uint64_t prev = max_.load(std::memory_order_relaxed);
+        while (micros > prev && !max_.compare_exchange_weak(prev, micros, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    // Upper bound of the bucket holding the given percentile (0-100)
+    uint64_t percentile(double pct) const
+    {
+        uint64_t total = count_.load(std::memory_order_relaxed);
+        if (total == 0)
+        {
+            return 0;
+        }
+        uint64_t target = static_cast<uint64_t>(total * pct / 100.0);
+        if (target >= total)
+        {
+            target = total - 1;
+        }
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBuckets; ++i)
+        {
+            seen += buckets_[i].load(std::memory_order_relaxed);
+            if (seen > target)
+            {
+                uint64_t upper = bucketUpperBound(i);
+                uint64_t maxSeen = max_.load(std::memory_order_relaxed);
+                return upper < maxSeen ? upper : maxSeen;
+            }
+        }
+        return max_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+
+    void reset()
+    {
+        for (auto& bucket : buckets_)
+        {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+        count_.store(0, std::memory_order_relaxed);
+        max_.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr size_t kLinear = 16;
+    static constexpr size_t kSubBuckets = 8;
+    static constexpr size_t kBuckets = kLinear + (64 - 4) * kSubBuckets;
+
+    static size_t bucketFor(uint64_t v)
+    {
+        if (v < kLinear)
+        {
+            return static_cast<size_t>(v);
+        }
+        int exp = 63;
+        while (!(v >> exp))
+        {
+            --exp;
+        }
+        size_t sub = static_cast<size_t>((v >> (exp - 3)) & (kSubBuckets - 1));
+        return kLinear + static_cast<size_t>(exp - 4) * kSubBuckets + sub;
+    }
+
+    static uint64_t bucketUpperBound(size_t index)
+    {
+        if (index < kLinear)
+        {
+            return index;
+        }
+        size_t exp = (index - kLinear) / kSubBuckets + 4;
+        size_t sub = (index - kLinear) % kSubBuckets;
+        uint64_t base = uint64_t(1) << exp;
+        uint64_t step = base / kSubBuckets;
+        return base + (sub + 1) * step - 1;
+    }
+
+    std::array<std::atomic<uint64_t>, kBuckets> buckets_{};
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> max_{0};
+};
@@ -0,0 +1,215 @@
+#include "logger.h"
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+
+std::atomic<LogLevel> Logger::minLevel_{LogLevel::Info};
+
+namespace {
+const char* levelName(LogLevel level)
+{
+    switch (level)
+    {
+    case LogLevel::Trace: return "TRACE";
+    case LogLevel::Debug: return "DEBUG";
+    case LogLevel::Info: return "INFO";
+    case LogLevel::Warn: return "WARN";
+    case LogLevel::Error: return "ERROR";
+    }
+    return "?";
+}
+} // namespace
+
+Logger& Logger::instance()
+{
+    static Logger logger;
+    return logger;
+}
+
+Logger::Logger() : ring_(4096)
+{
+    writerThread_ = std::thread([this]() { writerLoop(); });
+}
+
+Logger::~Logger()
+{
+    shutdown();
+}
+
+void Logger::shutdown()
+{
+    if (!running_.exchange(false))
+    {
+        return;
+    }
+    wakeup_.notify_one();
+    if (writerThread_.joinable())
+    {
+        writerThread_.join();
+    }
+}
+
+bool Logger::admit(LogSite& site, int64_t now, uint32_t& suppressed)
+{
+    const int64_t window = 1000000000; // 1 s
+    int64_t start = site.windowStart.load(std::memory_order_relaxed);
+    if (now - start >= window && site.windowStart.compare_exchange_strong(start, now, std::memory_order_relaxed))
+    {
+        site.windowCount.store(0, std::memory_order_relaxed);
+    }
+    if (site.windowCount.fetch_add(1, std::memory_order_relaxed) >= rateLimitPerSecond_.load(std::memory_order_relaxed))
+    {
+        site.suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    suppressed = site.suppressed.exchange(0, std::memory_order_relaxed);
+    return true;
+}
+
+void Logger::encodeString(LogRecord& rec, const char* data, size_t len)
+{
+    LogArg& arg = rec.args[rec.argCount++];
+    arg.type = LogArg::Str;
+    size_t room = LogRecord::kStringBytes - rec.stringBytes;
+    if (len > room)
+    {
+        len = room; // Truncate rather than spill into another record
+    }
+    if (len > 0)
+    {
+        std::memcpy(rec.strings + rec.stringBytes, data, len);
+    }
+    arg.strOffset = rec.stringBytes;
+    arg.strLen = static_cast<uint16_t>(len);
+    rec.stringBytes += static_cast<uint16_t>(len);
+}
+
+int64_t Logger::nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+uint32_t Logger::currentThreadId()
+{
+    static std::atomic<uint32_t> nextId{1};
+    thread_local uint32_t id = nextId.fetch_add(1, std::memory_order_relaxed);
+    return id;
+}
+
+void Logger::writerLoop()
+{
+    while (running_.load(std::memory_order_relaxed))
+    {
+        if (!drain())
+        {
+            std::unique_lock<std::mutex> lock(wakeupMutex_);
+            wakeup_.wait_for(lock, std::chrono::milliseconds(10));
+        }
+    }
+    drain();
+}
+
+bool Logger::drain()
+{
+    std::string out;
+    std::string line;
+    bool any = false;
+    while (ring_.tryPop([&](LogRecord& rec) {
+        format(rec, line);
+        out += line;
+    }))
+    {
+        any = true;
+        // Write in batches so one burst costs one syscall per few KB
+        if (out.size() > 16 * 1024)
+        {
+            std::fwrite(out.data(), 1, out.size(), stdout);
+            out.clear();
+        }
+    }
+    uint64_t drops = dropped_.load(std::memory_order_relaxed);
+    if (drops != reportedDrops_)
+    {
+        out += "[logger] dropped " + std::to_string(drops - reportedDrops_) + " records (ring full)\n";
+        reportedDrops_ = drops;
+    }
+    if (!out.empty())
+    {
+        std::fwrite(out.data(), 1, out.size(), stdout);
+    }
+    if (any)
+    {
+        std::fflush(stdout);
+    }
+    return any;
+}
+
+void Logger::format(const LogRecord& rec, std::string& out)
+{
+    out.clear();
+
+    char prefix[64];
+    std::time_t seconds = static_cast<std::time_t>(rec.timestampNs / 1000000000);
+    int millis = static_cast<int>((rec.timestampNs / 1000000) % 1000);
+    std::tm tm{};
+#ifdef _WIN32
+    localtime_s(&tm, &seconds);
+#else
+    localtime_r(&seconds, &tm);
+#endif
+    size_t n = std::strftime(prefix, sizeof(prefix), "%H:%M:%S", &tm);
+    std::snprintf(prefix + n, sizeof(prefix) - n, ".%03d [%s] [T%u] ", millis, levelName(rec.site->level), rec.threadId);
+    out += prefix;
+
+    auto appendArg = [&](const LogArg& arg) {
+        char buf[32];
+        switch (arg.type)
+        {
+        case LogArg::Int:
+            std::snprintf(buf, sizeof(buf), "%lld", static_cast<long long>(arg.i));
+            out += buf;
+            break;
+        case LogArg::UInt:
+            std::snprintf(buf, sizeof(buf), "%llu", static_cast<unsigned long long>(arg.u));
+            out += buf;
+            break;
+        case LogArg::Double:
+            std::snprintf(buf, sizeof(buf), "%g", arg.d);
+            out += buf;
+            break;
+        case LogArg::Str:
+            out.append(rec.strings + arg.strOffset, arg.strLen);
+            break;
+        }
+    };
+
+    size_t argIndex = 0;
+    for (const char* p = rec.site->format; *p; ++p)
+    {
+        if (p[0] == '{' && p[1] == '}' && argIndex < rec.argCount)
+        {
+            appendArg(rec.args[argIndex++]);
+            ++p;
+        }
+        else
+        {
+            out += *p;
+        }
+    }
+    // Arguments without a placeholder are appended
+    for (; argIndex < rec.argCount; ++argIndex)
+    {
+        out += ' ';
+        appendArg(rec.args[argIndex]);
+    }
+    if (rec.suppressed > 0)
+    {
+        out += " (" + std::to_string(rec.suppressed) + " similar messages suppressed)";
+    }
+    if (out.empty() || out.back() != '\n')
+    {
+        out += '\n';
+    }
+}
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include "mpsc_ring.h"
+
+enum class LogLevel : uint8_t { Trace, Debug, Info, Warn, Error };
+
+// One per LOG_* call site: format string plus rate-limit state for repeats
+struct LogSite {
+    constexpr LogSite(LogLevel lvl, const char* fmt) : level(lvl), format(fmt) {}
+
+    const LogLevel level;
+    const char* const format;
+    std::atomic<int64_t> windowStart{0};
+    std::atomic<uint32_t> windowCount{0};
+    std::atomic<uint32_t> suppressed{0};
+};
+
+// Arguments are captured in binary form on the calling thread and only turned
+// into text ("{}" placeholders) by the background writer.
+struct LogArg {
+    enum Type : uint8_t { Int, UInt, Double, Str };
+    Type type;
+    uint16_t strOffset;
+    uint16_t strLen;
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+    };
+};
+
+struct LogRecord {
+    static constexpr size_t kMaxArgs = 8;
+    static constexpr size_t kStringBytes = 320;
+
+    int64_t timestampNs;
+    const LogSite* site;
+    uint32_t threadId;
+    uint32_t suppressed;
+    uint8_t argCount;
+    uint16_t stringBytes;
+    LogArg args[kMaxArgs];
+    char strings[kStringBytes];
+};
+
+// Asynchronous logger: LOG_* calls copy their arguments into a lock-free ring
+// and return; a writer thread formats and writes them. When the ring is full
+// the record is dropped and counted rather than blocking the caller.
+class Logger {
+public:
+    static Logger& instance();
+
+    static bool enabled(LogLevel level) { return level >= minLevel_.load(std::memory_order_relaxed); }
+    static void setLevel(LogLevel level) { minLevel_.store(level, std::memory_order_relaxed); }
+
+    // Records from one call site beyond this many per second are suppressed
+    // and reported as a count on the next record that gets through
+    void setRateLimit(uint32_t perSecond) { rateLimitPerSecond_.store(perSecond, std::memory_order_relaxed); }
+
+    template <typename... Args>
+    void log(LogSite& site, const Args&... args)
+    {
+        static_assert(sizeof...(Args) <= LogRecord::kMaxArgs, "too many log arguments");
+        uint32_t suppressed = 0;
+        int64_t now = nowNs();
+        if (!admit(site, now, suppressed))
+        {
+            return;
+        }
+        bool pushed = ring_.tryPush([&](LogRecord& rec) {
+            rec.timestampNs = now;
+            rec.site = &site;
+            rec.threadId = currentThreadId();
+            rec.suppressed = suppressed;
+            rec.argCount = 0;
+            rec.stringBytes = 0;
+            (encode(rec, args), ...);
+        });
+        if (!pushed)
+        {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
+        else if (site.level >= LogLevel::Error)
+        {
+            wakeup_.notify_one();
+        }
+    }
+
+    // Drain everything queued so far and stop the writer thread
+    void shutdown();
+
+    uint64_t droppedCount() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    Logger();
+    ~Logger();
+
+    bool admit(LogSite& site, int64_t now, uint32_t& suppressed);
+    void writerLoop();
+    bool drain();
+    void format(const LogRecord& rec, std::string& out);
+
+    static int64_t nowNs();
+    static uint32_t currentThreadId();
+
+    static void encode(LogRecord& rec, const char* str) { encodeString(rec, str, str ? std::strlen(str) : 0); }
+    static void encode(LogRecord& rec, const std::string& str) { encodeString(rec, str.data(), str.size()); }
+    static void encodeString(LogRecord& rec, const char* data, size_t len);
+
+    template <typename T>
+    static void encode(LogRecord& rec, const T& value)
+    {
+        if constexpr (std::is_convertible_v<const T&, const char*>)
+        {
+            encode(rec, static_cast<const char*>(value));
+        }
+        else
+        {
+            LogArg& arg = rec.args[rec.argCount++];
+            if constexpr (std::is_enum_v<T>)
+            {
+                arg.type = LogArg::Int;
+                arg.i = static_cast<int64_t>(value);
+            }
+            else if constexpr (std::is_floating_point_v<T>)
+            {
+                arg.type = LogArg::Double;
+                arg.d = static_cast<double>(value);
+            }
+            else if constexpr (std::is_signed_v<T>)
+            {
+                arg.type = LogArg::Int;
+                arg.i = static_cast<int64_t>(value);
+            }
+            else
+            {
+                static_assert(std::is_unsigned_v<T>, "unsupported log argument type");
+                arg.type = LogArg::UInt;
+                arg.u = static_cast<uint64_t>(value);
+            }
+        }
+    }
+
+    static std::atomic<LogLevel> minLevel_;
+
+    MpscRing<LogRecord> ring_;
+    std::atomic<uint64_t> dropped_{0};
+    uint64_t reportedDrops_ = 0; // Writer thread only
+    std::atomic<uint32_t> rateLimitPerSecond_{50};
+    std::atomic<bool> running_{true};
+    std::mutex wakeupMutex_;
+    std::condition_variable wakeup_;
+    std::thread writerThread_;
+};
+
+#define LOG_AT(level, fmt, ...)                                              \
+    do                                                                       \
+    {                                                                        \
+        if (Logger::enabled(level))                                          \
+        {                                                                    \
+            static LogSite logSite_(level, fmt);                             \
+            Logger::instance().log(logSite_, ##__VA_ARGS__);                 \
+        }                                                                    \
+    } while (0)
+
+#define LOG_TRACE(fmt, ...) LOG_AT(LogLevel::Trace, fmt, ##__VA_ARGS__)
+#define LOG_DEBUG(fmt, ...) LOG_AT(LogLevel::Debug, fmt, ##__VA_ARGS__)
+#define LOG_INFO(fmt, ...) LOG_AT(LogLevel::Info, fmt, ##__VA_ARGS__)
+#define LOG_WARN(fmt, ...) LOG_AT(LogLevel::Warn, fmt, ##__VA_ARGS__)
+#define LOG_ERROR(fmt, ...) LOG_AT(LogLevel::Error, fmt, ##__VA_ARGS__)
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <boost/asio.hpp>
+#include "handler_allocator.h"
+#include "multiplex_manager.h"
+#include "tunnel_transport.h"
+
+// In-process stand-in for one direction of a Steam connection: every frame
+// sent is copied and handed to the peer MultiplexManager on the peer's
+// io_context, just like SteamMessageHandler does for received messages.
+// Frames are batched: one post per batch, into recycled buffers, so a busy
+// link doesn't allocate per frame.
+class LoopbackTransport : public TunnelTransport {
+public:
+    explicit LoopbackTransport(boost::asio::io_context& peerIoContext)
+        : peerIoContext_(peerIoContext), timer_(peerIoContext) {}
+
+    // lane: which of the peer's bonded connections this link stands for
+    void setPeer(MultiplexManager* peer, int lane = 0)
+    {
+        peer_ = peer;
+        peerLane_ = lane;
+    }
+    // A link that's down loses what it's given and what's still in flight,
+    // like a Steam connection that dropped
+    void setLinkUp(bool up) { up_.store(up, std::memory_order_relaxed); }
+    // Caps delivery at bytesPerSecond (0: unlimited); frames queue up
+    // behind the cap like they do in Steam's send buffer. Set before use.
+    void setBandwidth(uint64_t bytesPerSecond) { bandwidth_ = bytesPerSecond; }
+
+    EResult send(HSteamNetConnection, const void* data, uint32 size, int) override
+    {
+        if (!peer_ || !up_.load(std::memory_order_relaxed))
+        {
+            return k_EResultNoConnection;
+        }
+        messages_.fetch_add(1, std::memory_order_relaxed);
+        bytes_.fetch_add(size, std::memory_order_relaxed);
+        pendingBytes_.fetch_add(size, std::memory_order_relaxed);
+        bool schedule;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::vector<char> frame;
+            if (!spare_.empty())
+            {
+                frame = std::move(spare_.back());
+                spare_.pop_back();
+            }
+            else
+            {
+                frame.reserve(kFrameReserve);
+            }
+            frame.assign(static_cast<const char*>(data), static_cast<const char*>(data) + size);
+            pending_.push_back(std::move(frame));
+            schedule = !scheduled_;
+            scheduled_ = true;
+        }
+        if (schedule)
+        {
+            boost::asio::post(peerIoContext_, makeCustomAllocHandler(postMemory_, [this]() { deliver(); }));
+        }
+        return k_EResultOK;
+    }
+
+    // Reports the cap as the send rate, the way Steam reports its estimate
+    bool laneStatus(HSteamNetConnection, LaneStatus& status) override
+    {
+        if (bandwidth_ == 0)
+        {
+            return false;
+        }
+        status.sendRate = bandwidth_;
+        status.pendingBytes = pendingBytes_.load(std::memory_order_relaxed);
+        return true;
+    }
+
+    uint64_t messageCount() const { return messages_.load(std::memory_order_relaxed); }
+    uint64_t byteCount() const { return bytes_.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr size_t kFrameReserve = 2048; // Fits any data frame MultiplexManager sends
+    static constexpr uint64_t kMinBurst = 64 * 1024;
+
+    // Runs on the peer's io_context; at most one delivery is scheduled at a
+    // time. With a cap, a batch may be handed over across several timer waits.
+    void deliver()
+    {
+        if (delivered_ == delivering_.size())
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            recycleDelivered();
+            delivering_.swap(pending_);
+        }
+        if (bandwidth_ > 0)
+        {
+            refill();
+        }
+        while (delivered_ < delivering_.size())
+        {
+            auto& frame = delivering_[delivered_];
+            if (bandwidth_ > 0 && tokens_ <= 0)
+            {
+                break;
+            }
+            tokens_ -= static_cast<double>(frame.size());
+            pendingBytes_.fetch_sub(frame.size(), std::memory_order_relaxed);
+            if (up_.load(std::memory_order_relaxed))
+            {
+                peer_->handleTunnelPacket(frame.data(), frame.size(), peerLane_);
+            }
+            ++delivered_;
+        }
+        if (delivered_ < delivering_.size())
+        {
+            // Out of budget: wait until the deficit is paid back
+            auto wait = std::chrono::nanoseconds(static_cast<int64_t>(-tokens_ * 1e9 / bandwidth_) + 1);
+            timer_.expires_after(wait);
+            timer_.async_wait(makeCustomAllocHandler(timerMemory_, [this](const boost::system::error_code& ec) {
+                if (!ec)
+                {
+                    deliver();
+                }
+            }));
+            return;
+        }
+        bool more;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            recycleDelivered();
+            more = !pending_.empty();
+            scheduled_ = more;
+        }
+        if (more)
+        {
+            boost::asio::post(peerIoContext_, makeCustomAllocHandler(postMemory_, [this]() { deliver(); }));
+        }
+    }
+
+    // mutex_ held
+    void recycleDelivered()
+    {
+        for (auto& frame : delivering_)
+        {
+            spare_.push_back(std::move(frame));
+        }
+        delivering_.clear();
+        delivered_ = 0;
+    }
+
+    void refill()
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (lastRefill_.time_since_epoch().count() == 0)
+        {
+            lastRefill_ = now;
+        }
+        double elapsed = std::chrono::duration<double>(now - lastRefill_).count();
+        lastRefill_ = now;
+        double burst = static_cast<double>(std::max<uint64_t>(bandwidth_ / 100, kMinBurst));
+        tokens_ = std::min(tokens_ + elapsed * static_cast<double>(bandwidth_), burst);
+    }
+
+    boost::asio::io_context& peerIoContext_;
+    MultiplexManager* peer_ = nullptr;
+    int peerLane_ = 0;
+    std::mutex mutex_;
+    std::vector<std::vector<char>> pending_;
+    std::vector<std::vector<char>> delivering_; // Owned by the scheduled delivery
+    size_t delivered_ = 0;                      // Frames of delivering_ handed over
+    std::vector<std::vector<char>> spare_;
+    bool scheduled_ = false;
+    std::atomic<bool> up_{true};
+    HandlerMemory postMemory_;
+    HandlerMemory timerMemory_;
+    boost::asio::steady_timer timer_;
+    uint64_t bandwidth_ = 0;
+    double tokens_ = 0; // Bytes that may go now; negative while paying back a burst
+    std::chrono::steady_clock::time_point lastRefill_{};
+    std::atomic<uint64_t> pendingBytes_{0};
+    std::atomic<uint64_t> messages_{0};
+    std::atomic<uint64_t> bytes_{0};
+};
+
+// Several LoopbackTransports behind one TunnelTransport, one per connection
+// handle: the in-process stand-in for a bonded peer. Links are added before
+// the manager starts sending and never removed.
+class LoopbackLanes : public TunnelTransport {
+public:
+    void addLink(HSteamNetConnection conn, LoopbackTransport* link) { links_[conn] = link; }
+
+    EResult send(HSteamNetConnection conn, const void* data, uint32 size, int flags) override
+    {
+        auto it = links_.find(conn);
+        return it == links_.end() ? k_EResultNoConnection : it->second->send(conn, data, size, flags);
+    }
+
+    bool laneStatus(HSteamNetConnection conn, LaneStatus& status) override
+    {
+        auto it = links_.find(conn);
+        return it != links_.end() && it->second->laneStatus(conn, status);
+    }
+
+private:
+    std::map<HSteamNetConnection, LoopbackTransport*> links_;
+};
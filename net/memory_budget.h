@@ -0,0 +1,122 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Process-wide account of what the tunnels hold in memory: per-stream state
+// and pooled write buffers, data queued for local sockets, and managers with
+// their replay buffers. With a limit set, going over it makes the managers
+// act (see MultiplexManager::sweep): ShedIdle closes the streams idle
+// longest; Backpressure stops reading local sockets until usage is back
+// under kResumePercent of the limit, but only while queued data is left to
+// drain: stopping can't shrink anything else. Counters are relaxed atomics,
+// so charging from the hot path costs an uncontended add.
+class MemoryBudget {
+public:
+    enum class Category { Streams, WriteQueues, Managers, Count };
+    enum class Policy { ShedIdle, Backpressure };
+
+    struct Snapshot {
+        size_t streams = 0;     // Stream state and write buffer pools
+        size_t writeQueues = 0; // Bytes waiting for local sockets
+        size_t managers = 0;    // Managers and replay buffers
+        size_t limit = 0;
+        uint64_t shed = 0;      // Streams closed to get under the limit
+        uint64_t reaped = 0;    // Streams closed for being idle too long
+        uint64_t stalls = 0;    // Times reading stopped for the limit
+    };
+
+    static constexpr size_t kDefaultLimit = 1024ull * 1024 * 1024;
+    static constexpr std::chrono::seconds kDefaultIdleTimeout{30 * 60};
+    // Streams that saw traffic more recently than this are never shed
+    static constexpr std::chrono::seconds kMinShedIdle{10};
+    static constexpr size_t kResumePercent = 90;
+
+    static MemoryBudget& instance()
+    {
+        static MemoryBudget budget;
+        return budget;
+    }
+
+    void charge(Category category, size_t bytes) { used_[index(category)].fetch_add(bytes, std::memory_order_relaxed); }
+    void release(Category category, size_t bytes) { used_[index(category)].fetch_sub(bytes, std::memory_order_relaxed); }
+
+    size_t used() const
+    {
+        size_t total = 0;
+        for (const auto& counter : used_)
+        {
+            total += counter.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    // 0: no limit
+    void setLimit(size_t bytes) { limit_ = bytes; }
+    size_t limit() const { return limit_; }
+    void setPolicy(Policy policy) { policy_ = policy; }
+    Policy policy() const { return policy_; }
+    // 0: idle streams are kept
+    void setIdleTimeout(std::chrono::seconds timeout) { idleTimeoutSeconds_ = timeout.count(); }
+    std::chrono::seconds idleTimeout() const { return std::chrono::seconds(idleTimeoutSeconds_.load()); }
+
+    bool overLimit() const
+    {
+        size_t limit = limit_.load(std::memory_order_relaxed);
+        return limit != 0 && used() > limit;
+    }
+    bool belowResumeMark() const
+    {
+        size_t limit = limit_.load(std::memory_order_relaxed);
+        return limit == 0 || used() <= limit / 100 * kResumePercent;
+    }
+    // Backpressure: reading stops while this holds
+    bool shouldPause() const
+    {
+        return policy_ == Policy::Backpressure && queued() != 0 && overLimit();
+    }
+
+    // Backpressure: a stream stopped reading for the limit. Whoever drives
+    // the sweeps restarts them once takeStalled() says so.
+    void stalled()
+    {
+        ++stalls_;
+        stalled_ = true;
+    }
+    bool takeStalled()
+    {
+        return stalled_.load(std::memory_order_relaxed) && (queued() == 0 || belowResumeMark()) &&
+               stalled_.exchange(false);
+    }
+    void countShed() { ++shed_; }
+    void countReaped() { ++reaped_; }
+
+    Snapshot snapshot() const
+    {
+        Snapshot s;
+        s.streams = used_[index(Category::Streams)].load(std::memory_order_relaxed);
+        s.writeQueues = used_[index(Category::WriteQueues)].load(std::memory_order_relaxed);
+        s.managers = used_[index(Category::Managers)].load(std::memory_order_relaxed);
+        s.limit = limit_;
+        s.shed = shed_;
+        s.reaped = reaped_;
+        s.stalls = stalls_;
+        return s;
+    }
+
+private:
+    MemoryBudget() = default;
+    static size_t index(Category category) { return static_cast<size_t>(category); }
+    size_t queued() const { return used_[index(Category::WriteQueues)].load(std::memory_order_relaxed); }
+
+    std::atomic<size_t> used_[static_cast<size_t>(Category::Count)] = {};
+    std::atomic<size_t> limit_{kDefaultLimit};
+    std::atomic<Policy> policy_{Policy::ShedIdle};
+    std::atomic<int64_t> idleTimeoutSeconds_{kDefaultIdleTimeout.count()};
+    std::atomic<bool> stalled_{false};
+    std::atomic<uint64_t> shed_{0};
+    std::atomic<uint64_t> reaped_{0};
+    std::atomic<uint64_t> stalls_{0};
+};
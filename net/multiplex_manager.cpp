@@ -1,166 +1,1933 @@
 #include "multiplex_manager.h"
-#include "nanoid/nanoid.h"
-#include <iostream>
+#include "logger.h"
+#include "io_context_monitor.h"
+#include "tracer.h"
+#include "tunnel_capture.h"
+#include <algorithm>
+#include <chrono>
 #include <cstring>
+#include <random>
 
-MultiplexManager::MultiplexManager(ISteamNetworkingSockets *steamInterface, HSteamNetConnection steamConn,
+namespace
+{
+// Same alphabet nanoid uses, so IDs look the same on the wire as before
+const char kIdAlphabet[] = "useandom-26T198340PX75pxJACKVERYMINDBUSHWOLF_GQZbfghjklqvwyzrict";
+// Session control, lane joins and relay headers always use the legacy
+// header: they're read before anything is negotiated
+const size_t kFrameHeaderSize = kLegacyHeaderSize;
+const size_t kMaxRejectedStreams = 1024; // Forgotten in bulk beyond this, a late frame just finds no stream
+
+// Frame types. 0-2 belong to a stream and are counted by the session;
+// 3-5 are session control and aren't.
+const uint32_t kTypeData = 0;
+const uint32_t kTypeClose = 1;
+const uint32_t kTypeOpen = 2;
+const uint32_t kTypeHello = 3;   // Client: session ID, frames received
+const uint32_t kTypeWelcome = 4; // Host: frames received, whether the session resumed
+const uint32_t kTypeAck = 5;     // Frames received
+const uint32_t kTypeStriped = 6;  // Sequence number and inner type (0-2) ahead of the payload
+const uint32_t kTypeLaneJoin = 7; // First frame on a bonded connection: session ID, lane
+const uint32_t kTypeRelay = 8;    // Peer Steam ID, route, then a whole frame for or from that peer
+const size_t kStripeHeaderSize = 2 * sizeof(uint32_t);
+const auto kLaneWeightInterval = std::chrono::milliseconds(100);
+const int64_t kDefaultLaneWeight = 1 << 20; // When the transport can't tell a lane's rate
+const uint32_t kMinPeerMaxFrame = 4096;     // Smaller limits from a peer are ignored
+const size_t kHelloSize = 2 * sizeof(uint64_t);
+const size_t kWelcomeSize = sizeof(uint64_t) + sizeof(uint32_t);
+} // namespace
+
+MultiplexManager::MultiplexManager(TunnelTransport *transport, HSteamNetConnection steamConn,
                                    boost::asio::io_context &io_context, bool &isHost, int &localPort)
-    : steamInterface_(steamInterface), steamConn_(steamConn),
-      io_context_(io_context), isHost_(isHost), localPort_(localPort) {}
+    : transport_(transport), steamConn_(steamConn),
+      io_context_(io_context), isHost_(isHost), localPort_(localPort), uring_(UringEngine::instance()),
+      budget_(MemoryBudget::instance())
+{
+    budget_.charge(MemoryBudget::Category::Managers, sizeof(MultiplexManager));
+    std::random_device rd;
+    idState_ = (static_cast<uint64_t>(rd()) << 32) ^ rd() ^
+               static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+}
 
 MultiplexManager::~MultiplexManager()
 {
     // Close all sockets
-    std::lock_guard<std::mutex> lock(mapMutex_);
-    for (auto &pair : clientMap_)
+    std::vector<std::shared_ptr<StreamEndpoint>> endpoints;
+    std::vector<std::function<void()>> drained;
+    std::vector<std::shared_ptr<Stream>> parked;
+    {
+        std::lock_guard<std::mutex> lock(mapMutex_);
+        for (auto &pair : streams_)
+        {
+            Stream &stream = *pair.second;
+            bool wasClosed = stream.closed.exchange(true);
+            stream.owner = nullptr;
+            {
+                std::lock_guard<std::mutex> streamLock(stream.writeMutex);
+                takeDrainWaiters(stream, drained, true);
+                if (stream.readParked)
+                {
+                    // No read is pending to end with the socket
+                    stream.readParked = false;
+                    parked.push_back(pair.second);
+                }
+            }
+            if (stream.endpoint)
+            {
+                if (!wasClosed)
+                {
+                    endpoints.push_back(stream.endpoint);
+                }
+                continue;
+            }
+            if (uring_)
+            {
+                // Ends the engine's operations; the last one closes the socket
+                std::lock_guard<std::mutex> streamLock(stream.writeMutex);
+                if (stream.uringOps > 0)
+                {
+                    stream.shutdownUring();
+                    continue;
+                }
+            }
+            boost::system::error_code ec;
+            stream.socket->close(ec);
+        }
+        streams_.clear();
+    }
+    // Outside the lock: an endpoint's owner may be calling into us right now
+    for (auto &endpoint : endpoints)
+    {
+        endpoint->close();
+    }
+    // Streams held back for ours can go on
+    for (auto &callback : drained)
+    {
+        callback();
+    }
+    for (auto &stream : parked)
+    {
+        if (stream->onClosed)
+        {
+            boost::asio::post(stream->socket->get_executor(), [stream]() { stream->onClosed(); });
+        }
+    }
+    budget_.release(MemoryBudget::Category::Managers, sizeof(MultiplexManager) + replayCharged_);
+    if (uring_)
+    {
+        // Wait out a completion that may still be using this manager
+        uring_->barrier();
+    }
+}
+
+StreamId MultiplexManager::addClient(std::shared_ptr<tcp::socket> socket, DataCallback onData,
+                                     std::function<void()> onClosed, int remotePort)
+{
+    auto stream = std::make_shared<Stream>();
+    {
+        std::lock_guard<std::mutex> lock(sessionMutex_);
+        stream->striped = striping_;
+        stream->lane = stream->striped ? pickLane() : pickStreamLane();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mapMutex_);
+        stream->id = generateStreamId();
+        stream->socket = std::move(socket);
+        stream->onData = std::move(onData);
+        stream->onClosed = std::move(onClosed);
+        streams_[stream->id] = stream;
+    }
+    if (remotePort > 0)
+    {
+        // Ahead of any data, so the host connects to the right port
+        uint16_t port = static_cast<uint16_t>(remotePort);
+        sendStreamPacket(*stream, reinterpret_cast<const char *>(&port), sizeof(port), kTypeOpen);
+    }
+    startAsyncRead(stream);
+    LOG_INFO("Added client with id {}", StreamIdText(stream->id).c_str());
+    return stream->id;
+}
+
+void MultiplexManager::removeClient(StreamId id)
+{
+    auto stream = findStream(id);
+    if (stream && unregisterStream(stream))
     {
-        pair.second->close();
+        closeStream(stream);
+        LOG_INFO("Removed client with id {}", StreamIdText(id).c_str());
     }
-    clientMap_.clear();
 }
 
-std::string MultiplexManager::addClient(std::shared_ptr<tcp::socket> socket)
+StreamId MultiplexManager::addEndpoint(std::shared_ptr<StreamEndpoint> endpoint)
 {
-    std::string id;
+    StreamId id;
+    auto stream = std::make_shared<Stream>();
+    {
+        std::lock_guard<std::mutex> lock(sessionMutex_);
+        stream->striped = striping_;
+        stream->lane = stream->striped ? pickLane() : pickStreamLane();
+    }
     {
         std::lock_guard<std::mutex> lock(mapMutex_);
-        id = nanoid::generate(6);
-        clientMap_[id] = socket;
-        readBuffers_[id].resize(1024);
+        id = stream->id = generateStreamId();
+        stream->endpoint = std::move(endpoint);
+        streams_[id] = std::move(stream);
     }
-    startAsyncRead(id);
-    std::cout << "Added client with id " << id << std::endl;
+    LOG_INFO("Added endpoint stream with id {}", StreamIdText(id).c_str());
     return id;
 }
 
-void MultiplexManager::removeClient(const std::string &id)
+void MultiplexManager::sendFromEndpoint(StreamId id, const char *data, size_t len)
 {
-    std::lock_guard<std::mutex> lock(mapMutex_);
-    auto it = clientMap_.find(id);
-    if (it != clientMap_.end())
+    if (auto stream = findStream(id))
+    {
+        TRACE_EVENT("endpoint.read", StreamIdText(id).c_str(), len);
+        stream->lastActivity.store(nowTicks(), std::memory_order_relaxed);
+        sendStreamPacket(*stream, data, len, kTypeData);
+    }
+}
+
+void MultiplexManager::closeFromEndpoint(StreamId id)
+{
+    auto stream = findStream(id);
+    if (stream && unregisterStream(stream))
     {
-        it->second->close();
-        clientMap_.erase(it);
+        // Closed on our side: tell the peer
+        stream->closed = true;
+        sendStreamPacket(*stream, nullptr, 0, kTypeClose);
+        LOG_INFO("Endpoint stream {} closed locally", StreamIdText(id).c_str());
     }
-    readBuffers_.erase(id);
+}
+
+void MultiplexManager::setEndpointAcceptor(EndpointAcceptor acceptor)
+{
+    std::lock_guard<std::mutex> lock(mapMutex_);
+    endpointAcceptor_ = std::move(acceptor);
+}
+
+void MultiplexManager::setAllowedPorts(std::vector<int> ports)
+{
+    std::lock_guard<std::mutex> lock(mapMutex_);
+    allowedPorts_ = std::move(ports);
+}
 
-    std::cout << "Removed client with id " << id << std::endl;
+void MultiplexManager::setBackendPools(std::map<int, std::shared_ptr<BackendPool>> pools)
+{
+    std::lock_guard<std::mutex> lock(mapMutex_);
+    backendPools_ = std::move(pools);
 }
 
-std::shared_ptr<tcp::socket> MultiplexManager::getClient(const std::string &id)
+bool MultiplexManager::portAllowed(int port)
 {
+    if (port == localPort_)
+    {
+        return true;
+    }
     std::lock_guard<std::mutex> lock(mapMutex_);
-    auto it = clientMap_.find(id);
-    if (it != clientMap_.end())
+    return std::find(allowedPorts_.begin(), allowedPorts_.end(), port) != allowedPorts_.end();
+}
+
+std::shared_ptr<tcp::socket> MultiplexManager::getClient(StreamId id)
+{
+    auto stream = findStream(id);
+    return stream ? stream->socket : nullptr;
+}
+
+bool MultiplexManager::writeToClient(StreamId id, const char *data, size_t len)
+{
+    auto stream = findStream(id);
+    if (!stream)
+    {
+        return false;
+    }
+    queueWrite(stream, data, len);
+    return true;
+}
+
+MultiplexManager::QueueResult MultiplexManager::writeToClient(StreamId id, const SharedChunk &chunk, size_t maxQueued,
+                                                              bool queueWhenFull)
+{
+    auto stream = findStream(id);
+    if (!stream)
     {
-        return it->second;
+        return QueueResult::NoStream;
     }
-    return nullptr;
+    return queueWrite(stream, chunk->data(), chunk->size(), chunk, maxQueued, queueWhenFull);
 }
 
-void MultiplexManager::sendTunnelPacket(const std::string &id, const char *data, size_t len, int type)
+bool MultiplexManager::holdReading(StreamId id)
 {
-    // Packet format: string id (6 chars + null), uint32_t type, then data if type==0
-    size_t idLen = id.size() + 1; // include null terminator
-    size_t packetSize = idLen + sizeof(uint32_t) + (type == 0 ? len : 0);
-    std::vector<char> packet(packetSize);
-    std::memcpy(&packet[0], id.c_str(), idLen);
-    uint32_t *pType = reinterpret_cast<uint32_t *>(&packet[idLen]);
-    *pType = type;
-    if (type == 0 && data)
+    auto stream = findStream(id);
+    if (!stream || stream->endpoint || uring_)
     {
-        std::memcpy(&packet[idLen + sizeof(uint32_t)], data, len);
+        return false;
     }
-    steamInterface_->SendMessageToConnection(steamConn_, packet.data(), packet.size(), k_nSteamNetworkingSend_Reliable, nullptr);
+    std::lock_guard<std::mutex> lock(stream->writeMutex);
+    ++stream->readHolds;
+    return true;
 }
 
-void MultiplexManager::handleTunnelPacket(const char *data, size_t len)
+void MultiplexManager::releaseReading(StreamId id)
 {
-    size_t idLen = 7; // 6 + null
-    if (len < idLen + sizeof(uint32_t))
+    auto stream = findStream(id);
+    if (!stream)
     {
-        std::cerr << "Invalid tunnel packet size" << std::endl;
         return;
     }
-    std::string id(data, 6);
-    uint32_t type = *reinterpret_cast<const uint32_t *>(data + idLen);
-    if (type == 0)
+    bool resume = false;
     {
-        // Data packet
-        size_t dataLen = len - idLen - sizeof(uint32_t);
-        const char *packetData = data + idLen + sizeof(uint32_t);
-        auto socket = getClient(id);
-        if (!socket && isHost_ && localPort_ > 0)
+        std::lock_guard<std::mutex> lock(stream->writeMutex);
+        if (stream->readHolds > 0 && --stream->readHolds == 0 && stream->readParked)
         {
-            // 如果是主持且没有对应的 TCP Client，创建一个连接到本地端口
-            std::cout << "Creating new TCP client for id " << id << " connecting to localhost:" << localPort_ << std::endl;
-            try
-            {
-                auto newSocket = std::make_shared<tcp::socket>(io_context_);
-                tcp::resolver resolver(io_context_);
-                auto endpoints = resolver.resolve("127.0.0.1", std::to_string(localPort_));
-                boost::asio::connect(*newSocket, endpoints);
+            stream->readParked = false;
+            resume = true;
+        }
+    }
+    if (resume)
+    {
+        boost::asio::post(stream->socket->get_executor(), [this, stream]() { startAsyncRead(stream); });
+    }
+}
 
-                std::string tempId = id;
-                {
-                    std::lock_guard<std::mutex> lock(mapMutex_);
-                    clientMap_[id] = newSocket;
-                    readBuffers_[id].resize(1024);
-                    socket = newSocket;
-                }
-                std::cout << "Successfully created TCP client for id " << id << std::endl;
-                startAsyncRead(tempId);
+bool MultiplexManager::notifyDrained(StreamId id, size_t lowMark, std::function<void()> onDrained)
+{
+    auto stream = findStream(id);
+    if (!stream)
+    {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(stream->writeMutex);
+        if (stream->queuedBytes > lowMark && !stream->closed)
+        {
+            stream->drainWaiters.emplace_back(lowMark, std::move(onDrained));
+            return true;
+        }
+    }
+    onDrained();
+    return true;
+}
+
+MultiplexManager::Stream::Stream() : lastActivity(nowTicks())
+{
+    MemoryBudget::instance().charge(MemoryBudget::Category::Streams, sizeof(Stream));
+}
+
+MultiplexManager::Stream::~Stream()
+{
+    MemoryBudget &budget = MemoryBudget::instance();
+    budget.release(MemoryBudget::Category::Streams, sizeof(Stream) + poolBytes);
+    budget.release(MemoryBudget::Category::WriteQueues, queuedBytes);
+}
+
+size_t MultiplexManager::sweep(const std::vector<std::shared_ptr<MultiplexManager>> &managers)
+{
+    MemoryBudget &budget = MemoryBudget::instance();
+    const int64_t now = nowTicks();
+    const int64_t idleTimeout = std::chrono::duration_cast<std::chrono::steady_clock::duration>(budget.idleTimeout()).count();
+    const bool shed = budget.policy() == MemoryBudget::Policy::ShedIdle && budget.overLimit();
+    if (idleTimeout == 0 && !shed)
+    {
+        return 0;
+    }
+    const int64_t minShedIdle = std::chrono::duration_cast<std::chrono::steady_clock::duration>(MemoryBudget::kMinShedIdle).count();
+    struct Candidate {
+        int64_t lastActivity;
+        MultiplexManager *manager;
+        std::shared_ptr<Stream> stream;
+    };
+    std::vector<Candidate> candidates;
+    size_t closed = 0;
+    for (auto &manager : managers)
+    {
+        std::vector<std::shared_ptr<Stream>> streams;
+        {
+            std::lock_guard<std::mutex> lock(manager->mapMutex_);
+            streams.reserve(manager->streams_.size());
+            for (auto &pair : manager->streams_)
+            {
+                streams.push_back(pair.second);
             }
-            catch (const std::exception &e)
+        }
+        for (auto &stream : streams)
+        {
+            int64_t lastActivity = stream->lastActivity.load(std::memory_order_relaxed);
+            if (idleTimeout > 0 && now - lastActivity >= idleTimeout)
             {
-                std::cerr << "Failed to create TCP client for id " << id << ": " << e.what() << std::endl;
-                return;
+                LOG_INFO("Closing stream {}, idle for {} s", StreamIdText(stream->id).c_str(), budget.idleTimeout().count());
+                manager->reapStream(stream);
+                budget.countReaped();
+                ++closed;
+            }
+            else if (shed && now - lastActivity >= minShedIdle)
+            {
+                candidates.push_back({lastActivity, manager.get(), std::move(stream)});
+            }
+        }
+    }
+    if (!shed)
+    {
+        return closed;
+    }
+    // Streams are freed once their handlers let go, so count what each one
+    // gives back instead of waiting for the budget to notice
+    size_t used = budget.used();
+    size_t limit = budget.limit();
+    size_t shedCount = 0;
+    std::sort(candidates.begin(), candidates.end(),
+              [](const Candidate &a, const Candidate &b) { return a.lastActivity < b.lastActivity; });
+    for (auto &candidate : candidates)
+    {
+        if (used <= limit)
+        {
+            break;
+        }
+        size_t freed;
+        {
+            std::lock_guard<std::mutex> lock(candidate.stream->writeMutex);
+            freed = sizeof(Stream) + candidate.stream->poolBytes + candidate.stream->queuedBytes;
+        }
+        candidate.manager->reapStream(candidate.stream);
+        budget.countShed();
+        used = used > freed ? used - freed : 0;
+        ++shedCount;
+    }
+    if (shedCount > 0 || used > limit)
+    {
+        LOG_WARN("Over the memory budget ({} of {} bytes), closed {} idle streams", budget.used(), limit, shedCount);
+    }
+    return closed + shedCount;
+}
+
+void MultiplexManager::resumeReading()
+{
+    std::vector<std::shared_ptr<Stream>> resumed;
+    {
+        std::lock_guard<std::mutex> lock(mapMutex_);
+        for (auto &pair : streams_)
+        {
+            Stream &stream = *pair.second;
+            std::lock_guard<std::mutex> streamLock(stream.writeMutex);
+            if (stream.readParked && stream.readHolds == 0)
+            {
+                stream.readParked = false;
+                resumed.push_back(pair.second);
             }
         }
-        if (socket)
+    }
+    for (auto &stream : resumed)
+    {
+        boost::asio::post(stream->socket->get_executor(), [this, stream]() { startAsyncRead(stream); });
+    }
+}
+
+void MultiplexManager::reapStream(const std::shared_ptr<Stream> &stream)
+{
+    if (unregisterStream(stream))
+    {
+        sendStreamPacket(*stream, nullptr, 0, kTypeClose);
+        closeStream(stream);
+    }
+}
+
+bool MultiplexManager::budgetStopsReading() const
+{
+    return budget_.shouldPause();
+}
+
+void MultiplexManager::takeDrainWaiters(Stream &stream, std::vector<std::function<void()>> &out, bool everything)
+{
+    auto &waiters = stream.drainWaiters;
+    for (size_t i = 0; i < waiters.size();)
+    {
+        if (everything || stream.queuedBytes <= waiters[i].first)
         {
-            boost::asio::async_write(*socket, boost::asio::buffer(packetData, dataLen), [](const boost::system::error_code &, std::size_t) {});
+            out.push_back(std::move(waiters[i].second));
+            waiters[i] = std::move(waiters.back());
+            waiters.pop_back();
         }
         else
         {
-            std::cerr << "No client found for id " << id << std::endl;
+            ++i;
         }
     }
-    else if (type == 1)
+}
+
+size_t MultiplexManager::getClientCount()
+{
+    std::lock_guard<std::mutex> lock(mapMutex_);
+    return streams_.size();
+}
+
+void MultiplexManager::sendTunnelPacket(StreamId id, const char *data, size_t len, int type, int lane)
+{
+    TRACE_SCOPE("sendTunnelPacket", StreamIdText(id).c_str(), len);
+    // Packet format: frame header (see tunnel_frame.h), then data if type==0,
+    // or the uint16_t destination port if type==2 (open).
+    // Framed in a per-thread buffer that only ever grows, so steady state
+    // doesn't allocate; the transport copies the frame before returning.
+    thread_local std::vector<char> packet;
+    size_t payloadLen = ((type == 0 || type == 2) && data) ? len : 0;
+    packet.resize(kMaxFrameHeaderSize + payloadLen);
+    size_t headerSize = encodeFrameHeader(packet.data(), id, static_cast<uint32_t>(type),
+                                          compactFrames_.load(std::memory_order_relaxed));
+    if (payloadLen > 0)
     {
-        // Disconnect packet
-        removeClient(id);
-        std::cout << "Client " << id << " disconnected" << std::endl;
+        std::memcpy(packet.data() + headerSize, data, payloadLen);
     }
-    else
+    packet.resize(headerSize + payloadLen);
     {
-        std::cerr << "Unknown packet type " << type << std::endl;
+        TRACE_SCOPE("steam.send", StreamIdText(id).c_str(), packet.size());
+        std::lock_guard<std::mutex> lock(sessionMutex_);
+        sendOnLane(lane, packet.data(), packet.size());
     }
 }
 
-void MultiplexManager::startAsyncRead(const std::string &id)
+// Same framing as sendTunnelPacket, on the stream's lane; a striped stream's
+// frames carry a sequence number and go to whichever lane is next. Data
+// larger than the peer takes in one frame goes out in several.
+void MultiplexManager::sendStreamPacket(Stream &stream, const char *data, size_t len, int type)
 {
-    auto socket = getClient(id);
-    if (!socket)
+    size_t maxPayload = peerMaxFrame_.load(std::memory_order_relaxed) - kMaxFrameHeaderSize - kStripeHeaderSize;
+    if (type == kTypeData && len > maxPayload)
+    {
+        for (size_t offset = 0; offset < len; offset += maxPayload)
+        {
+            sendStreamPacket(stream, data + offset, std::min(maxPayload, len - offset), type);
+        }
+        return;
+    }
+    if (!stream.striped)
     {
-        std::cout << "Error: Socket is null for id " << id << std::endl;
+        sendTunnelPacket(stream.id, data, len, type, stream.lane);
         return;
     }
-    socket->async_read_some(boost::asio::buffer(readBuffers_[id]),
-    [this, id](const boost::system::error_code &ec, std::size_t bytes_transferred)
+    TRACE_SCOPE("sendTunnelPacket", StreamIdText(stream.id).c_str(), len);
+    thread_local std::vector<char> packet;
+    size_t payloadLen = ((type == kTypeData || type == kTypeOpen) && data) ? len : 0;
+    packet.resize(kMaxFrameHeaderSize + kStripeHeaderSize + payloadLen);
+    size_t headerSize = encodeFrameHeader(packet.data(), stream.id, kTypeStriped,
+                                          compactFrames_.load(std::memory_order_relaxed));
+    uint32_t innerType = static_cast<uint32_t>(type);
+    std::memcpy(packet.data() + headerSize + sizeof(uint32_t), &innerType, sizeof(innerType));
+    if (payloadLen > 0)
     {
-        if (!ec)
+        std::memcpy(packet.data() + headerSize + kStripeHeaderSize, data, payloadLen);
+    }
+    packet.resize(headerSize + kStripeHeaderSize + payloadLen);
+    TRACE_SCOPE("steam.send", StreamIdText(stream.id).c_str(), packet.size());
+    std::lock_guard<std::mutex> lock(sessionMutex_);
+    // Numbered under the lock, so sequence order is send order on every lane
+    uint32_t seq = stream.stripeSeq++;
+    std::memcpy(packet.data() + headerSize, &seq, sizeof(seq));
+    sendOnLane(pickLane(), packet.data(), packet.size());
+}
+
+// Lane 0 is the session's connection: its frames are kept for a replay and
+// held while it's down. Other lanes just send.
+void MultiplexManager::sendOnLane(int lane, const char *data, size_t len)
+{
+    if (lane != 0)
+    {
+        HSteamNetConnection conn = lanes_[lane].conn;
+        if (conn != k_HSteamNetConnection_Invalid)
         {
-            if (bytes_transferred > 0)
+            transmit(conn, data, len);
+        }
+        return;
+    }
+    if (!isHost_ && !helloSent_)
+    {
+        sendHello();
+    }
+    // Appended even once lost, so sent() keeps counting and a resume can't
+    // skip the frames; the warning goes out once per session
+    if (recording_ && !replay_.append(data, len) && !replayLostLogged_)
+    {
+        replayLostLogged_ = true;
+        LOG_WARN("Replay buffer full ({} bytes unacknowledged), this session can't be resumed", replay_.bytes());
+    }
+    if (replayCharged_ != replay_.allocated())
+    {
+        budget_.charge(MemoryBudget::Category::Managers, replay_.allocated() - replayCharged_);
+        replayCharged_ = replay_.allocated();
+    }
+    if (state_ == SessionState::Active)
+    {
+        sendFrame(data, len);
+    }
+}
+
+void MultiplexManager::sendFrame(const char *data, size_t len)
+{
+    transmit(steamConn_, data, len);
+}
+
+void MultiplexManager::transmit(HSteamNetConnection conn, const char *data, size_t len)
+{
+    TunnelCapture::instance().record(CaptureDirection::Outbound, conn, data, len);
+    transport_->send(conn, data, static_cast<uint32>(len), k_nSteamNetworkingSend_Reliable);
+}
+
+// Smooth weighted round-robin over the lanes that are up, per frame
+int MultiplexManager::pickLane()
+{
+    if (laneCount_ == 1)
+    {
+        return 0;
+    }
+    refreshLaneWeights();
+    int best = -1;
+    int64_t total = 0;
+    for (int i = 0; i < kMaxLanes; ++i)
+    {
+        Lane &lane = lanes_[i];
+        if (!laneUp(i))
+        {
+            continue;
+        }
+        lane.current += lane.weight;
+        total += lane.weight;
+        if (best < 0 || lane.current > lanes_[best].current)
+        {
+            best = i;
+        }
+    }
+    if (best < 0)
+    {
+        return 0;
+    }
+    lanes_[best].current -= total;
+    return best;
+}
+
+// For a stream pinned to one lane: the lane where it gets the largest share,
+// its weight split over the streams already on it plus this one. A frame
+// round-robin would hand a slow lane as many streams as its weight's share
+// of picks, which starves them once every stream is busy. Ties go to the
+// heavier lane.
+int MultiplexManager::pickStreamLane()
+{
+    int best = 0;
+    if (laneCount_ > 1)
+    {
+        refreshLaneWeights();
+        best = -1;
+        for (int i = 0; i < kMaxLanes; ++i)
+        {
+            if (!laneUp(i))
+            {
+                continue;
+            }
+            if (best < 0)
+            {
+                best = i;
+                continue;
+            }
+            const Lane &lane = lanes_[i];
+            const Lane &top = lanes_[best];
+            // weight / (streams + 1), compared without dividing
+            int64_t share = lane.weight * (top.streams + 1);
+            int64_t topShare = top.weight * (lane.streams + 1);
+            if (share > topShare || (share == topShare && lane.weight > top.weight))
             {
-                sendTunnelPacket(id, readBuffers_[id].data(), bytes_transferred, 0);
+                best = i;
             }
-            startAsyncRead(id);
         }
-        else
+        best = std::max(best, 0);
+    }
+    ++lanes_[best].streams;
+    return best;
+}
+
+bool MultiplexManager::laneUp(int lane) const
+{
+    // Lane 0 only holds frames while its connection is down
+    return lane == 0 ? state_ == SessionState::Active : lanes_[lane].conn != k_HSteamNetConnection_Invalid;
+}
+
+void MultiplexManager::refreshLaneWeights()
+{
+    auto now = std::chrono::steady_clock::now();
+    if (now - weightsUpdated_ >= kLaneWeightInterval)
+    {
+        weightsUpdated_ = now;
+        updateLaneWeights();
+    }
+}
+
+// A lane's weight is its send rate, less for whatever is already queued on
+// it: a lane with 100 ms of backlog counts half
+void MultiplexManager::updateLaneWeights()
+{
+    for (int i = 0; i < kMaxLanes; ++i)
+    {
+        Lane &lane = lanes_[i];
+        HSteamNetConnection conn = i == 0 ? steamConn_.load() : lane.conn;
+        LaneStatus status;
+        if (conn == k_HSteamNetConnection_Invalid || !transport_->laneStatus(conn, status) || status.sendRate == 0)
         {
-            std::cout << "Error reading from TCP client " << id << ": " << ec.message() << std::endl;
-            removeClient(id);
+            lane.weight = kDefaultLaneWeight;
+            continue;
         }
-    });
-}
\ No newline at end of file
+        double backlog = static_cast<double>(status.pendingBytes) / (static_cast<double>(status.sendRate) / 10);
+        lane.weight = std::max<int64_t>(1, static_cast<int64_t>(status.sendRate / (1 + backlog)));
+    }
+}
+
+void MultiplexManager::sendControl(int type, const void *payload, size_t len)
+{
+    char frame[kFrameHeaderSize + kHelloSize + kCapabilitiesWireSize];
+    streamIdToWire(0, frame);
+    uint32_t frameType = static_cast<uint32_t>(type);
+    std::memcpy(frame + kStreamIdWireSize, &frameType, sizeof(frameType));
+    std::memcpy(frame + kFrameHeaderSize, payload, len);
+    sendFrame(frame, kFrameHeaderSize + len);
+}
+
+void MultiplexManager::sendHello()
+{
+    if (sessionId_ == 0)
+    {
+        std::random_device rd;
+        uint64_t id = 0;
+        while (id == 0)
+        {
+            id = (static_cast<uint64_t>(rd()) << 32) ^ rd();
+        }
+        sessionId_ = id;
+    }
+    sendHelloFrame();
+    helloSent_ = true;
+    recording_ = true;
+}
+
+// Session ID and frames received, then our capabilities
+void MultiplexManager::sendHelloFrame()
+{
+    char hello[kHelloSize + kCapabilitiesWireSize];
+    uint64_t ids[2] = {sessionId_, received_};
+    std::memcpy(hello, ids, sizeof(ids));
+    writeCapabilities(hello + kHelloSize, localCaps_);
+    sendControl(kTypeHello, hello, localCaps_.version >= 2 ? sizeof(hello) : kHelloSize);
+}
+
+// The capabilities block after a hello or welcome, if the peer sent one
+void MultiplexManager::applyPeerCapabilities(const char *data, size_t len)
+{
+    Capabilities caps;
+    if (localCaps_.version >= 2)
+    {
+        readCapabilities(data, len, caps);
+    }
+    peerCaps_ = caps;
+    peerMaxFrame_ = std::min(std::max(caps.maxFrame, kMinPeerMaxFrame), kMaxFrameSize);
+    bool compact = caps.has(kFeatureCompactHeader) && localCaps_.has(kFeatureCompactHeader);
+    compactFrames_ = compact;
+    LOG_INFO("Peer speaks protocol version {} (features {}, frames up to {} bytes), using {} frame headers",
+             caps.version, caps.features, caps.maxFrame, compact ? "compact" : "legacy");
+}
+
+Capabilities MultiplexManager::peerCapabilities()
+{
+    std::lock_guard<std::mutex> lock(sessionMutex_);
+    return peerCaps_;
+}
+
+void MultiplexManager::setLocalCapabilities(const Capabilities &caps)
+{
+    std::lock_guard<std::mutex> lock(sessionMutex_);
+    localCaps_ = caps;
+    if (caps.version < 2)
+    {
+        // A version 1 build neither sends nor reads the block
+        localCaps_.features = Capabilities().features;
+    }
+    compactFrames_ = compactFrames_ && localCaps_.has(kFeatureCompactHeader);
+}
+
+bool MultiplexManager::parseHello(const char *data, size_t len, uint64_t &sessionId)
+{
+    uint32_t type;
+    if (isCompactFrame(data, len) || len < kFrameHeaderSize + kHelloSize)
+    {
+        return false;
+    }
+    std::memcpy(&type, data + kStreamIdWireSize, sizeof(type));
+    if (type != kTypeHello)
+    {
+        return false;
+    }
+    std::memcpy(&sessionId, data + kFrameHeaderSize, sizeof(sessionId));
+    return sessionId != 0;
+}
+
+bool MultiplexManager::detach()
+{
+    std::lock_guard<std::mutex> lock(sessionMutex_);
+    if (!recording_ || !peerSessions_ || replay_.lost())
+    {
+        return false;
+    }
+    state_ = SessionState::Detached;
+    LOG_INFO("Session {} detached, keeping {} unacknowledged bytes", sessionId_.load(), replay_.bytes());
+    return true;
+}
+
+void MultiplexManager::resume(HSteamNetConnection conn)
+{
+    std::lock_guard<std::mutex> lock(sessionMutex_);
+    steamConn_ = conn;
+    state_ = SessionState::Resuming;
+    // Received count first: the host replays what we missed before the welcome
+    sendHelloFrame();
+    LOG_INFO("Resuming session {} on connection {}", sessionId_.load(), conn);
+}
+
+void MultiplexManager::attach(HSteamNetConnection conn)
+{
+    std::lock_guard<std::mutex> lock(sessionMutex_);
+    steamConn_ = conn;
+    // Frames wait for the replay the hello triggers
+    state_ = SessionState::Detached;
+}
+
+void MultiplexManager::handleSessionPacket(uint32_t type, const char *payload, size_t len)
+{
+    if (type == kTypeHello)
+    {
+        uint64_t hello[2];
+        if (!isHost_ || len < sizeof(hello))
+        {
+            return;
+        }
+        std::memcpy(hello, payload, sizeof(hello));
+        bool resumed;
+        {
+            std::lock_guard<std::mutex> lock(sessionMutex_);
+            applyPeerCapabilities(payload + kHelloSize, len - kHelloSize);
+            if (sessionId_ == 0 && hello[1] == 0)
+            {
+                sessionId_ = hello[0];
+                recording_ = true;
+                peerSessions_ = true;
+                state_ = SessionState::Active;
+                resumed = true;
+                LOG_INFO("Session {} opened", hello[0]);
+            }
+            else
+            {
+                resumed = sessionId_ == hello[0] && replay_.canReplayFrom(hello[1]);
+            }
+            // Frames received, whether the session resumed, our capabilities
+            char welcome[kWelcomeSize + kCapabilitiesWireSize];
+            uint64_t received = received_;
+            uint32_t resumedFlag = resumed ? 1u : 0u;
+            std::memcpy(welcome, &received, sizeof(received));
+            std::memcpy(welcome + sizeof(received), &resumedFlag, sizeof(resumedFlag));
+            writeCapabilities(welcome + kWelcomeSize, localCaps_);
+            sendControl(kTypeWelcome, welcome, localCaps_.version >= 2 ? sizeof(welcome) : kWelcomeSize);
+            if (resumed && state_ != SessionState::Active)
+            {
+                LOG_INFO("Session {} resumed, replaying {} frames", hello[0], replay_.sent() - hello[1]);
+                replay_.replayFrom(hello[1], [this](const char *data, size_t frameLen) { sendFrame(data, frameLen); });
+                state_ = SessionState::Active;
+            }
+        }
+        if (!resumed)
+        {
+            LOG_WARN("Can't resume session {}, closing its streams", hello[0]);
+            resetSession();
+        }
+    }
+    else if (type == kTypeWelcome)
+    {
+        uint64_t hostReceived;
+        uint32_t resumed;
+        if (isHost_ || len < sizeof(hostReceived) + sizeof(resumed))
+        {
+            return;
+        }
+        std::memcpy(&hostReceived, payload, sizeof(hostReceived));
+        std::memcpy(&resumed, payload + sizeof(hostReceived), sizeof(resumed));
+        {
+            std::lock_guard<std::mutex> lock(sessionMutex_);
+            applyPeerCapabilities(payload + kWelcomeSize, len - kWelcomeSize);
+            if (resumed && replay_.canReplayFrom(hostReceived))
+            {
+                peerSessions_ = true;
+                if (state_ == SessionState::Resuming)
+                {
+                    LOG_INFO("Session {} resumed, replaying {} frames", sessionId_.load(), replay_.sent() - hostReceived);
+                    replay_.replayFrom(hostReceived, [this](const char *data, size_t frameLen) { sendFrame(data, frameLen); });
+                    state_ = SessionState::Active;
+                }
+                else
+                {
+                    replay_.acknowledge(hostReceived);
+                }
+                return;
+            }
+        }
+        LOG_WARN("Host couldn't resume session {}, closing its streams", sessionId_.load());
+        resetSession();
+    }
+    else if (type == kTypeAck)
+    {
+        uint64_t count;
+        if (len < sizeof(count))
+        {
+            return;
+        }
+        std::memcpy(&count, payload, sizeof(count));
+        std::lock_guard<std::mutex> lock(sessionMutex_);
+        replay_.acknowledge(count);
+    }
+    else
+    {
+        LOG_WARN("Unknown packet type {}", type);
+    }
+}
+
+// The session is gone (the peer couldn't resume it): close every stream and
+// start over; a client opens a new session with its next frame
+void MultiplexManager::resetSession()
+{
+    std::vector<StreamId> ids;
+    {
+        std::lock_guard<std::mutex> lock(mapMutex_);
+        for (auto &pair : streams_)
+        {
+            ids.push_back(pair.first);
+        }
+    }
+    for (StreamId id : ids)
+    {
+        removeClient(id);
+    }
+    std::lock_guard<std::mutex> lock(sessionMutex_);
+    replay_.reset();
+    replayLostLogged_ = false;
+    received_ = 0;
+    sessionId_ = 0;
+    recording_ = false;
+    peerSessions_ = false;
+    helloSent_ = false;
+    state_ = SessionState::Active;
+}
+
+void MultiplexManager::handleTunnelPacket(const char *data, size_t len, int lane)
+{
+    if (lane < 0 || lane >= kMaxLanes)
+    {
+        return;
+    }
+    HSteamNetConnection conn = steamConn_;
+    if (lane != 0)
+    {
+        std::lock_guard<std::mutex> lock(sessionMutex_);
+        conn = lanes_[lane].conn;
+    }
+    TunnelCapture::instance().record(CaptureDirection::Inbound, conn, data, len);
+    FrameHeader header;
+    if (!decodeFrameHeader(data, len, header))
+    {
+        LOG_WARN("Invalid tunnel packet size");
+        return;
+    }
+    StreamId id = header.id;
+    uint32_t type = header.type;
+    const char *payload = data + header.size;
+    size_t payloadLen = len - header.size;
+    TRACE_SCOPE("handleTunnelPacket", StreamIdText(id).c_str(), len);
+    if (type == kTypeLaneJoin || type == kTypeRelay)
+    {
+        // SteamMessageHandler routes these before they get here
+        return;
+    }
+    if (type > kTypeOpen && type != kTypeStriped)
+    {
+        if (lane == 0)
+        {
+            handleSessionPacket(type, payload, payloadLen);
+        }
+        return;
+    }
+    // Every stream frame on the session's connection counts, handled or
+    // not, so both sides agree on what was delivered
+    if (lane == 0)
+    {
+        uint64_t received = ++received_;
+        if (received % kAckInterval == 0)
+        {
+            std::lock_guard<std::mutex> lock(sessionMutex_);
+            if (peerSessions_ && state_ == SessionState::Active)
+            {
+                sendControl(kTypeAck, &received, sizeof(received));
+            }
+        }
+    }
+    if (type == kTypeStriped)
+    {
+        handleStripedFrame(id, payload, payloadLen, lane);
+        return;
+    }
+    handleStreamFrame(id, type, payload, payloadLen, lane, false);
+}
+
+void MultiplexManager::handleStreamFrame(StreamId id, uint32_t type, const char *payload, size_t len, int lane,
+                                         bool striped)
+{
+    if (type == kTypeData)
+    {
+        // Data packet
+        auto stream = findStream(id);
+        if (!stream && isHost_)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mapMutex_);
+                if (rejected_.count(id))
+                {
+                    return;
+                }
+            }
+            // No open packet (older clients): the default port. A stream
+            // that had one is either still registered or in rejected_
+            stream = openLocalStream(id, localPort_, lane, striped, false);
+        }
+        if (stream)
+        {
+            // Copied into the stream's write queue: the caller's buffer (a
+            // Steam message) is released as soon as we return
+            queueWrite(stream, payload, len);
+        }
+        else
+        {
+            LOG_WARN("No client found for id {}", StreamIdText(id).c_str());
+        }
+    }
+    else if (type == kTypeClose)
+    {
+        // Disconnect packet
+        removeClient(id);
+        LOG_INFO("Client {} disconnected", StreamIdText(id).c_str());
+    }
+    else
+    {
+        // Open packet: the client picked the destination port
+        uint16_t port;
+        if (!isHost_ || len < sizeof(port) || findStream(id))
+        {
+            return;
+        }
+        std::memcpy(&port, payload, sizeof(port));
+        if (port == 0 || !portAllowed(port))
+        {
+            LOG_WARN("Rejected stream {} to port {}: not in the allowed ports", StreamIdText(id).c_str(), port);
+            {
+                std::lock_guard<std::mutex> lock(mapMutex_);
+                rejectStream(id);
+            }
+            // A plain close on the session's connection ends a striped stream too
+            sendTunnelPacket(id, nullptr, 0, kTypeClose);
+            return;
+        }
+        if (!openLocalStream(id, port, lane, striped, true))
+        {
+            {
+                std::lock_guard<std::mutex> lock(mapMutex_);
+                rejectStream(id);
+            }
+            // Tell the client instead of letting its data go nowhere
+            sendTunnelPacket(id, nullptr, 0, kTypeClose);
+        }
+    }
+}
+
+bool MultiplexManager::sessionEstablished()
+{
+    std::lock_guard<std::mutex> lock(sessionMutex_);
+    return peerSessions_;
+}
+
+void MultiplexManager::openSession()
+{
+    std::lock_guard<std::mutex> lock(sessionMutex_);
+    if (!isHost_ && !helloSent_)
+    {
+        sendHello();
+    }
+}
+
+int MultiplexManager::addLane(HSteamNetConnection conn)
+{
+    std::lock_guard<std::mutex> lock(sessionMutex_);
+    if (!peerSessions_)
+    {
+        return -1;
+    }
+    for (int i = 1; i < kMaxLanes; ++i)
+    {
+        if (lanes_[i].conn == k_HSteamNetConnection_Invalid)
+        {
+            lanes_[i] = Lane{conn, kDefaultLaneWeight, 0};
+            ++laneCount_;
+            weightsUpdated_ = {};
+            char join[kFrameHeaderSize + sizeof(uint64_t) + sizeof(uint32_t)];
+            streamIdToWire(0, join);
+            std::memcpy(join + kStreamIdWireSize, &kTypeLaneJoin, sizeof(kTypeLaneJoin));
+            uint64_t id = sessionId_;
+            uint32_t lane = static_cast<uint32_t>(i);
+            std::memcpy(join + kFrameHeaderSize, &id, sizeof(id));
+            std::memcpy(join + kFrameHeaderSize + sizeof(id), &lane, sizeof(lane));
+            transmit(conn, join, sizeof(join));
+            LOG_INFO("Session {} added lane {} on connection {}", id, i, conn);
+            return i;
+        }
+    }
+    return -1;
+}
+
+void MultiplexManager::attachLane(int lane, HSteamNetConnection conn)
+{
+    if (lane <= 0 || lane >= kMaxLanes)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(sessionMutex_);
+    if (lanes_[lane].conn == k_HSteamNetConnection_Invalid)
+    {
+        ++laneCount_;
+    }
+    lanes_[lane] = Lane{conn, kDefaultLaneWeight, 0};
+    weightsUpdated_ = {};
+    LOG_INFO("Session {} lane {} attached on connection {}", sessionId_.load(), lane, conn);
+}
+
+void MultiplexManager::removeLane(HSteamNetConnection conn)
+{
+    int lane = -1;
+    {
+        std::lock_guard<std::mutex> lock(sessionMutex_);
+        for (int i = 1; i < kMaxLanes; ++i)
+        {
+            if (lanes_[i].conn == conn)
+            {
+                lanes_[i] = Lane{};
+                --laneCount_;
+                lane = i;
+                break;
+            }
+        }
+    }
+    if (lane < 0)
+    {
+        return;
+    }
+    // What was in flight on the lane is gone: its streams, and every striped
+    // stream, can't continue
+    std::vector<StreamId> lost;
+    {
+        std::lock_guard<std::mutex> lock(mapMutex_);
+        for (auto &pair : streams_)
+        {
+            if (pair.second->lane == lane || pair.second->striped)
+            {
+                lost.push_back(pair.first);
+            }
+        }
+    }
+    LOG_WARN("Lane {} on connection {} dropped, closing {} streams", lane, conn, lost.size());
+    for (StreamId id : lost)
+    {
+        sendTunnelPacket(id, nullptr, 0, kTypeClose);
+        removeClient(id);
+    }
+}
+
+size_t MultiplexManager::laneCount()
+{
+    std::lock_guard<std::mutex> lock(sessionMutex_);
+    return static_cast<size_t>(laneCount_);
+}
+
+void MultiplexManager::setStriping(bool stripe)
+{
+    std::lock_guard<std::mutex> lock(sessionMutex_);
+    striping_ = stripe;
+}
+
+bool MultiplexManager::parseLaneJoin(const char *data, size_t len, uint64_t &sessionId, int &lane)
+{
+    uint32_t type;
+    uint32_t laneIndex;
+    if (isCompactFrame(data, len) || len < kFrameHeaderSize + sizeof(uint64_t) + sizeof(uint32_t))
+    {
+        return false;
+    }
+    std::memcpy(&type, data + kStreamIdWireSize, sizeof(type));
+    if (type != kTypeLaneJoin)
+    {
+        return false;
+    }
+    std::memcpy(&sessionId, data + kFrameHeaderSize, sizeof(sessionId));
+    std::memcpy(&laneIndex, data + kFrameHeaderSize + sizeof(sessionId), sizeof(laneIndex));
+    if (sessionId == 0 || laneIndex == 0 || laneIndex >= static_cast<uint32_t>(kMaxLanes))
+    {
+        return false;
+    }
+    lane = static_cast<int>(laneIndex);
+    return true;
+}
+
+void MultiplexManager::writeRelayHeader(char *out, uint64_t peer, uint32_t route)
+{
+    streamIdToWire(0, out);
+    std::memcpy(out + kStreamIdWireSize, &kTypeRelay, sizeof(kTypeRelay));
+    std::memcpy(out + kFrameHeaderSize, &peer, sizeof(peer));
+    std::memcpy(out + kFrameHeaderSize + sizeof(peer), &route, sizeof(route));
+}
+
+bool MultiplexManager::parseRelay(const char *data, size_t len, uint64_t &peer, uint32_t &route, const char *&inner,
+                                  size_t &innerLen)
+{
+    uint32_t type;
+    if (isCompactFrame(data, len) || len < kRelayHeaderSize + kCompactHeaderSize)
+    {
+        return false;
+    }
+    std::memcpy(&type, data + kStreamIdWireSize, sizeof(type));
+    if (type != kTypeRelay)
+    {
+        return false;
+    }
+    std::memcpy(&peer, data + kFrameHeaderSize, sizeof(peer));
+    std::memcpy(&route, data + kFrameHeaderSize + sizeof(peer), sizeof(route));
+    inner = data + kRelayHeaderSize;
+    innerLen = len - kRelayHeaderSize;
+    return true;
+}
+
+// Frames of a striped stream arrive over several lanes in any order; each is
+// handled once every frame before it has been
+void MultiplexManager::handleStripedFrame(StreamId id, const char *payload, size_t len, int lane)
+{
+    uint32_t seq;
+    uint32_t innerType;
+    if (len < kStripeHeaderSize)
+    {
+        LOG_WARN("Invalid striped packet size");
+        return;
+    }
+    std::memcpy(&seq, payload, sizeof(seq));
+    std::memcpy(&innerType, payload + sizeof(seq), sizeof(innerType));
+    payload += kStripeHeaderSize;
+    len -= kStripeHeaderSize;
+    bool overflow = false;
+    {
+        std::lock_guard<std::mutex> lock(stripeMutex_);
+        if (stripeClosed_.count(id))
+        {
+            return;
+        }
+        StripeReceiver &receiver = stripeReceivers_[id];
+        if (static_cast<int32_t>(seq - receiver.next) < 0)
+        {
+            return; // Duplicate
+        }
+        if (seq != receiver.next && receiver.pending.size() < kMaxStripeBacklog)
+        {
+            // The inner type rides along in front of the payload
+            std::vector<char> frame(sizeof(innerType) + len);
+            std::memcpy(frame.data(), &innerType, sizeof(innerType));
+            std::memcpy(frame.data() + sizeof(innerType), payload, len);
+            receiver.pending.emplace(seq, std::move(frame));
+            return;
+        }
+        overflow = seq != receiver.next;
+        if (!overflow)
+        {
+            ++receiver.next;
+        }
+    }
+    if (overflow)
+    {
+        LOG_WARN("Striped stream {} is missing frames, closing it", StreamIdText(id).c_str());
+        sendTunnelPacket(id, nullptr, 0, kTypeClose);
+        removeClient(id);
+        forgetStripe(id);
+        return;
+    }
+    handleStreamFrame(id, innerType, payload, len, lane, true);
+    for (;;)
+    {
+        std::vector<char> frame;
+        {
+            std::lock_guard<std::mutex> lock(stripeMutex_);
+            auto receiver = stripeReceivers_.find(id);
+            if (receiver == stripeReceivers_.end())
+            {
+                return;
+            }
+            auto next = receiver->second.pending.find(receiver->second.next);
+            if (next == receiver->second.pending.end())
+            {
+                return;
+            }
+            frame = std::move(next->second);
+            receiver->second.pending.erase(next);
+            ++receiver->second.next;
+        }
+        std::memcpy(&innerType, frame.data(), sizeof(innerType));
+        handleStreamFrame(id, innerType, frame.data() + sizeof(innerType), frame.size() - sizeof(innerType), lane, true);
+    }
+}
+
+void MultiplexManager::forgetStripe(StreamId id)
+{
+    std::lock_guard<std::mutex> lock(stripeMutex_);
+    stripeReceivers_.erase(id);
+    if (stripeClosed_.size() >= kMaxRejectedStreams)
+    {
+        stripeClosed_.clear();
+    }
+    stripeClosed_.insert(id);
+}
+
+// The host's end of a stream the client opened; replies use the lane (or
+// striping) the client chose
+std::shared_ptr<MultiplexManager::Stream> MultiplexManager::openLocalStream(StreamId id, int port, int lane, bool striped,
+                                                                           bool opened)
+{
+    if (port == localPort_)
+    {
+        EndpointAcceptor acceptor;
+        {
+            std::lock_guard<std::mutex> lock(mapMutex_);
+            acceptor = endpointAcceptor_;
+        }
+        if (auto endpoint = acceptor ? acceptor(*this, id) : nullptr)
+        {
+            // A local game server attached without TCP takes the stream
+            LOG_INFO("Handed stream {} to a local endpoint", StreamIdText(id).c_str());
+            return registerStream(id, nullptr, std::move(endpoint), lane, striped, opened);
+        }
+    }
+    if (port <= 0)
+    {
+        return nullptr;
+    }
+    std::shared_ptr<BackendPool> pool;
+    {
+        std::lock_guard<std::mutex> lock(mapMutex_);
+        auto it = backendPools_.find(port);
+        if (it != backendPools_.end())
+        {
+            pool = it->second;
+        }
+    }
+    // Registered while the connect is under way, with the write chain marked
+    // busy: data arriving meanwhile queues up instead of holding up the
+    // tunnel receive path
+    auto socket = std::make_shared<tcp::socket>(io_context_);
+    auto stream = registerStream(id, socket, nullptr, lane, striped, opened);
+    {
+        std::lock_guard<std::mutex> lock(stream->writeMutex);
+        stream->writing = true;
+    }
+    if (pool)
+    {
+        pool->connect(socket, remotePeer_, [this, stream, port](bool ok, BackendPool::Lease lease) {
+            if (ok)
+            {
+                LOG_INFO("Stream {} goes to backend {} of port {}", StreamIdText(stream->id).c_str(), lease.backend(),
+                         port);
+            }
+            else
+            {
+                LOG_ERROR("No backend for port {} could take stream {}", port, StreamIdText(stream->id).c_str());
+            }
+            onLocalConnected(stream, ok, std::move(lease));
+        });
+        return stream;
+    }
+    // 如果是主持且没有对应的 TCP Client，创建一个连接到本地端口
+    LOG_INFO("Creating new TCP client for id {} connecting to localhost:{}", StreamIdText(id).c_str(), port);
+    // Same deadline as a pool backend: a stuck listen backlog would
+    // otherwise hold the stream for the OS's SYN timeout
+    auto deadline = std::make_shared<boost::asio::steady_timer>(socket->get_executor(), BackendPool::kConnectTimeout);
+    deadline->async_wait([socket](const boost::system::error_code &ec) {
+        if (!ec)
+        {
+            boost::system::error_code ignored;
+            socket->close(ignored);
+        }
+    });
+    tcp::endpoint endpoint(boost::asio::ip::address_v4::loopback(), static_cast<unsigned short>(port));
+    socket->async_connect(endpoint, [this, stream, deadline](const boost::system::error_code &ec) {
+        bool timedOut = deadline->expiry() <= std::chrono::steady_clock::now();
+        deadline->cancel();
+        if (ec)
+        {
+            LOG_ERROR("Failed to create TCP client for id {}: {}", StreamIdText(stream->id).c_str(),
+                      timedOut ? "connect timed out" : ec.message());
+            boost::system::error_code ignored;
+            stream->socket->close(ignored);
+        }
+        else
+        {
+            LOG_INFO("Successfully created TCP client for id {}", StreamIdText(stream->id).c_str());
+        }
+        onLocalConnected(stream, !ec, BackendPool::Lease());
+    });
+    return stream;
+}
+
+// On the socket's executor, once the connect for a stream the client opened
+// is done
+void MultiplexManager::onLocalConnected(const std::shared_ptr<Stream> &stream, bool ok, BackendPool::Lease lease)
+{
+    if (!ok)
+    {
+        {
+            std::lock_guard<std::mutex> lock(stream->writeMutex);
+            stream->writing = false;
+        }
+        {
+            // Even without an open frame: data still in flight must not
+            // try the connect again or land on the default port
+            std::lock_guard<std::mutex> lock(mapMutex_);
+            rejectStream(stream->id);
+        }
+        if (unregisterStream(stream))
+        {
+            // Tell the client instead of letting its data go nowhere
+            sendTunnelPacket(stream->id, nullptr, 0, kTypeClose);
+            closeStream(stream);
+        }
+        return;
+    }
+    stream->backend = std::move(lease);
+    startAsyncRead(stream);
+    // Flushes what queued up during the connect, or closes the socket if
+    // the stream was closed meanwhile
+    if (uring_)
+    {
+        writeNextUring(stream);
+    }
+    else
+    {
+        writeNext(stream);
+    }
+}
+
+std::shared_ptr<MultiplexManager::Stream> MultiplexManager::findStream(StreamId id)
+{
+    std::lock_guard<std::mutex> lock(mapMutex_);
+    auto it = streams_.find(id);
+    return it != streams_.end() ? it->second : nullptr;
+}
+
+std::shared_ptr<MultiplexManager::Stream> MultiplexManager::registerStream(StreamId id, std::shared_ptr<tcp::socket> socket,
+                                                                          std::shared_ptr<StreamEndpoint> endpoint, int lane,
+                                                                          bool striped, bool opened)
+{
+    auto stream = std::make_shared<Stream>();
+    stream->id = id;
+    stream->opened = opened;
+    stream->socket = std::move(socket);
+    stream->endpoint = std::move(endpoint);
+    stream->lane = lane;
+    stream->striped = striped;
+    if (!striped)
+    {
+        std::lock_guard<std::mutex> lock(sessionMutex_);
+        ++lanes_[lane].streams;
+    }
+    std::lock_guard<std::mutex> lock(mapMutex_);
+    streams_[id] = stream;
+    return stream;
+}
+
+bool MultiplexManager::unregisterStream(const std::shared_ptr<Stream> &stream)
+{
+    {
+        std::lock_guard<std::mutex> lock(mapMutex_);
+        auto it = streams_.find(stream->id);
+        if (it == streams_.end() || it->second != stream)
+        {
+            return false;
+        }
+        streams_.erase(it);
+        if (stream->opened)
+        {
+            // Data still in flight must not reopen it on the default port
+            rejectStream(stream->id);
+        }
+    }
+    if (stream->striped)
+    {
+        forgetStripe(stream->id);
+    }
+    else
+    {
+        std::lock_guard<std::mutex> lock(sessionMutex_);
+        Lane &lane = lanes_[stream->lane];
+        lane.streams = std::max(lane.streams - 1, 0); // The lane may have been replaced since
+    }
+    return true;
+}
+
+// Called with mapMutex_ held
+void MultiplexManager::rejectStream(StreamId id)
+{
+    if (rejected_.size() >= kMaxRejectedStreams)
+    {
+        rejected_.clear();
+    }
+    rejected_.insert(id);
+}
+
+// Called with mapMutex_ held
+StreamId MultiplexManager::generateStreamId()
+{
+    for (;;)
+    {
+        // splitmix64
+        uint64_t z = (idState_ += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        z ^= z >> 31;
+        StreamId id = 0;
+        for (int i = 0; i < 6; ++i)
+        {
+            id |= static_cast<StreamId>(static_cast<unsigned char>(kIdAlphabet[(z >> (6 * i)) & 63])) << (8 * i);
+        }
+        if (streams_.find(id) == streams_.end())
+        {
+            return id;
+        }
+    }
+}
+
+// The only reader of a stream's socket: forwards into the tunnel until the
+// socket fails or the stream is closed
+void MultiplexManager::startAsyncRead(std::shared_ptr<Stream> stream)
+{
+    if (uring_)
+    {
+        // Multishot: armed once, completions keep coming until the stream ends
+        stream->owner = this;
+        stream->fd = stream->socket->native_handle();
+        {
+            std::lock_guard<std::mutex> lock(stream->writeMutex);
+            stream->holdUring(stream);
+        }
+        uring_->startReceive(stream->fd, stream.get());
+        return;
+    }
+    if (stream->readHolds > 0 || budgetStopsReading())
+    {
+        // A slow local reader holds us back (releaseReading restarts the
+        // loop), or we're over the memory budget (resumeReading does).
+        // Both are checked again under the lock: releaseReading may have
+        // dropped the last hold in between, and a loop parked as a budget
+        // stall with nothing over budget would wait for a sweep that never
+        // comes
+        std::lock_guard<std::mutex> lock(stream->writeMutex);
+        bool held = stream->readHolds > 0;
+        bool overBudget = !held && budgetStopsReading();
+        if (!stream->closed && (held || overBudget))
+        {
+            stream->readParked = true;
+            if (overBudget)
+            {
+                budget_.stalled();
+            }
+            return;
+        }
+    }
+    Stream &s = *stream;
+    s.socket->async_read_some(boost::asio::buffer(s.readBuffer), trackHandler("MultiplexManager::read",
+    makeCustomAllocHandler(s.readMemory, [this, stream = std::move(stream)](const boost::system::error_code &ec, std::size_t bytes_transferred) mutable
+    {
+        if (!ec && !stream->closed)
+        {
+            TRACE_EVENT("tcp.read", StreamIdText(stream->id).c_str(), bytes_transferred);
+            if (bytes_transferred > 0)
+            {
+                stream->lastActivity.store(nowTicks(), std::memory_order_relaxed);
+                sendStreamPacket(*stream, stream->readBuffer.data(), bytes_transferred, kTypeData);
+                if (stream->onData)
+                {
+                    stream->onData(stream->readBuffer.data(), bytes_transferred);
+                }
+            }
+            startAsyncRead(std::move(stream));
+            return;
+        }
+        onReadEnded(stream, ec.message().c_str());
+    })));
+}
+
+void MultiplexManager::onReadEnded(const std::shared_ptr<Stream> &stream, const char *reason)
+{
+    if (unregisterStream(stream))
+    {
+        // Closed on our side: tell the peer
+        LOG_INFO("Error reading from TCP client {}: {}", StreamIdText(stream->id).c_str(), reason);
+        sendStreamPacket(*stream, nullptr, 0, kTypeClose);
+        closeStream(stream);
+    }
+    if (stream->onClosed)
+    {
+        stream->onClosed();
+    }
+}
+
+MultiplexManager::QueueResult MultiplexManager::queueWrite(const std::shared_ptr<Stream> &stream, const char *data,
+                                                           size_t len, const SharedChunk &shared, size_t maxQueued,
+                                                           bool queueWhenFull)
+{
+    stream->lastActivity.store(nowTicks(), std::memory_order_relaxed);
+    if (stream->endpoint)
+    {
+        // The endpoint does its own queueing
+        if (!stream->closed)
+        {
+            TRACE_EVENT("endpoint.write", StreamIdText(stream->id).c_str(), len);
+            stream->endpoint->write(data, len);
+        }
+        return QueueResult::Queued;
+    }
+    bool startChain = false;
+    QueueResult result = QueueResult::Queued;
+    {
+        std::lock_guard<std::mutex> lock(stream->writeMutex);
+        if (stream->closed)
+        {
+            return QueueResult::Queued;
+        }
+        if (stream->queuedBytes > maxQueued)
+        {
+            result = QueueResult::Full;
+            if (!queueWhenFull)
+            {
+                return result;
+            }
+        }
+        WriteBuffer *buffer = stream->freeList;
+        if (buffer)
+        {
+            stream->freeList = buffer->next;
+        }
+        else
+        {
+            // The pool only grows when the queue gets deeper than ever before
+            stream->buffers.push_back(std::make_unique<WriteBuffer>());
+            buffer = stream->buffers.back().get();
+            buffer->data.reserve(kReadBufferSize); // A peer's read size, the usual payload bound
+            stream->poolBytes += sizeof(WriteBuffer) + kReadBufferSize;
+            budget_.charge(MemoryBudget::Category::Streams, sizeof(WriteBuffer) + kReadBufferSize);
+        }
+        if (shared)
+        {
+            buffer->shared = shared;
+        }
+        else
+        {
+            size_t capacity = buffer->data.capacity();
+            buffer->data.assign(data, data + len);
+            if (buffer->data.capacity() != capacity)
+            {
+                stream->poolBytes += buffer->data.capacity() - capacity;
+                budget_.charge(MemoryBudget::Category::Streams, buffer->data.capacity() - capacity);
+            }
+        }
+        buffer->next = nullptr;
+        stream->queuedBytes += len;
+        budget_.charge(MemoryBudget::Category::WriteQueues, len);
+        if (stream->queueTail)
+        {
+            stream->queueTail->next = buffer;
+        }
+        else
+        {
+            stream->queueHead = buffer;
+        }
+        stream->queueTail = buffer;
+        startChain = !stream->writing;
+        stream->writing = true;
+    }
+    if (startChain && uring_)
+    {
+        writeNextUring(stream);
+    }
+    else if (startChain)
+    {
+        // Socket operations stay on the socket's own executor
+        boost::asio::post(stream->socket->get_executor(),
+                          makeCustomAllocHandler(stream->postMemory, [this, stream]() { writeNext(stream); }));
+    }
+    return result;
+}
+
+// Runs on the socket's executor; one async_write in flight per stream
+void MultiplexManager::writeNext(std::shared_ptr<Stream> stream)
+{
+    WriteBuffer *buffer;
+    {
+        std::lock_guard<std::mutex> lock(stream->writeMutex);
+        buffer = stream->queueHead;
+        if (!buffer)
+        {
+            stream->writing = false;
+            if (stream->closed)
+            {
+                boost::system::error_code ec;
+                stream->socket->close(ec);
+            }
+            return;
+        }
+    }
+    Stream &s = *stream;
+    boost::asio::async_write(*s.socket, boost::asio::buffer(buffer->bytes(), buffer->size()), trackHandler("MultiplexManager::write",
+    makeCustomAllocHandler(s.writeMemory, [this, stream = std::move(stream), buffer](const boost::system::error_code &ec, [[maybe_unused]] std::size_t bytes_written) mutable
+    {
+        TRACE_EVENT("tcp.write", StreamIdText(stream->id).c_str(), bytes_written);
+        std::vector<std::function<void()>> drained;
+        {
+            std::lock_guard<std::mutex> lock(stream->writeMutex);
+            stream->queueHead = buffer->next;
+            if (!stream->queueHead)
+            {
+                stream->queueTail = nullptr;
+            }
+            stream->queuedBytes -= buffer->size();
+            budget_.release(MemoryBudget::Category::WriteQueues, buffer->size());
+            buffer->shared.reset();
+            buffer->next = stream->freeList;
+            stream->freeList = buffer;
+            if (!stream->drainWaiters.empty())
+            {
+                // A broken socket won't drain any further
+                takeDrainWaiters(*stream, drained, static_cast<bool>(ec));
+            }
+            if (ec)
+            {
+                // The read side notices the broken socket and cleans up
+                stream->writing = false;
+            }
+        }
+        for (auto &callback : drained)
+        {
+            callback();
+        }
+        if (!ec)
+        {
+            writeNext(std::move(stream));
+        }
+    })));
+}
+
+void MultiplexManager::closeStream(const std::shared_ptr<Stream> &stream)
+{
+    if (stream->endpoint)
+    {
+        if (!stream->closed.exchange(true))
+        {
+            stream->endpoint->close();
+        }
+        return;
+    }
+    bool closeNow;
+    bool unpark;
+    std::vector<std::function<void()>> drained;
+    {
+        std::lock_guard<std::mutex> lock(stream->writeMutex);
+        stream->closed = true;
+        closeNow = !stream->writing;
+        // Whoever waits for this stream to drain stops waiting; a parked read
+        // loop runs once more to see the socket close
+        takeDrainWaiters(*stream, drained, true);
+        unpark = stream->readParked;
+        stream->readParked = false;
+        if (closeNow && uring_)
+        {
+            // Ends the multishot receive; the socket closes once the engine lets go of it
+            stream->shutdownUring();
+        }
+    }
+    for (auto &callback : drained)
+    {
+        callback();
+    }
+    if (unpark)
+    {
+        boost::asio::post(stream->socket->get_executor(), [this, stream]() { startAsyncRead(stream); });
+    }
+    if (uring_)
+    {
+        return;
+    }
+    // Otherwise writeNext closes the socket once queued data is flushed
+    if (closeNow)
+    {
+        boost::asio::post(stream->socket->get_executor(), [stream]()
+        {
+            boost::system::error_code ec;
+            stream->socket->close(ec);
+        });
+    }
+}
+
+// io_uring write chain: one send in flight per stream, submitted from
+// whichever thread queued the data or reaped the previous send
+void MultiplexManager::writeNextUring(const std::shared_ptr<Stream> &stream)
+{
+    size_t count = 0;
+    {
+        std::lock_guard<std::mutex> lock(stream->writeMutex);
+        WriteBuffer *buffer = stream->queueHead;
+        if (!buffer)
+        {
+            stream->writing = false;
+            if (stream->closed)
+            {
+                stream->shutdownUring();
+            }
+            return;
+        }
+        // Everything queued so far goes out in one send
+        size_t offset = stream->writeOffset;
+        for (; buffer && count < stream->sendIov.size(); buffer = buffer->next)
+        {
+            stream->sendIov[count++] = {buffer->bytes() + offset, buffer->size() - offset};
+            offset = 0;
+        }
+        stream->holdUring(stream);
+    }
+    uring_->send(stream->fd, stream->sendIov.data(), count, stream.get());
+}
+
+void MultiplexManager::Stream::holdUring(const std::shared_ptr<Stream> &self)
+{
+    if (uringOps++ == 0)
+    {
+        uringSelf = self;
+    }
+}
+
+void MultiplexManager::Stream::releaseUring()
+{
+    std::shared_ptr<Stream> last;
+    {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        if (--uringOps == 0)
+        {
+            last = std::move(uringSelf);
+            if (closed)
+            {
+                // Nothing in the ring refers to the descriptor any more, so it can't be reused under us
+                boost::system::error_code ec;
+                socket->close(ec);
+            }
+        }
+    }
+    // `last` may be the final reference: nothing touches *this after here
+}
+
+void MultiplexManager::Stream::shutdownUring()
+{
+    boost::system::error_code ec;
+    socket->shutdown(tcp::socket::shutdown_both, ec);
+}
+
+void MultiplexManager::Stream::onUringData(const char *data, size_t len)
+{
+    MultiplexManager *manager = owner;
+    if (!manager || closed)
+    {
+        return;
+    }
+    TRACE_EVENT("tcp.read", StreamIdText(id).c_str(), len);
+    lastActivity.store(nowTicks(), std::memory_order_relaxed);
+    manager->sendStreamPacket(*this, data, len, kTypeData);
+    if (onData)
+    {
+        onData(data, len);
+    }
+}
+
+void MultiplexManager::Stream::onUringReceiveEnd(int result)
+{
+    MultiplexManager *manager = owner;
+    if (manager)
+    {
+        std::shared_ptr<Stream> self;
+        {
+            std::lock_guard<std::mutex> lock(writeMutex);
+            self = uringSelf;
+        }
+        manager->onReadEnded(self, result == 0 ? "End of file" : std::strerror(-result));
+    }
+    releaseUring();
+}
+
+void MultiplexManager::Stream::onUringSent(int result)
+{
+    MultiplexManager *manager = owner;
+    std::shared_ptr<Stream> self;
+    bool more = false;
+    std::vector<std::function<void()>> drained;
+    {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        if (result < 0 || !manager || !queueHead)
+        {
+            // The receive side notices the broken socket and cleans up
+            writing = false;
+            takeDrainWaiters(*this, drained, true);
+            if (closed)
+            {
+                shutdownUring();
+            }
+        }
+        else
+        {
+            TRACE_EVENT("tcp.write", StreamIdText(id).c_str(), result);
+            // Retire fully sent buffers; a short send resumes mid-buffer
+            size_t sent = static_cast<size_t>(result);
+            queuedBytes -= sent;
+            manager->budget_.release(MemoryBudget::Category::WriteQueues, sent);
+            while (queueHead && sent >= queueHead->size() - writeOffset)
+            {
+                sent -= queueHead->size() - writeOffset;
+                writeOffset = 0;
+                WriteBuffer *buffer = queueHead;
+                queueHead = buffer->next;
+                if (!queueHead)
+                {
+                    queueTail = nullptr;
+                }
+                buffer->shared.reset();
+                buffer->next = freeList;
+                freeList = buffer;
+            }
+            writeOffset += sent;
+            if (!drainWaiters.empty())
+            {
+                takeDrainWaiters(*this, drained, false);
+            }
+            self = uringSelf;
+            more = true;
+        }
+    }
+    for (auto &callback : drained)
+    {
+        callback();
+    }
+    if (more)
+    {
+        manager->writeNextUring(self);
+    }
+    releaseUring();
+}
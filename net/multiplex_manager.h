@@ -1,6 +1,13 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
 #include <unordered_map>
+#include <unordered_set>
 #include <memory>
 #include <mutex>
 #include <vector>
@@ -9,32 +16,330 @@
 #include <steam_api.h>
 #include <isteamnetworkingsockets.h>
 #include <steamnetworkingtypes.h>
+#include "backend_pool.h"
+#include "handler_allocator.h"
+#include "memory_budget.h"
+#include "replay_buffer.h"
+#include "tunnel_frame.h"
+#include "tunnel_transport.h"
+#include "uring_engine.h"
 
 using boost::asio::ip::tcp;
 
+// Bytes written to several local streams at once (TCPServer's local
+// broadcast): each stream queues a reference, the last write frees them
+using SharedChunk = std::shared_ptr<const std::vector<char>>;
+
+// A local stream that isn't a TCP socket, e.g. a shared-memory ring
+// (ShmServer). The manager hands it whatever arrives from the tunnel; its
+// owner feeds the other direction in with MultiplexManager::sendFromEndpoint.
+class StreamEndpoint {
+public:
+    virtual ~StreamEndpoint() = default;
+    // Tunnel data for the local side, from any thread; copy it, don't block
+    virtual void write(const char* data, size_t len) = 0;
+    // The stream ended from the tunnel side (peer disconnect, removeClient,
+    // manager teardown). Called at most once, never with manager locks held.
+    virtual void close() = 0;
+};
+
 class MultiplexManager {
 public:
-    MultiplexManager(ISteamNetworkingSockets* steamInterface, HSteamNetConnection steamConn, 
+    using DataCallback = std::function<void(const char* data, size_t len)>;
+    // Host: supplies the local end of a stream the peer opened, or nullptr to
+    // fall back to a TCP connection to localPort
+    using EndpointAcceptor = std::function<std::shared_ptr<StreamEndpoint>(MultiplexManager& manager, StreamId id)>;
+
+    MultiplexManager(TunnelTransport* transport, HSteamNetConnection steamConn,
                      boost::asio::io_context& io_context, bool& isHost, int& localPort);
     ~MultiplexManager();
 
-    std::string addClient(std::shared_ptr<tcp::socket> socket);
-    void removeClient(const std::string& id);
-    std::shared_ptr<tcp::socket> getClient(const std::string& id);
+    // Registers a local socket and starts forwarding what it sends. onData
+    // sees every chunk after it went into the tunnel; onClosed runs once when
+    // the stream's read loop ends. remotePort picks the host-side
+    // destination; 0 leaves it to the host's default localPort.
+    StreamId addClient(std::shared_ptr<tcp::socket> socket, DataCallback onData = nullptr,
+                       std::function<void()> onClosed = nullptr, int remotePort = 0);
+    void removeClient(StreamId id);
+    std::shared_ptr<tcp::socket> getClient(StreamId id);
+    // Queues a copy of data for a local stream; callable from any thread
+    bool writeToClient(StreamId id, const char* data, size_t len);
+    enum class QueueResult { Queued, Full, NoStream };
+    // Queues chunk by reference. Full: more than maxQueued bytes were
+    // already waiting on the stream, and the chunk was only queued if
+    // queueWhenFull is set.
+    QueueResult writeToClient(StreamId id, const SharedChunk& chunk, size_t maxQueued, bool queueWhenFull = false);
+    // Flow control between local streams. While a stream has holds its
+    // socket isn't read; false if it can't be paused (endpoint streams, the
+    // io_uring backend's multishot receive).
+    bool holdReading(StreamId id);
+    void releaseReading(StreamId id);
+    // onDrained runs once the stream has lowMark bytes or fewer waiting, or
+    // when it closes; right away if that's already so. false if there's no
+    // such stream.
+    bool notifyDrained(StreamId id, size_t lowMark, std::function<void()> onDrained);
+    // Registered stream count, for leak checks
+    size_t getClientCount();
+
+    // Housekeeping over every manager in the process, about once a second:
+    // closes streams idle past MemoryBudget's idle timeout and, over the
+    // budget with ShedIdle, the ones idle longest until usage fits. Returns
+    // how many streams it closed.
+    static size_t sweep(const std::vector<std::shared_ptr<MultiplexManager>>& managers);
+    // Restarts local reads stopped while over the budget (Backpressure)
+    void resumeReading();
+
+    // Local streams that aren't sockets. sendFromEndpoint tunnels data from
+    // the local side; closeFromEndpoint ends the stream from the local side
+    // (the endpoint's close() is not called back).
+    StreamId addEndpoint(std::shared_ptr<StreamEndpoint> endpoint);
+    void sendFromEndpoint(StreamId id, const char* data, size_t len);
+    void closeFromEndpoint(StreamId id);
+    void setEndpointAcceptor(EndpointAcceptor acceptor);
+    // Host: destination ports clients may ask for besides localPort
+    void setAllowedPorts(std::vector<int> ports);
+    // Host: streams to these ports connect to a pool of local servers
+    // instead of 127.0.0.1:port (endpoint acceptors still go first)
+    void setBackendPools(std::map<int, std::shared_ptr<BackendPool>> pools);
+    // Host: the client's Steam ID, which BackendPool::Policy::PeerHash keys on
+    void setRemotePeer(uint64_t steamId) { remotePeer_ = steamId; }
 
-    void sendTunnelPacket(const std::string& id, const char* data, size_t len, int type);
+    // lane: which bonded connection carries the frame (0 = the session's own)
+    void sendTunnelPacket(StreamId id, const char* data, size_t len, int type, int lane = 0);
 
-    void handleTunnelPacket(const char* data, size_t len);
+    void handleTunnelPacket(const char* data, size_t len, int lane = 0);
+
+    // Session resumption. A client opens a session with a hello ahead of its
+    // first frame; from then on both sides keep what they sent until the
+    // peer acknowledges it, so the session can move to a new Steam
+    // connection and pick up where the old one stopped.
+    uint64_t sessionId() const { return sessionId_; }
+    // The connection dropped: frames are kept (not sent) until resume/attach.
+    // Returns false if the session can't be resumed (no session, or the
+    // replay buffer overflowed); the caller should drop the manager then.
+    bool detach();
+    // Client: continue the session on a new connection to the host
+    void resume(HSteamNetConnection conn);
+    // Host: a client's hello for this session arrived on conn
+    void attach(HSteamNetConnection conn);
+    // Session ID of a hello frame, for routing it to its manager
+    static bool parseHello(const char* data, size_t len, uint64_t& sessionId);
+    // Client: the host acknowledged the session (lanes need that); openSession
+    // sends the hello now instead of ahead of the first stream
+    bool sessionEstablished();
+    void openSession();
+    // What the peer's hello (host) or welcome (client) said it supports;
+    // version 1 until then or if it's older. Frames use the compact header
+    // once both sides have kFeatureCompactHeader.
+    Capabilities peerCapabilities();
+    // What we advertise, Capabilities::local() by default; version 1 sends
+    // the hello and welcome without capabilities, like older builds
+    void setLocalCapabilities(const Capabilities& caps);
+
+    // Bonding: more connections to the same peer ("lanes", the session's own
+    // connection being lane 0). New streams are spread over the lanes by
+    // each lane's send rate; with striping each frame of a stream is, and
+    // the receiver puts them back in order. Frames on lanes other than 0
+    // aren't replayed: losing a lane closes the streams that used it.
+    static constexpr int kMaxLanes = 4;
+    // Client: adds a connection opened for this session and sends the lane
+    // join on it. Returns the lane, or -1 if all are taken or there's no session.
+    int addLane(HSteamNetConnection conn);
+    // Host: a lane join for this session arrived on conn
+    void attachLane(int lane, HSteamNetConnection conn);
+    // The lane's connection dropped
+    void removeLane(HSteamNetConnection conn);
+    size_t laneCount();
+    // Client: stripe the streams opened from now on
+    void setStriping(bool stripe);
+    // Session ID and lane of a lane join frame
+    static bool parseLaneJoin(const char* data, size_t len, uint64_t& sessionId, int& lane);
+
+    // Relay frames carry another connection's frame through the host, for
+    // mesh peers without a direct route. peer is the destination Steam ID on
+    // the way to the host and the source on the way out; route tells the
+    // receiver which of its two managers for that peer the inner frame is
+    // for (see RelayTransport).
+    static constexpr size_t kRelayHeaderSize = kStreamIdWireSize + sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint32_t);
+    static void writeRelayHeader(char* out, uint64_t peer, uint32_t route);
+    // inner points into data
+    static bool parseRelay(const char* data, size_t len, uint64_t& peer, uint32_t& route, const char*& inner,
+                           size_t& innerLen);
 
 private:
-    ISteamNetworkingSockets* steamInterface_;
-    HSteamNetConnection steamConn_;
-    std::unordered_map<std::string, std::shared_ptr<tcp::socket>> clientMap_;
+    static constexpr size_t kReadBufferSize = 1024;
+    static constexpr size_t kReplayCapacity = 4 * 1024 * 1024; // Unacknowledged bytes a session may hold
+    static constexpr uint64_t kAckInterval = 64; // Frames received between acknowledgements
+    static constexpr size_t kMaxStripeBacklog = 4096; // Out-of-order frames held per striped stream
+
+    enum class SessionState {
+        Active,   // Frames go out as they're sent
+        Detached, // No connection: frames are only kept
+        Resuming, // Client: hello sent on the new connection, waiting for the host's welcome
+    };
+
+    // Pending local write; linked into its stream's write queue or free list
+    struct WriteBuffer {
+        WriteBuffer* next = nullptr;
+        std::vector<char> data;
+        SharedChunk shared; // Written instead of data when set
+        const char* bytes() const { return shared ? shared->data() : data.data(); }
+        size_t size() const { return shared ? shared->size() : data.size(); }
+    };
+
+    // Everything a stream needs per packet, allocated once when it opens.
+    // Handlers hold it by shared_ptr so it outlives removal from the map.
+    // With the io_uring backend the stream is also the engine's completion
+    // target and keeps itself alive while the engine holds it. Charged to
+    // MemoryBudget from construction to destruction.
+    struct Stream : UringSocket {
+        Stream();
+        ~Stream() override;
+
+        StreamId id = 0;
+        std::shared_ptr<tcp::socket> socket; // nullptr for endpoint streams
+        std::shared_ptr<StreamEndpoint> endpoint;
+        BackendPool::Lease backend; // Host: the pool backend it's connected to
+        int lane = 0;           // Bonding: the lane this stream's frames use
+        bool striped = false;   // Frames go over every lane, sequenced
+        bool opened = false;    // Host: the client sent an open frame for it
+        uint32_t stripeSeq = 0; // Next sequence number to send, under sessionMutex_
+        DataCallback onData;
+        std::function<void()> onClosed;
+        std::array<char, kReadBufferSize> readBuffer;
+        HandlerMemory readMemory;
+        HandlerMemory writeMemory;
+        HandlerMemory postMemory;
+
+        std::mutex writeMutex;
+        std::vector<std::unique_ptr<WriteBuffer>> buffers; // Owns every WriteBuffer of this stream
+        size_t poolBytes = 0; // What buffers hold, under writeMutex
+        WriteBuffer* freeList = nullptr;
+        WriteBuffer* queueHead = nullptr;
+        WriteBuffer* queueTail = nullptr;
+        bool writing = false; // A write chain is scheduled or running on the socket's executor
+        size_t queuedBytes = 0; // Not yet written, under writeMutex
+        std::vector<std::pair<size_t, std::function<void()>>> drainWaiters; // (lowMark, callback), under writeMutex
+        std::atomic<int> readHolds{0}; // Changed under writeMutex
+        bool readParked = false; // The read loop stopped for the holds or the budget, under writeMutex
+        std::atomic<int64_t> lastActivity; // Steady clock ticks of the last data either way
+        std::atomic<bool> closed{false}; // No more writes accepted; socket closes once the queue drains
+
+        // io_uring backend
+        std::atomic<MultiplexManager*> owner{nullptr}; // Cleared when the manager goes away
+        int fd = -1;
+        size_t writeOffset = 0; // Bytes of queueHead already sent, under writeMutex
+        std::array<UringIoVec, 16> sendIov; // Queued buffers gathered into the send in flight
+        int uringOps = 0; // Engine operations in flight, under writeMutex; the socket closes at zero
+        std::shared_ptr<Stream> uringSelf;
+
+        void holdUring(const std::shared_ptr<Stream>& self); // writeMutex held
+        void releaseUring();
+        void shutdownUring();
+        int uringFd() const override { return fd; }
+        void onUringData(const char* data, size_t len) override;
+        void onUringReceiveEnd(int result) override;
+        void onUringSent(int result) override;
+    };
+
+    TunnelTransport* transport_;
+    std::atomic<HSteamNetConnection> steamConn_;
+    std::unordered_map<StreamId, std::shared_ptr<Stream>> streams_;
     std::mutex mapMutex_;
     boost::asio::io_context& io_context_;
     bool& isHost_;
     int& localPort_;
-    std::unordered_map<std::string, std::vector<char>> readBuffers_;
+    uint64_t idState_;
+    UringEngine* uring_; // nullptr: Asio reactor
+    EndpointAcceptor endpointAcceptor_; // Under mapMutex_
+    std::vector<int> allowedPorts_;     // Under mapMutex_
+    std::map<int, std::shared_ptr<BackendPool>> backendPools_; // By port, under mapMutex_
+    std::atomic<uint64_t> remotePeer_{0};
+    std::unordered_set<StreamId> rejected_; // Refused, failed or closed after an open frame, their data is dropped; under mapMutex_
+    MemoryBudget& budget_;
+
+    // Session; everything below is under sessionMutex_, which also orders
+    // sends so a replay can't interleave with new frames
+    std::mutex sessionMutex_;
+    std::atomic<uint64_t> sessionId_{0}; // 0: no session (a host before the hello, or an older client)
+    SessionState state_ = SessionState::Active;
+    bool recording_ = false;    // Sent frames go into replay_
+    bool peerSessions_ = false; // The peer acknowledges frames
+    bool helloSent_ = false;
+    ReplayBuffer replay_{kReplayCapacity};
+    bool replayLostLogged_ = false;
+    std::atomic<uint64_t> received_{0}; // Stream frames received this session; io thread writes
+    size_t replayCharged_ = 0; // The replay ring, once allocated
+    Capabilities localCaps_ = Capabilities::local();
+    Capabilities peerCaps_;
+    std::atomic<bool> compactFrames_{false};
+    std::atomic<uint32_t> peerMaxFrame_{kMaxFrameSize};
+
+    struct Lane {
+        HSteamNetConnection conn = k_HSteamNetConnection_Invalid; // Lane 0 uses steamConn_
+        int64_t weight = 1;
+        int64_t current = 0; // Smooth weighted round-robin state
+        int streams = 0;     // Unstriped streams pinned to it
+    };
+
+    // Striped streams being received: frames wait here until the ones
+    // before them arrived
+    struct StripeReceiver {
+        uint32_t next = 0;
+        std::map<uint32_t, std::vector<char>> pending;
+    };
+
+    // Under sessionMutex_
+    std::array<Lane, kMaxLanes> lanes_;
+    int laneCount_ = 1;
+    bool striping_ = false;
+    std::chrono::steady_clock::time_point weightsUpdated_;
+
+    std::mutex stripeMutex_;
+    std::unordered_map<StreamId, StripeReceiver> stripeReceivers_; // Under stripeMutex_
+    std::unordered_set<StreamId> stripeClosed_; // Late frames of these are dropped; under stripeMutex_
+
+    void sendFrame(const char* data, size_t len); // sessionMutex_ held
+    void transmit(HSteamNetConnection conn, const char* data, size_t len);
+    void sendOnLane(int lane, const char* data, size_t len); // sessionMutex_ held
+    void sendStreamPacket(Stream& stream, const char* data, size_t len, int type);
+    int pickLane(); // sessionMutex_ held
+    int pickStreamLane(); // sessionMutex_ held
+    bool laneUp(int lane) const; // sessionMutex_ held
+    void refreshLaneWeights(); // sessionMutex_ held
+    void updateLaneWeights(); // sessionMutex_ held
+    void handleStreamFrame(StreamId id, uint32_t type, const char* payload, size_t len, int lane, bool striped);
+    void handleStripedFrame(StreamId id, const char* payload, size_t len, int lane);
+    void forgetStripe(StreamId id);
+    void sendControl(int type, const void* payload, size_t len); // sessionMutex_ held
+    void sendHello(); // sessionMutex_ held
+    void sendHelloFrame(); // sessionMutex_ held
+    void applyPeerCapabilities(const char* data, size_t len); // sessionMutex_ held
+    void handleSessionPacket(uint32_t type, const char* payload, size_t len);
+    void resetSession();
 
-    void startAsyncRead(const std::string& id);
-};
\ No newline at end of file
+    std::shared_ptr<Stream> findStream(StreamId id);
+    std::shared_ptr<Stream> registerStream(StreamId id, std::shared_ptr<tcp::socket> socket,
+                                           std::shared_ptr<StreamEndpoint> endpoint = nullptr, int lane = 0,
+                                           bool striped = false, bool opened = false);
+    bool unregisterStream(const std::shared_ptr<Stream>& stream);
+    void rejectStream(StreamId id);
+    StreamId generateStreamId();
+    bool portAllowed(int port);
+    std::shared_ptr<Stream> openLocalStream(StreamId id, int port, int lane, bool striped, bool opened);
+    void onLocalConnected(const std::shared_ptr<Stream>& stream, bool ok, BackendPool::Lease lease);
+    void startAsyncRead(std::shared_ptr<Stream> stream);
+    void onReadEnded(const std::shared_ptr<Stream>& stream, const char* reason);
+    QueueResult queueWrite(const std::shared_ptr<Stream>& stream, const char* data, size_t len,
+                           const SharedChunk& shared = nullptr, size_t maxQueued = SIZE_MAX, bool queueWhenFull = true);
+    // Waiters whose mark the queue is down to (all of them with everything); writeMutex held
+    static void takeDrainWaiters(Stream& stream, std::vector<std::function<void()>>& out, bool everything = false);
+    void writeNext(std::shared_ptr<Stream> stream);
+    void writeNextUring(const std::shared_ptr<Stream>& stream);
+    void closeStream(const std::shared_ptr<Stream>& stream);
+    // Closes a stream on our side and tells the peer, as if its socket had
+    // ended
+    void reapStream(const std::shared_ptr<Stream>& stream);
+    bool budgetStopsReading() const;
+    static int64_t nowTicks() { return std::chrono::steady_clock::now().time_since_epoch().count(); }
+};
@@ -0,0 +1,257 @@
+#include "poll_thread.h"
+#include "logger.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#endif
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
+
+namespace {
+// Tells the core we're spinning: cheaper for a hyperthread sibling, and
+// faster out of the loop when the store we wait for lands
+inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+} // namespace
+
+PollThread::PollThread(std::string name, std::chrono::milliseconds exportWindow)
+    : name_(std::move(name)), exportWindow_(exportWindow) {}
+
+PollThread::~PollThread()
+{
+    stop();
+}
+
+void PollThread::start(const Options& options, PollFunction poll)
+{
+    if (running_.exchange(true))
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(snapshotMutex_);
+        options_ = options;
+    }
+    thread_ = std::thread([this, options, poll = std::move(poll)]() { run(options, poll); });
+}
+
+void PollThread::stop()
+{
+    running_ = false;
+    if (thread_.joinable())
+    {
+        thread_.join();
+    }
+}
+
+PollThread::Options PollThread::options() const
+{
+    std::lock_guard<std::mutex> lock(snapshotMutex_);
+    return options_;
+}
+
+PollThread::Snapshot PollThread::snapshot() const
+{
+    std::lock_guard<std::mutex> lock(snapshotMutex_);
+    return snapshot_;
+}
+
+const char* PollThread::strategyName(WaitStrategy wait)
+{
+    switch (wait)
+    {
+    case WaitStrategy::BusySpin: return "busy-spin";
+    case WaitStrategy::Hybrid: return "hybrid";
+    case WaitStrategy::Timed: return "timed";
+    }
+    return "?";
+}
+
+void PollThread::run(Options options, PollFunction poll)
+{
+    applyPlacement(options);
+    LOG_INFO("[{}] poll thread up: {} wait, spin {}us, yield {}us, sleep {}us", name_,
+             strategyName(options.wait), options.spinFor.count(), options.yieldFor.count(),
+             options.sleepFor.count());
+    latency_.reset();
+    polls_ = 0;
+    windowStart_ = std::chrono::steady_clock::now();
+    windowCpuStart_ = threadCpuMicros();
+    auto lastWork = windowStart_;
+    while (running_.load(std::memory_order_relaxed))
+    {
+        size_t found = poll();
+        ++polls_;
+        auto now = std::chrono::steady_clock::now();
+        if (now - windowStart_ >= exportWindow_)
+        {
+            exportWindow(now);
+        }
+        if (found > 0)
+        {
+            lastWork = now;
+            continue;
+        }
+        switch (options.wait)
+        {
+        case WaitStrategy::BusySpin:
+            cpuRelax();
+            break;
+        case WaitStrategy::Hybrid:
+            if (now - lastWork < options.spinFor)
+            {
+                cpuRelax();
+            }
+            else if (now - lastWork < options.yieldFor)
+            {
+                std::this_thread::yield();
+            }
+            else
+            {
+                std::this_thread::sleep_for(options.sleepFor);
+            }
+            break;
+        case WaitStrategy::Timed:
+            std::this_thread::sleep_for(options.sleepFor);
+            break;
+        }
+    }
+    exportWindow(std::chrono::steady_clock::now());
+}
+
+// Affinity and priority of the calling thread. Failing either only costs
+// latency, so it's logged and the thread runs anyway.
+void PollThread::applyPlacement(const Options& options)
+{
+#ifdef _WIN32
+    if (options.cpu >= 0 && options.cpu < 64 &&
+        !SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << options.cpu))
+    {
+        LOG_WARN("[{}] can't pin to CPU {}: error {}", name_, options.cpu, static_cast<uint64_t>(GetLastError()));
+    }
+    if (options.priority != Priority::Normal)
+    {
+        int priority = options.priority == Priority::Realtime ? THREAD_PRIORITY_TIME_CRITICAL : THREAD_PRIORITY_HIGHEST;
+        if (!SetThreadPriority(GetCurrentThread(), priority))
+        {
+            LOG_WARN("[{}] can't raise thread priority: error {}", name_, static_cast<uint64_t>(GetLastError()));
+        }
+    }
+#elif defined(__linux__)
+    if (options.cpu >= 0 && options.cpu < CPU_SETSIZE)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(options.cpu, &set);
+        int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (error != 0)
+        {
+            LOG_WARN("[{}] can't pin to CPU {}: error {}", name_, options.cpu, error);
+        }
+    }
+    if (options.priority == Priority::Realtime)
+    {
+        sched_param param{};
+        param.sched_priority = 10;
+        int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (error != 0)
+        {
+            // Usually EPERM without CAP_SYS_NICE: settle for a better nice value
+            LOG_WARN("[{}] can't switch to SCHED_FIFO (error {}), using high priority instead", name_, error);
+        }
+        else
+        {
+            return;
+        }
+    }
+    if (options.priority != Priority::Normal)
+    {
+        // Nice values are per thread on Linux
+        pid_t tid = static_cast<pid_t>(syscall(SYS_gettid));
+        if (setpriority(PRIO_PROCESS, static_cast<id_t>(tid), -10) != 0)
+        {
+            LOG_WARN("[{}] can't raise thread priority (needs CAP_SYS_NICE)", name_);
+        }
+    }
+#else
+    if (options.cpu >= 0)
+    {
+        LOG_WARN("[{}] CPU affinity isn't supported on this platform", name_);
+    }
+    if (options.priority != Priority::Normal)
+    {
+        sched_param param{};
+        int policy = SCHED_OTHER;
+        pthread_getschedparam(pthread_self(), &policy, &param);
+        param.sched_priority = sched_get_priority_max(policy);
+        pthread_setschedparam(pthread_self(), policy, &param);
+    }
+#endif
+}
+
+void PollThread::exportWindow(std::chrono::steady_clock::time_point now)
+{
+    Snapshot snap;
+    snap.latencyP50Us = latency_.percentile(50);
+    snap.latencyP99Us = latency_.percentile(99);
+    snap.latencyMaxUs = latency_.max();
+    snap.samples = latency_.count();
+    snap.polls = polls_;
+    int64_t cpu = threadCpuMicros();
+    auto wall = std::chrono::duration_cast<std::chrono::microseconds>(now - windowStart_).count();
+    if (cpu > 0 && wall > 0)
+    {
+        snap.cpuPercent = 100.0 * static_cast<double>(cpu - windowCpuStart_) / static_cast<double>(wall);
+    }
+    latency_.reset();
+    polls_ = 0;
+    windowStart_ = now;
+    windowCpuStart_ = cpu;
+    {
+        std::lock_guard<std::mutex> lock(snapshotMutex_);
+        snapshot_ = snap;
+    }
+    LOG_DEBUG("[{}] dispatch latency p50={}us p99={}us max={}us over {} messages, {} polls, cpu {}%", name_,
+              snap.latencyP50Us, snap.latencyP99Us, snap.latencyMaxUs, snap.samples, snap.polls, snap.cpuPercent);
+}
+
+// CPU time the calling thread has used, 0 if unknown
+int64_t PollThread::threadCpuMicros()
+{
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+    {
+        return 0;
+    }
+    auto ticks = [](const FILETIME& t) {
+        return (static_cast<int64_t>(t.dwHighDateTime) << 32) | t.dwLowDateTime;
+    };
+    return (ticks(kernel) + ticks(user)) / 10; // 100 ns units
+#elif defined(CLOCK_THREAD_CPUTIME_ID)
+    timespec ts{};
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+    {
+        return 0;
+    }
+    return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+#else
+    return 0;
+#endif
+}
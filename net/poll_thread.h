@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "latency_histogram.h"
+
+// A thread that does nothing but call a poll function, for work that has
+// no file descriptor to block on (Steam's message queue). How it waits
+// between polls that found nothing decides both wake-up latency and CPU:
+//   BusySpin: polls back to back, one core at 100%
+//   Hybrid:   spins for spinFor after the last work, then yields until
+//             yieldFor, then sleeps sleepFor between polls
+//   Timed:    sleeps sleepFor between idle polls
+// The poll function reports receive-to-dispatch latency with
+// recordLatency; percentiles are exported every window.
+class PollThread {
+public:
+    enum class WaitStrategy { BusySpin, Hybrid, Timed };
+    enum class Priority { Normal, High, Realtime };
+
+    struct Options {
+        WaitStrategy wait = WaitStrategy::Hybrid;
+        std::chrono::microseconds spinFor{50};
+        std::chrono::microseconds yieldFor{200};
+        std::chrono::microseconds sleepFor{1000};
+        int cpu = -1; // Pin to this CPU; -1: let the scheduler pick
+        Priority priority = Priority::Normal;
+    };
+
+    struct Snapshot {
+        uint64_t latencyP50Us = 0;
+        uint64_t latencyP99Us = 0;
+        uint64_t latencyMaxUs = 0;
+        uint64_t samples = 0;
+        uint64_t polls = 0;
+        double cpuPercent = 0; // Of one core; 0 where the platform can't tell
+    };
+
+    // Returns how much work it found; 0 means idle
+    using PollFunction = std::function<size_t()>;
+
+    explicit PollThread(std::string name, std::chrono::milliseconds exportWindow = std::chrono::seconds(5));
+    ~PollThread();
+
+    void start(const Options& options, PollFunction poll);
+    // Joins the thread; not from the poll function
+    void stop();
+    bool running() const { return running_.load(std::memory_order_relaxed); }
+    Options options() const;
+
+    void recordLatency(uint64_t micros) { latency_.record(micros); }
+    // The last completed export window
+    Snapshot snapshot() const;
+
+    static const char* strategyName(WaitStrategy wait);
+
+private:
+    void run(Options options, PollFunction poll);
+    void applyPlacement(const Options& options);
+    void exportWindow(std::chrono::steady_clock::time_point now);
+    static int64_t threadCpuMicros();
+
+    std::string name_;
+    std::chrono::milliseconds exportWindow_;
+    std::thread thread_;
+    std::atomic<bool> running_{false};
+    Options options_; // Under snapshotMutex_
+
+    LatencyHistogram latency_;
+    uint64_t polls_ = 0; // Poll thread only
+    std::chrono::steady_clock::time_point windowStart_;
+    int64_t windowCpuStart_ = 0;
+
+    mutable std::mutex snapshotMutex_;
+    Snapshot snapshot_;
+};
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstring>
+#include <vector>
+#include "multiplex_manager.h"
+#include "tunnel_transport.h"
+
+// Mesh peer without a direct connection: every frame goes to the host
+// wrapped in a relay frame naming the peer, and the host passes it on.
+// Each side keeps two managers per relayed peer, one for the streams it
+// opens (client role) and one for the streams the peer opens (host role);
+// route 0 frames come from an opener and go to the acceptor, route 1 the
+// other way.
+class RelayTransport : public TunnelTransport {
+public:
+    static constexpr uint32_t kRouteToAcceptor = 0;
+    static constexpr uint32_t kRouteToOpener = 1;
+
+    RelayTransport(TunnelTransport* inner, HSteamNetConnection hostConn, uint64_t peer, uint32_t route)
+        : inner_(inner), hostConn_(hostConn), peer_(peer), route_(route) {}
+
+    EResult send(HSteamNetConnection, const void* data, uint32 size, int sendFlags) override
+    {
+        // Same grow-only per-thread framing as MultiplexManager::sendTunnelPacket
+        thread_local std::vector<char> frame;
+        frame.resize(MultiplexManager::kRelayHeaderSize + size);
+        MultiplexManager::writeRelayHeader(frame.data(), peer_, route_);
+        std::memcpy(frame.data() + MultiplexManager::kRelayHeaderSize, data, size);
+        return inner_->send(hostConn_, frame.data(), static_cast<uint32>(frame.size()), sendFlags);
+    }
+
+    HSteamNetConnection hostConnection() const { return hostConn_; }
+
+private:
+    TunnelTransport* inner_;
+    HSteamNetConnection hostConn_;
+    uint64_t peer_;
+    uint32_t route_;
+};
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+// Frames sent on a session but not yet acknowledged by the peer, kept so
+// they can go out again on a new connection after the old one dropped.
+// Frames are numbered from 1 in send order and acknowledged by count (the
+// number of frames the peer has received). Records are packed into one
+// ring allocated on first use; not thread-safe, the owner locks.
+class ReplayBuffer {
+public:
+    explicit ReplayBuffer(size_t capacity) : capacity_(capacity) {}
+
+    ReplayBuffer(const ReplayBuffer&) = delete;
+    ReplayBuffer& operator=(const ReplayBuffer&) = delete;
+
+    // Returns false if the frame didn't fit; from then on nothing can be
+    // replayed (the frame is still counted)
+    bool append(const char* data, size_t len)
+    {
+        ++sent_;
+        if (lost_)
+        {
+            return false;
+        }
+        size_t record = recordSize(len);
+        if (!data_)
+        {
+            data_.reset(new char[capacity_]);
+        }
+        if (used_ == 0)
+        {
+            head_ = tail_ = 0;
+        }
+        bool wrapped = used_ > 0 && tail_ <= head_;
+        if (!wrapped && record > capacity_ - tail_)
+        {
+            // Doesn't fit before the end: pad it out and start over at 0
+            size_t padding = capacity_ - tail_;
+            if (record > head_)
+            {
+                lost_ = true;
+                return false;
+            }
+            if (padding >= kHeaderSize)
+            {
+                uint32_t marker = kWrapMarker;
+                std::memcpy(data_.get() + tail_, &marker, kHeaderSize);
+            }
+            used_ += padding;
+            tail_ = 0;
+            wrapped = true;
+        }
+        if (wrapped && record > head_ - tail_)
+        {
+            lost_ = true;
+            return false;
+        }
+        uint32_t frameLen = static_cast<uint32_t>(len);
+        std::memcpy(data_.get() + tail_, &frameLen, kHeaderSize);
+        std::memcpy(data_.get() + tail_ + kHeaderSize, data, len);
+        tail_ += record;
+        used_ += record;
+        return true;
+    }
+
+    // The peer has received `count` frames: drop them
+    void acknowledge(uint64_t count)
+    {
+        if (count > sent_)
+        {
+            count = sent_;
+        }
+        while (acked_ < count && used_ > 0)
+        {
+            skipWrap();
+            used_ -= recordSize(frameLength(head_));
+            head_ += recordSize(frameLength(head_));
+            ++acked_;
+        }
+        acked_ = count > acked_ ? count : acked_;
+    }
+
+    // Whether every frame after the peer's `count` is still here
+    bool canReplayFrom(uint64_t count) const
+    {
+        return count <= sent_ && (count == sent_ || (!lost_ && count >= acked_));
+    }
+
+    // Calls send(data, len) for each frame after `count`, in order;
+    // canReplayFrom(count) must hold
+    template <typename Send>
+    void replayFrom(uint64_t count, Send&& send)
+    {
+        acknowledge(count);
+        size_t offset = head_;
+        size_t remaining = used_;
+        while (remaining > 0)
+        {
+            if (capacity_ - offset < kHeaderSize || frameLength(offset) == kWrapMarker)
+            {
+                remaining -= capacity_ - offset;
+                offset = 0;
+                continue;
+            }
+            uint32_t len = frameLength(offset);
+            send(data_.get() + offset + kHeaderSize, len);
+            remaining -= recordSize(len);
+            offset += recordSize(len);
+        }
+    }
+
+    // Starts a new session; keeps the allocation
+    void reset()
+    {
+        head_ = tail_ = used_ = 0;
+        sent_ = acked_ = 0;
+        lost_ = false;
+    }
+
+    uint64_t sent() const { return sent_; }
+    size_t bytes() const { return used_; }
+    size_t allocated() const { return data_ ? capacity_ : 0; } // The ring, once the first frame went in
+    bool lost() const { return lost_; }
+
+private:
+    static constexpr size_t kHeaderSize = sizeof(uint32_t);
+    static constexpr uint32_t kWrapMarker = 0xffffffffu;
+
+    static size_t recordSize(size_t len) { return (kHeaderSize + len + 3) & ~static_cast<size_t>(3); }
+
+    uint32_t frameLength(size_t offset) const
+    {
+        uint32_t len;
+        std::memcpy(&len, data_.get() + offset, kHeaderSize);
+        return len;
+    }
+
+    // Moves head_ past end-of-ring padding
+    void skipWrap()
+    {
+        if (capacity_ - head_ < kHeaderSize || frameLength(head_) == kWrapMarker)
+        {
+            used_ -= capacity_ - head_;
+            head_ = 0;
+        }
+    }
+
+    std::unique_ptr<char[]> data_;
+    size_t capacity_;
+    size_t head_ = 0; // Oldest record
+    size_t tail_ = 0; // Where the next record goes
+    size_t used_ = 0; // Including end-of-ring padding
+    uint64_t sent_ = 0;
+    uint64_t acked_ = 0; // Frames dropped; the oldest kept is acked_ + 1
+    bool lost_ = false;
+};
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Shared-memory transport between ConnectTool (ShmServer) and game processes
+// (the connecttool_shim library), Linux only. One POSIX shm segment holds a
+// control block and a fixed table of slots; a process attaches by claiming a
+// slot, which gives it a pair of single-producer/single-consumer byte rings.
+// Frames in the rings carry slot-local stream numbers, multiplexed like the
+// TCP streams of TCPServer. Wakeups are futexes on words inside the segment,
+// so an idle side sleeps and a busy one never makes a syscall.
+//
+// Everything here is fixed-size and position-independent: both sides map the
+// segment at different addresses and only share these structs.
+
+constexpr uint64_t kShmMagic = 0x314d485354434e43ULL; // "CNCTSHM1"
+constexpr uint32_t kShmVersion = 1;
+constexpr uint32_t kShmSlotCount = 16;
+constexpr uint32_t kShmRingSize = 256 * 1024;   // Per direction, power of two
+constexpr uint32_t kShmMaxPayload = 16 * 1024;  // Per frame; larger writes are split
+constexpr const char* kShmDefaultName = "/connecttool";
+
+enum class ShmSlotState : uint32_t {
+    Free = 0,
+    Attaching = 1, // Claimed, being set up by the attaching process
+    Active = 2,
+    Detaching = 3, // The process left; the server tears its streams down and frees the slot
+};
+
+// Who opens streams in a slot: a game client opens them towards the tunnel,
+// a game server is handed the streams remote players open
+enum class ShmSlotRole : uint32_t { Client = 0, Server = 1 };
+
+enum class ShmFrameType : uint32_t { Open = 0, Data = 1, Close = 2 };
+
+struct ShmFrameHeader {
+    uint32_t stream; // Slot-local stream number, chosen by whoever opened it
+    uint32_t type;   // ShmFrameType
+    uint32_t len;    // Payload bytes following the header
+    uint32_t reserved;
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<uint64_t>::is_always_lock_free,
+              "shared-memory atomics must be lock-free");
+
+// Futex-backed event count. A sleeper reads seq, announces itself in
+// waiters, re-checks its condition and sleeps only while seq is unchanged;
+// a notifier bumps seq and makes the wake syscall only if someone announced.
+struct alignas(64) ShmEvent {
+    std::atomic<uint32_t> seq;
+    std::atomic<uint32_t> waiters;
+};
+
+// SPSC byte ring of frames. head/tail are free-running byte counters.
+struct alignas(64) ShmRing {
+    alignas(64) std::atomic<uint64_t> head; // Consumer
+    std::atomic<uint32_t> producerBlocked;  // Producer found it full; consumer notifies after freeing space
+    alignas(64) std::atomic<uint64_t> tail; // Producer
+    alignas(64) char data[kShmRingSize];
+};
+
+struct ShmSlot {
+    std::atomic<uint32_t> state; // ShmSlotState
+    uint32_t role;               // ShmSlotRole, written before state becomes Active
+    std::atomic<int32_t> pid;    // Attached process, checked for liveness by the server
+    uint32_t reserved;
+    ShmEvent clientEvent;        // Server -> attached process
+    ShmRing toServer;
+    ShmRing toClient;
+};
+
+struct ShmControl {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t slotCount;
+    std::atomic<int32_t> serverPid; // 0 once the server stopped
+    ShmEvent serverEvent;           // Any attached process -> server
+    ShmSlot slots[kShmSlotCount];
+};
+
+// Total frame footprint in a ring, padded so headers stay aligned
+inline uint64_t shmFrameSpace(uint32_t payload)
+{
+    return (sizeof(ShmFrameHeader) + payload + 15) & ~uint64_t(15);
+}
+
+inline void shmRingCopyIn(ShmRing& ring, uint64_t pos, const void* src, size_t len)
+{
+    size_t offset = static_cast<size_t>(pos & (kShmRingSize - 1));
+    size_t first = len < kShmRingSize - offset ? len : kShmRingSize - offset;
+    std::memcpy(ring.data + offset, src, first);
+    std::memcpy(ring.data, static_cast<const char*>(src) + first, len - first);
+}
+
+inline void shmRingCopyOut(const ShmRing& ring, uint64_t pos, void* dst, size_t len)
+{
+    size_t offset = static_cast<size_t>(pos & (kShmRingSize - 1));
+    size_t first = len < kShmRingSize - offset ? len : kShmRingSize - offset;
+    std::memcpy(dst, ring.data + offset, first);
+    std::memcpy(static_cast<char*>(dst) + first, ring.data, len - first);
+}
+
+// Producer side. Returns false (and flags producerBlocked) when the frame
+// doesn't fit; retry after the consumer's notification.
+inline bool shmRingWrite(ShmRing& ring, uint32_t stream, ShmFrameType type, const void* payload, uint32_t len)
+{
+    uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+    uint64_t space = shmFrameSpace(len);
+    if (kShmRingSize - (tail - ring.head.load(std::memory_order_acquire)) < space)
+    {
+        ring.producerBlocked.store(1, std::memory_order_seq_cst);
+        // The consumer may have drained everything before seeing the flag
+        if (kShmRingSize - (tail - ring.head.load(std::memory_order_seq_cst)) < space)
+        {
+            return false;
+        }
+    }
+    ShmFrameHeader header{stream, static_cast<uint32_t>(type), len, 0};
+    shmRingCopyIn(ring, tail, &header, sizeof(header));
+    if (len > 0)
+    {
+        shmRingCopyIn(ring, tail + sizeof(header), payload, len);
+    }
+    ring.tail.store(tail + space, std::memory_order_release);
+    return true;
+}
+
+// Consumer side. Copies the next frame's payload into `payload` (at least
+// kShmMaxPayload bytes). Returns false when the ring is empty. *freed is
+// set when the producer was waiting for space and should be notified.
+inline bool shmRingRead(ShmRing& ring, ShmFrameHeader& header, char* payload, bool* freed)
+{
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    if (head == ring.tail.load(std::memory_order_acquire))
+    {
+        return false;
+    }
+    shmRingCopyOut(ring, head, &header, sizeof(header));
+    uint32_t len = header.len < kShmMaxPayload ? header.len : kShmMaxPayload;
+    if (len > 0)
+    {
+        shmRingCopyOut(ring, head + sizeof(header), payload, len);
+    }
+    ring.head.store(head + shmFrameSpace(header.len), std::memory_order_seq_cst);
+    *freed = ring.producerBlocked.load(std::memory_order_seq_cst) != 0 &&
+             ring.producerBlocked.exchange(0, std::memory_order_seq_cst) != 0;
+    return true;
+}
+
+inline bool shmRingEmpty(const ShmRing& ring)
+{
+    return ring.head.load(std::memory_order_acquire) == ring.tail.load(std::memory_order_acquire);
+}
+
+inline void shmRingReset(ShmRing& ring)
+{
+    ring.head.store(0, std::memory_order_relaxed);
+    ring.tail.store(0, std::memory_order_relaxed);
+    ring.producerBlocked.store(0, std::memory_order_relaxed);
+}
+
+#ifdef __linux__
+#include <climits>
+#include <ctime>
+#include <linux/futex.h>
+#include <thread>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+inline void shmEventNotify(ShmEvent& event)
+{
+    event.seq.fetch_add(1, std::memory_order_seq_cst);
+    if (event.waiters.load(std::memory_order_seq_cst) > 0)
+    {
+        // Shared (not FUTEX_PRIVATE) so it works across processes
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&event.seq), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+}
+
+// Spinning only pays off when the other side runs on another core; on a
+// single CPU it just delays the producer we're waiting for
+inline int shmSpinCount()
+{
+    static const int spins = std::thread::hardware_concurrency() > 1 ? 2000 : 0;
+    return spins;
+}
+
+// Spins briefly, then sleeps until notified or timeoutMs passes, unless
+// ready() turns true first. Returns ready().
+template <typename Ready>
+bool shmEventWait(ShmEvent& event, Ready ready, int timeoutMs, int spins = shmSpinCount())
+{
+    for (int i = 0; i < spins; ++i)
+    {
+        if (ready())
+        {
+            return true;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+    uint32_t seq = event.seq.load(std::memory_order_seq_cst);
+    event.waiters.fetch_add(1, std::memory_order_seq_cst);
+    if (!ready() && timeoutMs != 0)
+    {
+        timespec timeout{timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&event.seq), FUTEX_WAIT, seq,
+                timeoutMs > 0 ? &timeout : nullptr, nullptr, 0);
+    }
+    event.waiters.fetch_sub(1, std::memory_order_seq_cst);
+    return ready();
+}
+#endif
@@ -0,0 +1,553 @@
+#include "shm_server.h"
+#include "logger.h"
+
+#ifdef __linux__
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "shm_protocol.h"
+
+namespace {
+const int kFramesPerPass = 256; // Per slot, so one busy process can't starve the others
+const auto kLivenessInterval = std::chrono::seconds(1);
+
+bool processAlive(int32_t pid)
+{
+    return pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+}
+} // namespace
+
+struct ShmServer::Core : std::enable_shared_from_this<ShmServer::Core> {
+    // Frame that didn't fit in a toClient ring yet
+    struct Pending {
+        uint32_t stream;
+        ShmFrameType type;
+        std::vector<char> payload;
+    };
+
+    // A stream's manager stays valid while its entry exists: the manager
+    // closes its endpoints (which erases the entries) before it goes away
+    struct StreamEntry {
+        MultiplexManager* manager;
+        StreamId id;
+    };
+
+    struct Slot {
+        std::mutex streamsMutex;
+        std::unordered_map<uint32_t, StreamEntry> streams;
+        uint32_t nextStream = 1; // Numbers we open towards a server-role process, under streamsMutex
+        std::mutex sendMutex;    // Producer side of toClient
+        std::deque<Pending> backlog;
+        std::atomic<bool> hasBacklog{false};
+        std::atomic<uint32_t> generation{0}; // Bumped on teardown, so stale endpoints can't write
+        std::atomic<bool> attached{false};
+        ShmSlotRole role = ShmSlotRole::Client;
+        int32_t pid = 0;
+    };
+
+    std::string name;
+    TunnelProvider tunnelProvider;
+    std::function<void()> onClientsChanged;
+    ShmControl* control = nullptr;
+    Slot slots[kShmSlotCount];
+    std::vector<char> payload = std::vector<char>(kShmMaxPayload);
+    std::atomic<bool> running{false};
+    std::atomic<int> attachedCount{0};
+    std::atomic<int> streamCount{0};
+    std::atomic<uint32_t> nextServerSlot{0};
+    std::thread thread;
+
+    ~Core()
+    {
+        if (control)
+        {
+            munmap(control, sizeof(ShmControl));
+        }
+    }
+
+    void run();
+    bool service(uint32_t index);
+    bool pendingWork();
+    void attach(uint32_t index);
+    void teardown(uint32_t index, const char* reason);
+    void dispatch(uint32_t index, const ShmFrameHeader& header, const char* data);
+    void flushBacklog(uint32_t index);
+    void sendFrame(uint32_t index, uint32_t generation, uint32_t stream, ShmFrameType type, const char* data,
+                   uint32_t len);
+    void sendData(uint32_t index, uint32_t generation, uint32_t stream, const char* data, size_t len);
+    void endpointClosed(uint32_t index, uint32_t generation, uint32_t stream);
+    std::shared_ptr<StreamEndpoint> acceptStream(MultiplexManager& manager, StreamId id);
+};
+
+class ShmServer::Endpoint : public StreamEndpoint {
+public:
+    Endpoint(std::shared_ptr<Core> core, uint32_t slot, uint32_t generation, uint32_t stream)
+        : core_(std::move(core)), slot_(slot), generation_(generation), stream_(stream) {}
+
+    void write(const char* data, size_t len) override { core_->sendData(slot_, generation_, stream_, data, len); }
+    void close() override { core_->endpointClosed(slot_, generation_, stream_); }
+
+private:
+    std::shared_ptr<Core> core_;
+    uint32_t slot_;
+    uint32_t generation_;
+    uint32_t stream_;
+};
+
+void ShmServer::Core::run()
+{
+    auto lastLivenessCheck = std::chrono::steady_clock::now();
+    while (running)
+    {
+        bool worked = false;
+        for (uint32_t i = 0; i < kShmSlotCount; ++i)
+        {
+            worked |= service(i);
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (now - lastLivenessCheck >= kLivenessInterval)
+        {
+            // A process that crashed never detaches
+            lastLivenessCheck = now;
+            for (uint32_t i = 0; i < kShmSlotCount; ++i)
+            {
+                ShmSlot& shared = control->slots[i];
+                uint32_t state = shared.state.load(std::memory_order_acquire);
+                if (state != static_cast<uint32_t>(ShmSlotState::Free) && shared.pid.load() > 0 &&
+                    !processAlive(shared.pid.load()))
+                {
+                    teardown(i, "process exited");
+                }
+            }
+        }
+        if (!worked)
+        {
+            shmEventWait(control->serverEvent, [this]() { return !running || pendingWork(); }, 200);
+        }
+    }
+}
+
+bool ShmServer::Core::pendingWork()
+{
+    for (uint32_t i = 0; i < kShmSlotCount; ++i)
+    {
+        const ShmSlot& shared = control->slots[i];
+        uint32_t state = shared.state.load(std::memory_order_acquire);
+        if (state == static_cast<uint32_t>(ShmSlotState::Detaching) ||
+            (state == static_cast<uint32_t>(ShmSlotState::Active) && !slots[i].attached) ||
+            (slots[i].attached && !shmRingEmpty(shared.toServer)))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ShmServer::Core::service(uint32_t index)
+{
+    ShmSlot& shared = control->slots[index];
+    Slot& local = slots[index];
+    uint32_t state = shared.state.load(std::memory_order_acquire);
+    if (state == static_cast<uint32_t>(ShmSlotState::Active) && !local.attached)
+    {
+        attach(index);
+    }
+    else if (state == static_cast<uint32_t>(ShmSlotState::Detaching))
+    {
+        teardown(index, "detached");
+        return true;
+    }
+    if (!local.attached)
+    {
+        return false;
+    }
+    bool worked = false;
+    ShmFrameHeader header;
+    bool freed;
+    for (int i = 0; i < kFramesPerPass && shmRingRead(shared.toServer, header, payload.data(), &freed); ++i)
+    {
+        worked = true;
+        if (freed)
+        {
+            shmEventNotify(shared.clientEvent);
+        }
+        dispatch(index, header, payload.data());
+    }
+    if (local.hasBacklog)
+    {
+        flushBacklog(index);
+    }
+    return worked;
+}
+
+void ShmServer::Core::attach(uint32_t index)
+{
+    ShmSlot& shared = control->slots[index];
+    Slot& local = slots[index];
+    local.role = static_cast<ShmSlotRole>(shared.role);
+    local.pid = shared.pid.load();
+    local.attached = true;
+    ++attachedCount;
+    LOG_INFO("Shared-memory {} attached: pid {}, slot {}",
+             local.role == ShmSlotRole::Server ? "game server" : "client", local.pid, index);
+    if (onClientsChanged)
+    {
+        onClientsChanged();
+    }
+}
+
+void ShmServer::Core::teardown(uint32_t index, const char* reason)
+{
+    ShmSlot& shared = control->slots[index];
+    Slot& local = slots[index];
+    {
+        std::lock_guard<std::mutex> lock(local.streamsMutex);
+        for (auto& pair : local.streams)
+        {
+            pair.second.manager->closeFromEndpoint(pair.second.id);
+        }
+        streamCount -= static_cast<int>(local.streams.size());
+        local.streams.clear();
+        local.nextStream = 1;
+        ++local.generation;
+    }
+    {
+        std::lock_guard<std::mutex> lock(local.sendMutex);
+        local.backlog.clear();
+        local.hasBacklog = false;
+    }
+    shmRingReset(shared.toServer);
+    shmRingReset(shared.toClient);
+    shared.pid.store(0);
+    bool wasAttached = local.attached.exchange(false);
+    shared.state.store(static_cast<uint32_t>(ShmSlotState::Free), std::memory_order_release);
+    if (wasAttached)
+    {
+        --attachedCount;
+        LOG_INFO("Shared-memory slot {} released: {}", index, reason);
+        if (onClientsChanged)
+        {
+            onClientsChanged();
+        }
+    }
+}
+
+void ShmServer::Core::dispatch(uint32_t index, const ShmFrameHeader& header, const char* data)
+{
+    Slot& local = slots[index];
+    uint32_t len = header.len < kShmMaxPayload ? header.len : kShmMaxPayload;
+    switch (static_cast<ShmFrameType>(header.type))
+    {
+    case ShmFrameType::Open:
+    {
+        if (local.role != ShmSlotRole::Client)
+        {
+            LOG_WARN("Shared-memory slot {}: game servers can't open streams", index);
+            break;
+        }
+        uint32_t generation = local.generation;
+        auto manager = tunnelProvider();
+        if (!manager)
+        {
+            LOG_WARN("Not connected to Steam, rejecting shared-memory stream");
+            sendFrame(index, generation, header.stream, ShmFrameType::Close, nullptr, 0);
+            break;
+        }
+        auto endpoint = std::make_shared<Endpoint>(shared_from_this(), index, generation, header.stream);
+        std::lock_guard<std::mutex> lock(local.streamsMutex);
+        StreamId id = manager->addEndpoint(std::move(endpoint));
+        local.streams[header.stream] = {manager.get(), id};
+        ++streamCount;
+        break;
+    }
+    case ShmFrameType::Data:
+    {
+        std::lock_guard<std::mutex> lock(local.streamsMutex);
+        auto it = local.streams.find(header.stream);
+        if (it != local.streams.end())
+        {
+            it->second.manager->sendFromEndpoint(it->second.id, data, len);
+        }
+        break;
+    }
+    case ShmFrameType::Close:
+    {
+        std::lock_guard<std::mutex> lock(local.streamsMutex);
+        auto it = local.streams.find(header.stream);
+        if (it != local.streams.end())
+        {
+            it->second.manager->closeFromEndpoint(it->second.id);
+            local.streams.erase(it);
+            --streamCount;
+        }
+        break;
+    }
+    default:
+        LOG_WARN("Shared-memory slot {}: unknown frame type {}", index, header.type);
+        break;
+    }
+}
+
+void ShmServer::Core::sendFrame(uint32_t index, uint32_t generation, uint32_t stream, ShmFrameType type,
+                                const char* data, uint32_t len)
+{
+    ShmSlot& shared = control->slots[index];
+    Slot& local = slots[index];
+    {
+        std::lock_guard<std::mutex> lock(local.sendMutex);
+        if (!running || generation != local.generation)
+        {
+            return;
+        }
+        // Keep frames in order: once something is waiting, queue behind it
+        if (!local.backlog.empty() || !shmRingWrite(shared.toClient, stream, type, data, len))
+        {
+            local.backlog.push_back({stream, type, std::vector<char>(data, data + len)});
+            local.hasBacklog = true;
+            return;
+        }
+    }
+    shmEventNotify(shared.clientEvent);
+}
+
+void ShmServer::Core::sendData(uint32_t index, uint32_t generation, uint32_t stream, const char* data, size_t len)
+{
+    while (len > 0)
+    {
+        uint32_t chunk = static_cast<uint32_t>(len < kShmMaxPayload ? len : kShmMaxPayload);
+        sendFrame(index, generation, stream, ShmFrameType::Data, data, chunk);
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+void ShmServer::Core::flushBacklog(uint32_t index)
+{
+    ShmSlot& shared = control->slots[index];
+    Slot& local = slots[index];
+    bool wrote = false;
+    {
+        std::lock_guard<std::mutex> lock(local.sendMutex);
+        while (!local.backlog.empty())
+        {
+            Pending& frame = local.backlog.front();
+            if (!shmRingWrite(shared.toClient, frame.stream, frame.type, frame.payload.data(),
+                              static_cast<uint32_t>(frame.payload.size())))
+            {
+                break;
+            }
+            local.backlog.pop_front();
+            wrote = true;
+        }
+        local.hasBacklog = !local.backlog.empty();
+    }
+    if (wrote)
+    {
+        shmEventNotify(shared.clientEvent);
+    }
+}
+
+void ShmServer::Core::endpointClosed(uint32_t index, uint32_t generation, uint32_t stream)
+{
+    Slot& local = slots[index];
+    {
+        std::lock_guard<std::mutex> lock(local.streamsMutex);
+        if (generation != local.generation || local.streams.erase(stream) == 0)
+        {
+            return;
+        }
+        --streamCount;
+    }
+    sendFrame(index, generation, stream, ShmFrameType::Close, nullptr, 0);
+}
+
+std::shared_ptr<StreamEndpoint> ShmServer::Core::acceptStream(MultiplexManager& manager, StreamId id)
+{
+    // Round-robin over attached game servers
+    uint32_t start = nextServerSlot++;
+    for (uint32_t n = 0; n < kShmSlotCount; ++n)
+    {
+        uint32_t index = (start + n) % kShmSlotCount;
+        Slot& local = slots[index];
+        if (!local.attached || local.role != ShmSlotRole::Server)
+        {
+            continue;
+        }
+        uint32_t generation;
+        uint32_t stream;
+        {
+            std::lock_guard<std::mutex> lock(local.streamsMutex);
+            generation = local.generation;
+            stream = local.nextStream++;
+            local.streams[stream] = {&manager, id};
+            ++streamCount;
+        }
+        sendFrame(index, generation, stream, ShmFrameType::Open, nullptr, 0);
+        return std::make_shared<Endpoint>(shared_from_this(), index, generation, stream);
+    }
+    return nullptr;
+}
+
+ShmServer::ShmServer(std::string name, TunnelProvider tunnelProvider, std::function<void()> onClientsChanged)
+    : name_(std::move(name)), tunnelProvider_(std::move(tunnelProvider)), onClientsChanged_(std::move(onClientsChanged))
+{
+}
+
+ShmServer::~ShmServer()
+{
+    stop();
+}
+
+bool ShmServer::start()
+{
+    if (core_)
+    {
+        return true;
+    }
+    int fd = shm_open(name_.c_str(), O_CREAT | O_RDWR, 0600);
+    if (fd < 0)
+    {
+        LOG_ERROR("Failed to create shared memory {}: {}", name_, std::strerror(errno));
+        return false;
+    }
+    // A segment left behind by a crashed instance is simply reinitialized
+    if (ftruncate(fd, sizeof(ShmControl)) != 0)
+    {
+        LOG_ERROR("Failed to size shared memory {}: {}", name_, std::strerror(errno));
+        ::close(fd);
+        shm_unlink(name_.c_str());
+        return false;
+    }
+    void* mapping = mmap(nullptr, sizeof(ShmControl), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        LOG_ERROR("Failed to map shared memory {}: {}", name_, std::strerror(errno));
+        shm_unlink(name_.c_str());
+        return false;
+    }
+
+    auto core = std::make_shared<Core>();
+    core->name = name_;
+    core->tunnelProvider = tunnelProvider_;
+    core->onClientsChanged = onClientsChanged_;
+    core->control = static_cast<ShmControl*>(mapping);
+    ShmControl& control = *core->control;
+    control.version = kShmVersion;
+    control.slotCount = kShmSlotCount;
+    control.serverEvent.seq.store(0);
+    control.serverEvent.waiters.store(0);
+    for (ShmSlot& slot : control.slots)
+    {
+        slot.state.store(static_cast<uint32_t>(ShmSlotState::Free));
+        slot.pid.store(0);
+        slot.clientEvent.seq.store(0);
+        slot.clientEvent.waiters.store(0);
+        shmRingReset(slot.toServer);
+        shmRingReset(slot.toClient);
+    }
+    control.serverPid.store(getpid());
+    // Attaching processes check the magic last
+    std::atomic_thread_fence(std::memory_order_release);
+    control.magic = kShmMagic;
+
+    core->running = true;
+    core->thread = std::thread([raw = core.get()]() {
+        LOG_INFO("Shared-memory server thread started");
+        raw->run();
+        LOG_INFO("Shared-memory server thread stopped");
+    });
+    core_ = std::move(core);
+    LOG_INFO("Shared-memory transport listening on {}", name_);
+    return true;
+}
+
+void ShmServer::stop()
+{
+    if (!core_)
+    {
+        return;
+    }
+    Core& core = *core_;
+    core.running = false;
+    shmEventNotify(core.control->serverEvent);
+    if (core.thread.joinable())
+    {
+        core.thread.join();
+    }
+    for (uint32_t i = 0; i < kShmSlotCount; ++i)
+    {
+        if (core.control->slots[i].state.load() != static_cast<uint32_t>(ShmSlotState::Free))
+        {
+            core.teardown(i, "server stopped");
+        }
+    }
+    // Attached processes see serverPid 0 and report the transport as gone
+    core.control->serverPid.store(0);
+    for (ShmSlot& slot : core.control->slots)
+    {
+        shmEventNotify(slot.clientEvent);
+    }
+    shm_unlink(name_.c_str());
+    // Endpoints still held by managers keep the mapping until they're released
+    core_.reset();
+    LOG_INFO("Shared-memory transport {} stopped", name_);
+}
+
+int ShmServer::getClientCount()
+{
+    return core_ ? core_->attachedCount.load() : 0;
+}
+
+int ShmServer::getStreamCount()
+{
+    return core_ ? core_->streamCount.load() : 0;
+}
+
+MultiplexManager::EndpointAcceptor ShmServer::acceptor()
+{
+    std::weak_ptr<Core> weak = core_;
+    return [weak](MultiplexManager& manager, StreamId id) -> std::shared_ptr<StreamEndpoint> {
+        auto core = weak.lock();
+        if (!core || !core->running)
+        {
+            return nullptr;
+        }
+        return core->acceptStream(manager, id);
+    };
+}
+
+#else // No shared-memory transport on this platform
+
+struct ShmServer::Core {
+};
+
+ShmServer::ShmServer(std::string name, TunnelProvider tunnelProvider, std::function<void()> onClientsChanged)
+    : name_(std::move(name)), tunnelProvider_(std::move(tunnelProvider)), onClientsChanged_(std::move(onClientsChanged))
+{
+}
+
+ShmServer::~ShmServer() = default;
+
+bool ShmServer::start()
+{
+    LOG_ERROR("Shared-memory transport is only available on Linux");
+    return false;
+}
+
+void ShmServer::stop() {}
+int ShmServer::getClientCount() { return 0; }
+int ShmServer::getStreamCount() { return 0; }
+MultiplexManager::EndpointAcceptor ShmServer::acceptor() { return nullptr; }
+
+#endif
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include "multiplex_manager.h"
+
+// Local IPC alternative to TCPServer. Game processes link the
+// connecttool_shim library and attach to a shared-memory segment (see
+// shm_protocol.h) instead of connecting to 127.0.0.1:
+//  - a client-role process opens streams into the tunnel, like a TCP client
+//    of TCPServer;
+//  - on the host, a server-role process (a game server wrapper) is handed the
+//    streams remote players open, via acceptor(), instead of a TCP
+//    connection to the local port.
+// One thread moves frames between the rings and the managers. Linux only;
+// start() fails elsewhere.
+class ShmServer {
+public:
+    // Returns the manager that tunnels local streams, or nullptr while no tunnel is up
+    using TunnelProvider = std::function<std::shared_ptr<MultiplexManager>()>;
+
+    ShmServer(std::string name, TunnelProvider tunnelProvider, std::function<void()> onClientsChanged = nullptr);
+    ~ShmServer();
+
+    bool start();
+    void stop();
+    bool running() const { return core_ != nullptr; }
+    const std::string& name() const { return name_; }
+    // Attached processes, and streams open through them
+    int getClientCount();
+    int getStreamCount();
+    // For MultiplexManager::setEndpointAcceptor on the host; hands streams to
+    // an attached server-role process, or returns nullptr when there is none
+    MultiplexManager::EndpointAcceptor acceptor();
+
+private:
+    // Segment mapping and per-slot bookkeeping; shared with the endpoints
+    // handed to managers, so a late write after stop() is harmless
+    struct Core;
+    class Endpoint;
+
+    std::string name_;
+    TunnelProvider tunnelProvider_;
+    std::function<void()> onClientsChanged_;
+    std::shared_ptr<Core> core_;
+};
@@ -1,42 +1,127 @@
 #include "tcp_server.h"
-#include "../steam/steam_networking_manager.h"
-#include <iostream>
+#include "logger.h"
 #include <algorithm>
 
-TCPServer::TCPServer(int port, SteamNetworkingManager* manager) : port_(port), running_(false), acceptor_(io_context_), work_(boost::asio::make_work_guard(io_context_)), manager_(manager) {}
+TCPServer::TCPServer(int port, TunnelProvider tunnelProvider, std::function<void()> onClientsChanged)
+    : TCPServer(std::vector<PortMapping>{{port, 0}}, std::move(tunnelProvider), std::move(onClientsChanged)) {}
+
+TCPServer::TCPServer(std::vector<PortMapping> mappings, TunnelProvider tunnelProvider, std::function<void()> onClientsChanged)
+    : running_(false), localBroadcast_(true), work_(boost::asio::make_work_guard(io_context_)), monitor_(io_context_, "tcp-server"),
+      tunnelProvider_(std::move(tunnelProvider)), onClientsChanged_(std::move(onClientsChanged)) {
+    for (const PortMapping& mapping : mappings) {
+        listeners_.push_back(std::unique_ptr<Listener>(new Listener{mapping, {}, false}));
+    }
+}
 
 TCPServer::~TCPServer() { stop(); }
 
 bool TCPServer::start() {
-    try {
-        tcp::endpoint endpoint(tcp::v4(), port_);
-        acceptor_.open(endpoint.protocol());
-        acceptor_.set_option(tcp::acceptor::reuse_address(true));
-        acceptor_.bind(endpoint);
-        acceptor_.listen();
-
-        running_ = true;
-        serverThread_ = std::thread([this]() { 
-            std::cout << "Server thread started" << std::endl;
-            io_context_.run(); 
-            std::cout << "Server thread stopped" << std::endl;
+    while (threadContextCount() < static_cast<size_t>(std::max(1, acceptOptions_.threads))) {
+        threadContexts_.emplace_back(new ThreadContext());
+    }
+    // A port that's taken only costs its own mapping
+    int listening = 0;
+    for (auto& listener : listeners_) {
+        if (listen(*listener)) {
+            ++listening;
+        }
+    }
+    if (listening == 0) {
+        LOG_ERROR("Failed to start TCP server");
+        return false;
+    }
+
+    running_ = true;
+    monitor_.start();
+    for (size_t i = 0; i < threadContextCount(); ++i) {
+        serverThreads_.emplace_back([this, i]() {
+            monitor_.bindCurrentThread();
+            LOG_INFO("Server thread started");
+            threadContext(i).run();
+            LOG_INFO("Server thread stopped");
         });
-        start_accept();
-        std::cout << "TCP server started on port " << port_ << std::endl;
-        return true;
+    }
+    for (auto& listener : listeners_) {
+        if (listener->listening) {
+            for (auto& acceptor : listener->acceptors) {
+                Listener* l = listener.get();
+                Acceptor* a = acceptor.get();
+                boost::asio::post(a->strand, [this, l, a]() {
+                    for (int i = 0; i < std::max(1, acceptOptions_.pendingAccepts); ++i) {
+                        start_accept(*l, *a);
+                    }
+                });
+            }
+            if (listener->mapping.peer != 0) {
+                LOG_INFO("TCP server listening on port {} -> peer {} port {}", listener->mapping.localPort,
+                         listener->mapping.peer, listener->mapping.remotePort);
+            } else if (listener->mapping.remotePort > 0) {
+                LOG_INFO("TCP server listening on port {} -> host port {}", listener->mapping.localPort,
+                         listener->mapping.remotePort);
+            } else {
+                LOG_INFO("TCP server started on port {}", listener->mapping.localPort);
+            }
+        }
+    }
+    return true;
+}
+
+bool TCPServer::listen(Listener& listener) {
+    int count = 1;
+#ifdef __linux__
+    if (acceptOptions_.reusePort) {
+        count = std::max(1, acceptOptions_.threads);
+    }
+#endif
+    int port = listener.mapping.localPort;
+    try {
+        for (int i = 0; i < count; ++i) {
+            // With reusePort each thread accepts on its own
+            std::unique_ptr<Acceptor> acceptor(new Acceptor(threadContext(static_cast<size_t>(i))));
+            tcp::endpoint endpoint(tcp::v4(), static_cast<unsigned short>(port));
+            acceptor->acceptor.open(endpoint.protocol());
+            acceptor->acceptor.set_option(tcp::acceptor::reuse_address(true));
+#ifdef __linux__
+            if (count > 1) {
+                acceptor->acceptor.set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+            }
+#endif
+            acceptor->acceptor.bind(endpoint);
+            acceptor->acceptor.listen(acceptOptions_.backlog);
+            // With port 0 the others join the port the first one got
+            port = acceptor->acceptor.local_endpoint().port();
+            listener.acceptors.push_back(std::move(acceptor));
+        }
     } catch (const std::exception& e) {
-        std::cerr << "Failed to start TCP server: " << e.what() << std::endl;
+        LOG_ERROR("Failed to listen on port {}: {}", listener.mapping.localPort, e.what());
+        listener.acceptors.clear();
         return false;
     }
+    listener.mapping.localPort = port;
+    listener.listening = true;
+    return true;
 }
 
 void TCPServer::stop() {
     running_ = false;
+    monitor_.stop();
     io_context_.stop();
-    if (serverThread_.joinable()) {
-        serverThread_.join();
+    for (auto& context : threadContexts_) {
+        context->io.stop();
+    }
+    for (auto& thread : serverThreads_) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+    serverThreads_.clear();
+    for (auto& listener : listeners_) {
+        for (auto& acceptor : listener->acceptors) {
+            boost::system::error_code ec;
+            acceptor->acceptor.close(ec);
+        }
+        listener->listening = false;
     }
-    acceptor_.close();
 }
 
 void TCPServer::sendToAll(const std::string& message, std::shared_ptr<tcp::socket> excludeSocket) {
@@ -44,12 +129,86 @@ void TCPServer::sendToAll(const std::string& message, std::shared_ptr<tcp::socke
 }
 
 void TCPServer::sendToAll(const char* data, size_t size, std::shared_ptr<tcp::socket> excludeSocket) {
-    std::lock_guard<std::mutex> lock(clientsMutex_);
-    for (auto& client : clients_) {
-        if (client != excludeSocket) {
-            boost::asio::async_write(*client, boost::asio::buffer(data, size), [](const boost::system::error_code&, std::size_t) {});
+    broadcast(nullptr, data, size, excludeSocket);
+}
+
+void TCPServer::broadcast(const Listener* listener, const char* data, size_t size,
+                          const std::shared_ptr<tcp::socket>& source) {
+    std::vector<std::shared_ptr<tcp::socket>> slow;
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex_);
+        SharedChunk chunk; // Made for the first recipient; alone on a mapping costs nothing
+        const size_t maxQueued = broadcastOptions_.maxQueuedBytes;
+        const SlowConsumerPolicy policy = broadcastOptions_.policy;
+        auto from = std::find_if(clients_.begin(), clients_.end(),
+                                 [&source](const LocalClient& client) { return client.socket == source; });
+        for (auto& client : clients_) {
+            if (client.socket == source || client.disconnecting || (listener && client.listener != listener)) {
+                continue;
+            }
+            auto multiplexManager = client.manager.lock();
+            if (!multiplexManager) {
+                continue;
+            }
+            if (!chunk) {
+                chunk = std::make_shared<const std::vector<char>>(data, data + size);
+                ++broadcastStats_.chunks;
+            }
+            bool backpressure = policy == SlowConsumerPolicy::Backpressure;
+            auto result = multiplexManager->writeToClient(client.id, chunk, maxQueued, backpressure);
+            if (result == MultiplexManager::QueueResult::Queued) {
+                ++broadcastStats_.deliveries;
+                continue;
+            }
+            if (result == MultiplexManager::QueueResult::NoStream) {
+                continue;
+            }
+            if (policy == SlowConsumerPolicy::Drop) {
+                ++broadcastStats_.dropped;
+                continue;
+            }
+            if (backpressure) {
+                // Queued past the bound anyway; the sender waits until this
+                // client is down to half of it
+                ++broadcastStats_.deliveries;
+                auto sourceManager = from != clients_.end() ? from->manager.lock() : nullptr;
+                if (!sourceManager) {
+                    continue; // sendToAll from outside: nobody to hold back
+                }
+                if (sourceManager->holdReading(from->id)) {
+                    ++broadcastStats_.stalls;
+                    std::weak_ptr<MultiplexManager> weakSource = sourceManager;
+                    StreamId sourceId = from->id;
+                    auto release = [weakSource, sourceId]() {
+                        if (auto manager = weakSource.lock()) {
+                            manager->releaseReading(sourceId);
+                        }
+                    };
+                    if (!multiplexManager->notifyDrained(client.id, maxQueued / 2, release)) {
+                        release();
+                    }
+                    continue;
+                }
+            }
+            ++broadcastStats_.disconnected;
+            LOG_WARN("Local client {} fell more than {} bytes behind the broadcast, disconnecting",
+                     StreamIdText(client.id).c_str(), maxQueued);
+            client.disconnecting = true;
+            slow.push_back(client.socket);
         }
     }
+    // Its read loop sees the shutdown and unregisters it as for any close
+    for (auto& socket : slow) {
+        boost::asio::post(socket->get_executor(), [socket]() {
+            boost::system::error_code ec;
+            socket->shutdown(tcp::socket::shutdown_both, ec);
+        });
+    }
+}
+
+TCPServer::BroadcastStats TCPServer::getBroadcastStats() {
+    std::lock_guard<std::mutex> lock(clientsMutex_);
+    return broadcastStats_;
 }
 
 int TCPServer::getClientCount() {
@@ -57,48 +216,81 @@ int TCPServer::getClientCount() {
     return clients_.size();
 }
 
-void TCPServer::start_accept() {
-    auto socket = std::make_shared<tcp::socket>(io_context_);
-    acceptor_.async_accept(*socket, [this, socket](const boost::system::error_code& error) {
-        if (!error) {
-            std::cout << "New client connected" << std::endl;
-            auto multiplexManager = manager_->getMessageHandler()->getMultiplexManager(manager_->getConnection());
-            std::string id = multiplexManager->addClient(socket);
-            {
-                std::lock_guard<std::mutex> lock(clientsMutex_);
-                clients_.push_back(socket);
-            }
-            start_read(socket, id);
-        }
-        if (running_) {
-            start_accept();
+std::vector<PortMapping> TCPServer::getListeningMappings() {
+    std::vector<PortMapping> mappings;
+    for (auto& listener : listeners_) {
+        if (listener->listening) {
+            mappings.push_back(listener->mapping);
         }
-    });
+    }
+    return mappings;
+}
+
+boost::asio::io_context& TCPServer::threadContext(size_t index) {
+    return index == 0 ? io_context_ : threadContexts_[index - 1]->io;
 }
 
-void TCPServer::start_read(std::shared_ptr<tcp::socket> socket, std::string id) {
-    auto buffer = std::make_shared<std::vector<char>>(1024);
-    socket->async_read_some(boost::asio::buffer(*buffer), [this, socket, buffer, id](const boost::system::error_code& error, std::size_t bytes_transferred) {
+// On the acceptor's strand. Accepted sockets go round robin to the I/O
+// threads' contexts and are registered there.
+void TCPServer::start_accept(Listener& listener, Acceptor& acceptor) {
+    boost::asio::io_context& context = threadContext(nextContext_++ % threadContextCount());
+    acceptor.acceptor.async_accept(context, trackHandler("TCPServer::accept", [this, &listener, &acceptor](const boost::system::error_code& error, tcp::socket peer) {
+        // Re-arm before anything else so the next queued connection is taken
+        // while this one is registered elsewhere
+        if (running_) {
+            start_accept(listener, acceptor);
+        }
         if (!error) {
-            if (manager_->isConnected()) {
-                auto multiplexManager = manager_->getMessageHandler()->getMultiplexManager(manager_->getConnection());
-                multiplexManager->sendTunnelPacket(id, buffer->data(), bytes_transferred, 0);
-            } else {
-                std::cout << "Not connected to Steam, skipping forward" << std::endl;
-            }
-            sendToAll(buffer->data(), bytes_transferred, socket);
-            start_read(socket, id);
-        } else {
-            std::cout << "TCP client " << id << " disconnected or error: " << error.message() << std::endl;
-            // Send disconnect packet
-            if (manager_->isConnected()) {
-                auto multiplexManager = manager_->getMessageHandler()->getMultiplexManager(manager_->getConnection());
-                multiplexManager->sendTunnelPacket(id, nullptr, 0, 1);
-                // Remove client
-                multiplexManager->removeClient(id);
-            }
-            std::lock_guard<std::mutex> lock(clientsMutex_);
-            clients_.erase(std::remove(clients_.begin(), clients_.end(), socket), clients_.end());
+            auto socket = std::make_shared<tcp::socket>(std::move(peer));
+            boost::asio::post(socket->get_executor(), trackHandler("TCPServer::register", [this, &listener, socket]() {
+                register_client(listener, socket);
+            }));
         }
-    });
-}
\ No newline at end of file
+    }));
+}
+
+void TCPServer::register_client(Listener& listener, std::shared_ptr<tcp::socket> socket) {
+    if (!running_) {
+        return;
+    }
+    LOG_INFO("New client connected");
+    auto multiplexManager = tunnelProvider_(listener.mapping.peer);
+    if (!multiplexManager) {
+        LOG_WARN("Not connected to Steam, rejecting local client");
+        boost::system::error_code ec;
+        socket->close(ec);
+        return;
+    }
+    {
+        // The manager owns reading; we only mirror data to the other local
+        // clients and track the client list
+        std::lock_guard<std::mutex> lock(clientsMutex_);
+        StreamId id = multiplexManager->addClient(socket,
+            [this, socket, &listener](const char* data, size_t len) {
+                // Only among clients of the same mapping: a voice port
+                // mustn't see game traffic
+                if (localBroadcast_) {
+                    broadcast(&listener, data, len, socket);
+                }
+            },
+            [this, socket]() { on_client_closed(socket); },
+            listener.mapping.remotePort);
+        clients_.push_back({socket, id, &listener, multiplexManager, false});
+    }
+    if (onClientsChanged_) {
+        onClientsChanged_();
+    }
+}
+
+void TCPServer::on_client_closed(const std::shared_ptr<tcp::socket>& socket) {
+    LOG_INFO("TCP client disconnected");
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex_);
+        clients_.erase(std::remove_if(clients_.begin(), clients_.end(),
+                                      [&socket](const LocalClient& client) { return client.socket == socket; }),
+                       clients_.end());
+    }
+    if (onClientsChanged_) {
+        onClientsChanged_();
+    }
+}
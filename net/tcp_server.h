@@ -1,25 +1,75 @@
 #pragma once
 
 #include <boost/asio.hpp>
+#include <atomic>
 #include <memory>
 #include <vector>
 #include <string>
 #include <thread>
 #include <mutex>
+#include <functional>
 #include <unordered_map>
 #include <isteamnetworkingsockets.h>
 #include <isteamnetworkingutils.h>
 #include <steamnetworkingtypes.h>
 #include "multiplex_manager.h"
-
-class SteamNetworkingManager;
+#include "io_context_monitor.h"
 
 using boost::asio::ip::tcp;
 
-// TCP Server class
+// Connections to localPort are tunneled to remotePort on the host; 0 means
+// the host's own default port. With a mesh, peer names another member
+// (Steam ID) to tunnel to instead of the host.
+struct PortMapping {
+    int localPort;
+    int remotePort;
+    uint64_t peer = 0;
+};
+
+// TCP Server class. Listens on every mapped port; each mapping's streams go
+// through the tunnel the provider returns for its peer. Several accepts stay
+// outstanding on every acceptor and a new connection is registered with its
+// tunnel after the accept is re-armed, so a burst of connections (a launcher
+// opening dozens at once) drains the kernel's accept queue quickly.
+// With local broadcast on, what one client sends is also queued for the
+// other clients of its mapping, bounded per recipient (BroadcastOptions).
 class TCPServer {
 public:
-    TCPServer(int port, SteamNetworkingManager* manager);
+    // Set before start()
+    struct AcceptOptions {
+        int backlog = boost::asio::socket_base::max_listen_connections;
+        int pendingAccepts = 4; // async_accepts kept outstanding per acceptor
+        int threads = 1;        // I/O threads for accepts and the local sockets, each with its own io_context
+        bool reusePort = false; // Linux: an SO_REUSEPORT acceptor per thread, the kernel spreads connections over them
+    };
+
+    // What the local broadcast does with a client that has more than
+    // maxQueuedBytes waiting to be written to it
+    enum class SlowConsumerPolicy {
+        Drop,         // It misses chunks until it catches up (only for protocols that tolerate gaps)
+        Disconnect,   // Its connection is closed
+        Backpressure  // The sender isn't read until it catches up; disconnects it where senders can't be paused (io_uring)
+    };
+    // Set before start()
+    struct BroadcastOptions {
+        size_t maxQueuedBytes = 1024 * 1024; // Per recipient
+        SlowConsumerPolicy policy = SlowConsumerPolicy::Disconnect;
+    };
+    struct BroadcastStats {
+        uint64_t chunks = 0;     // Fanned out to at least one client
+        uint64_t deliveries = 0; // Chunks queued for a client
+        uint64_t dropped = 0;
+        uint64_t disconnected = 0;
+        uint64_t stalls = 0;     // Times a sender was held back
+    };
+
+    // Returns the manager that tunnels local streams to peer (0: the host),
+    // or nullptr while no tunnel is up
+    using TunnelProvider = std::function<std::shared_ptr<MultiplexManager>(uint64_t peer)>;
+
+    TCPServer(int port, TunnelProvider tunnelProvider, std::function<void()> onClientsChanged = nullptr);
+    TCPServer(std::vector<PortMapping> mappings, TunnelProvider tunnelProvider,
+              std::function<void()> onClientsChanged = nullptr);
     ~TCPServer();
 
     bool start();
@@ -27,18 +77,73 @@ public:
     void sendToAll(const std::string& message, std::shared_ptr<tcp::socket> excludeSocket = nullptr);
     void sendToAll(const char* data, size_t size, std::shared_ptr<tcp::socket> excludeSocket = nullptr);
     int getClientCount();
+    // Echo each local client's data to the other local clients (LAN-style hub); on by default
+    void setLocalBroadcast(bool enabled) { localBroadcast_ = enabled; }
+    void setAcceptOptions(const AcceptOptions& options) { acceptOptions_ = options; }
+    void setBroadcastOptions(const BroadcastOptions& options) { broadcastOptions_ = options; }
+    BroadcastStats getBroadcastStats();
+    IoContextMonitor::Snapshot getMonitorSnapshot() const { return monitor_.snapshot(); }
+    // Mappings whose port is being listened on (local port 0 picks a free
+    // one, reported here)
+    std::vector<PortMapping> getListeningMappings();
 
 private:
-    void start_accept();
-    void start_read(std::shared_ptr<tcp::socket> socket, std::string id);
+    // One per acceptor; accepts are started on its strand
+    struct Acceptor {
+        explicit Acceptor(boost::asio::io_context& io) : strand(boost::asio::make_strand(io)), acceptor(strand) {}
+        boost::asio::strand<boost::asio::io_context::executor_type> strand;
+        tcp::acceptor acceptor;
+    };
+
+    struct Listener {
+        PortMapping mapping;
+        std::vector<std::unique_ptr<Acceptor>> acceptors; // More than one with reusePort
+        bool listening;
+    };
+
+    struct LocalClient {
+        std::shared_ptr<tcp::socket> socket;
+        StreamId id;
+        const Listener* listener;
+        std::weak_ptr<MultiplexManager> manager; // The stream's tunnel
+        bool disconnecting = false; // Fell behind the broadcast, being shut down
+    };
+
+    // Every I/O thread runs one io_context: io_context_ for the first, the
+    // rest in threadContexts_. A client socket lives on one of them, so its
+    // handlers never run concurrently, which MultiplexManager relies on.
+    struct ThreadContext {
+        boost::asio::io_context io;
+        boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work{boost::asio::make_work_guard(io)};
+    };
+
+    boost::asio::io_context& threadContext(size_t index);
+    size_t threadContextCount() const { return threadContexts_.size() + 1; }
+
+    bool listen(Listener& listener);
+    void start_accept(Listener& listener, Acceptor& acceptor);
+    // Off the accept path: hands the socket to its tunnel
+    void register_client(Listener& listener, std::shared_ptr<tcp::socket> socket);
+    // To the clients of listener (nullptr: every local client) but source.
+    // The data is copied once into a chunk all their queues share.
+    void broadcast(const Listener* listener, const char* data, size_t size,
+                   const std::shared_ptr<tcp::socket>& source);
+    void on_client_closed(const std::shared_ptr<tcp::socket>& socket);
 
-    int port_;
-    bool running_;
+    std::atomic<bool> running_;
+    bool localBroadcast_;
+    AcceptOptions acceptOptions_;
+    BroadcastOptions broadcastOptions_;
+    BroadcastStats broadcastStats_; // Under clientsMutex_
     boost::asio::io_context io_context_;
     boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work_;
-    tcp::acceptor acceptor_;
-    std::vector<std::shared_ptr<tcp::socket>> clients_;
+    std::vector<std::unique_ptr<ThreadContext>> threadContexts_; // Outlive every socket on them
+    std::atomic<size_t> nextContext_{0}; // Round robin for accepted sockets
+    std::vector<std::unique_ptr<Listener>> listeners_;
+    IoContextMonitor monitor_;
+    std::vector<LocalClient> clients_;
     std::mutex clientsMutex_;
-    std::thread serverThread_;
-    SteamNetworkingManager* manager_;
+    std::vector<std::thread> serverThreads_;
+    TunnelProvider tunnelProvider_;
+    std::function<void()> onClientsChanged_;
 };
\ No newline at end of file
@@ -0,0 +1,111 @@
+#include "tracer.h"
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+const size_t kEventsPerThread = 1 << 16;
+
+struct ThreadBuffer {
+    uint32_t threadId;
+    std::atomic<uint64_t> head{0};
+    TraceEvent events[kEventsPerThread];
+};
+
+// Buffers outlive their threads so a dump still sees events of exited threads
+std::mutex registryMutex;
+std::vector<std::unique_ptr<ThreadBuffer>> registry;
+
+ThreadBuffer* threadBuffer()
+{
+    thread_local ThreadBuffer* buffer = nullptr;
+    if (!buffer)
+    {
+        auto owned = std::make_unique<ThreadBuffer>();
+        std::lock_guard<std::mutex> lock(registryMutex);
+        owned->threadId = static_cast<uint32_t>(registry.size() + 1);
+        buffer = owned.get();
+        registry.push_back(std::move(owned));
+    }
+    return buffer;
+}
+
+void writeJsonString(FILE* f, const char* str, size_t maxLen)
+{
+    std::fputc('"', f);
+    for (size_t i = 0; i < maxLen && str[i]; ++i)
+    {
+        unsigned char c = static_cast<unsigned char>(str[i]);
+        if (c == '"' || c == '\\')
+        {
+            std::fputc('\\', f);
+            std::fputc(c, f);
+        }
+        else if (c < 0x20)
+        {
+            std::fprintf(f, "\\u%04x", c);
+        }
+        else
+        {
+            std::fputc(c, f);
+        }
+    }
+    std::fputc('"', f);
+}
+} // namespace
+
+void Tracer::record(const char* name, const char* streamId, size_t size, int64_t ts, int64_t duration)
+{
+    ThreadBuffer* buffer = threadBuffer();
+    uint64_t head = buffer->head.load(std::memory_order_relaxed);
+    TraceEvent& ev = buffer->events[head & (kEventsPerThread - 1)];
+    ev.timestampNs = ts;
+    ev.durationNs = duration;
+    ev.name = name;
+    copyStreamId(ev.streamId, streamId);
+    ev.size = static_cast<uint32_t>(size);
+    buffer->head.store(head + 1, std::memory_order_release);
+}
+
+bool Tracer::dumpChromeTrace(const std::string& path)
+{
+    FILE* f = std::fopen(path.c_str(), "w");
+    if (!f)
+    {
+        return false;
+    }
+    std::fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", f);
+    bool first = true;
+    std::lock_guard<std::mutex> lock(registryMutex);
+    for (const auto& buffer : registry)
+    {
+        uint64_t head = buffer->head.load(std::memory_order_acquire);
+        uint64_t begin = head > kEventsPerThread ? head - kEventsPerThread : 0;
+        for (uint64_t i = begin; i < head; ++i)
+        {
+            const TraceEvent& ev = buffer->events[i & (kEventsPerThread - 1)];
+            if (!first)
+            {
+                std::fputs(",\n", f);
+            }
+            first = false;
+            std::fputs("{\"name\":", f);
+            writeJsonString(f, ev.name, 64);
+            if (ev.durationNs >= 0)
+            {
+                std::fprintf(f, ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f", ev.timestampNs / 1000.0, ev.durationNs / 1000.0);
+            }
+            else
+            {
+                std::fprintf(f, ",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f", ev.timestampNs / 1000.0);
+            }
+            std::fprintf(f, ",\"pid\":1,\"tid\":%u,\"args\":{\"stream\":", buffer->threadId);
+            writeJsonString(f, ev.streamId, sizeof(ev.streamId));
+            std::fprintf(f, ",\"size\":%u}}", ev.size);
+        }
+    }
+    std::fputs("\n]}\n", f);
+    return std::fclose(f) == 0;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Hot-path tracer. Compiled in only with CONNECTTOOL_TRACE; otherwise the
+// TRACE_* macros expand to nothing. Each thread appends fixed-size events to
+// its own ring buffer (oldest events are overwritten), and dumpChromeTrace()
+// writes all buffers as Chrome trace-event JSON for chrome://tracing / Perfetto.
+struct TraceEvent {
+    int64_t timestampNs;  // steady_clock
+    int64_t durationNs;   // < 0 for instant events
+    const char* name;     // string literal
+    char streamId[8];
+    uint32_t size;
+};
+
+class Tracer {
+public:
+    // streamId: NUL-terminated, at most the first 7 characters are kept
+    static void instant(const char* name, const char* streamId, size_t size)
+    {
+        record(name, streamId, size, nowNs(), -1);
+    }
+    static void complete(const char* name, const char* streamId, size_t size, int64_t startNs)
+    {
+        record(name, streamId, size, startNs, nowNs() - startNs);
+    }
+
+    // Best effort while threads are still tracing: events being overwritten
+    // during the dump may come out garbled
+    static bool dumpChromeTrace(const std::string& path);
+
+    static int64_t nowNs()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    static void copyStreamId(char (&out)[8], const char* streamId)
+    {
+        size_t i = 0;
+        for (; i < sizeof(out) - 1 && streamId[i]; ++i)
+        {
+            out[i] = streamId[i];
+        }
+        out[i] = '\0';
+    }
+
+private:
+    static void record(const char* name, const char* streamId, size_t size, int64_t ts, int64_t duration);
+};
+
+// Records a complete ("X") event spanning the enclosing scope
+class TraceScope {
+public:
+    TraceScope(const char* name, const char* streamId, size_t size)
+        : name_(name), size_(size), start_(Tracer::nowNs())
+    {
+        Tracer::copyStreamId(streamId_, streamId);
+    }
+    ~TraceScope() { Tracer::complete(name_, streamId_, size_, start_); }
+
+private:
+    const char* name_;
+    char streamId_[8];
+    size_t size_;
+    int64_t start_;
+};
+
+#ifdef CONNECTTOOL_TRACE
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_EVENT(name, streamId, size) Tracer::instant(name, streamId, size)
+#define TRACE_SCOPE(name, streamId, size) TraceScope TRACE_CONCAT(traceScope_, __LINE__)(name, streamId, size)
+#else
+#define TRACE_EVENT(name, streamId, size) ((void)0)
+#define TRACE_SCOPE(name, streamId, size) ((void)0)
+#endif
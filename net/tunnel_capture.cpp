@@ -0,0 +1,291 @@
+#include "tunnel_capture.h"
+#include "logger.h"
+#include "tunnel_frame.h"
+#include <chrono>
+#include <cstring>
+#include <new>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace {
+const char kMagic[8] = {'C', 'T', 'C', 'A', 'P', 0, 0, 1};
+const uint32_t kVersion = 1;
+const size_t kGrowChunk = 64 * 1024 * 1024;
+
+int64_t steadyNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+} // namespace
+
+TunnelCapture& TunnelCapture::instance()
+{
+    static TunnelCapture capture;
+    return capture;
+}
+
+TunnelCapture::~TunnelCapture()
+{
+    stop();
+}
+
+bool TunnelCapture::start(const std::string& path)
+{
+    if (active_)
+    {
+        return false;
+    }
+    // Reap a writer that stopped on its own after an I/O failure
+    stop();
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        LOG_ERROR("Failed to open capture file {}", path);
+        return false;
+    }
+    file_ = file;
+#else
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0)
+    {
+        LOG_ERROR("Failed to open capture file {}", path);
+        return false;
+    }
+#endif
+    if (!mapFile(kGrowChunk))
+    {
+        unmapFile();
+        return false;
+    }
+
+    CaptureFileHeader header{};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.headerSize = sizeof(CaptureFileHeader);
+    header.startTimeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             std::chrono::system_clock::now().time_since_epoch())
+                             .count();
+    std::memcpy(base_, &header, sizeof(header));
+    writeOffset_ = sizeof(header);
+
+    if (!ring_)
+    {
+        // Kept across restarts: a producer may still be inside enqueue()
+        ring_ = std::make_unique<MpscRing<Slot>>(2048);
+    }
+    records_ = 0;
+    dropped_ = 0;
+    startSteadyNs_ = steadyNs();
+    active_ = true;
+    writerThread_ = std::thread([this]() { writerLoop(); });
+    LOG_INFO("Tunnel capture started: {}", path);
+    return true;
+}
+
+void TunnelCapture::stop()
+{
+    active_ = false;
+    if (!writerThread_.joinable())
+    {
+        return;
+    }
+    writerThread_.join();
+    unmapFile();
+    LOG_INFO("Tunnel capture stopped: {} records, {} dropped", records_.load(), dropped_.load());
+}
+
+void TunnelCapture::enqueue(CaptureDirection direction, HSteamNetConnection conn, const void* frame, size_t size)
+{
+    std::unique_ptr<char[]> large;
+    if (size > kMaxFrame)
+    {
+        large.reset(new (std::nothrow) char[size]);
+        if (!large)
+        {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        std::memcpy(large.get(), frame, size);
+    }
+    int64_t now = steadyNs();
+    bool pushed = ring_->tryPush([&](Slot& slot) {
+        slot.header.frameSize = static_cast<uint32_t>(size);
+        slot.header.connection = conn;
+        slot.header.timestampNs = now - startSteadyNs_;
+        slot.header.direction = static_cast<uint8_t>(direction);
+        std::memset(slot.header.reserved, 0, sizeof(slot.header.reserved));
+        std::memset(slot.header.streamId, 0, sizeof(slot.header.streamId));
+        streamIdToWire(frameStreamId(static_cast<const char*>(frame), size), slot.header.streamId);
+        slot.large = std::move(large);
+        if (!slot.large)
+        {
+            std::memcpy(slot.frame, frame, size);
+        }
+    });
+    if (!pushed)
+    {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void TunnelCapture::writerLoop()
+{
+    bool ok = true;
+    auto drain = [&]() {
+        bool any = false;
+        while (ok && ring_->tryPop([&](Slot& slot) {
+                   ok = append(slot);
+                   slot.large.reset();
+               }))
+        {
+            any = true;
+        }
+        return any;
+    };
+    while (active_.load(std::memory_order_relaxed) && ok)
+    {
+        if (!drain())
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    drain();
+}
+
+bool TunnelCapture::append(const Slot& slot)
+{
+    size_t needed = sizeof(CaptureRecordHeader) + slot.header.frameSize;
+    if (writeOffset_ + needed > mappedSize_ && !mapFile(mappedSize_ + kGrowChunk))
+    {
+        LOG_ERROR("Tunnel capture stopped: cannot grow capture file");
+        active_ = false;
+        return false;
+    }
+    std::memcpy(base_ + writeOffset_, &slot.header, sizeof(CaptureRecordHeader));
+    std::memcpy(base_ + writeOffset_ + sizeof(CaptureRecordHeader), slot.data(), slot.header.frameSize);
+    writeOffset_ += needed;
+    records_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+#ifdef _WIN32
+bool TunnelCapture::mapFile(size_t size)
+{
+    if (base_)
+    {
+        UnmapViewOfFile(base_);
+        CloseHandle(mapping_);
+        base_ = nullptr;
+        mapping_ = nullptr;
+    }
+    mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READWRITE, static_cast<DWORD>(uint64_t(size) >> 32),
+                                  static_cast<DWORD>(size & 0xffffffffu), nullptr);
+    if (!mapping_)
+    {
+        return false;
+    }
+    base_ = static_cast<char*>(MapViewOfFile(mapping_, FILE_MAP_ALL_ACCESS, 0, 0, size));
+    mappedSize_ = base_ ? size : 0;
+    return base_ != nullptr;
+}
+
+void TunnelCapture::unmapFile()
+{
+    if (base_)
+    {
+        UnmapViewOfFile(base_);
+        base_ = nullptr;
+    }
+    if (mapping_)
+    {
+        CloseHandle(mapping_);
+        mapping_ = nullptr;
+    }
+    if (file_)
+    {
+        // Trim the preallocated tail
+        LARGE_INTEGER end;
+        end.QuadPart = static_cast<LONGLONG>(writeOffset_);
+        SetFilePointerEx(file_, end, nullptr, FILE_BEGIN);
+        SetEndOfFile(file_);
+        CloseHandle(file_);
+        file_ = nullptr;
+    }
+    mappedSize_ = 0;
+}
+#else
+bool TunnelCapture::mapFile(size_t size)
+{
+    if (base_)
+    {
+        munmap(base_, mappedSize_);
+        base_ = nullptr;
+    }
+    if (ftruncate(fd_, static_cast<off_t>(size)) != 0)
+    {
+        return false;
+    }
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (addr == MAP_FAILED)
+    {
+        mappedSize_ = 0;
+        return false;
+    }
+    base_ = static_cast<char*>(addr);
+    mappedSize_ = size;
+    return true;
+}
+
+void TunnelCapture::unmapFile()
+{
+    if (base_)
+    {
+        munmap(base_, mappedSize_);
+        base_ = nullptr;
+    }
+    if (fd_ >= 0)
+    {
+        // Trim the preallocated tail
+        if (ftruncate(fd_, static_cast<off_t>(writeOffset_)) != 0)
+        {
+            LOG_WARN("Failed to trim capture file");
+        }
+        ::close(fd_);
+        fd_ = -1;
+    }
+    mappedSize_ = 0;
+}
+#endif
+
+bool CaptureReader::open(const std::string& path)
+{
+    file_.reset(std::fopen(path.c_str(), "rb"));
+    if (!file_ || std::fread(&header_, sizeof(header_), 1, file_.get()) != 1)
+    {
+        return false;
+    }
+    if (std::memcmp(header_.magic, kMagic, sizeof(kMagic)) != 0 || header_.version != kVersion)
+    {
+        return false;
+    }
+    return std::fseek(file_.get(), static_cast<long>(header_.headerSize), SEEK_SET) == 0;
+}
+
+bool CaptureReader::next(Record& record)
+{
+    if (!file_ || std::fread(&record.header, sizeof(record.header), 1, file_.get()) != 1)
+    {
+        return false;
+    }
+    record.frame.resize(record.header.frameSize);
+    return record.header.frameSize == 0 ||
+           std::fread(record.frame.data(), 1, record.frame.size(), file_.get()) == record.frame.size();
+}
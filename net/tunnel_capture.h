@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <steamnetworkingtypes.h>
+#include "mpsc_ring.h"
+
+// Optional recording of every tunnel frame into an append-only, memory-mapped
+// capture file. record() only copies the frame into a lock-free ring; a
+// writer thread appends to the mapping, growing it in chunks. When the ring
+// is full the frame is dropped and counted, so forwarding never waits.
+//
+// File layout: CaptureFileHeader, then CaptureRecordHeader + frame bytes per
+// record, all little-endian.
+enum class CaptureDirection : uint8_t { Inbound = 0, Outbound = 1 };
+
+#pragma pack(push, 1)
+struct CaptureFileHeader {
+    char magic[8];        // "CTCAP\0\0\1"
+    uint32_t version;
+    uint32_t headerSize;
+    int64_t startTimeNs;  // system_clock at capture start
+};
+
+struct CaptureRecordHeader {
+    uint32_t frameSize;
+    uint32_t connection;
+    int64_t timestampNs;  // Since capture start
+    uint8_t direction;
+    uint8_t reserved[3];
+    char streamId[8];     // Copy of the frame's stream ID, for filtering
+};
+#pragma pack(pop)
+
+class TunnelCapture {
+public:
+    static TunnelCapture& instance();
+
+    bool start(const std::string& path);
+    void stop();
+    bool active() const { return active_.load(std::memory_order_relaxed); }
+
+    void record(CaptureDirection direction, HSteamNetConnection conn, const void* frame, size_t size)
+    {
+        if (active_.load(std::memory_order_relaxed))
+        {
+            enqueue(direction, conn, frame, size);
+        }
+    }
+
+    uint64_t recordCount() const { return records_.load(std::memory_order_relaxed); }
+    uint64_t droppedCount() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    // Frames up to this size are copied into the slot itself. Larger ones
+    // (shared-memory and endpoint frames, bulk frames up to kMaxFrameSize)
+    // go to a heap copy the slot owns until the writer has appended it.
+    static constexpr size_t kMaxFrame = 4096;
+
+    struct Slot {
+        CaptureRecordHeader header;
+        char frame[kMaxFrame];
+        std::unique_ptr<char[]> large;
+
+        const char* data() const { return large ? large.get() : frame; }
+    };
+
+    TunnelCapture() = default;
+    ~TunnelCapture();
+
+    void enqueue(CaptureDirection direction, HSteamNetConnection conn, const void* frame, size_t size);
+    void writerLoop();
+    bool append(const Slot& slot);
+    bool mapFile(size_t size);
+    void unmapFile();
+
+    std::atomic<bool> active_{false};
+    std::atomic<uint64_t> records_{0};
+    std::atomic<uint64_t> dropped_{0};
+    std::unique_ptr<MpscRing<Slot>> ring_;
+    std::thread writerThread_;
+    int64_t startSteadyNs_ = 0;
+
+    // Writer thread only
+#ifdef _WIN32
+    void* file_ = nullptr;
+    void* mapping_ = nullptr;
+#else
+    int fd_ = -1;
+#endif
+    char* base_ = nullptr;
+    size_t mappedSize_ = 0;
+    size_t writeOffset_ = 0;
+};
+
+// Sequential reader for capture files, used by the replay tool
+class CaptureReader {
+public:
+    struct Record {
+        CaptureRecordHeader header;
+        std::vector<char> frame;
+    };
+
+    bool open(const std::string& path);
+    bool next(Record& record);
+    const CaptureFileHeader& header() const { return header_; }
+
+private:
+    std::unique_ptr<FILE, int (*)(FILE*)> file_{nullptr, &std::fclose};
+    CaptureFileHeader header_{};
+};
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Stream IDs travel as 6 ASCII characters plus a NUL; in memory the 6 bytes
+// are packed into an integer so lookups and handler captures never allocate
+using StreamId = uint64_t;
+
+constexpr size_t kStreamIdWireSize = 7;
+
+inline StreamId streamIdFromWire(const char* data)
+{
+    StreamId id = 0;
+    for (int i = 0; i < 6; ++i)
+    {
+        id |= static_cast<StreamId>(static_cast<unsigned char>(data[i])) << (8 * i);
+    }
+    return id;
+}
+
+inline void streamIdToWire(StreamId id, char* out)
+{
+    for (int i = 0; i < 6; ++i)
+    {
+        out[i] = static_cast<char>((id >> (8 * i)) & 0xff);
+    }
+    out[6] = '\0';
+}
+
+// Printable stream ID for logs and traces
+struct StreamIdText {
+    explicit StreamIdText(StreamId id) { streamIdToWire(id, text); }
+    const char* c_str() const { return text; }
+    char text[kStreamIdWireSize];
+};
+
+// Tunnel frames start with one of two headers, told apart by the first byte:
+//   legacy:  stream ID (6 characters + NUL), uint32 type in host byte order
+//   compact: 0xC0 | type, then the 6 ID bytes
+// Stream IDs are ASCII and control frames use ID 0, so a legacy frame never
+// starts with a byte of 0x80 or more. Receivers take either; a sender only
+// uses compact once the peer said it decodes it (kFeatureCompactHeader).
+constexpr size_t kLegacyHeaderSize = kStreamIdWireSize + sizeof(uint32_t);
+constexpr size_t kCompactHeaderSize = 1 + 6;
+constexpr size_t kMaxFrameHeaderSize = kLegacyHeaderSize;
+constexpr unsigned char kCompactMarker = 0xC0;
+constexpr unsigned char kCompactMarkerMask = 0xE0;
+constexpr uint32_t kCompactMaxType = 0x1F;
+
+struct FrameHeader {
+    StreamId id = 0;
+    uint32_t type = 0;
+    size_t size = 0; // Bytes before the payload
+};
+
+inline bool isCompactFrame(const char* data, size_t len)
+{
+    return len > 0 && (static_cast<unsigned char>(data[0]) & kCompactMarkerMask) == kCompactMarker;
+}
+
+inline bool decodeFrameHeader(const char* data, size_t len, FrameHeader& header)
+{
+    if (isCompactFrame(data, len))
+    {
+        if (len < kCompactHeaderSize)
+        {
+            return false;
+        }
+        header.type = static_cast<unsigned char>(data[0]) & kCompactMaxType;
+        header.id = streamIdFromWire(data + 1);
+        header.size = kCompactHeaderSize;
+        return true;
+    }
+    if (len < kLegacyHeaderSize)
+    {
+        return false;
+    }
+    header.id = streamIdFromWire(data);
+    std::memcpy(&header.type, data + kStreamIdWireSize, sizeof(header.type));
+    header.size = kLegacyHeaderSize;
+    return true;
+}
+
+// Writes the header into out (room for kMaxFrameHeaderSize bytes) and
+// returns its size; types above kCompactMaxType always go legacy
+inline size_t encodeFrameHeader(char* out, StreamId id, uint32_t type, bool compact)
+{
+    if (compact && type <= kCompactMaxType)
+    {
+        out[0] = static_cast<char>(kCompactMarker | type);
+        for (int i = 0; i < 6; ++i)
+        {
+            out[1 + i] = static_cast<char>((id >> (8 * i)) & 0xff);
+        }
+        return kCompactHeaderSize;
+    }
+    streamIdToWire(id, out);
+    std::memcpy(out + kStreamIdWireSize, &type, sizeof(type));
+    return kLegacyHeaderSize;
+}
+
+// The stream ID of a frame in either encoding, 0 if it's too short
+inline StreamId frameStreamId(const char* data, size_t len)
+{
+    FrameHeader header;
+    return decodeFrameHeader(data, len, header) ? header.id : 0;
+}
+
+// Protocol version and capabilities, exchanged in the session hello and
+// welcome so each connection uses the best encoding both ends understand.
+// Version 1 is everything before the exchange: its hello and welcome end
+// where the capabilities would start, and older peers ignore the extra bytes.
+constexpr uint16_t kProtocolVersion = 2;
+
+constexpr uint32_t kFeatureCompactHeader = 1u << 0; // Compact frame headers with integer IDs
+constexpr uint32_t kFeatureLanes = 1u << 1;         // Bonded connections (lane joins)
+constexpr uint32_t kFeatureBatching = 1u << 2;      // Reserved: several frames per message
+constexpr uint32_t kFeatureCompression = 1u << 3;   // Reserved: compressed payloads
+constexpr uint32_t kLocalFeatures = kFeatureCompactHeader | kFeatureLanes;
+
+// Steam's limit on one reliable message
+constexpr uint32_t kMaxFrameSize = 512 * 1024;
+
+struct Capabilities {
+    uint16_t version = 1;
+    uint32_t maxFrame = kMaxFrameSize; // Largest frame the peer accepts
+    uint32_t features = kFeatureLanes; // Version 1 peers can take lane joins
+
+    static Capabilities local() { return Capabilities{kProtocolVersion, kMaxFrameSize, kLocalFeatures}; }
+    bool has(uint32_t feature) const { return (features & feature) == feature; }
+};
+
+// Little-endian on the wire: u16 version, u16 reserved, u32 max frame, u32 features
+constexpr size_t kCapabilitiesWireSize = 12;
+
+inline void writeCapabilities(char* out, const Capabilities& caps)
+{
+    auto put = [&out](uint32_t value, int bytes) {
+        for (int i = 0; i < bytes; ++i)
+        {
+            *out++ = static_cast<char>((value >> (8 * i)) & 0xff);
+        }
+    };
+    put(caps.version, 2);
+    put(0, 2);
+    put(caps.maxFrame, 4);
+    put(caps.features, 4);
+}
+
+// false (caps untouched) if the block isn't there: a version 1 peer
+inline bool readCapabilities(const char* data, size_t len, Capabilities& caps)
+{
+    if (len < kCapabilitiesWireSize)
+    {
+        return false;
+    }
+    auto get = [&data](int offset, int bytes) {
+        uint32_t value = 0;
+        for (int i = 0; i < bytes; ++i)
+        {
+            value |= static_cast<uint32_t>(static_cast<unsigned char>(data[offset + i])) << (8 * i);
+        }
+        return value;
+    };
+    uint16_t version = static_cast<uint16_t>(get(0, 2));
+    if (version < 2)
+    {
+        return false;
+    }
+    caps.version = version;
+    caps.maxFrame = get(4, 4);
+    caps.features = get(8, 4);
+    return true;
+}
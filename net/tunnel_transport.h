@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <isteamnetworkingsockets.h>
+#include <steamnetworkingtypes.h>
+
+// What a connection can carry right now, for spreading load over bonded
+// connections
+struct LaneStatus {
+    uint64_t sendRate = 0;     // Bytes/s the connection's rate control allows
+    uint64_t pendingBytes = 0; // Queued and not sent yet
+};
+
+// Outgoing side of the Steam link as seen by MultiplexManager. The Steam
+// implementation forwards to ISteamNetworkingSockets; benchmarks and tools
+// plug in in-process stand-ins.
+class TunnelTransport {
+public:
+    virtual ~TunnelTransport() = default;
+    virtual EResult send(HSteamNetConnection conn, const void* data, uint32 size, int sendFlags) = 0;
+    // false if the transport can't tell; lanes are then weighted equally
+    virtual bool laneStatus(HSteamNetConnection, LaneStatus&) { return false; }
+};
+
+class SteamTunnelTransport : public TunnelTransport {
+public:
+    explicit SteamTunnelTransport(ISteamNetworkingSockets* steamInterface) : steamInterface_(steamInterface) {}
+
+    EResult send(HSteamNetConnection conn, const void* data, uint32 size, int sendFlags) override
+    {
+        return steamInterface_->SendMessageToConnection(conn, data, size, sendFlags, nullptr);
+    }
+
+    bool laneStatus(HSteamNetConnection conn, LaneStatus& status) override
+    {
+        SteamNetConnectionRealTimeStatus_t realTime;
+        if (steamInterface_->GetConnectionRealTimeStatus(conn, &realTime, 0, nullptr) != k_EResultOK)
+        {
+            return false;
+        }
+        status.sendRate = realTime.m_nSendRateBytesPerSecond > 0 ? realTime.m_nSendRateBytesPerSecond : 0;
+        status.pendingBytes = realTime.m_cbPendingReliable > 0 ? realTime.m_cbPendingReliable : 0;
+        return true;
+    }
+
+private:
+    ISteamNetworkingSockets* steamInterface_;
+};
@@ -0,0 +1,454 @@
+#include "uring_engine.h"
+#include "logger.h"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define CONNECTTOOL_HAS_URING 1
+#include <cerrno>
+#include <cstdio>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+std::atomic<int> g_requested{-1}; // -1: not decided yet, read CONNECTTOOL_IO
+
+bool requested()
+{
+    int value = g_requested.load();
+    if (value < 0)
+    {
+        const char* env = std::getenv("CONNECTTOOL_IO");
+        value = (env && std::strcmp(env, "uring") == 0) ? 1 : 0;
+        g_requested.store(value);
+    }
+    return value == 1;
+}
+
+#ifdef CONNECTTOOL_HAS_URING
+// Low bits of user_data say what completed; the rest is the UringSocket (or barrier) pointer
+enum : uint64_t { kOpRecv = 1, kOpSend = 2, kOpBarrier = 3, kOpWake = 4, kOpMask = 7 };
+const uint16_t kBufferGroup = 0;
+
+struct Barrier {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+};
+
+bool kernelAtLeast(int major, int minor)
+{
+    utsname info{};
+    if (uname(&info) != 0)
+    {
+        return false;
+    }
+    int kMajor = 0, kMinor = 0;
+    if (std::sscanf(info.release, "%d.%d", &kMajor, &kMinor) != 2)
+    {
+        return false;
+    }
+    return kMajor > major || (kMajor == major && kMinor >= minor);
+}
+#endif
+} // namespace
+
+#ifdef CONNECTTOOL_HAS_URING
+
+struct UringEngine::Ring {
+    int fd = -1;
+    void* sqPtr = MAP_FAILED;
+    size_t sqSize = 0;
+    void* cqPtr = MAP_FAILED;
+    size_t cqSize = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqesSize = 0;
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned sqMask = 0;
+    unsigned sqEntries = 0;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    unsigned cqMask = 0;
+
+    io_uring_buf_ring* bufRing = static_cast<io_uring_buf_ring*>(MAP_FAILED);
+    size_t bufRingSize = 0;
+    char* buffers = static_cast<char*>(MAP_FAILED);
+    unsigned bufCount = 0;
+    unsigned bufSize = 0;
+    uint16_t bufTail = 0; // Engine thread only after init
+
+    ~Ring()
+    {
+        if (buffers != MAP_FAILED) munmap(buffers, static_cast<size_t>(bufCount) * bufSize);
+        if (bufRing != MAP_FAILED) munmap(bufRing, bufRingSize);
+        if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+        if (cqPtr != MAP_FAILED && cqPtr != sqPtr) munmap(cqPtr, cqSize);
+        if (sqPtr != MAP_FAILED) munmap(sqPtr, sqSize);
+        if (fd >= 0) close(fd);
+    }
+
+    int enter(unsigned toSubmit, unsigned minComplete, unsigned flags)
+    {
+        int ret = static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+        return ret < 0 ? -errno : ret;
+    }
+
+    void addBuffer(uint16_t bid)
+    {
+        // Entries start at the ring base (the header's tail overlays bufs[0]);
+        // not via bufs[], which the flex-array macro pushes to offset 16 in C++
+        io_uring_buf& buf = reinterpret_cast<io_uring_buf*>(bufRing)[bufTail & (bufCount - 1)];
+        buf.addr = reinterpret_cast<uint64_t>(buffers + static_cast<size_t>(bid) * bufSize);
+        buf.len = bufSize;
+        buf.bid = bid;
+        ++bufTail;
+    }
+
+    void publishBuffers() { __atomic_store_n(&bufRing->tail, bufTail, __ATOMIC_RELEASE); }
+};
+
+UringEngine* UringEngine::instance()
+{
+    if (!requested())
+    {
+        return nullptr;
+    }
+    // Created once, on first use; a failed probe sticks for the process
+    static std::unique_ptr<UringEngine> engine = []() {
+        std::unique_ptr<UringEngine> e(new UringEngine());
+        if (!kernelAtLeast(6, 0) || !e->init(512, 4096, 1024))
+        {
+            LOG_WARN("io_uring not available (needs Linux 6.0+), falling back to epoll");
+            return std::unique_ptr<UringEngine>();
+        }
+        LOG_INFO("Local socket I/O uses io_uring");
+        return e;
+    }();
+    return engine.get();
+}
+
+bool UringEngine::init(unsigned entries, unsigned bufferCount, unsigned bufferSize)
+{
+    ring_ = std::make_unique<Ring>();
+    Ring& r = *ring_;
+
+    io_uring_params params{};
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = bufferCount * 2; // Room for a full buffer ring of receives plus sends
+    r.fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (r.fd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+    {
+        return false;
+    }
+
+    r.sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r.cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    r.sqSize = r.cqSize = r.sqSize > r.cqSize ? r.sqSize : r.cqSize;
+    r.sqPtr = mmap(nullptr, r.sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_SQ_RING);
+    if (r.sqPtr == MAP_FAILED)
+    {
+        return false;
+    }
+    r.cqPtr = r.sqPtr;
+    r.sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    r.sqes = static_cast<io_uring_sqe*>(
+        mmap(nullptr, r.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_SQES));
+    if (r.sqes == MAP_FAILED)
+    {
+        return false;
+    }
+    char* sq = static_cast<char*>(r.sqPtr);
+    r.sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    r.sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    r.sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    r.sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    r.sqEntries = params.sq_entries;
+    char* cq = static_cast<char*>(r.cqPtr);
+    r.cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    r.cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    r.cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    r.cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    // The ops we rely on
+    size_t probeSize = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+    std::unique_ptr<char[]> probeBuffer(new char[probeSize]());
+    auto* probe = reinterpret_cast<io_uring_probe*>(probeBuffer.get());
+    if (syscall(__NR_io_uring_register, r.fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+    {
+        return false;
+    }
+    for (int op : {IORING_OP_NOP, IORING_OP_RECV, IORING_OP_SENDMSG})
+    {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+        {
+            return false;
+        }
+    }
+
+    // Registered ring of provided receive buffers
+    r.bufCount = bufferCount;
+    r.bufSize = bufferSize;
+    r.bufRingSize = bufferCount * sizeof(io_uring_buf);
+    r.bufRing = static_cast<io_uring_buf_ring*>(
+        mmap(nullptr, r.bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    r.buffers = static_cast<char*>(mmap(nullptr, static_cast<size_t>(bufferCount) * bufferSize,
+                                        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (r.bufRing == MAP_FAILED || r.buffers == MAP_FAILED)
+    {
+        return false;
+    }
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(r.bufRing);
+    reg.ring_entries = bufferCount;
+    reg.bgid = kBufferGroup;
+    if (syscall(__NR_io_uring_register, r.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        return false;
+    }
+    for (unsigned i = 0; i < bufferCount; ++i)
+    {
+        r.addBuffer(static_cast<uint16_t>(i));
+    }
+    r.publishBuffers();
+
+    thread_ = std::thread([this]() { run(); });
+    threadId_ = thread_.get_id();
+    return true;
+}
+
+UringEngine::~UringEngine()
+{
+    if (thread_.joinable())
+    {
+        stopping_ = true;
+        submit(IORING_OP_NOP, -1, nullptr, 0, kOpWake, 0, 0, 0);
+        thread_.join();
+    }
+}
+
+void UringEngine::startReceive(int fd, UringSocket* socket)
+{
+    submit(IORING_OP_RECV, fd, nullptr, 0, reinterpret_cast<uint64_t>(socket) | kOpRecv, 0, IORING_RECV_MULTISHOT,
+           IOSQE_BUFFER_SELECT);
+}
+
+void UringEngine::send(int fd, const UringIoVec* iov, size_t count, UringSocket* socket)
+{
+    static_assert(sizeof(msghdr) <= sizeof(socket->sendHeader_), "msghdr doesn't fit");
+    static_assert(sizeof(UringIoVec) == sizeof(iovec) && offsetof(UringIoVec, len) == offsetof(iovec, iov_len),
+                  "UringIoVec must match iovec");
+    auto* msg = new (socket->sendHeader_) msghdr();
+    msg->msg_iov = reinterpret_cast<iovec*>(const_cast<UringIoVec*>(iov));
+    msg->msg_iovlen = count;
+    submit(IORING_OP_SENDMSG, fd, msg, 1, reinterpret_cast<uint64_t>(socket) | kOpSend, MSG_NOSIGNAL, 0, 0);
+}
+
+void UringEngine::barrier()
+{
+    if (std::this_thread::get_id() == threadId_)
+    {
+        return;
+    }
+    Barrier b;
+    submit(IORING_OP_NOP, -1, nullptr, 0, reinterpret_cast<uint64_t>(&b) | kOpBarrier, 0, 0, 0);
+    std::unique_lock<std::mutex> lock(b.mutex);
+    b.cv.wait(lock, [&b]() { return b.done; });
+}
+
+UringEngine::Stats UringEngine::stats() const
+{
+    Stats s;
+    s.submitted = submitted_.load(std::memory_order_relaxed);
+    s.completions = completions_.load(std::memory_order_relaxed);
+    s.enterCalls = enterCalls_.load(std::memory_order_relaxed);
+    s.bufferStarvation = bufferStarvation_.load(std::memory_order_relaxed);
+    return s;
+}
+
+void UringEngine::submit(uint8_t opcode, int fd, const void* addr, uint32_t len, uint64_t userData, uint32_t opFlags,
+                         uint16_t ioprio, uint8_t sqeFlags)
+{
+    Ring& r = *ring_;
+    std::lock_guard<std::mutex> lock(submitMutex_);
+    unsigned tail = *r.sqTail;
+    // Fewer than sqEntries SQEs are ever left unsubmitted and submission is
+    // synchronous, so this slot has been consumed
+    unsigned index = tail & r.sqMask;
+    io_uring_sqe* sqe = &r.sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->flags = sqeFlags;
+    sqe->ioprio = ioprio;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(addr);
+    sqe->len = len;
+    sqe->msg_flags = opFlags;
+    sqe->user_data = userData;
+    if (sqeFlags & IOSQE_BUFFER_SELECT)
+    {
+        sqe->buf_group = kBufferGroup;
+    }
+    r.sqArray[index] = index;
+    __atomic_store_n(r.sqTail, tail + 1, __ATOMIC_RELEASE);
+    submitted_.fetch_add(1, std::memory_order_relaxed);
+    ++unsubmitted_;
+    // Callbacks on the engine thread leave their SQEs for the next wait,
+    // which submits and sleeps in one io_uring_enter
+    if (std::this_thread::get_id() == threadId_ && unsubmitted_ < r.sqEntries / 2)
+    {
+        return;
+    }
+    flush(unsubmitted_, 0, 0);
+    unsubmitted_ = 0;
+}
+
+// Every queued SQE is always covered by some caller's toSubmit, so the
+// kernel has consumed a slot before submit() reuses it
+int UringEngine::flush(unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    Ring& r = *ring_;
+    int ret;
+    do
+    {
+        ret = r.enter(toSubmit, minComplete, flags);
+        enterCalls_.fetch_add(1, std::memory_order_relaxed);
+    } while (ret == -EINTR || ret == -EAGAIN || ret == -EBUSY);
+    if (ret < 0)
+    {
+        LOG_ERROR("io_uring_enter failed: {}", std::strerror(-ret));
+    }
+    return ret;
+}
+
+void UringEngine::run()
+{
+    Ring& r = *ring_;
+    for (;;)
+    {
+        unsigned head = *r.cqHead;
+        unsigned tail = __atomic_load_n(r.cqTail, __ATOMIC_ACQUIRE);
+        unsigned toSubmit;
+        {
+            std::lock_guard<std::mutex> lock(submitMutex_);
+            toSubmit = unsubmitted_;
+            unsubmitted_ = 0;
+        }
+        if (head == tail)
+        {
+            // Idle: submit what the last batch queued and sleep in one call
+            flush(toSubmit, 1, IORING_ENTER_GETEVENTS);
+            continue;
+        }
+        if (toSubmit > 0)
+        {
+            // Busy: don't hold the last batch's sends back behind this one
+            flush(toSubmit, 0, 0);
+        }
+        bool recycled = false;
+        for (; head != tail; ++head)
+        {
+            const io_uring_cqe& cqe = r.cqes[head & r.cqMask];
+            uint64_t op = cqe.user_data & kOpMask;
+            int res = cqe.res;
+            unsigned flags = cqe.flags;
+            // Release the slot before running callbacks, which may submit
+            __atomic_store_n(r.cqHead, head + 1, __ATOMIC_RELEASE);
+            completions_.fetch_add(1, std::memory_order_relaxed);
+
+            if (op == kOpWake && stopping_)
+            {
+                return;
+            }
+            if (op == kOpBarrier)
+            {
+                auto* b = reinterpret_cast<Barrier*>(cqe.user_data & ~kOpMask);
+                std::lock_guard<std::mutex> lock(b->mutex);
+                b->done = true;
+                b->cv.notify_all();
+                continue;
+            }
+            auto* socket = reinterpret_cast<UringSocket*>(cqe.user_data & ~kOpMask);
+            if (op == kOpSend)
+            {
+                socket->onUringSent(res);
+            }
+            else if (op == kOpRecv)
+            {
+                if (res > 0 && (flags & IORING_CQE_F_BUFFER))
+                {
+                    uint16_t bid = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+                    socket->onUringData(r.buffers + static_cast<size_t>(bid) * r.bufSize, static_cast<size_t>(res));
+                    r.addBuffer(bid);
+                    recycled = true;
+                }
+                if (!(flags & IORING_CQE_F_MORE))
+                {
+                    if (res > 0 || res == -ENOBUFS)
+                    {
+                        // Terminated without an error on the socket; keep receiving
+                        if (res == -ENOBUFS)
+                        {
+                            bufferStarvation_.fetch_add(1, std::memory_order_relaxed);
+                            r.publishBuffers();
+                        }
+                        startReceive(socket->uringFd(), socket);
+                    }
+                    else
+                    {
+                        socket->onUringReceiveEnd(res);
+                    }
+                }
+            }
+        }
+        if (recycled)
+        {
+            r.publishBuffers();
+        }
+    }
+}
+
+#else // No io_uring on this platform
+
+struct UringEngine::Ring {
+};
+
+UringEngine* UringEngine::instance()
+{
+    static bool warned = false;
+    if (requested() && !warned)
+    {
+        warned = true;
+        LOG_WARN("io_uring not supported on this platform, using the default reactor");
+    }
+    return nullptr;
+}
+
+UringEngine::~UringEngine() = default;
+void UringEngine::startReceive(int, UringSocket*) {}
+void UringEngine::send(int, const UringIoVec*, size_t, UringSocket*) {}
+void UringEngine::barrier() {}
+UringEngine::Stats UringEngine::stats() const { return Stats(); }
+
+#endif
+
+void UringEngine::setRequested(bool requested)
+{
+    g_requested.store(requested ? 1 : 0);
+}
+
+const char* UringEngine::backendName()
+{
+    return instance() ? "io_uring" : "asio";
+}
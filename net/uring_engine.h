@@ -0,0 +1,92 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// One piece of a gathered send; laid out like struct iovec
+struct UringIoVec {
+    const void* data;
+    size_t len;
+};
+
+// Completion target for one socket driven by UringEngine. Callbacks run on
+// the engine thread.
+class UringSocket {
+public:
+    virtual ~UringSocket() = default;
+    // Descriptor to re-arm the receive on
+    virtual int uringFd() const = 0;
+    // Received bytes; the buffer goes back to the kernel once this returns
+    virtual void onUringData(const char* data, size_t len) = 0;
+    // The receive stopped for good: 0 = peer closed or socket shut down,
+    // -errno otherwise
+    virtual void onUringReceiveEnd(int result) = 0;
+    // A send finished: bytes sent (possibly partial) or -errno
+    virtual void onUringSent(int result) = 0;
+
+private:
+    friend class UringEngine;
+    alignas(void*) unsigned char sendHeader_[64]; // msghdr of the send in flight
+};
+
+// Optional io_uring backend for local sockets on Linux (kernel 6.0+).
+// Receives are multishot into a registered ring of provided buffers, so a
+// busy socket costs no syscall per read; sends gather a socket's queued buffers into one IORING_OP_SENDMSG.
+// Any thread may submit, one engine thread reaps completions.
+//
+// Opt-in at runtime with CONNECTTOOL_IO=uring (or setRequested); when it's
+// not requested, not compiled in or the kernel lacks support, instance()
+// returns nullptr and callers stay on Asio's epoll reactor.
+class UringEngine {
+public:
+    struct Stats {
+        uint64_t submitted = 0;
+        uint64_t completions = 0;
+        uint64_t enterCalls = 0; // io_uring_enter syscalls, submit and wait
+        uint64_t bufferStarvation = 0; // Receives re-armed after running out of buffers
+    };
+
+    static UringEngine* instance();
+    // Overrides CONNECTTOOL_IO; takes effect for managers created afterwards
+    static void setRequested(bool requested);
+    // Name of the backend new streams will use, for logs and UI
+    static const char* backendName();
+
+    ~UringEngine();
+
+    // Runs until the socket reports EOF or an error; shut the socket down to
+    // end it, and keep the descriptor open until onUringReceiveEnd
+    void startReceive(int fd, UringSocket* socket);
+    // Gathered send; `iov` must stay valid until onUringSent. One send in
+    // flight per socket.
+    void send(int fd, const UringIoVec* iov, size_t count, UringSocket* socket);
+    // Returns once every completion reaped so far has been handled; no-op on the engine thread
+    void barrier();
+
+    Stats stats() const;
+
+private:
+    struct Ring;
+
+    UringEngine() = default;
+    bool init(unsigned entries, unsigned bufferCount, unsigned bufferSize);
+    void submit(uint8_t opcode, int fd, const void* addr, uint32_t len, uint64_t userData, uint32_t opFlags,
+                uint16_t ioprio, uint8_t sqeFlags);
+    int flush(unsigned toSubmit, unsigned minComplete, unsigned flags);
+    void run();
+
+    std::unique_ptr<Ring> ring_;
+    std::mutex submitMutex_;
+    unsigned unsubmitted_ = 0; // Queued SQEs not yet passed to io_uring_enter, under submitMutex_
+    std::thread thread_;
+    std::thread::id threadId_;
+    std::atomic<bool> stopping_{false};
+    std::atomic<uint64_t> submitted_{0};
+    std::atomic<uint64_t> completions_{0};
+    std::atomic<uint64_t> enterCalls_{0};
+    std::atomic<uint64_t> bufferStarvation_{0};
+};
@@ -1,11 +1,24 @@
 #include "steam/steam_networking_manager.h"
 #include "steam/steam_room_manager.h"
 #include "steam/steam_utils.h"
+#include "steam/steam_view_model.h"
+#include "ui/font_atlas.h"
+#include "io_context_monitor.h"
+#include "logger.h"
+#include "memory_budget.h"
+#include "tracer.h"
+#include "shm_protocol.h"
+#include "shm_server.h"
 #include "tcp_server.h"
+#include "tunnel_capture.h"
 #include <GLFW/glfw3.h>
 #include <algorithm>
+#include <atomic>
 #include <boost/asio.hpp>
+#include <chrono>
+#include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <filesystem>
 #include <fstream>
 #include <imgui.h>
@@ -19,6 +32,11 @@
 #include <thread>
 #include <vector>
 
+// CONNECTTOOL_UI_GLYPHS, generated by CMake: the characters the labels use
+#if __has_include("ui_glyphs.h")
+#include "ui_glyphs.h"
+#endif
+
 #ifdef _WIN32
 #include <windows.h>
 #define GLFW_EXPOSE_NATIVE_WIN32
@@ -36,6 +54,7 @@ std::vector<HSteamNetConnection> connections;
 std::mutex connectionsMutex; // Add mutex for connections
 int localPort = 0;
 std::unique_ptr<TCPServer> server;
+std::unique_ptr<ShmServer> shmServer;
 
 #ifdef _WIN32
 // Windows implementation using mutex and shared memory
@@ -124,7 +143,7 @@ bool checkSingleInstance() {
 
   g_lockfd = open(g_lockFilePath.c_str(), O_CREAT | O_RDWR, 0666);
   if (g_lockfd < 0) {
-    std::cerr << "Failed to open lock file" << std::endl;
+    LOG_ERROR("Failed to open lock file");
     return false;
   }
 
@@ -175,40 +194,114 @@ void cleanupSingleInstance() {
 }
 #endif
 
+// "27015, 27016" -> {27015, 27016}; anything that isn't a port is skipped
+std::vector<int> parsePortList(const char *text) {
+  std::vector<int> ports;
+  while (*text) {
+    char *end = nullptr;
+    long port = std::strtol(text, &end, 10);
+    if (end == text) {
+      ++text;
+      continue;
+    }
+    if (port > 0 && port <= 65535) {
+      ports.push_back(static_cast<int>(port));
+    }
+    text = end;
+  }
+  return ports;
+}
+
+// How far networking has come up; the UI waits for Relay
+enum class StartupStage { Networking, Relay, Ready, Failed };
+
 int main() {
+  // Startup is timed from here to the first frame and to networking ready
+  const auto launchTime = std::chrono::steady_clock::now();
+  auto millisSinceLaunch = [&launchTime]() {
+    return static_cast<int64_t>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - launchTime)
+            .count());
+  };
+
   // Check for single instance
   if (!checkSingleInstance()) {
-    std::cout << "另一个实例已在运行，正在激活该窗口..." << std::endl;
+    LOG_INFO("另一个实例已在运行，正在激活该窗口...");
     return 0;
   }
 
   // Initialize Steam API first
   if (!SteamAPI_Init()) {
-    std::cerr << "Failed to initialize Steam API" << std::endl;
+    LOG_ERROR("Failed to initialize Steam API");
     return 1;
   }
 
   boost::asio::io_context io_context;
   auto work_guard = boost::asio::make_work_guard(io_context);
-  std::thread io_thread([&io_context]() { io_context.run(); });
+  IoContextMonitor ioMonitor(io_context, "io");
+  std::thread io_thread([&io_context, &ioMonitor]() {
+    ioMonitor.bindCurrentThread();
+    io_context.run();
+  });
+  ioMonitor.start();
 
-  // Initialize Steam Networking Manager
-  SteamNetworkingManager steamManager;
-  if (!steamManager.initialize()) {
-    std::cerr << "Failed to initialize Steam Networking Manager" << std::endl;
+  // Initialize GLFW
+  if (!glfwInit()) {
+    LOG_ERROR("Failed to initialize GLFW");
     SteamAPI_Shutdown();
-    return 1;
+    return -1;
   }
 
+  SteamNetworkingManager steamManager;
+
   // Initialize Steam Room Manager
   SteamRoomManager roomManager(&steamManager);
 
-  // Initialize GLFW
-  if (!glfwInit()) {
-    std::cerr << "Failed to initialize GLFW" << std::endl;
-    steamManager.shutdown();
-    return -1;
-  }
+  // Cached friends / lobby-member lists for the UI
+  SteamViewModel viewModel(&steamManager, &roomManager);
+
+  // Networking comes up on its own thread while the window and font load.
+  // The UI unlocks once the manager is initialized; Steam's relay network
+  // takes seconds more to reach, shown as progress until it's there.
+  std::atomic<StartupStage> startupStage(StartupStage::Networking);
+  std::atomic<bool> startupCancelled(false);
+  std::thread startupThread([&]() {
+    // Wake the render loop whenever networking state changes
+    steamManager.setStateChangedCallback([]() { glfwPostEmptyEvent(); });
+    if (!steamManager.initialize()) {
+      LOG_ERROR("Failed to initialize Steam Networking Manager");
+      startupStage = StartupStage::Failed;
+      glfwPostEmptyEvent();
+      return;
+    }
+    steamManager.setMessageHandlerDependencies(io_context, server, localPort);
+    steamManager.startMessageHandler();
+    LOG_INFO("Networking initialized after {} ms", millisSinceLaunch());
+    startupStage = StartupStage::Relay;
+    glfwPostEmptyEvent();
+
+    // InitRelayNetworkAccess only starts the work
+    SteamRelayNetworkStatus_t relay;
+    while (!startupCancelled) {
+      ESteamNetworkingAvailability avail =
+          SteamNetworkingUtils()->GetRelayNetworkStatus(&relay);
+      if (avail == k_ESteamNetworkingAvailability_Current) {
+        LOG_INFO("Ready after {} ms (relay network reachable)",
+                 millisSinceLaunch());
+        break;
+      }
+      if (avail == k_ESteamNetworkingAvailability_Failed ||
+          avail == k_ESteamNetworkingAvailability_CannotTry) {
+        LOG_WARN("Relay network unavailable after {} ms: {}",
+                 millisSinceLaunch(), relay.m_debugMsg);
+        break;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    startupStage = StartupStage::Ready;
+    glfwPostEmptyEvent();
+  });
 
 #ifdef __APPLE__
   glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
@@ -221,7 +314,9 @@ int main() {
   GLFWwindow *window =
       glfwCreateWindow(1280, 720, "在线游戏工具 - 1.0.0", nullptr, nullptr);
   if (!window) {
-    std::cerr << "Failed to create GLFW window" << std::endl;
+    LOG_ERROR("Failed to create GLFW window");
+    startupCancelled = true;
+    startupThread.join();
     glfwTerminate();
     cleanupSingleInstance();
     SteamAPI_Shutdown();
@@ -238,10 +333,14 @@ int main() {
   ImGui::CreateContext();
   ImGuiIO &io = ImGui::GetIO();
   (void)io;
-  // Load Chinese font
-  io.Fonts->AddFontFromFileTTF(
-      "font.ttf", 18.0f, nullptr,
-      io.Fonts->GetGlyphRangesChineseSimplifiedCommon());
+  // Chinese font with only the glyphs the UI shows, from the disk cache
+  // when it matches
+  FontAtlas uiFont("font.ttf", 18.0f, FontAtlas::defaultCacheDir());
+#ifdef CONNECTTOOL_UI_GLYPHS
+  uiFont.load(io.Fonts, CONNECTTOOL_UI_GLYPHS);
+#else
+  uiFont.load(io.Fonts, nullptr);
+#endif
   ImGui::StyleColorsDark();
 
   // Initialize ImGui backends
@@ -252,15 +351,26 @@ int main() {
 #endif
   ImGui_ImplOpenGL3_Init(glsl_version);
 
-  // Set message handler dependencies
-  steamManager.setMessageHandlerDependencies(io_context, server, localPort);
-  steamManager.startMessageHandler();
-
   // Steam Networking variables
   bool isHost = false;
   bool isClient = false;
   char joinBuffer[256] = "";
   char filterBuffer[256] = "";
+  char allowedPortsBuffer[256] = "";
+  int bondingLanes = 1;
+  bool stripeStreams = false;
+  bool meshMode = false;
+  int poolPort = 27015;
+  char poolBackendsBuffer[256] = "";
+  int poolPolicy = 0;
+  bool poolInvalid = false;
+  int budgetMb = static_cast<int>(MemoryBudget::kDefaultLimit / (1024 * 1024));
+  int budgetPolicy = 0;
+  int idleTimeoutMinutes =
+      static_cast<int>(MemoryBudget::kDefaultIdleTimeout.count() / 60);
+  PollThread::Options pollOptions; // The handler's, which may not exist yet
+  int pollWait = static_cast<int>(pollOptions.wait);
+  int pollPriority = static_cast<int>(pollOptions.priority);
 
   // Lambda to get connection info for a member
   auto getMemberConnectionInfo =
@@ -283,13 +393,18 @@ int main() {
         }
       }
     } else {
-      // Client only shows ping to host, not to other clients
+      // Client only shows ping to host, and the route to mesh members
       if (memberID == hostSteamID) {
         ping = steamManager.getHostPing();
         if (steamManager.getConnection() != k_HSteamNetConnection_Invalid) {
           relayInfo =
               steamManager.getConnectionRelayInfo(steamManager.getConnection());
         }
+      } else {
+        std::string route = steamManager.getMeshRouteInfo(memberID);
+        if (!route.empty()) {
+          relayInfo = route;
+        }
       }
     }
 
@@ -299,61 +414,103 @@ int main() {
   // Lambda to render invite friends UI
   auto renderInviteFriends = [&]() {
     ImGui::InputText("过滤朋友", filterBuffer, IM_ARRAYSIZE(filterBuffer));
+    uiFont.require(filterBuffer);
     ImGui::Text("朋友:");
-    for (const auto &friendPair : SteamUtils::getFriendsList()) {
-      std::string nameStr = friendPair.second;
-      std::string filterStr(filterBuffer);
-      // Convert to lowercase for case-insensitive search
-      std::transform(nameStr.begin(), nameStr.end(), nameStr.begin(),
-                     ::tolower);
-      std::transform(filterStr.begin(), filterStr.end(), filterStr.begin(),
-                     ::tolower);
-      if (filterStr.empty() || nameStr.find(filterStr) != std::string::npos) {
-        ImGui::PushID(friendPair.first.ConvertToUint64());
-        if (ImGui::Button(("邀请 " + friendPair.second).c_str())) {
-          // Send invite via Steam to lobby
-          if (SteamMatchmaking()) {
-            SteamMatchmaking()->InviteUserToLobby(roomManager.getCurrentLobby(),
-                                                  friendPair.first);
-            std::cout << "Sent lobby invite to " << friendPair.second
-                      << std::endl;
-          } else {
-            std::cerr << "SteamMatchmaking() is null! Cannot send invite."
-                      << std::endl;
-          }
+    for (const FriendEntry *entry :
+         viewModel.getFilteredFriends(filterBuffer)) {
+      uiFont.require(entry->inviteLabel);
+      ImGui::PushID(entry->steamID.ConvertToUint64());
+      if (ImGui::Button(entry->inviteLabel.c_str())) {
+        // Send invite via Steam to lobby
+        if (SteamMatchmaking()) {
+          SteamMatchmaking()->InviteUserToLobby(roomManager.getCurrentLobby(),
+                                                entry->steamID);
+          LOG_INFO("Sent lobby invite to {}", entry->name);
+        } else {
+          LOG_ERROR("SteamMatchmaking() is null! Cannot send invite.");
         }
-        ImGui::PopID();
       }
+      ImGui::PopID();
     }
   };
 
-  // Frame rate limiting
-  const double targetFrameTimeForeground = 1.0 / 60.0; // 60 FPS when focused
-  const double targetFrameTimeBackground = 1.0; // 1 FPS when in background
-  double lastFrameTime = glfwGetTime();
+  // Redraw is driven by invalidation: input events, state changes published
+  // by the networking side (via glfwPostEmptyEvent) or the stats tick wake the
+  // loop; otherwise it sleeps in glfwWaitEventsTimeout.
+  const double statsTickInterval = 1.0; // Refresh ping / client count once a second
+  const int framesPerWake = 2; // ImGui needs an extra frame to settle after input
+  int framesToRender = framesPerWake;
+
+  // Shared by the render thread and the Steam callback pump: Steam callbacks
+  // mutate room/server state that the frame reads.
+  std::mutex uiStateMutex;
+
+  // Pump Steam callbacks on their own thread so their timing no longer
+  // depends on frame rate
+  std::atomic<bool> steamPumpRunning(true);
+  std::thread steamPumpThread([&]() {
+    while (steamPumpRunning) {
+      {
+        std::lock_guard<std::mutex> lock(uiStateMutex);
+        // Callbacks wait in Steam's queue until the manager they reach is up
+        StartupStage stage = startupStage.load();
+        if (stage == StartupStage::Relay || stage == StartupStage::Ready) {
+          SteamAPI_RunCallbacks();
+          steamManager.update();
+          roomManager.update();
+        }
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  });
+
+  bool firstFrame = true;
+  auto presentFrame = [&](std::unique_lock<std::mutex> &uiLock) {
+    ImGui::Render();
+    uiLock.unlock();
+    int display_w, display_h;
+    glfwGetFramebufferSize(window, &display_w, &display_h);
+    glViewport(0, 0, display_w, display_h);
+    glClearColor(0.45f, 0.55f, 0.60f, 1.00f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+
+    // Swap buffers
+    glfwSwapBuffers(window);
+    if (firstFrame) {
+      firstFrame = false;
+      LOG_INFO("First frame after {} ms", millisSinceLaunch());
+    }
+    // Text this frame couldn't draw yet: bake it and draw again
+    if (uiFont.pending()) {
+      framesToRender = std::max(framesToRender, 1);
+    }
+  };
 
   // Main loop
   while (!glfwWindowShouldClose(window)) {
-    // Frame rate control based on window focus
-    bool isFocused = glfwGetWindowAttrib(window, GLFW_FOCUSED);
-    double targetFrameTime =
-        isFocused ? targetFrameTimeForeground : targetFrameTimeBackground;
-
-    double currentTime = glfwGetTime();
-    double deltaTime = currentTime - lastFrameTime;
-    if (deltaTime < targetFrameTime) {
-      std::this_thread::sleep_for(
-          std::chrono::duration<double>(targetFrameTime - deltaTime));
+    if (framesToRender > 0) {
+      glfwPollEvents();
+      --framesToRender;
+    } else {
+      glfwWaitEventsTimeout(statsTickInterval);
+      framesToRender = framesPerWake - 1;
     }
-    lastFrameTime = glfwGetTime();
 
-    // Poll events
-    glfwPollEvents();
+    // Nothing to show while minimized
+    if (glfwGetWindowAttrib(window, GLFW_ICONIFIED)) {
+      framesToRender = 0;
+      continue;
+    }
 
-    SteamAPI_RunCallbacks();
+    if (uiFont.update(io.Fonts)) {
+#if IMGUI_VERSION_NUM < 19200
+      ImGui_ImplOpenGL3_DestroyFontsTexture();
+      ImGui_ImplOpenGL3_CreateFontsTexture();
+#endif
+    }
 
-    // Update Steam networking info
-    steamManager.update();
+    std::unique_lock<std::mutex> uiLock(uiStateMutex);
 
     // Start ImGui frame
     ImGui_ImplOpenGL3_NewFrame();
@@ -362,31 +519,301 @@ int main() {
 
     // Create a window for online game tool
     ImGui::Begin("在线游戏工具");
+    StartupStage stage = startupStage.load();
+    if (stage == StartupStage::Networking || stage == StartupStage::Failed) {
+      // Nothing below works without the networking manager
+      if (stage == StartupStage::Failed) {
+        ImGui::Text("Steam 网络初始化失败，请确认 Steam 已启动并登录");
+      } else {
+        ImGui::ProgressBar(0.3f, ImVec2(-1, 0), "正在初始化 Steam 网络...");
+      }
+      ImGui::End();
+      presentFrame(uiLock);
+      continue;
+    }
+    if (stage == StartupStage::Relay) {
+      // Hosting and joining work already; relayed routes wait for this
+      SteamRelayNetworkStatus_t relay;
+      SteamNetworkingUtils()->GetRelayNetworkStatus(&relay);
+      ImGui::ProgressBar(relay.m_bPingMeasurementInProgress ? 0.8f : 0.6f,
+                         ImVec2(-1, 0), "正在连接 Steam 中继网络...");
+      ImGui::TextDisabled("%s", relay.m_debugMsg);
+    }
     if (server) {
-      ImGui::Text("TCP服务器监听端口8888");
+      for (const PortMapping &mapping : server->getListeningMappings()) {
+        if (mapping.remotePort > 0) {
+          ImGui::Text("TCP服务器监听端口%d -> 主持方端口%d", mapping.localPort,
+                      mapping.remotePort);
+        } else {
+          ImGui::Text("TCP服务器监听端口%d", mapping.localPort);
+        }
+      }
       ImGui::Text("已连接客户端: %d", server->getClientCount());
     }
+    {
+      // Event-loop lag of the io threads over the last export window
+      auto ioStats = ioMonitor.snapshot();
+      ImGui::Text("IO线程延迟 p50/p99/max: %llu/%llu/%llu us",
+                  (unsigned long long)ioStats.lagP50Us,
+                  (unsigned long long)ioStats.lagP99Us,
+                  (unsigned long long)ioStats.lagMaxUs);
+      if (server) {
+        auto tcpStats = server->getMonitorSnapshot();
+        ImGui::Text("TCP线程延迟 p50/p99/max: %llu/%llu/%llu us",
+                    (unsigned long long)tcpStats.lagP50Us,
+                    (unsigned long long)tcpStats.lagP99Us,
+                    (unsigned long long)tcpStats.lagMaxUs);
+      }
+    }
+    if (ImGui::CollapsingHeader("网络线程")) {
+      // Receiving runs on its own thread; how it waits for the next message
+      // trades wake-up latency for CPU
+      auto pollStats = steamManager.getPollStats();
+      ImGui::Text("接收到处理延迟 p50/p99/max: %llu/%llu/%llu us (%llu 条)",
+                  (unsigned long long)pollStats.latencyP50Us,
+                  (unsigned long long)pollStats.latencyP99Us,
+                  (unsigned long long)pollStats.latencyMaxUs,
+                  (unsigned long long)pollStats.samples);
+      ImGui::Text("CPU 占用 %.0f%%", pollStats.cpuPercent);
+      bool pollChanged = false;
+      const char *waitStrategies[] = {"忙等（占满一个核心）", "先自旋再休眠",
+                                      "定时休眠"};
+      ImGui::SetNextItemWidth(200);
+      if (ImGui::Combo("等待方式", &pollWait, waitStrategies,
+                       IM_ARRAYSIZE(waitStrategies))) {
+        pollOptions.wait = static_cast<PollThread::WaitStrategy>(pollWait);
+        pollChanged = true;
+      }
+      ImGui::SetNextItemWidth(120);
+      if (ImGui::InputInt("绑定 CPU (-1 不绑定)", &pollOptions.cpu)) {
+        pollOptions.cpu = std::max(-1, pollOptions.cpu);
+        pollChanged = true;
+      }
+      const char *priorities[] = {"普通", "高", "实时"};
+      ImGui::SetNextItemWidth(120);
+      if (ImGui::Combo("优先级", &pollPriority, priorities,
+                       IM_ARRAYSIZE(priorities))) {
+        pollOptions.priority = static_cast<PollThread::Priority>(pollPriority);
+        pollChanged = true;
+      }
+      if (pollChanged) {
+        steamManager.setPollOptions(pollOptions);
+      }
+    }
+    if (ImGui::CollapsingHeader("内存")) {
+      // What the tunnels hold, and what happens past the limit
+      MemoryBudget &budget = MemoryBudget::instance();
+      auto memory = budget.snapshot();
+      ImGui::Text("流 %.1f MB, 待写 %.1f MB, 会话 %.1f MB",
+                  memory.streams / 1048576.0, memory.writeQueues / 1048576.0,
+                  memory.managers / 1048576.0);
+      ImGui::Text("超限关闭 %llu, 空闲关闭 %llu, 暂停读取 %llu",
+                  (unsigned long long)memory.shed,
+                  (unsigned long long)memory.reaped,
+                  (unsigned long long)memory.stalls);
+      ImGui::SetNextItemWidth(120);
+      if (ImGui::InputInt("上限 (MB, 0 不限)", &budgetMb, 64)) {
+        budgetMb = std::max(0, budgetMb);
+        budget.setLimit(static_cast<size_t>(budgetMb) * 1024 * 1024);
+      }
+      const char *budgetPolicies[] = {"关闭最久空闲的连接", "暂停读取"};
+      ImGui::SetNextItemWidth(200);
+      if (ImGui::Combo("超限时", &budgetPolicy, budgetPolicies,
+                       IM_ARRAYSIZE(budgetPolicies))) {
+        budget.setPolicy(static_cast<MemoryBudget::Policy>(budgetPolicy));
+      }
+      ImGui::SetNextItemWidth(120);
+      if (ImGui::InputInt("空闲超时 (分钟, 0 不限)", &idleTimeoutMinutes)) {
+        idleTimeoutMinutes = std::max(0, idleTimeoutMinutes);
+        budget.setIdleTimeout(std::chrono::minutes(idleTimeoutMinutes));
+      }
+    }
+#ifdef CONNECTTOOL_TRACE
+    if (ImGui::Button("导出性能追踪")) {
+      if (Tracer::dumpChromeTrace("connecttool_trace.json")) {
+        LOG_INFO("Trace written to connecttool_trace.json");
+      } else {
+        LOG_ERROR("Failed to write connecttool_trace.json");
+      }
+    }
+#endif
+    {
+      // Record tunnel frames for offline replay with connecttool_replay
+      TunnelCapture &capture = TunnelCapture::instance();
+      bool capturing = capture.active();
+      if (ImGui::Checkbox("录制隧道流量", &capturing)) {
+        if (capturing) {
+          capture.start("tunnel_" + std::to_string(std::time(nullptr)) + ".ctcap");
+        } else {
+          capture.stop();
+        }
+      }
+      if (capture.active()) {
+        ImGui::SameLine();
+        ImGui::Text("%llu 帧, 丢弃 %llu",
+                    (unsigned long long)capture.recordCount(),
+                    (unsigned long long)capture.droppedCount());
+      }
+    }
+#ifdef __linux__
+    {
+      // Local games linked against connecttool_shim attach here instead of
+      // connecting to 127.0.0.1:8888
+      bool shmEnabled = shmServer != nullptr;
+      if (ImGui::Checkbox("共享内存传输", &shmEnabled)) {
+        if (shmEnabled) {
+          shmServer = steamManager.createShmServer(kShmDefaultName);
+          if (shmServer->start()) {
+            steamManager.setEndpointAcceptor(shmServer->acceptor());
+          } else {
+            shmServer.reset();
+          }
+        } else {
+          steamManager.setEndpointAcceptor(nullptr);
+          shmServer->stop();
+          shmServer.reset();
+        }
+      }
+      if (shmServer) {
+        ImGui::SameLine();
+        ImGui::Text("%s: %d 进程, %d 连接", shmServer->name().c_str(),
+                    shmServer->getClientCount(), shmServer->getStreamCount());
+      }
+    }
+#endif
     ImGui::Separator();
 
-    if (!steamManager.isHost() && !steamManager.isConnected()) {
+    if (!steamManager.isHost() && !steamManager.isConnected() &&
+        !steamManager.isReconnecting()) {
       if (ImGui::Button("主持游戏房间")) {
         roomManager.startHosting();
       }
+      ImGui::SameLine();
+      int maxMembers = roomManager.getMaxMembers();
+      ImGui::SetNextItemWidth(100);
+      if (ImGui::InputInt("人数上限", &maxMembers)) {
+        roomManager.setMaxMembers(maxMembers);
+      }
       ImGui::InputText("房间ID", joinBuffer, IM_ARRAYSIZE(joinBuffer));
+      if (ImGui::CollapsingHeader("房间列表")) {
+        // Hosts by estimated round trip, so the closest one with room is
+        // picked before connecting rather than found out after
+        LobbyBrowser &browser = roomManager.getLobbyBrowser();
+        if (ImGui::Button("刷新##lobbies")) {
+          roomManager.searchLobbies();
+        }
+        if (browser.searching()) {
+          ImGui::SameLine();
+          ImGui::Text("正在搜索...");
+        } else if (browser.pending() > 0) {
+          ImGui::SameLine();
+          ImGui::Text("正在获取 %d 个房间的信息...",
+                      static_cast<int>(browser.pending()));
+        }
+        const std::vector<LobbyEntry> &lobbies = browser.results();
+        if (!lobbies.empty() &&
+            ImGui::BeginTable("LobbyTable", 4,
+                              ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg)) {
+          ImGui::TableSetupColumn("主持方");
+          ImGui::TableSetupColumn("延迟估计 (ms)");
+          ImGui::TableSetupColumn("人数");
+          ImGui::TableSetupColumn("");
+          ImGui::TableHeadersRow();
+          for (const LobbyEntry &lobby : lobbies) {
+            ImGui::PushID(static_cast<int>(lobby.lobby));
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            if (lobby.hostName.empty()) {
+              ImGui::Text("%llu", (unsigned long long)lobby.lobby);
+            } else {
+              uiFont.require(lobby.hostName);
+              ImGui::Text("%s", lobby.hostName.c_str());
+            }
+            ImGui::TableNextColumn();
+            if (lobby.rttMs >= 0) {
+              ImGui::Text("%d", lobby.rttMs);
+            } else {
+              ImGui::Text("-");
+            }
+            ImGui::TableNextColumn();
+            ImGui::Text("%d/%d", lobby.members, lobby.memberLimit);
+            ImGui::TableNextColumn();
+            ImGui::BeginDisabled(lobby.spare() == 0);
+            if (ImGui::Button("加入")) {
+              roomManager.joinLobby(CSteamID(static_cast<uint64>(lobby.lobby)));
+            }
+            ImGui::EndDisabled();
+            ImGui::PopID();
+          }
+          ImGui::EndTable();
+        }
+      }
+      if (ImGui::CollapsingHeader("端口映射")) {
+        // Local ports to listen on when joining; all share one Steam
+        // connection. Host port 0 means the host's own local port.
+        std::vector<PortMapping> mappings = steamManager.getPortMappings();
+        bool changed = false;
+        for (size_t i = 0; i < mappings.size(); ++i) {
+          ImGui::PushID(static_cast<int>(i));
+          ImGui::SetNextItemWidth(120);
+          changed |= ImGui::InputInt("本地", &mappings[i].localPort, 0);
+          ImGui::SameLine();
+          ImGui::SetNextItemWidth(120);
+          changed |= ImGui::InputInt("主持方", &mappings[i].remotePort, 0);
+          ImGui::SameLine();
+          if (meshMode) {
+            // Another member's Steam ID; 0 tunnels to the host
+            ImGui::SetNextItemWidth(180);
+            changed |= ImGui::InputScalar("对端", ImGuiDataType_U64, &mappings[i].peer);
+            ImGui::SameLine();
+          }
+          if (mappings.size() > 1 && ImGui::Button("删除")) {
+            mappings.erase(mappings.begin() + i);
+            changed = true;
+          }
+          ImGui::PopID();
+        }
+        if (ImGui::Button("添加映射")) {
+          mappings.push_back({0, 0});
+          changed = true;
+        }
+        if (changed) {
+          steamManager.setPortMappings(std::move(mappings));
+        }
+      }
+      if (ImGui::Checkbox("成员间直连", &meshMode)) {
+        steamManager.setMeshMode(meshMode);
+      }
+      if (ImGui::CollapsingHeader("多连接聚合")) {
+        // Extra Steam connections to the host, for links where one
+        // connection's rate control is the bottleneck
+        ImGui::SetNextItemWidth(120);
+        bool changed = ImGui::SliderInt("连接数", &bondingLanes, 1, MultiplexManager::kMaxLanes);
+        changed |= ImGui::Checkbox("单流条带化", &stripeStreams);
+        if (changed) {
+          steamManager.setBonding(bondingLanes, stripeStreams);
+        }
+      }
       if (ImGui::Button("加入游戏房间")) {
         uint64 hostID = std::stoull(joinBuffer);
         if (steamManager.joinHost(hostID)) {
           // Start TCP Server
-          server = std::make_unique<TCPServer>(8888, &steamManager);
+          server = steamManager.createTCPServer();
           if (!server->start()) {
-            std::cerr << "Failed to start TCP server" << std::endl;
+            LOG_ERROR("Failed to start TCP server");
           }
         }
       }
     }
-    if (steamManager.isHost() || steamManager.isConnected()) {
-      ImGui::Text(steamManager.isHost() ? "正在主持游戏房间。邀请朋友!"
-                                        : "已连接到游戏房间。邀请朋友!");
+    if (steamManager.isHost() || steamManager.isConnected() ||
+        steamManager.isReconnecting()) {
+      if (steamManager.isReconnecting()) {
+        // Local connections stay open and resume once we're back
+        ImGui::Text("连接中断，正在重连...");
+      } else {
+        ImGui::Text(steamManager.isHost() ? "正在主持游戏房间。邀请朋友!"
+                                          : "已连接到游戏房间。邀请朋友!");
+      }
       ImGui::Separator();
       if (ImGui::Button("断开连接")) {
         roomManager.leaveLobby();
@@ -396,8 +823,45 @@ int main() {
           server.reset();
         }
       }
-      if (steamManager.isHost()) {
+      // Mesh members take streams from each other too
+      if (steamManager.isHost() || steamManager.isMeshMode()) {
         ImGui::InputInt("本地端口", &localPort);
+        // Other ports clients' mappings may reach; anything else is refused
+        if (ImGui::InputText("允许的端口", allowedPortsBuffer,
+                             IM_ARRAYSIZE(allowedPortsBuffer))) {
+          steamManager.setAllowedPorts(parsePortList(allowedPortsBuffer));
+        }
+        ImGui::SameLine();
+        ImGui::TextDisabled("例如 27015, 27016");
+        if (ImGui::CollapsingHeader("后端池")) {
+          // Several local servers behind one port: new streams are spread
+          // over the ones passing their health checks
+          ImGui::SetNextItemWidth(120);
+          ImGui::InputInt("端口##pool", &poolPort, 0);
+          ImGui::InputText("后端", poolBackendsBuffer,
+                           IM_ARRAYSIZE(poolBackendsBuffer));
+          ImGui::SameLine();
+          ImGui::TextDisabled("例如 27015, 27016, 10.0.0.2:27015");
+          const char *policies[] = {"轮询", "最少连接", "按玩家固定"};
+          ImGui::Combo("策略", &poolPolicy, policies, IM_ARRAYSIZE(policies));
+          if (ImGui::Button("应用##pool")) {
+            poolInvalid = !steamManager.setBackendPool(
+                poolPort, poolBackendsBuffer,
+                static_cast<BackendPool::Policy>(poolPolicy));
+          }
+          if (poolInvalid) {
+            ImGui::SameLine();
+            ImGui::Text("后端地址格式错误");
+          }
+          for (const auto &pool : steamManager.getBackendPools()) {
+            for (const auto &backend : pool.second->status()) {
+              ImGui::Text("%d -> %s:%d  %s  %d 连接", pool.first,
+                          backend.endpoint.address().to_string().c_str(),
+                          backend.endpoint.port(),
+                          backend.up ? "正常" : "已摘除", backend.streams);
+            }
+          }
+        }
       }
       ImGui::Separator();
       renderInviteFriends();
@@ -417,14 +881,14 @@ int main() {
         ImGui::TableSetupColumn("连接类型");
         ImGui::TableHeadersRow();
         {
-          std::vector<CSteamID> members = roomManager.getLobbyMembers();
           CSteamID mySteamID = SteamUser()->GetSteamID();
           CSteamID hostSteamID = steamManager.getHostSteamID();
-          for (const auto &memberID : members) {
+          for (const auto &member : viewModel.getLobbyMembers()) {
+            const CSteamID &memberID = member.steamID;
             ImGui::TableNextRow();
             ImGui::TableNextColumn();
-            const char *name = SteamFriends()->GetFriendPersonaName(memberID);
-            ImGui::Text("%s", name);
+            uiFont.require(member.name);
+            ImGui::Text("%s", member.name.c_str());
             ImGui::TableNextColumn();
 
             if (memberID == mySteamID) {
@@ -441,6 +905,7 @@ int main() {
                 ImGui::Text("-");
               }
               ImGui::TableNextColumn();
+              uiFont.require(relayInfo);
               ImGui::Text("%s", relayInfo.c_str());
             }
           }
@@ -451,16 +916,18 @@ int main() {
     }
 
     // Rendering
-    ImGui::Render();
-    int display_w, display_h;
-    glfwGetFramebufferSize(window, &display_w, &display_h);
-    glViewport(0, 0, display_w, display_h);
-    glClearColor(0.45f, 0.55f, 0.60f, 1.00f);
-    glClear(GL_COLOR_BUFFER_BIT);
-    ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+    presentFrame(uiLock);
+  }
 
-    // Swap buffers
-    glfwSwapBuffers(window);
+  startupCancelled = true;
+  if (startupThread.joinable()) {
+    startupThread.join();
+  }
+
+  // Stop Steam callback pump
+  steamPumpRunning = false;
+  if (steamPumpThread.joinable()) {
+    steamPumpThread.join();
   }
 
   // Stop message handler
@@ -470,8 +937,12 @@ int main() {
   if (server) {
     server->stop();
   }
+  if (shmServer) {
+    shmServer->stop();
+  }
 
   // Stop io_context and join thread
+  ioMonitor.stop();
   work_guard.reset();
   io_context.stop();
   if (io_thread.joinable()) {
@@ -484,9 +955,16 @@ int main() {
   glfwDestroyWindow(window);
   glfwTerminate();
   steamManager.shutdown();
+  SteamAPI_Shutdown();
 
   // Cleanup single instance resources
   cleanupSingleInstance();
 
-  return 0;
+  // Finish the capture file before the logger goes away
+  TunnelCapture::instance().stop();
+
+  // Flush pending log records
+  Logger::instance().shutdown();
+
+  return startupStage == StartupStage::Failed ? 1 : 0;
 }
\ No newline at end of file
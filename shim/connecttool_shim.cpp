@@ -0,0 +1,218 @@
+#include "connecttool_shim.h"
+#include "shm_protocol.h"
+#include <cerrno>
+#include <chrono>
+#include <mutex>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static_assert(CT_SHIM_MAX_PAYLOAD == kShmMaxPayload, "shim and server disagree on the frame size");
+
+struct ct_shim {
+    ShmControl* control = nullptr;
+    ShmSlot* slot = nullptr;
+    int role = CT_SHIM_CLIENT;
+    std::mutex sendMutex; // toServer has a single producer
+    uint32_t nextStream = 1;
+};
+
+namespace {
+const int kLivenessPollMs = 200; // How often an unbounded wait checks that ConnectTool is still there
+
+bool serverAlive(const ct_shim* shim)
+{
+    int32_t pid = shim->control->serverPid.load();
+    return pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+// Waits on the slot's event until ready() or the deadline; false on timeout
+// or when the server is gone
+template <typename Ready>
+bool waitFor(ct_shim* shim, Ready ready, int timeoutMs)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    for (;;)
+    {
+        int slice = kLivenessPollMs;
+        if (timeoutMs >= 0)
+        {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            if (left.count() <= 0)
+            {
+                return ready();
+            }
+            slice = left.count() < slice ? static_cast<int>(left.count()) : slice;
+        }
+        if (shmEventWait(shim->slot->clientEvent, ready, slice))
+        {
+            return true;
+        }
+        if (!serverAlive(shim))
+        {
+            return false;
+        }
+    }
+}
+
+int writeFrame(ct_shim* shim, uint32_t stream, ShmFrameType type, const char* data, uint32_t len, int timeoutMs)
+{
+    std::lock_guard<std::mutex> lock(shim->sendMutex);
+    ShmRing& ring = shim->slot->toServer;
+    while (!shmRingWrite(ring, stream, type, data, len))
+    {
+        // Full: ConnectTool notifies once it has drained some of it
+        if (!waitFor(shim, [&ring, len]() {
+                return kShmRingSize - (ring.tail.load() - ring.head.load()) >= shmFrameSpace(len);
+            }, timeoutMs))
+        {
+            return -1;
+        }
+    }
+    shmEventNotify(shim->control->serverEvent);
+    return 0;
+}
+} // namespace
+
+extern "C" {
+
+ct_shim* ct_shim_attach(const char* name, int role)
+{
+    int fd = shm_open(name ? name : kShmDefaultName, O_RDWR, 0);
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(ShmControl))
+    {
+        close(fd);
+        return nullptr;
+    }
+    void* mapping = mmap(nullptr, sizeof(ShmControl), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    auto* control = static_cast<ShmControl*>(mapping);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (control->magic != kShmMagic || control->version != kShmVersion || control->serverPid.load() == 0)
+    {
+        munmap(mapping, sizeof(ShmControl));
+        return nullptr;
+    }
+    for (ShmSlot& slot : control->slots)
+    {
+        uint32_t expected = static_cast<uint32_t>(ShmSlotState::Free);
+        if (!slot.state.compare_exchange_strong(expected, static_cast<uint32_t>(ShmSlotState::Attaching)))
+        {
+            continue;
+        }
+        auto* shim = new ct_shim();
+        shim->control = control;
+        shim->slot = &slot;
+        shim->role = role;
+        slot.role = static_cast<uint32_t>(role == CT_SHIM_SERVER ? ShmSlotRole::Server : ShmSlotRole::Client);
+        slot.pid.store(getpid());
+        slot.state.store(static_cast<uint32_t>(ShmSlotState::Active), std::memory_order_release);
+        shmEventNotify(control->serverEvent);
+        return shim;
+    }
+    munmap(mapping, sizeof(ShmControl));
+    return nullptr;
+}
+
+void ct_shim_detach(ct_shim* shim)
+{
+    if (!shim)
+    {
+        return;
+    }
+    // ConnectTool closes the streams and frees the slot
+    shim->slot->state.store(static_cast<uint32_t>(ShmSlotState::Detaching), std::memory_order_release);
+    shmEventNotify(shim->control->serverEvent);
+    munmap(shim->control, sizeof(ShmControl));
+    delete shim;
+}
+
+uint32_t ct_shim_open(ct_shim* shim)
+{
+    if (shim->role != CT_SHIM_CLIENT)
+    {
+        return 0;
+    }
+    uint32_t stream;
+    {
+        std::lock_guard<std::mutex> lock(shim->sendMutex);
+        stream = shim->nextStream++;
+    }
+    return writeFrame(shim, stream, ShmFrameType::Open, nullptr, 0, -1) == 0 ? stream : 0;
+}
+
+int ct_shim_send(ct_shim* shim, uint32_t stream, const void* data, size_t len, int timeout_ms)
+{
+    const char* bytes = static_cast<const char*>(data);
+    while (len > 0)
+    {
+        uint32_t chunk = static_cast<uint32_t>(len < kShmMaxPayload ? len : kShmMaxPayload);
+        if (writeFrame(shim, stream, ShmFrameType::Data, bytes, chunk, timeout_ms) != 0)
+        {
+            return -1;
+        }
+        bytes += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+int ct_shim_close(ct_shim* shim, uint32_t stream)
+{
+    return writeFrame(shim, stream, ShmFrameType::Close, nullptr, 0, -1);
+}
+
+int ct_shim_poll(ct_shim* shim, ct_shim_event* event, void* buffer, size_t capacity, int timeout_ms)
+{
+    if (capacity < kShmMaxPayload)
+    {
+        return -1;
+    }
+    ShmRing& ring = shim->slot->toClient;
+    if (shmRingEmpty(ring) && !waitFor(shim, [&ring, shim]() {
+            return !shmRingEmpty(ring) || shim->control->serverPid.load() == 0;
+        }, timeout_ms))
+    {
+        return serverAlive(shim) ? 0 : -1;
+    }
+    ShmFrameHeader header;
+    bool freed;
+    if (!shmRingRead(ring, header, static_cast<char*>(buffer), &freed))
+    {
+        // Woken because ConnectTool stopped
+        return -1;
+    }
+    if (freed)
+    {
+        shmEventNotify(shim->control->serverEvent);
+    }
+    event->stream = header.stream;
+    event->len = 0;
+    switch (static_cast<ShmFrameType>(header.type))
+    {
+    case ShmFrameType::Open:
+        event->type = CT_SHIM_EVENT_OPEN;
+        break;
+    case ShmFrameType::Data:
+        event->type = CT_SHIM_EVENT_DATA;
+        event->len = header.len;
+        break;
+    default:
+        event->type = CT_SHIM_EVENT_CLOSE;
+        break;
+    }
+    return 1;
+}
+
+} // extern "C"
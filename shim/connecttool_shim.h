@@ -0,0 +1,61 @@
+#ifndef CONNECTTOOL_SHIM_H
+#define CONNECTTOOL_SHIM_H
+
+/*
+ * connecttool_shim: attach a game process to a running ConnectTool over
+ * shared memory instead of a loopback TCP connection (Linux only).
+ *
+ * A CT_SHIM_CLIENT process opens streams into the tunnel, one per
+ * connection it would have made to 127.0.0.1:8888. On the host, a
+ * CT_SHIM_SERVER process (e.g. a game server wrapper) receives a
+ * CT_SHIM_EVENT_OPEN for every stream a remote player opens, instead of
+ * ConnectTool connecting to the local port.
+ *
+ * ct_shim_send/ct_shim_open/ct_shim_close may be called from any thread;
+ * ct_shim_poll from one thread at a time.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ct_shim ct_shim;
+
+enum { CT_SHIM_CLIENT = 0, CT_SHIM_SERVER = 1 };
+
+enum { CT_SHIM_EVENT_OPEN = 1, CT_SHIM_EVENT_DATA = 2, CT_SHIM_EVENT_CLOSE = 3 };
+
+/* Largest payload of one CT_SHIM_EVENT_DATA; poll buffers must hold it */
+#define CT_SHIM_MAX_PAYLOAD (16 * 1024)
+
+typedef struct {
+    int type;        /* CT_SHIM_EVENT_* */
+    uint32_t stream; /* Stream number, local to this attachment */
+    size_t len;      /* Payload bytes written to the poll buffer */
+} ct_shim_event;
+
+/* name: shared-memory name ConnectTool listens on, NULL for "/connecttool".
+   Returns NULL if ConnectTool isn't running or all slots are taken. */
+ct_shim* ct_shim_attach(const char* name, int role);
+void ct_shim_detach(ct_shim* shim);
+
+/* Client role: opens a stream into the tunnel. Returns its number, or 0. */
+uint32_t ct_shim_open(ct_shim* shim);
+/* Queues len bytes on a stream, waiting up to timeout_ms (-1: forever) for
+   ring space. Returns 0, or -1 on timeout or when ConnectTool went away. */
+int ct_shim_send(ct_shim* shim, uint32_t stream, const void* data, size_t len, int timeout_ms);
+int ct_shim_close(ct_shim* shim, uint32_t stream);
+
+/* Waits up to timeout_ms (-1: forever) for the next event. buffer must hold
+   CT_SHIM_MAX_PAYLOAD bytes. Returns 1 with *event filled, 0 on timeout,
+   -1 when ConnectTool went away. */
+int ct_shim_poll(ct_shim* shim, ct_shim_event* event, void* buffer, size_t capacity, int timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CONNECTTOOL_SHIM_H */
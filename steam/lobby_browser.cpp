@@ -0,0 +1,132 @@
+#include "lobby_browser.h"
+#include "../net/logger.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <tuple>
+
+LobbyBrowser::LobbyBrowser(LobbyDirectory *directory)
+    : directory_(directory)
+{
+    directory_->setHandlers([this](bool ok, const std::vector<uint64_t> &lobbies) { onLobbyList(ok, lobbies); },
+                            [this](uint64_t lobby, bool ok) { onLobbyData(lobby, ok); });
+}
+
+bool LobbyBrowser::refresh()
+{
+    if (!directory_->requestLobbyList())
+    {
+        LOG_ERROR("Failed to request lobby list");
+        return false;
+    }
+    searching_ = true;
+    return true;
+}
+
+void LobbyBrowser::onLobbyList(bool ok, const std::vector<uint64_t> &lobbies)
+{
+    searching_ = false;
+    entries_.clear();
+    pending_ = 0;
+    sortedDirty_ = true;
+    if (!ok)
+    {
+        LOG_ERROR("Failed to receive lobby list");
+        if (changed_)
+        {
+            changed_();
+        }
+        return;
+    }
+    // Ask for every result's data at once: one round trip for the whole
+    // list instead of one per lobby
+    for (uint64_t lobby : lobbies)
+    {
+        LobbyEntry &entry = entries_[lobby];
+        entry.lobby = lobby;
+        readEntry(entry); // Whatever came with the list, until the fresh data lands
+        if (directory_->requestLobbyData(lobby))
+        {
+            ++pending_;
+        }
+    }
+    LOG_INFO("Received {} lobbies", lobbies.size());
+    if (changed_)
+    {
+        changed_();
+    }
+}
+
+void LobbyBrowser::onLobbyData(uint64_t lobby, bool ok)
+{
+    auto it = entries_.find(lobby);
+    if (it == entries_.end())
+    {
+        return; // From an earlier search, or not a lobby we listed
+    }
+    if (pending_ > 0)
+    {
+        --pending_;
+    }
+    sortedDirty_ = true;
+    if (ok)
+    {
+        readEntry(it->second);
+    }
+    else
+    {
+        entries_.erase(it); // Gone since the search
+    }
+    if (changed_)
+    {
+        changed_();
+    }
+}
+
+void LobbyBrowser::readEntry(LobbyEntry &entry)
+{
+    entry.members = directory_->memberCount(entry.lobby);
+    entry.memberLimit = directory_->memberLimit(entry.lobby);
+    entry.hostName = directory_->lobbyData(entry.lobby, kLobbyKeyHostName);
+    std::string connections = directory_->lobbyData(entry.lobby, kLobbyKeyConnections);
+    entry.connections = connections.empty() ? -1 : std::atoi(connections.c_str());
+    entry.pingLocation = directory_->lobbyData(entry.lobby, kLobbyKeyPingLocation);
+    entry.rttMs = entry.pingLocation.empty() ? -1 : directory_->estimatePingMs(entry.pingLocation);
+    entry.hasData = !entry.hostName.empty() || !entry.pingLocation.empty();
+}
+
+void LobbyBrowser::update()
+{
+    for (auto &pair : entries_)
+    {
+        LobbyEntry &entry = pair.second;
+        if (entry.rttMs < 0 && !entry.pingLocation.empty())
+        {
+            entry.rttMs = directory_->estimatePingMs(entry.pingLocation);
+            sortedDirty_ |= entry.rttMs >= 0;
+        }
+    }
+}
+
+const std::vector<LobbyEntry> &LobbyBrowser::results()
+{
+    if (!sortedDirty_)
+    {
+        return sorted_;
+    }
+    sorted_.clear();
+    sorted_.reserve(entries_.size());
+    for (const auto &pair : entries_)
+    {
+        sorted_.push_back(pair.second);
+    }
+    auto rank = [](const LobbyEntry &entry) {
+        int bucket = entry.rttMs < 0 ? INT32_MAX : entry.rttMs / kRttBucketMs;
+        return std::make_tuple(entry.spare() == 0, bucket, -entry.spare(), entry.rttMs < 0 ? INT32_MAX : entry.rttMs,
+                               entry.lobby);
+    };
+    std::sort(sorted_.begin(), sorted_.end(),
+              [&rank](const LobbyEntry &a, const LobbyEntry &b) { return rank(a) < rank(b); });
+    sortedDirty_ = false;
+    return sorted_;
+}
@@ -0,0 +1,101 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Lobby data a hosting ConnectTool publishes (SteamRoomManager) for the
+// browser to read
+constexpr const char *kLobbyKeyTag = "connecttool";   // "1"; searches filter on it
+constexpr const char *kLobbyKeyPingLocation = "ct_ping"; // The host's ping location string
+constexpr const char *kLobbyKeyConnections = "ct_conns"; // Clients connected to the host
+constexpr const char *kLobbyKeyHostName = "ct_name";
+
+// Matchmaking as the lobby browser sees it. The Steam implementation
+// (SteamLobbyDirectory) forwards to ISteamMatchmaking and
+// ISteamNetworkingUtils; benchmarks and tools plug in a local stand-in.
+// Answers arrive through the handlers, on whatever thread the directory
+// delivers them (Steam: the one running SteamAPI_RunCallbacks).
+class LobbyDirectory
+{
+public:
+    using ListHandler = std::function<void(bool ok, const std::vector<uint64_t> &lobbies)>;
+    using DataHandler = std::function<void(uint64_t lobby, bool ok)>;
+
+    virtual ~LobbyDirectory() = default;
+
+    void setHandlers(ListHandler onList, DataHandler onData)
+    {
+        onList_ = std::move(onList);
+        onData_ = std::move(onData);
+    }
+
+    // Lobbies hosted by ConnectTool, anywhere in the world
+    virtual bool requestLobbyList() = 0;
+    // Fresh data for one lobby; any number may be in flight at once
+    virtual bool requestLobbyData(uint64_t lobby) = 0;
+    virtual std::string lobbyData(uint64_t lobby, const char *key) = 0;
+    virtual int memberCount(uint64_t lobby) = 0;
+    virtual int memberLimit(uint64_t lobby) = 0;
+    // Round trip in ms from us to a published ping location; -1 until our
+    // own location is measured, or if it doesn't parse
+    virtual int estimatePingMs(const std::string &location) = 0;
+
+protected:
+    ListHandler onList_;
+    DataHandler onData_;
+};
+
+struct LobbyEntry
+{
+    uint64_t lobby = 0;
+    std::string hostName;
+    std::string pingLocation;
+    int members = 0;
+    int memberLimit = 0;
+    int connections = -1; // -1: the host didn't say
+    int rttMs = -1;       // Estimated; -1 unknown
+    bool hasData = false;
+
+    int spare() const { return memberLimit > members ? memberLimit - members : 0; }
+};
+
+// Client side of the lobby list: one search, then every result's data
+// requested at once, and the results ordered for picking a host before
+// connecting: lobbies with room first, then by estimated round trip in
+// kRttBucketMs steps (closer than that is noise in the estimate), then by
+// spare places. Callbacks and getters must run on the same thread or under
+// the same lock (the UI state mutex).
+class LobbyBrowser
+{
+public:
+    static constexpr int kRttBucketMs = 10;
+
+    explicit LobbyBrowser(LobbyDirectory *directory);
+
+    // Called when results arrive, e.g. to wake the UI
+    void setChangedCallback(std::function<void()> callback) { changed_ = std::move(callback); }
+
+    bool refresh();
+    bool searching() const { return searching_; }
+    // Results whose data is still on its way
+    size_t pending() const { return pending_; }
+    // Estimates that needed our own ping location are retried; call
+    // periodically
+    void update();
+    const std::vector<LobbyEntry> &results();
+
+private:
+    void onLobbyList(bool ok, const std::vector<uint64_t> &lobbies);
+    void onLobbyData(uint64_t lobby, bool ok);
+    void readEntry(LobbyEntry &entry);
+
+    LobbyDirectory *directory_;
+    std::function<void()> changed_;
+    std::unordered_map<uint64_t, LobbyEntry> entries_;
+    std::vector<LobbyEntry> sorted_;
+    bool sortedDirty_ = false;
+    bool searching_ = false;
+    size_t pending_ = 0;
+};
@@ -0,0 +1,109 @@
+#pragma once
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include "lobby_browser.h"
+
+// In-process stand-in for Steam matchmaking, for benchmarks and tools.
+// Lobbies are registered directly; answers queue up until deliver(), which
+// plays the part of SteamAPI_RunCallbacks. A ping location is just the
+// round trip in ms ("42"), and estimates stay unknown until
+// setLocalMeasured(true), like ours before Steam has measured it.
+class LocalLobbyDirectory : public LobbyDirectory
+{
+public:
+    struct Lobby
+    {
+        int members = 1;
+        int memberLimit = 4;
+        std::map<std::string, std::string> data;
+    };
+
+    void addLobby(uint64_t id, Lobby lobby) { lobbies_[id] = std::move(lobby); }
+    // Closed after being listed: its data request fails
+    void removeLobby(uint64_t id) { lobbies_.erase(id); }
+    void setLocalMeasured(bool measured) { localMeasured_ = measured; }
+
+    // Answers everything asked so far; requests made by the handlers wait
+    // for the next call. Returns how many answers went out.
+    size_t deliver()
+    {
+        size_t delivered = 0;
+        for (size_t asked = queue_.size(); asked > 0; --asked)
+        {
+            Answer answer = queue_.front();
+            queue_.pop_front();
+            ++delivered;
+            if (answer.list)
+            {
+                std::vector<uint64_t> ids;
+                for (const auto &pair : lobbies_)
+                {
+                    ids.push_back(pair.first);
+                }
+                if (onList_)
+                {
+                    onList_(true, ids);
+                }
+            }
+            else if (onData_)
+            {
+                onData_(answer.lobby, lobbies_.count(answer.lobby) != 0);
+            }
+        }
+        return delivered;
+    }
+    uint64_t dataRequests() const { return dataRequests_; }
+
+    bool requestLobbyList() override
+    {
+        queue_.push_back(Answer{true, 0});
+        return true;
+    }
+    bool requestLobbyData(uint64_t lobby) override
+    {
+        ++dataRequests_;
+        queue_.push_back(Answer{false, lobby});
+        return true;
+    }
+    std::string lobbyData(uint64_t lobby, const char *key) override
+    {
+        auto it = lobbies_.find(lobby);
+        if (it == lobbies_.end())
+        {
+            return "";
+        }
+        auto value = it->second.data.find(key);
+        return value == it->second.data.end() ? "" : value->second;
+    }
+    int memberCount(uint64_t lobby) override
+    {
+        auto it = lobbies_.find(lobby);
+        return it == lobbies_.end() ? 0 : it->second.members;
+    }
+    int memberLimit(uint64_t lobby) override
+    {
+        auto it = lobbies_.find(lobby);
+        return it == lobbies_.end() ? 0 : it->second.memberLimit;
+    }
+    int estimatePingMs(const std::string &location) override
+    {
+        char *end = nullptr;
+        long ms = std::strtol(location.c_str(), &end, 10);
+        return localMeasured_ && end != location.c_str() && ms >= 0 ? static_cast<int>(ms) : -1;
+    }
+
+private:
+    struct Answer
+    {
+        bool list;
+        uint64_t lobby;
+    };
+
+    std::map<uint64_t, Lobby> lobbies_;
+    std::deque<Answer> queue_;
+    bool localMeasured_ = true;
+    uint64_t dataRequests_ = 0;
+};
@@ -1,12 +1,14 @@
 #include "steam_message_handler.h"
-#include <iostream>
+#include "../net/logger.h"
+#include "../net/tracer.h"
+#include <algorithm>
 #include <cstring>
 #include <chrono>
 #include <steam_api.h>
 #include <isteamnetworkingsockets.h>
 
 SteamMessageHandler::SteamMessageHandler(boost::asio::io_context& io_context, ISteamNetworkingSockets* interface, std::vector<HSteamNetConnection>& connections, std::mutex& connectionsMutex, bool& g_isHost, int& localPort)
-    : io_context_(io_context), m_pInterface_(interface), connections_(connections), connectionsMutex_(connectionsMutex), g_isHost_(g_isHost), localPort_(localPort), running_(false), currentPollInterval_(0) {}
+    : io_context_(io_context), m_pInterface_(interface), transport_(interface), connections_(connections), connectionsMutex_(connectionsMutex), g_isHost_(g_isHost), localPort_(localPort), running_(false) {}
 
 SteamMessageHandler::~SteamMessageHandler() {
     stop();
@@ -15,69 +17,518 @@ SteamMessageHandler::~SteamMessageHandler() {
 void SteamMessageHandler::start() {
     if (running_) return;
     running_ = true;
-    timer_ = std::make_unique<boost::asio::steady_timer>(io_context_);
-    startAsyncPoll();
+    pollGroup_ = m_pInterface_->CreatePollGroup();
+    grouped_.clear();
+    pollThread_.start(pollOptions_, [this]() { return poll(); });
 }
 
 void SteamMessageHandler::stop() {
     if (!running_) return;
     running_ = false;
-    if (timer_) {
-        timer_->cancel();
+    pollThread_.stop();
+    if (pollGroup_ != k_HSteamNetPollGroup_Invalid) {
+        m_pInterface_->DestroyPollGroup(pollGroup_);
+        pollGroup_ = k_HSteamNetPollGroup_Invalid;
+    }
+}
+
+void SteamMessageHandler::setPollOptions(const PollThread::Options& options) {
+    pollOptions_ = options;
+    if (running_) {
+        // The poll group and everything else stay; only the thread changes
+        pollThread_.stop();
+        pollThread_.start(pollOptions_, [this]() { return poll(); });
     }
 }
 
 std::shared_ptr<MultiplexManager> SteamMessageHandler::getMultiplexManager(HSteamNetConnection conn) {
-    if (multiplexManagers_.find(conn) == multiplexManagers_.end()) {
-        multiplexManagers_[conn] = std::make_shared<MultiplexManager>(m_pInterface_, conn, io_context_, g_isHost_, localPort_);
+    int lane;
+    return route(conn, lane);
+}
+
+std::shared_ptr<MultiplexManager> SteamMessageHandler::route(HSteamNetConnection conn, int& lane) {
+    std::lock_guard<std::mutex> lock(managersMutex_);
+    auto route = lanes_.find(conn);
+    if (route != lanes_.end()) {
+        lane = route->second.lane;
+        return route->second.manager;
     }
-    return multiplexManagers_[conn];
+    lane = 0;
+    auto& manager = multiplexManagers_[conn];
+    if (!manager) {
+        manager = createManager(&transport_, conn, g_isHost_);
+    }
+    return manager;
 }
 
-void SteamMessageHandler::startAsyncPoll() {
-    if (!running_) return;
-    
-    // Poll networking callbacks
+std::shared_ptr<MultiplexManager> SteamMessageHandler::createManager(TunnelTransport* transport, HSteamNetConnection conn,
+                                                                     bool& isHost) {
+    auto manager = std::make_shared<MultiplexManager>(transport, conn, io_context_, isHost, localPort_);
+    if (endpointAcceptor_) {
+        manager->setEndpointAcceptor(endpointAcceptor_);
+    }
+    manager->setAllowedPorts(allowedPorts_);
+    manager->setBackendPools(backendPools_);
+    auto peer = connectionPeers_.find(conn);
+    if (peer != connectionPeers_.end()) {
+        manager->setRemotePeer(peer->second);
+    }
+    return manager;
+}
+
+void SteamMessageHandler::setEndpointAcceptor(MultiplexManager::EndpointAcceptor acceptor) {
+    std::lock_guard<std::mutex> lock(managersMutex_);
+    endpointAcceptor_ = std::move(acceptor);
+    for (auto& pair : multiplexManagers_) {
+        pair.second->setEndpointAcceptor(endpointAcceptor_);
+    }
+    for (auto& pair : relays_) {
+        pair.second.manager->setEndpointAcceptor(endpointAcceptor_);
+    }
+}
+
+void SteamMessageHandler::setAllowedPorts(std::vector<int> ports) {
+    std::lock_guard<std::mutex> lock(managersMutex_);
+    allowedPorts_ = std::move(ports);
+    for (auto& pair : multiplexManagers_) {
+        pair.second->setAllowedPorts(allowedPorts_);
+    }
+    for (auto& pair : relays_) {
+        pair.second.manager->setAllowedPorts(allowedPorts_);
+    }
+}
+
+void SteamMessageHandler::setBackendPools(std::map<int, std::shared_ptr<BackendPool>> pools) {
+    std::lock_guard<std::mutex> lock(managersMutex_);
+    backendPools_ = std::move(pools);
+    for (auto& pair : multiplexManagers_) {
+        pair.second->setBackendPools(backendPools_);
+    }
+    for (auto& pair : relays_) {
+        pair.second.manager->setBackendPools(backendPools_);
+    }
+}
+
+void SteamMessageHandler::addMeshConnection(HSteamNetConnection conn, bool accepted, uint64_t peer) {
+    std::lock_guard<std::mutex> lock(managersMutex_);
+    auto manager = createManager(&transport_, conn, accepted ? acceptingRole_ : openingRole_);
+    manager->setRemotePeer(peer);
+    multiplexManagers_[conn] = manager;
+}
+
+std::shared_ptr<MultiplexManager> SteamMessageHandler::getRelayManager(HSteamNetConnection hostConn, uint64_t peer) {
+    std::lock_guard<std::mutex> lock(managersMutex_);
+    // Ours opens streams: it receives what the peer's acceptor sends back
+    auto& link = relays_[std::make_pair(peer, RelayTransport::kRouteToOpener)];
+    if (link.manager && link.transport->hostConnection() != hostConn) {
+        // From before a reconnect to the host; dropRelays normally got it
+        link = RelayLink{};
+    }
+    if (!link.manager) {
+        link.transport.reset(new RelayTransport(&transport_, hostConn, peer, RelayTransport::kRouteToAcceptor));
+        link.manager = createManager(link.transport.get(), hostConn, openingRole_);
+    }
+    return link.manager;
+}
+
+void SteamMessageHandler::dropRelays(uint64_t peer) {
+    std::vector<RelayLink> dropped;
+    std::lock_guard<std::mutex> lock(managersMutex_);
+    for (auto it = relays_.begin(); it != relays_.end();) {
+        if (peer == 0 || it->first.first == peer) {
+            dropped.push_back(std::move(it->second));
+            it = relays_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void SteamMessageHandler::setMeshEnabled(bool enabled) {
+    std::lock_guard<std::mutex> lock(managersMutex_);
+    meshEnabled_ = enabled;
+}
+
+void SteamMessageHandler::setConnectionPeer(HSteamNetConnection conn, uint64_t peer) {
+    std::lock_guard<std::mutex> lock(managersMutex_);
+    connectionPeers_[conn] = peer;
+    auto manager = multiplexManagers_.find(conn);
+    if (manager != multiplexManagers_.end()) {
+        manager->second->setRemotePeer(peer);
+    }
+}
+
+void SteamMessageHandler::forgetConnectionPeer(HSteamNetConnection conn) {
+    std::lock_guard<std::mutex> lock(managersMutex_);
+    connectionPeers_.erase(conn);
+}
+
+void SteamMessageHandler::relayFrame(HSteamNetConnection conn, uint64_t peer, uint32_t route, const char* inner,
+                                     size_t innerLen) {
+    if (g_isHost_) {
+        // Same frame, now naming the member it came from
+        uint64_t source = 0;
+        HSteamNetConnection destination = k_HSteamNetConnection_Invalid;
+        {
+            std::lock_guard<std::mutex> lock(managersMutex_);
+            auto from = connectionPeers_.find(conn);
+            if (from != connectionPeers_.end()) {
+                source = from->second;
+            }
+            for (auto& pair : connectionPeers_) {
+                if (pair.second == peer) {
+                    destination = pair.first;
+                    break;
+                }
+            }
+        }
+        if (source == 0 || destination == k_HSteamNetConnection_Invalid) {
+            return;
+        }
+        RelayTransport(&transport_, destination, source, route)
+            .send(destination, inner, static_cast<uint32>(innerLen), k_nSteamNetworkingSend_Reliable);
+        return;
+    }
+    std::shared_ptr<MultiplexManager> manager;
+    RelayLink stale; // Released outside the lock
+    {
+        std::lock_guard<std::mutex> lock(managersMutex_);
+        auto key = std::make_pair(peer, route);
+        auto it = relays_.find(key);
+        if (it != relays_.end() && it->second.transport->hostConnection() == conn) {
+            manager = it->second.manager;
+        } else if (route == RelayTransport::kRouteToAcceptor && meshEnabled_) {
+            // The peer opened a stream to us; replies go back the other way
+            RelayLink& link = relays_[key];
+            stale = std::move(link);
+            link.transport.reset(new RelayTransport(&transport_, conn, peer, RelayTransport::kRouteToOpener));
+            link.manager = createManager(link.transport.get(), conn, acceptingRole_);
+            link.manager->setRemotePeer(peer);
+            manager = link.manager;
+        }
+    }
+    if (manager) {
+        manager->handleTunnelPacket(inner, innerLen);
+    }
+}
+
+bool SteamMessageHandler::connectionLost(HSteamNetConnection conn) {
+    std::shared_ptr<MultiplexManager> dropped;
+    {
+        std::lock_guard<std::mutex> lock(managersMutex_);
+        auto it = multiplexManagers_.find(conn);
+        if (it == multiplexManagers_.end()) {
+            return false;
+        }
+        if (it->second->detach()) {
+            detachedAt_[conn] = std::chrono::steady_clock::now();
+            return true;
+        }
+        dropped = std::move(it->second);
+        multiplexManagers_.erase(it);
+    }
+    // Released outside the lock: the destructor closes the streams
+    return false;
+}
+
+void SteamMessageHandler::resumeConnection(HSteamNetConnection previous, HSteamNetConnection conn) {
+    std::shared_ptr<MultiplexManager> manager;
+    {
+        std::lock_guard<std::mutex> lock(managersMutex_);
+        auto it = multiplexManagers_.find(previous);
+        if (it == multiplexManagers_.end()) {
+            return;
+        }
+        manager = std::move(it->second);
+        multiplexManagers_.erase(it);
+        detachedAt_.erase(previous);
+        multiplexManagers_[conn] = manager;
+    }
+    manager->resume(conn);
+}
+
+void SteamMessageHandler::dropConnection(HSteamNetConnection conn) {
+    std::shared_ptr<MultiplexManager> dropped;
+    std::lock_guard<std::mutex> lock(managersMutex_);
+    auto it = multiplexManagers_.find(conn);
+    if (it != multiplexManagers_.end()) {
+        dropped = std::move(it->second);
+        multiplexManagers_.erase(it);
+    }
+    detachedAt_.erase(conn);
+    // Its lanes' connections are closed by the peer or by disconnect()
+    for (auto lane = lanes_.begin(); lane != lanes_.end();) {
+        if (dropped && lane->second.manager == dropped) {
+            lane = lanes_.erase(lane);
+        } else {
+            ++lane;
+        }
+    }
+}
+
+void SteamMessageHandler::dropAllConnections() {
+    std::map<HSteamNetConnection, std::shared_ptr<MultiplexManager>> dropped;
+    std::map<HSteamNetConnection, LaneRoute> droppedLanes;
+    std::map<std::pair<uint64_t, uint32_t>, RelayLink> droppedRelays;
+    std::lock_guard<std::mutex> lock(managersMutex_);
+    dropped.swap(multiplexManagers_);
+    droppedLanes.swap(lanes_);
+    droppedRelays.swap(relays_);
+    detachedAt_.clear();
+    connectionPeers_.clear();
+}
+
+bool SteamMessageHandler::addLane(HSteamNetConnection primary, HSteamNetConnection conn) {
+    std::lock_guard<std::mutex> lock(managersMutex_);
+    auto it = multiplexManagers_.find(primary);
+    if (it == multiplexManagers_.end()) {
+        return false;
+    }
+    int lane = it->second->addLane(conn);
+    if (lane < 0) {
+        return false;
+    }
+    lanes_[conn] = LaneRoute{it->second, lane};
+    return true;
+}
+
+void SteamMessageHandler::dropLane(HSteamNetConnection conn) {
+    std::shared_ptr<MultiplexManager> manager;
+    {
+        std::lock_guard<std::mutex> lock(managersMutex_);
+        auto it = lanes_.find(conn);
+        if (it == lanes_.end()) {
+            return;
+        }
+        manager = std::move(it->second.manager);
+        lanes_.erase(it);
+    }
+    manager->removeLane(conn);
+}
+
+bool SteamMessageHandler::joinLane(HSteamNetConnection conn, uint64_t sessionId, int lane) {
+    std::shared_ptr<MultiplexManager> manager;
+    {
+        std::lock_guard<std::mutex> lock(managersMutex_);
+        for (auto& pair : multiplexManagers_) {
+            if (pair.second->sessionId() == sessionId) {
+                manager = pair.second;
+                break;
+            }
+        }
+        if (!manager) {
+            return false;
+        }
+        lanes_[conn] = LaneRoute{manager, lane};
+    }
+    manager->attachLane(lane, conn);
+    return true;
+}
+
+void SteamMessageHandler::adoptSession(HSteamNetConnection conn, uint64_t sessionId) {
+    HSteamNetConnection previous = k_HSteamNetConnection_Invalid;
+    std::shared_ptr<MultiplexManager> manager;
+    {
+        std::lock_guard<std::mutex> lock(managersMutex_);
+        for (auto& pair : multiplexManagers_) {
+            if (pair.first != conn && pair.second->sessionId() == sessionId) {
+                previous = pair.first;
+                manager = pair.second;
+                break;
+            }
+        }
+        if (!manager) {
+            return;
+        }
+        // Whatever got created for conn before the hello has nothing in it
+        multiplexManagers_.erase(previous);
+        detachedAt_.erase(previous);
+        multiplexManagers_[conn] = manager;
+        manager->attach(conn);
+    }
+    LOG_INFO("Session {} moved from connection {} to {}", sessionId, previous, conn);
+    // The client gave up on the old connection even if we haven't noticed yet
+    closeConnection(previous, "Session resumed elsewhere");
+}
+
+void SteamMessageHandler::closeConnection(HSteamNetConnection conn, const char* reason) {
+    bool stillOpen;
+    {
+        std::lock_guard<std::mutex> lockConn(connectionsMutex_);
+        auto it = std::find(connections_.begin(), connections_.end(), conn);
+        stillOpen = it != connections_.end();
+        if (stillOpen) {
+            connections_.erase(it);
+        }
+    }
+    if (stillOpen) {
+        m_pInterface_->CloseConnection(conn, 0, reason, false);
+    }
+}
+
+void SteamMessageHandler::expireSessions() {
+    auto now = std::chrono::steady_clock::now();
+    std::vector<std::shared_ptr<MultiplexManager>> expired;
+    std::lock_guard<std::mutex> lock(managersMutex_);
+    for (auto it = detachedAt_.begin(); it != detachedAt_.end();) {
+        if (now - it->second < kSessionGrace) {
+            ++it;
+            continue;
+        }
+        LOG_INFO("Session on connection {} wasn't resumed in time, closing its streams", it->first);
+        auto manager = multiplexManagers_.find(it->first);
+        if (manager != multiplexManagers_.end()) {
+            expired.push_back(std::move(manager->second));
+            multiplexManagers_.erase(manager);
+        }
+        it = detachedAt_.erase(it);
+    }
+}
+
+bool SteamMessageHandler::connectionOpen(HSteamNetConnection conn) {
+    SteamNetConnectionInfo_t info;
+    if (!m_pInterface_->GetConnectionInfo(conn, &info)) {
+        return false;
+    }
+    return info.m_eState == k_ESteamNetworkingConnectionState_Connecting ||
+           info.m_eState == k_ESteamNetworkingConnectionState_FindingRoute ||
+           info.m_eState == k_ESteamNetworkingConnectionState_Connected;
+}
+
+void SteamMessageHandler::collectManagers(std::vector<std::shared_ptr<MultiplexManager>>& managers) {
+    for (auto& pair : multiplexManagers_) {
+        managers.push_back(pair.second);
+    }
+    for (auto& pair : relays_) {
+        managers.push_back(pair.second.manager);
+    }
+}
+
+void SteamMessageHandler::sweepManagers() {
+    std::vector<std::shared_ptr<MultiplexManager>> managers;
+    std::vector<std::shared_ptr<MultiplexManager>> orphaned;
+    {
+        std::lock_guard<std::mutex> lock(managersMutex_);
+        // A frame that raced its connection's close, or a lookup of a
+        // connection that just closed, creates a manager nothing removes.
+        // Two sweeps in a row give the close callback its chance first.
+        std::vector<HSteamNetConnection> closed;
+        for (auto it = multiplexManagers_.begin(); it != multiplexManagers_.end();) {
+            HSteamNetConnection conn = it->first;
+            if (detachedAt_.count(conn) || connectionOpen(conn)) {
+                ++it;
+                continue;
+            }
+            if (std::find(orphans_.begin(), orphans_.end(), conn) == orphans_.end()) {
+                closed.push_back(conn);
+                ++it;
+                continue;
+            }
+            LOG_INFO("Connection {} is gone, dropping its manager", conn);
+            orphaned.push_back(std::move(it->second));
+            it = multiplexManagers_.erase(it);
+        }
+        orphans_.swap(closed);
+        for (auto lane = lanes_.begin(); lane != lanes_.end();) {
+            if (std::find(orphaned.begin(), orphaned.end(), lane->second.manager) != orphaned.end()) {
+                lane = lanes_.erase(lane);
+            } else {
+                ++lane;
+            }
+        }
+        collectManagers(managers);
+    }
+    // Outside the lock: closing streams sends frames
+    MultiplexManager::sweep(managers);
+}
+
+size_t SteamMessageHandler::poll() {
+    // Connection status callbacks run here, promptly, rather than whenever
+    // the UI thread's SteamAPI_RunCallbacks gets to them
     m_pInterface_->RunCallbacks();
-    
-    // Receive messages and check if any were received
-    int totalMessages = 0;
-    std::vector<HSteamNetConnection> currentConnections;
+
+    // Every connection is in one poll group, so a poll costs the same with
+    // one peer or sixty; new connections join it here
     {
         std::lock_guard<std::mutex> lockConn(connectionsMutex_);
-        currentConnections = connections_;
-    }
-    for (auto conn : currentConnections) {
-        ISteamNetworkingMessage* pIncomingMsgs[10];
-        int numMsgs = m_pInterface_->ReceiveMessagesOnConnection(conn, pIncomingMsgs, 10);
-        totalMessages += numMsgs;
-        for (int i = 0; i < numMsgs; ++i) {
-            ISteamNetworkingMessage* pIncomingMsg = pIncomingMsgs[i];
-            const char* data = (const char*)pIncomingMsg->m_pData;
-            size_t size = pIncomingMsg->m_cbSize;
-            // Handle tunnel packets with multiplexing
-            if (multiplexManagers_.find(conn) == multiplexManagers_.end()) {
-                multiplexManagers_[conn] = std::make_shared<MultiplexManager>(m_pInterface_, conn, io_context_, g_isHost_, localPort_);
+        pollConnections_.assign(connections_.begin(), connections_.end());
+    }
+    std::sort(pollConnections_.begin(), pollConnections_.end());
+    if (pollConnections_ != grouped_) {
+        for (auto conn : pollConnections_) {
+            if (!std::binary_search(grouped_.begin(), grouped_.end(), conn)) {
+                m_pInterface_->SetConnectionPollGroup(conn, pollGroup_);
             }
-            multiplexManagers_[conn]->handleTunnelPacket(data, size);
+        }
+        grouped_.swap(pollConnections_);
+    }
+
+    ISteamNetworkingMessage* pIncomingMsgs[kPollBatch];
+    int totalMessages = m_pInterface_->ReceiveMessagesOnPollGroup(pollGroup_, pIncomingMsgs, kPollBatch);
+    if (totalMessages < 0) {
+        totalMessages = 0;
+    }
+    rejected_.clear();
+    for (int i = 0; i < totalMessages; ++i) {
+        ISteamNetworkingMessage* pIncomingMsg = pIncomingMsgs[i];
+        HSteamNetConnection conn = pIncomingMsg->m_conn;
+        // The rest of a rejected connection's batch goes too
+        if (std::find(rejected_.begin(), rejected_.end(), conn) != rejected_.end()) {
             pIncomingMsg->Release();
+            continue;
+        }
+        const char* data = (const char*)pIncomingMsg->m_pData;
+        size_t size = pIncomingMsg->m_cbSize;
+        SteamNetworkingMicroseconds dispatched = SteamNetworkingUtils()->GetLocalTimestamp();
+        if (pIncomingMsg->m_usecTimeReceived > 0 && dispatched >= pIncomingMsg->m_usecTimeReceived) {
+            pollThread_.recordLatency(static_cast<uint64_t>(dispatched - pIncomingMsg->m_usecTimeReceived));
         }
+        TRACE_EVENT("steam.receive", StreamIdText(frameStreamId(data, size)).c_str(), size);
+        uint64_t sessionId;
+        int lane;
+        uint64_t relayPeer;
+        uint32_t relayRoute;
+        const char* inner;
+        size_t innerLen;
+        if (MultiplexManager::parseRelay(data, size, relayPeer, relayRoute, inner, innerLen)) {
+            relayFrame(conn, relayPeer, relayRoute, inner, innerLen);
+            pIncomingMsg->Release();
+            continue;
+        }
+        if (g_isHost_ && MultiplexManager::parseHello(data, size, sessionId)) {
+            adoptSession(conn, sessionId);
+        } else if (g_isHost_ && MultiplexManager::parseLaneJoin(data, size, sessionId, lane) &&
+                   !joinLane(conn, sessionId, lane)) {
+            LOG_WARN("Lane join on connection {} for unknown session {}", conn, sessionId);
+            rejected_.push_back(conn);
+            pIncomingMsg->Release();
+            continue;
+        }
+        // Handle tunnel packets with multiplexing
+        route(conn, lane)->handleTunnelPacket(data, size, lane);
+        pIncomingMsg->Release();
     }
-    
-    // Adaptive polling: if messages received, poll immediately; otherwise increase interval
-    if (totalMessages > 0) {
-        currentPollInterval_ = 0; // 有消息，立即轮询
-    } else {
-        // 无消息，逐渐增加间隔，最大10ms
-        currentPollInterval_ = std::min(currentPollInterval_ + 1, 10);
+    for (auto conn : rejected_) {
+        closeConnection(conn, "Unknown session");
     }
     
-    // Schedule next poll
-    timer_->expires_after(std::chrono::milliseconds(currentPollInterval_));
-    timer_->async_wait([this](const boost::system::error_code& error) {
-        if (!error && running_) {
-            startAsyncPoll();
+    auto now = std::chrono::steady_clock::now();
+    if (now >= nextExpiry_) {
+        nextExpiry_ = now + std::chrono::seconds(1);
+        expireSessions();
+        sweepManagers();
+    }
+    if (MemoryBudget::instance().takeStalled()) {
+        // Back under the budget: local reads stopped for it start again
+        std::vector<std::shared_ptr<MultiplexManager>> managers;
+        {
+            std::lock_guard<std::mutex> lock(managersMutex_);
+            collectManagers(managers);
         }
-    });
+        for (auto& manager : managers) {
+            manager->resumeReading();
+        }
+    }
+    return static_cast<size_t>(totalMessages);
 }
 
@@ -1,6 +1,7 @@
 #ifndef STEAM_MESSAGE_HANDLER_H
 #define STEAM_MESSAGE_HANDLER_H
 
+#include <chrono>
 #include <vector>
 #include <map>
 #include <mutex>
@@ -10,32 +11,136 @@
 #include <steamnetworkingtypes.h>
 #include "../net/tcp_server.h"
 #include "../net/multiplex_manager.h"
+#include "../net/poll_thread.h"
+#include "../net/relay_transport.h"
+#include "../net/tunnel_transport.h"
 
 class SteamMessageHandler {
 public:
     SteamMessageHandler(boost::asio::io_context& io_context, ISteamNetworkingSockets* interface, std::vector<HSteamNetConnection>& connections, std::mutex& connectionsMutex, bool& g_isHost, int& localPort);
     ~SteamMessageHandler();
 
+    // Receiving and Steam's networking callbacks run on a thread of their
+    // own (see PollThread), not on io_context
     void start();
     void stop();
+    // Wait strategy, affinity and priority of that thread; restarts it if
+    // it's running. Not from Steam callbacks.
+    void setPollOptions(const PollThread::Options& options);
+    PollThread::Options getPollOptions() const { return pollOptions_; }
+    // Receive-to-dispatch latency and the thread's CPU use
+    PollThread::Snapshot getPollStats() const { return pollThread_.snapshot(); }
 
     std::shared_ptr<MultiplexManager> getMultiplexManager(HSteamNetConnection conn);
+    // The connection dropped. Keeps its manager for a resume if the session
+    // allows one (returns true), otherwise drops it and its streams.
+    bool connectionLost(HSteamNetConnection conn);
+    // Client: a new connection to the host carries on previous's session
+    void resumeConnection(HSteamNetConnection previous, HSteamNetConnection conn);
+    // Ends a connection's session now, closing its streams
+    void dropConnection(HSteamNetConnection conn);
+    void dropAllConnections();
+    // Client: conn is a bonding lane for primary's session; sends its lane
+    // join. false if the session can't take another lane.
+    bool addLane(HSteamNetConnection primary, HSteamNetConnection conn);
+    // A lane's connection closed: the streams that used it go with it
+    void dropLane(HSteamNetConnection conn);
+    // Mesh: a direct connection to another member. accepted: the peer
+    // opened it and its streams come in on it; otherwise ours go out.
+    void addMeshConnection(HSteamNetConnection conn, bool accepted, uint64_t peer);
+    // Mesh: the manager for streams to peer through the host, created on first use
+    std::shared_ptr<MultiplexManager> getRelayManager(HSteamNetConnection hostConn, uint64_t peer);
+    // Ends every stream relayed to or from peer (0: every peer)
+    void dropRelays(uint64_t peer);
+    // Member: whether peers may open streams to us through the host
+    void setMeshEnabled(bool enabled);
+    // The member a connection belongs to: the host relays between members by
+    // it, and pools that hash by peer key on it
+    void setConnectionPeer(HSteamNetConnection conn, uint64_t peer);
+    void forgetConnectionPeer(HSteamNetConnection conn);
+    // Applied to every manager, current and future (see MultiplexManager::setEndpointAcceptor)
+    void setEndpointAcceptor(MultiplexManager::EndpointAcceptor acceptor);
+    // Host: extra destination ports clients may open streams to, for every manager
+    void setAllowedPorts(std::vector<int> ports);
+    // Host: local server pools by port, for every manager (see MultiplexManager::setBackendPools)
+    void setBackendPools(std::map<int, std::shared_ptr<BackendPool>> pools);
 
 private:
-    void startAsyncPoll();
+    // How long the host keeps a dropped client's session for it to come back
+    static constexpr std::chrono::seconds kSessionGrace{60};
+    // Messages taken from the poll group per poll
+    static constexpr int kPollBatch = 64;
+
+    // One pass: callbacks, then up to kPollBatch messages. Returns the
+    // message count.
+    size_t poll();
+    // Host: a hello for a session that lives on another connection moves it here
+    void adoptSession(HSteamNetConnection conn, uint64_t sessionId);
+    void expireSessions();
+    // Once a second: drops managers whose connection closed without us
+    // hearing of it, then lets MultiplexManager::sweep reap idle streams and
+    // enforce the memory budget over every manager
+    void sweepManagers();
+    // managersMutex_ held
+    void collectManagers(std::vector<std::shared_ptr<MultiplexManager>>& managers);
+    bool connectionOpen(HSteamNetConnection conn);
+    // Closes a connection of ours that Steam hasn't reported closed
+    void closeConnection(HSteamNetConnection conn, const char* reason);
+    // Host: a lane join on conn attaches it to its session's manager
+    bool joinLane(HSteamNetConnection conn, uint64_t sessionId, int lane);
+    // The manager and lane a connection's frames go to
+    std::shared_ptr<MultiplexManager> route(HSteamNetConnection conn, int& lane);
+    // managersMutex_ held
+    std::shared_ptr<MultiplexManager> createManager(TunnelTransport* transport, HSteamNetConnection conn, bool& isHost);
+    // Host: passes a relay frame on to its destination. Member: hands the
+    // inner frame to the relay manager it's for.
+    void relayFrame(HSteamNetConnection conn, uint64_t peer, uint32_t route, const char* inner, size_t innerLen);
 
     boost::asio::io_context& io_context_;
     ISteamNetworkingSockets* m_pInterface_;
+    SteamTunnelTransport transport_;
     std::vector<HSteamNetConnection>& connections_;
     std::mutex& connectionsMutex_;
     bool& g_isHost_;
     int& localPort_;
 
+    std::mutex managersMutex_; // Never held while taking connectionsMutex_
     std::map<HSteamNetConnection, std::shared_ptr<MultiplexManager>> multiplexManagers_;
+    std::map<HSteamNetConnection, std::chrono::steady_clock::time_point> detachedAt_; // Under managersMutex_
+    std::chrono::steady_clock::time_point nextExpiry_;
+    // Bonding lanes other than 0, by connection; under managersMutex_
+    struct LaneRoute {
+        std::shared_ptr<MultiplexManager> manager;
+        int lane;
+    };
+    std::map<HSteamNetConnection, LaneRoute> lanes_;
+    // Mesh managers take a role of their own instead of g_isHost_
+    bool acceptingRole_ = true;
+    bool openingRole_ = false;
+    // Relayed mesh peers, by peer and the route the manager receives on
+    // (see RelayTransport); under managersMutex_
+    struct RelayLink {
+        std::unique_ptr<RelayTransport> transport;
+        std::shared_ptr<MultiplexManager> manager;
+    };
+    std::map<std::pair<uint64_t, uint32_t>, RelayLink> relays_;
+    std::map<HSteamNetConnection, uint64_t> connectionPeers_; // Host; under managersMutex_
+    bool meshEnabled_ = false; // Under managersMutex_
+    MultiplexManager::EndpointAcceptor endpointAcceptor_;
+    std::vector<int> allowedPorts_;
+    std::map<int, std::shared_ptr<BackendPool>> backendPools_;
+
+    // Poll state, only touched by the poll. grouped_: sorted connections
+    // already in pollGroup_.
+    HSteamNetPollGroup pollGroup_ = k_HSteamNetPollGroup_Invalid;
+    std::vector<HSteamNetConnection> grouped_;
+    std::vector<HSteamNetConnection> pollConnections_;
+    std::vector<HSteamNetConnection> rejected_;
+    std::vector<HSteamNetConnection> orphans_; // Closed connections that still had a manager last sweep
 
-    std::unique_ptr<boost::asio::steady_timer> timer_;
+    PollThread pollThread_{"steam"};
+    PollThread::Options pollOptions_;
     bool running_;
-    int currentPollInterval_; // 当前轮询间隔（毫秒）
 };
 
 #endif // STEAM_MESSAGE_HANDLER_H
\ No newline at end of file
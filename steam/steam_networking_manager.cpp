@@ -1,5 +1,6 @@
 #include "steam_networking_manager.h"
-#include <iostream>
+#include "../net/logger.h"
+#include "../net/shm_server.h"
 #include <algorithm>
 
 SteamNetworkingManager *SteamNetworkingManager::instance = nullptr;
@@ -16,6 +17,9 @@ void SteamNetworkingManager::OnSteamNetConnectionStatusChanged(SteamNetConnectio
 SteamNetworkingManager::SteamNetworkingManager()
     : m_pInterface(nullptr), hListenSock(k_HSteamListenSocket_Invalid), g_isHost(false), g_isClient(false), g_isConnected(false),
       g_hConnection(k_HSteamNetConnection_Invalid),
+      reconnecting_(false), resumeConn_(k_HSteamNetConnection_Invalid), reconnectAttempt_(0),
+      bondingLanes_(1), striping_(false),
+      meshMode_(false), meshListenSock_(k_HSteamListenSocket_Invalid),
       io_context_(nullptr), server_(nullptr), localPort_(nullptr), messageHandler_(nullptr), hostPing_(0)
 {
 }
@@ -34,15 +38,31 @@ bool SteamNetworkingManager::initialize()
     // Steam API should already be initialized before calling this
     if (!SteamAPI_IsSteamRunning())
     {
-        std::cerr << "Steam is not running" << std::endl;
+        LOG_ERROR("Steam is not running");
         return false;
     }
 
     // 【新增】开启详细日志
+    // Routed through the async logger so Steam's own (verbose) output never blocks its caller
     SteamNetworkingUtils()->SetDebugOutputFunction(k_ESteamNetworkingSocketsDebugOutputType_Msg,
                                                    [](ESteamNetworkingSocketsDebugOutputType nType, const char *pszMsg)
                                                    {
-                                                       std::cout << "[SteamNet] " << pszMsg << std::endl;
+                                                       if (nType <= k_ESteamNetworkingSocketsDebugOutputType_Error)
+                                                       {
+                                                           LOG_ERROR("[SteamNet] {}", pszMsg);
+                                                       }
+                                                       else if (nType <= k_ESteamNetworkingSocketsDebugOutputType_Warning)
+                                                       {
+                                                           LOG_WARN("[SteamNet] {}", pszMsg);
+                                                       }
+                                                       else if (nType == k_ESteamNetworkingSocketsDebugOutputType_Msg)
+                                                       {
+                                                           LOG_INFO("[SteamNet] {}", pszMsg);
+                                                       }
+                                                       else
+                                                       {
+                                                           LOG_DEBUG("[SteamNet] {}", pszMsg);
+                                                       }
                                                    });
 
     int32 logLevel = k_ESteamNetworkingSocketsDebugOutputType_Verbose;
@@ -90,22 +110,41 @@ bool SteamNetworkingManager::initialize()
     m_pInterface = SteamNetworkingSockets();
 
     // Check if callbacks are registered
-    std::cout << "Steam Networking Manager initialized successfully" << std::endl;
+    LOG_INFO("Steam Networking Manager initialized successfully");
 
     return true;
 }
 
 void SteamNetworkingManager::shutdown()
 {
+    // The Steam API itself belongs to whoever called SteamAPI_Init (the GUI,
+    // or a game embedding connecttool_core)
     if (g_hConnection != k_HSteamNetConnection_Invalid)
     {
         m_pInterface->CloseConnection(g_hConnection, 0, nullptr, false);
+        g_hConnection = k_HSteamNetConnection_Invalid;
+    }
+    for (auto &lane : laneConns_)
+    {
+        m_pInterface->CloseConnection(lane.first, 0, nullptr, false);
+    }
+    laneConns_.clear();
+    for (auto &mesh : meshConns_)
+    {
+        m_pInterface->CloseConnection(mesh.first, 0, nullptr, false);
     }
+    meshConns_.clear();
     if (hListenSock != k_HSteamListenSocket_Invalid)
     {
         m_pInterface->CloseListenSocket(hListenSock);
+        hListenSock = k_HSteamListenSocket_Invalid;
+    }
+    closeLaneListenSockets();
+    closeMesh();
+    for (auto &pool : backendPools_)
+    {
+        pool.second->stop();
     }
-    SteamAPI_Shutdown();
 }
 
 bool SteamNetworkingManager::joinHost(uint64 hostID)
@@ -117,15 +156,28 @@ bool SteamNetworkingManager::joinHost(uint64 hostID)
     identity.SetSteamID(hostSteamID);
 
     g_hConnection = m_pInterface->ConnectP2P(identity, 0, 0, nullptr);
+    if (meshMode_ && meshListenSock_ == k_HSteamListenSocket_Invalid)
+    {
+        // Other members connect to us here
+        meshListenSock_ = m_pInterface->CreateListenSocketP2P(kMeshVirtualPort, 0, nullptr);
+        if (meshListenSock_ == k_HSteamListenSocket_Invalid)
+        {
+            LOG_WARN("Failed to listen for mesh connections, other members will relay through the host");
+        }
+        if (messageHandler_)
+        {
+            messageHandler_->setMeshEnabled(true);
+        }
+    }
 
     if (g_hConnection != k_HSteamNetConnection_Invalid)
     {
-        std::cout << "Attempting to connect to host " << hostSteamID.ConvertToUint64() << " with virtual port " << 0 << std::endl;
+        LOG_INFO("Attempting to connect to host {} with virtual port {}", hostSteamID.ConvertToUint64(), 0);
         return true;
     }
     else
     {
-        std::cerr << "Failed to initiate connection" << std::endl;
+        LOG_ERROR("Failed to initiate connection");
         return false;
     }
 }
@@ -134,19 +186,28 @@ void SteamNetworkingManager::disconnect()
 {
     std::lock_guard<std::mutex> lock(connectionsMutex);
     
-    // Close client connection
+    // Close client connection. The App_Generic reason tells the peer we left
+    // on purpose, so it doesn't keep the session around for a reconnect.
     if (g_hConnection != k_HSteamNetConnection_Invalid)
     {
-        m_pInterface->CloseConnection(g_hConnection, 0, nullptr, false);
+        m_pInterface->CloseConnection(g_hConnection, k_ESteamNetConnectionEnd_App_Generic, "Disconnect", false);
         g_hConnection = k_HSteamNetConnection_Invalid;
     }
     
-    // Close all host connections
+    // Close all host connections (and bonding lanes, which are in there too)
     for (auto conn : connections)
     {
-        m_pInterface->CloseConnection(conn, 0, nullptr, false);
+        m_pInterface->CloseConnection(conn, k_ESteamNetConnectionEnd_App_Generic, "Disconnect", false);
     }
     connections.clear();
+    laneConns_.clear();
+    meshConns_.clear();
+    closeMesh();
+    stopReconnecting();
+    if (messageHandler_)
+    {
+        messageHandler_->dropAllConnections();
+    }
     
     // Close listen socket
     if (hListenSock != k_HSteamListenSocket_Invalid)
@@ -154,6 +215,7 @@ void SteamNetworkingManager::disconnect()
         m_pInterface->CloseListenSocket(hListenSock);
         hListenSock = k_HSteamListenSocket_Invalid;
     }
+    closeLaneListenSockets();
     
     // Reset state
     g_isHost = false;
@@ -161,7 +223,8 @@ void SteamNetworkingManager::disconnect()
     g_isConnected = false;
     hostPing_ = 0;
     
-    std::cout << "Disconnected from network" << std::endl;
+    LOG_INFO("Disconnected from network");
+    notifyStateChanged();
 }
 
 void SteamNetworkingManager::setMessageHandlerDependencies(boost::asio::io_context &io_context, std::unique_ptr<TCPServer> &server, int &localPort)
@@ -172,6 +235,171 @@ void SteamNetworkingManager::setMessageHandlerDependencies(boost::asio::io_conte
     messageHandler_ = new SteamMessageHandler(io_context, m_pInterface, connections, connectionsMutex, g_isHost, localPort);
 }
 
+std::unique_ptr<TCPServer> SteamNetworkingManager::createTCPServer()
+{
+    return std::make_unique<TCPServer>(
+        portMappings_,
+        [this](uint64_t peer) { return getTunnel(peer); },
+        [this]()
+        { notifyStateChanged(); });
+}
+
+std::unique_ptr<ShmServer> SteamNetworkingManager::createShmServer(const std::string &name)
+{
+    return std::make_unique<ShmServer>(
+        name,
+        [this]() -> std::shared_ptr<MultiplexManager>
+        { return getTunnel(0); },
+        [this]()
+        { notifyStateChanged(); });
+}
+
+void SteamNetworkingManager::setEndpointAcceptor(MultiplexManager::EndpointAcceptor acceptor)
+{
+    if (messageHandler_)
+    {
+        messageHandler_->setEndpointAcceptor(std::move(acceptor));
+    }
+}
+
+void SteamNetworkingManager::setAllowedPorts(std::vector<int> ports)
+{
+    if (messageHandler_)
+    {
+        messageHandler_->setAllowedPorts(std::move(ports));
+    }
+}
+
+bool SteamNetworkingManager::setBackendPool(int port, const std::string &backends, BackendPool::Policy policy)
+{
+    std::vector<tcp::endpoint> endpoints;
+    if (!io_context_ || !messageHandler_ || !BackendPool::parseBackends(backends, endpoints))
+    {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+    auto previous = backendPools_.find(port);
+    if (previous != backendPools_.end())
+    {
+        // Its streams keep their leases; it just stops checking
+        previous->second->stop();
+        backendPools_.erase(previous);
+    }
+    if (!endpoints.empty())
+    {
+        auto pool = std::make_shared<BackendPool>(*io_context_, std::move(endpoints), policy);
+        pool->start();
+        backendPools_[port] = pool;
+        LOG_INFO("Port {} now spreads streams over {} backends", port, pool->status().size());
+    }
+    messageHandler_->setBackendPools(backendPools_);
+    return true;
+}
+
+std::map<int, std::shared_ptr<BackendPool>> SteamNetworkingManager::getBackendPools()
+{
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+    return backendPools_;
+}
+
+void SteamNetworkingManager::setBonding(int lanes, bool striping)
+{
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+    bondingLanes_ = std::max(1, std::min(lanes, MultiplexManager::kMaxLanes));
+    striping_ = striping;
+}
+
+void SteamNetworkingManager::openLaneListenSockets()
+{
+    for (int port = 1; port < MultiplexManager::kMaxLanes; ++port)
+    {
+        HSteamListenSocket sock = m_pInterface->CreateListenSocketP2P(port, 0, nullptr);
+        if (sock == k_HSteamListenSocket_Invalid)
+        {
+            LOG_WARN("Failed to listen for bonding lanes on virtual port {}", port);
+            continue;
+        }
+        laneListenSocks_.push_back(sock);
+    }
+}
+
+void SteamNetworkingManager::closeLaneListenSockets()
+{
+    for (HSteamListenSocket sock : laneListenSocks_)
+    {
+        m_pInterface->CloseListenSocket(sock);
+    }
+    laneListenSocks_.clear();
+}
+
+void SteamNetworkingManager::setMeshMode(bool enabled)
+{
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+    meshMode_ = enabled;
+}
+
+void SteamNetworkingManager::setMeshPeers(const std::vector<CSteamID> &peers)
+{
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = meshPeers_.begin(); it != meshPeers_.end();)
+    {
+        bool member = std::find(peers.begin(), peers.end(), CSteamID(it->first)) != peers.end();
+        if (member)
+        {
+            ++it;
+            continue;
+        }
+        LOG_INFO("Mesh peer {} left", it->first);
+        closeMeshConnection(it->second.out);
+        closeMeshConnection(it->second.in);
+        if (messageHandler_)
+        {
+            messageHandler_->dropRelays(it->first);
+        }
+        it = meshPeers_.erase(it);
+    }
+    for (const CSteamID &peer : peers)
+    {
+        if (meshPeers_.count(peer.ConvertToUint64()) == 0)
+        {
+            meshPeers_[peer.ConvertToUint64()].nextAttempt = now;
+        }
+    }
+}
+
+// connectionsMutex held
+void SteamNetworkingManager::closeMesh()
+{
+    for (auto &peer : meshPeers_)
+    {
+        closeMeshConnection(peer.second.out);
+        closeMeshConnection(peer.second.in);
+    }
+    meshPeers_.clear();
+    if (meshListenSock_ != k_HSteamListenSocket_Invalid)
+    {
+        m_pInterface->CloseListenSocket(meshListenSock_);
+        meshListenSock_ = k_HSteamListenSocket_Invalid;
+    }
+    if (messageHandler_)
+    {
+        messageHandler_->setMeshEnabled(false);
+        messageHandler_->dropRelays(0);
+    }
+}
+
+std::string SteamNetworkingManager::getMeshRouteInfo(CSteamID peer)
+{
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+    auto it = meshPeers_.find(peer.ConvertToUint64());
+    if (!meshMode_ || it == meshPeers_.end())
+    {
+        return "";
+    }
+    return it->second.direct ? "直连" : "经主持方转发";
+}
+
 void SteamNetworkingManager::startMessageHandler()
 {
     if (messageHandler_)
@@ -188,11 +416,80 @@ void SteamNetworkingManager::stopMessageHandler()
     }
 }
 
+void SteamNetworkingManager::setPollOptions(const PollThread::Options &options)
+{
+    if (messageHandler_)
+    {
+        messageHandler_->setPollOptions(options);
+    }
+}
+
+int SteamNetworkingManager::getClientCount()
+{
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+    return static_cast<int>(connections.size());
+}
+
+PollThread::Options SteamNetworkingManager::getPollOptions() const
+{
+    return messageHandler_ ? messageHandler_->getPollOptions() : PollThread::Options();
+}
+
+PollThread::Snapshot SteamNetworkingManager::getPollStats() const
+{
+    return messageHandler_ ? messageHandler_->getPollStats() : PollThread::Snapshot();
+}
+
+void SteamNetworkingManager::notifyStateChanged()
+{
+    if (stateChangedCallback_)
+    {
+        stateChangedCallback_();
+    }
+}
+
 void SteamNetworkingManager::update()
 {
     std::lock_guard<std::mutex> lock(connectionsMutex);
-    // Update ping to host/client connection
-    if (g_hConnection != k_HSteamNetConnection_Invalid)
+    // An attempt in flight sets g_hConnection; its failure schedules the next
+    if (reconnecting_ && g_hConnection == k_HSteamNetConnection_Invalid)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= reconnectDeadline_)
+        {
+            LOG_WARN("Couldn't reconnect to host within {}s, giving up", kReconnectWindow.count());
+            if (messageHandler_ && resumeConn_ != k_HSteamNetConnection_Invalid)
+            {
+                messageHandler_->dropConnection(resumeConn_);
+            }
+            stopReconnecting();
+            notifyStateChanged();
+        }
+        else if (now >= nextReconnect_ && !joinHost(g_hostSteamID.ConvertToUint64()))
+        {
+            scheduleReconnect();
+        }
+    }
+    openLanes();
+    openMesh();
+    // Ping to the host, or the host's average over its clients
+    if (g_isHost)
+    {
+        int total = 0;
+        int count = 0;
+        for (HSteamNetConnection conn : connections)
+        {
+            SteamNetConnectionRealTimeStatus_t status;
+            if (laneConns_.count(conn) == 0 &&
+                m_pInterface->GetConnectionRealTimeStatus(conn, &status, 0, nullptr))
+            {
+                total += status.m_nPing;
+                ++count;
+            }
+        }
+        hostPing_ = count > 0 ? total / count : 0;
+    }
+    else if (g_hConnection != k_HSteamNetConnection_Invalid)
     {
         SteamNetConnectionRealTimeStatus_t status;
         if (m_pInterface->GetConnectionRealTimeStatus(g_hConnection, &status, 0, nullptr))
@@ -202,6 +499,330 @@ void SteamNetworkingManager::update()
     }
 }
 
+// connectionsMutex held. Host: clients' main connections, not their lanes
+int SteamNetworkingManager::clientConnectionCount() const
+{
+    int count = 0;
+    for (HSteamNetConnection conn : connections)
+    {
+        count += laneConns_.count(conn) == 0 ? 1 : 0;
+    }
+    return count;
+}
+
+// connectionsMutex held
+void SteamNetworkingManager::scheduleReconnect()
+{
+    auto now = std::chrono::steady_clock::now();
+    if (!reconnecting_)
+    {
+        reconnecting_ = true;
+        reconnectAttempt_ = 0;
+        reconnectDeadline_ = now + kReconnectWindow;
+    }
+    // 0.5s, 1s, 2s, 4s, then every 8s
+    auto delay = std::chrono::milliseconds(500) * (1 << std::min(reconnectAttempt_, 4));
+    nextReconnect_ = now + delay;
+    ++reconnectAttempt_;
+    LOG_WARN("Lost the connection to the host, reconnect attempt {} in {} ms", reconnectAttempt_, delay.count());
+}
+
+// connectionsMutex held
+void SteamNetworkingManager::stopReconnecting()
+{
+    reconnecting_ = false;
+    resumeConn_ = k_HSteamNetConnection_Invalid;
+    reconnectAttempt_ = 0;
+}
+
+// connectionsMutex held. Client: opens the bonding lanes that are missing
+// once the host knows our session (the lane joins name it)
+void SteamNetworkingManager::openLanes()
+{
+    int wanted = bondingLanes_ - 1;
+    if (wanted <= 0 || g_isHost || !g_isClient || !g_isConnected || reconnecting_ || !messageHandler_ ||
+        g_hConnection == k_HSteamNetConnection_Invalid || static_cast<int>(laneConns_.size()) >= wanted)
+    {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (now < nextLaneAttempt_)
+    {
+        return;
+    }
+    auto manager = messageHandler_->getMultiplexManager(g_hConnection);
+    if (!manager->sessionEstablished())
+    {
+        manager->openSession();
+        nextLaneAttempt_ = now + std::chrono::milliseconds(200);
+        return;
+    }
+    if (!manager->peerCapabilities().has(kFeatureLanes))
+    {
+        nextLaneAttempt_ = now + kLaneRetry;
+        return;
+    }
+    nextLaneAttempt_ = now + kLaneRetry;
+    SteamNetworkingIdentity identity;
+    identity.SetSteamID(g_hostSteamID);
+    for (int port = 1; port <= wanted; ++port)
+    {
+        bool open = std::any_of(laneConns_.begin(), laneConns_.end(),
+                                [port](const std::pair<const HSteamNetConnection, int> &lane) { return lane.second == port; });
+        if (open)
+        {
+            continue;
+        }
+        HSteamNetConnection conn = m_pInterface->ConnectP2P(identity, port, 0, nullptr);
+        if (conn == k_HSteamNetConnection_Invalid)
+        {
+            LOG_WARN("Failed to open bonding lane on virtual port {}", port);
+            continue;
+        }
+        // Steam queues the lane join until the connection is up
+        if (!messageHandler_->addLane(g_hConnection, conn))
+        {
+            m_pInterface->CloseConnection(conn, 0, nullptr, false);
+            break;
+        }
+        laneConns_[conn] = port;
+        connections.push_back(conn);
+        LOG_INFO("Opening bonding lane on virtual port {}", port);
+    }
+}
+
+// connectionsMutex held. Client: the lanes go with the main connection; a
+// resumed session opens new ones
+void SteamNetworkingManager::closeLanes()
+{
+    for (auto &lane : laneConns_)
+    {
+        auto it = std::find(connections.begin(), connections.end(), lane.first);
+        if (it != connections.end())
+        {
+            connections.erase(it);
+        }
+        m_pInterface->CloseConnection(lane.first, k_ESteamNetConnectionEnd_App_Generic, "Lane closed", false);
+        if (messageHandler_)
+        {
+            messageHandler_->dropLane(lane.first);
+        }
+    }
+    laneConns_.clear();
+}
+
+bool SteamNetworkingManager::isLaneConnection(const SteamNetConnectionStatusChangedCallback_t *pInfo) const
+{
+    return laneConns_.count(pInfo->m_hConn) > 0 ||
+           std::find(laneListenSocks_.begin(), laneListenSocks_.end(), pInfo->m_info.m_hListenSocket) != laneListenSocks_.end();
+}
+
+// connectionsMutex held
+void SteamNetworkingManager::handleLaneStatusChanged(SteamNetConnectionStatusChangedCallback_t *pInfo)
+{
+    HSteamNetConnection conn = pInfo->m_hConn;
+    if (pInfo->m_eOldState == k_ESteamNetworkingConnectionState_None && pInfo->m_info.m_eState == k_ESteamNetworkingConnectionState_Connecting)
+    {
+        if (g_isHost)
+        {
+            // Routed to its session by the lane join it starts with
+            m_pInterface->AcceptConnection(conn);
+            connections.push_back(conn);
+            auto sock = std::find(laneListenSocks_.begin(), laneListenSocks_.end(), pInfo->m_info.m_hListenSocket);
+            laneConns_[conn] = static_cast<int>(sock - laneListenSocks_.begin()) + 1;
+        }
+    }
+    else if (pInfo->m_info.m_eState == k_ESteamNetworkingConnectionState_Connected)
+    {
+        LOG_INFO("Bonding lane on connection {} is up", conn);
+    }
+    else if (pInfo->m_info.m_eState == k_ESteamNetworkingConnectionState_ClosedByPeer || pInfo->m_info.m_eState == k_ESteamNetworkingConnectionState_ProblemDetectedLocally)
+    {
+        LOG_WARN("Bonding lane on connection {} closed: {}", conn, pInfo->m_info.m_szEndDebug);
+        auto it = std::find(connections.begin(), connections.end(), conn);
+        if (it != connections.end())
+        {
+            connections.erase(it);
+        }
+        m_pInterface->CloseConnection(conn, 0, nullptr, false);
+        laneConns_.erase(conn);
+        if (messageHandler_)
+        {
+            messageHandler_->dropLane(conn);
+        }
+        nextLaneAttempt_ = std::chrono::steady_clock::now() + kLaneRetry;
+    }
+}
+
+std::shared_ptr<MultiplexManager> SteamNetworkingManager::getTunnel(uint64 peer)
+{
+    if (peer != 0 && peer != g_hostSteamID.ConvertToUint64())
+    {
+        return getMeshTunnel(peer);
+    }
+    // Steam queues reliable messages while the connection is still being
+    // established. Called from the TCP server's threads, so g_hConnection
+    // is read under the lock.
+    HSteamNetConnection conn;
+    {
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        conn = g_hConnection;
+    }
+    if (!messageHandler_ || conn == k_HSteamNetConnection_Invalid)
+    {
+        return nullptr;
+    }
+    return messageHandler_->getMultiplexManager(conn);
+}
+
+// Direct when our connection to the peer is up, through the host otherwise
+std::shared_ptr<MultiplexManager> SteamNetworkingManager::getMeshTunnel(uint64 peer)
+{
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+    auto it = meshPeers_.find(peer);
+    if (!meshMode_ || !messageHandler_ || it == meshPeers_.end() || g_hConnection == k_HSteamNetConnection_Invalid)
+    {
+        return nullptr;
+    }
+    if (it->second.direct)
+    {
+        return messageHandler_->getMultiplexManager(it->second.out);
+    }
+    return messageHandler_->getRelayManager(g_hConnection, peer);
+}
+
+// connectionsMutex held. Client: connects to the mesh peers we have no
+// connection to, spacing out the attempts
+void SteamNetworkingManager::openMesh()
+{
+    if (!meshMode_ || g_isHost || !g_isClient || !g_isConnected || !messageHandler_)
+    {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    for (auto &pair : meshPeers_)
+    {
+        MeshPeer &peer = pair.second;
+        if (peer.out != k_HSteamNetConnection_Invalid || now < peer.nextAttempt)
+        {
+            continue;
+        }
+        peer.nextAttempt = now + kMeshRetry;
+        SteamNetworkingIdentity identity;
+        identity.SetSteamID(CSteamID(pair.first));
+        HSteamNetConnection conn = m_pInterface->ConnectP2P(identity, kMeshVirtualPort, 0, nullptr);
+        if (conn == k_HSteamNetConnection_Invalid)
+        {
+            continue;
+        }
+        peer.out = conn;
+        meshConns_[conn] = pair.first;
+        connections.push_back(conn);
+        messageHandler_->addMeshConnection(conn, false, pair.first);
+        LOG_INFO("Connecting to mesh peer {}", pair.first);
+    }
+}
+
+// connectionsMutex held
+void SteamNetworkingManager::closeMeshConnection(HSteamNetConnection conn)
+{
+    if (conn == k_HSteamNetConnection_Invalid)
+    {
+        return;
+    }
+    auto it = std::find(connections.begin(), connections.end(), conn);
+    if (it != connections.end())
+    {
+        connections.erase(it);
+    }
+    m_pInterface->CloseConnection(conn, k_ESteamNetConnectionEnd_App_Generic, "Mesh closed", false);
+    meshConns_.erase(conn);
+    if (messageHandler_)
+    {
+        messageHandler_->dropConnection(conn);
+    }
+}
+
+bool SteamNetworkingManager::isMeshConnection(const SteamNetConnectionStatusChangedCallback_t *pInfo) const
+{
+    return meshConns_.count(pInfo->m_hConn) > 0 ||
+           (meshListenSock_ != k_HSteamListenSocket_Invalid && pInfo->m_info.m_hListenSocket == meshListenSock_);
+}
+
+// connectionsMutex held
+void SteamNetworkingManager::handleMeshStatusChanged(SteamNetConnectionStatusChangedCallback_t *pInfo)
+{
+    HSteamNetConnection conn = pInfo->m_hConn;
+    uint64 remote = pInfo->m_info.m_identityRemote.GetSteamID().ConvertToUint64();
+    if (pInfo->m_eOldState == k_ESteamNetworkingConnectionState_None && pInfo->m_info.m_eState == k_ESteamNetworkingConnectionState_Connecting)
+    {
+        if (meshConns_.count(conn))
+        {
+            return; // One of ours
+        }
+        auto peer = meshPeers_.find(remote);
+        if (peer == meshPeers_.end())
+        {
+            LOG_WARN("Rejected mesh connection from {}: not in the lobby", remote);
+            m_pInterface->CloseConnection(conn, 0, "Not a member", false);
+            return;
+        }
+        closeMeshConnection(peer->second.in);
+        m_pInterface->AcceptConnection(conn);
+        connections.push_back(conn);
+        meshConns_[conn] = remote;
+        peer->second.in = conn;
+        if (messageHandler_)
+        {
+            messageHandler_->addMeshConnection(conn, true, remote);
+        }
+        LOG_INFO("Accepted mesh connection from {}", remote);
+        return;
+    }
+    auto mesh = meshConns_.find(conn);
+    if (mesh == meshConns_.end())
+    {
+        return;
+    }
+    auto peer = meshPeers_.find(mesh->second);
+    bool outgoing = peer != meshPeers_.end() && peer->second.out == conn;
+    if (pInfo->m_info.m_eState == k_ESteamNetworkingConnectionState_Connected)
+    {
+        if (outgoing)
+        {
+            // New streams to the peer go direct; relayed ones stay relayed
+            peer->second.direct = true;
+            peer->second.failures = 0;
+            LOG_INFO("Direct route to mesh peer {} is up", mesh->second);
+        }
+    }
+    else if (pInfo->m_info.m_eState == k_ESteamNetworkingConnectionState_ClosedByPeer || pInfo->m_info.m_eState == k_ESteamNetworkingConnectionState_ProblemDetectedLocally)
+    {
+        LOG_INFO("Mesh connection {} to {} closed: {}", conn, mesh->second, pInfo->m_info.m_szEndDebug);
+        closeMeshConnection(conn);
+        if (peer == meshPeers_.end())
+        {
+            return;
+        }
+        if (outgoing)
+        {
+            MeshPeer &state = peer->second;
+            state.out = k_HSteamNetConnection_Invalid;
+            state.direct = false;
+            if (++state.failures == kMeshAttempts)
+            {
+                LOG_WARN("No direct route to mesh peer {}, relaying through the host", peer->first);
+            }
+            state.nextAttempt = std::chrono::steady_clock::now() +
+                                (state.failures >= kMeshAttempts ? kMeshDirectRetry : kMeshRetry);
+        }
+        else
+        {
+            peer->second.in = k_HSteamNetConnection_Invalid;
+        }
+    }
+}
+
 int SteamNetworkingManager::getConnectionPing(HSteamNetConnection conn) const
 {
     SteamNetConnectionRealTimeStatus_t status;
@@ -233,50 +854,135 @@ std::string SteamNetworkingManager::getConnectionRelayInfo(HSteamNetConnection c
 void SteamNetworkingManager::handleConnectionStatusChanged(SteamNetConnectionStatusChangedCallback_t *pInfo)
 {
     std::lock_guard<std::mutex> lock(connectionsMutex);
-    std::cout << "Connection status changed: " << pInfo->m_info.m_eState << " for connection " << pInfo->m_hConn << std::endl;
+    LOG_INFO("Connection status changed: {} for connection {}", pInfo->m_info.m_eState, pInfo->m_hConn);
     if (pInfo->m_info.m_eState == k_ESteamNetworkingConnectionState_ProblemDetectedLocally)
     {
-        std::cout << "Connection failed: " << pInfo->m_info.m_szEndDebug << std::endl;
+        LOG_WARN("Connection failed: {}", pInfo->m_info.m_szEndDebug);
+    }
+    if (isLaneConnection(pInfo))
+    {
+        handleLaneStatusChanged(pInfo);
+        return;
+    }
+    if (isMeshConnection(pInfo))
+    {
+        handleMeshStatusChanged(pInfo);
+        notifyStateChanged();
+        return;
     }
     if (pInfo->m_eOldState == k_ESteamNetworkingConnectionState_None && pInfo->m_info.m_eState == k_ESteamNetworkingConnectionState_Connecting)
     {
         m_pInterface->AcceptConnection(pInfo->m_hConn);
         connections.push_back(pInfo->m_hConn);
-        g_hConnection = pInfo->m_hConn;
+        // The host has a connection per client and routes by handle;
+        // g_hConnection is the client's one connection to the host
+        if (!g_isHost)
+        {
+            g_hConnection = pInfo->m_hConn;
+        }
         g_isConnected = true;
-        std::cout << "Accepted incoming connection from " << pInfo->m_info.m_identityRemote.GetSteamID().ConvertToUint64() << std::endl;
+        if (reconnecting_ && !g_isHost && messageHandler_ && resumeConn_ != k_HSteamNetConnection_Invalid)
+        {
+            // Steam queues the hello until the connection is up
+            messageHandler_->resumeConnection(resumeConn_, pInfo->m_hConn);
+            resumeConn_ = k_HSteamNetConnection_Invalid;
+        }
+        if (!g_isHost && messageHandler_)
+        {
+            auto manager = messageHandler_->getMultiplexManager(pInfo->m_hConn);
+            manager->setStriping(striping_ && bondingLanes_ > 1);
+            // Hello now rather than with the first stream, so the frame
+            // encoding is settled before there's traffic
+            manager->openSession();
+        }
+        else if (messageHandler_)
+        {
+            // For relaying between mesh members
+            messageHandler_->setConnectionPeer(pInfo->m_hConn, pInfo->m_info.m_identityRemote.GetSteamID().ConvertToUint64());
+        }
+        LOG_INFO("Accepted incoming connection from {}", pInfo->m_info.m_identityRemote.GetSteamID().ConvertToUint64());
         // Log connection info
         SteamNetConnectionInfo_t info;
         SteamNetConnectionRealTimeStatus_t status;
         if (m_pInterface->GetConnectionInfo(pInfo->m_hConn, &info) && m_pInterface->GetConnectionRealTimeStatus(pInfo->m_hConn, &status, 0, nullptr))
         {
-            std::cout << "Incoming connection details: ping=" << status.m_nPing << "ms, relay=" << (info.m_idPOPRelay != 0 ? "yes" : "no") << std::endl;
+            LOG_INFO("Incoming connection details: ping={}ms, relay={}", status.m_nPing, (info.m_idPOPRelay != 0 ? "yes" : "no"));
         }
     }
     else if (pInfo->m_eOldState == k_ESteamNetworkingConnectionState_Connecting && pInfo->m_info.m_eState == k_ESteamNetworkingConnectionState_Connected)
     {
         g_isConnected = true;
-        std::cout << "Connected to host" << std::endl;
+        LOG_INFO("Connected to host");
+        if (reconnecting_)
+        {
+            LOG_INFO("Reconnected after {} attempts", reconnectAttempt_);
+            stopReconnecting();
+        }
         // Log connection info
         SteamNetConnectionInfo_t info;
         SteamNetConnectionRealTimeStatus_t status;
         if (m_pInterface->GetConnectionInfo(pInfo->m_hConn, &info) && m_pInterface->GetConnectionRealTimeStatus(pInfo->m_hConn, &status, 0, nullptr))
         {
             hostPing_ = status.m_nPing;
-            std::cout << "Outgoing connection details: ping=" << status.m_nPing << "ms, relay=" << (info.m_idPOPRelay != 0 ? "yes" : "no") << std::endl;
+            LOG_INFO("Outgoing connection details: ping={}ms, relay={}", status.m_nPing, (info.m_idPOPRelay != 0 ? "yes" : "no"));
         }
     }
     else if (pInfo->m_info.m_eState == k_ESteamNetworkingConnectionState_ClosedByPeer || pInfo->m_info.m_eState == k_ESteamNetworkingConnectionState_ProblemDetectedLocally)
     {
-        g_isConnected = false;
-        g_hConnection = k_HSteamNetConnection_Invalid;
+        HSteamNetConnection conn = pInfo->m_hConn;
+        bool leaving = pInfo->m_info.m_eEndReason == k_ESteamNetConnectionEnd_App_Generic;
         // Remove from connections
-        auto it = std::find(connections.begin(), connections.end(), pInfo->m_hConn);
+        auto it = std::find(connections.begin(), connections.end(), conn);
         if (it != connections.end())
         {
             connections.erase(it);
         }
-        hostPing_ = 0;
-        std::cout << "Connection closed" << std::endl;
+        if (g_isHost)
+        {
+            // The other clients are still here
+            g_isConnected = clientConnectionCount() > 0;
+        }
+        else
+        {
+            g_isConnected = false;
+            g_hConnection = k_HSteamNetConnection_Invalid;
+            hostPing_ = 0;
+        }
+        // Steam keeps the handle until we close it too
+        m_pInterface->CloseConnection(conn, 0, nullptr, false);
+        if (!g_isHost)
+        {
+            // Direct mesh connections carry on; relayed streams went through this one
+            closeLanes();
+            if (messageHandler_)
+            {
+                messageHandler_->dropRelays(0);
+            }
+        }
+        else if (messageHandler_)
+        {
+            messageHandler_->forgetConnectionPeer(conn);
+        }
+        LOG_INFO("Connection closed");
+        // Unless the peer left on purpose its session waits for a new
+        // connection: the client reconnects, the host waits for it
+        if (messageHandler_ && leaving)
+        {
+            messageHandler_->dropConnection(conn);
+        }
+        else if (messageHandler_)
+        {
+            messageHandler_->connectionLost(conn);
+        }
+        if (g_isClient && !g_isHost && !leaving)
+        {
+            resumeConn_ = conn;
+            scheduleReconnect();
+        }
+        else if (leaving)
+        {
+            stopReconnecting();
+        }
     }
+    notifyStateChanged();
 }
\ No newline at end of file
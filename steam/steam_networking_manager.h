@@ -1,10 +1,13 @@
 #ifndef STEAM_NETWORKING_MANAGER_H
 #define STEAM_NETWORKING_MANAGER_H
 
+#include <chrono>
 #include <vector>
 #include <map>
 #include <mutex>
 #include <memory>
+#include <string>
+#include <functional>
 #include <steam_api.h>
 #include <isteamnetworkingsockets.h>
 #include <isteamnetworkingutils.h>
@@ -13,6 +16,7 @@
 
 // Forward declarations
 class TCPServer;
+class ShmServer;
 class SteamNetworkingManager;
 
 // User info structure
@@ -40,9 +44,14 @@ public:
     bool isHost() const { return g_isHost; }
     bool isClient() const { return g_isClient; }
     bool isConnected() const { return g_isConnected; }
+    // Client: the connection dropped and we're trying to get it back
+    bool isReconnecting() const { return reconnecting_; }
     const std::vector<HSteamNetConnection>& getConnections() const { return connections; }
     int getHostPing() const { return hostPing_; }
+    // Host: clients connected right now
+    int getClientCount();
     int getConnectionPing(HSteamNetConnection conn) const;
+    // Client: the connection to the host. The host has one per client (see getConnections).
     HSteamNetConnection getConnection() const { return g_hConnection; }
     ISteamNetworkingSockets* getInterface() const { return m_pInterface; }
     std::string getConnectionRelayInfo(HSteamNetConnection conn) const;
@@ -55,16 +64,62 @@ public:
     ISteamNetworkingSockets* getInterface() { return m_pInterface; }
     bool& getIsHost() { return g_isHost; }
 
+    // Client-side TCP server whose streams are tunneled over the current
+    // connection, listening on every port mapping
+    std::unique_ptr<TCPServer> createTCPServer();
+    void setPortMappings(std::vector<PortMapping> mappings) { portMappings_ = std::move(mappings); }
+    const std::vector<PortMapping>& getPortMappings() const { return portMappings_; }
+    // Host: destination ports clients may ask for besides the local port
+    void setAllowedPorts(std::vector<int> ports);
+    // Host: streams to port go to one of several local servers ("27015,
+    // 10.0.0.2:27016"), picked by policy and health-checked; empty backends
+    // removes the pool. false if backends doesn't parse.
+    bool setBackendPool(int port, const std::string& backends, BackendPool::Policy policy);
+    std::map<int, std::shared_ptr<BackendPool>> getBackendPools();
+    // Same, for game processes attached through connecttool_shim (Linux)
+    std::unique_ptr<ShmServer> createShmServer(const std::string& name);
+    // Host: hands new tunnel streams to local endpoints (nullptr: TCP to localPort only)
+    void setEndpointAcceptor(MultiplexManager::EndpointAcceptor acceptor);
+    // Client bonding: open up to `lanes` connections to the host (1: just
+    // the one) and optionally stripe each new stream over all of them.
+    // Takes effect on the next join.
+    void setBonding(int lanes, bool striping);
+    // Host: listen for bonding lanes next to the main listen socket
+    void openLaneListenSockets();
+    void closeLaneListenSockets();
+    // Mesh: besides the host connection, connect straight to every other
+    // member so mappings addressed to them (PortMapping::peer) skip the host;
+    // members we can't reach directly are relayed through it. Takes effect
+    // on the next join.
+    void setMeshMode(bool enabled);
+    bool isMeshMode() const { return meshMode_; }
+    // The other members besides the host; the room manager keeps this current
+    void setMeshPeers(const std::vector<CSteamID>& peers);
+    // How a mesh member is reached, for the UI ("" if it isn't one)
+    std::string getMeshRouteInfo(CSteamID peer);
+    // The manager that tunnels streams to peer: the host's for 0 or the
+    // host, a mesh member's otherwise; nullptr if there's no route
+    std::shared_ptr<MultiplexManager> getTunnel(uint64 peer);
+
     void setMessageHandlerDependencies(boost::asio::io_context& io_context, std::unique_ptr<TCPServer>& server, int& localPort);
 
     // Message handler
     void startMessageHandler();
     void stopMessageHandler();
     SteamMessageHandler* getMessageHandler() { return messageHandler_; }
+    // The thread that receives and runs the networking callbacks (see
+    // PollThread); options apply right away
+    void setPollOptions(const PollThread::Options& options);
+    PollThread::Options getPollOptions() const;
+    PollThread::Snapshot getPollStats() const;
 
     // Update user info (ping, relay status)
     void update();
 
+    // UI invalidation: invoked from any thread whenever state shown in the UI changes
+    void setStateChangedCallback(std::function<void()> callback) { stateChangedCallback_ = std::move(callback); }
+    void notifyStateChanged();
+
     // For callbacks
     void setHostSteamID(CSteamID id) { g_hostSteamID = id; }
     CSteamID getHostSteamID() const { return g_hostSteamID; }
@@ -91,12 +146,67 @@ private:
     const int MAX_RETRIES = 3;
     int g_currentVirtualPort;
 
+    // Client reconnects after a drop, with backoff, within kReconnectWindow.
+    // resumeConn_ is the dropped connection whose session the next one resumes.
+    static constexpr std::chrono::seconds kReconnectWindow{30};
+    bool reconnecting_;
+    HSteamNetConnection resumeConn_;
+    int reconnectAttempt_;
+    std::chrono::steady_clock::time_point nextReconnect_;
+    std::chrono::steady_clock::time_point reconnectDeadline_;
+    void scheduleReconnect();
+    void stopReconnecting();
+    int clientConnectionCount() const;
+
+    // Bonding. Lane i connects to virtual port i; lane connections aren't
+    // g_hConnection and don't count towards connected/reconnecting state.
+    static constexpr std::chrono::seconds kLaneRetry{5};
+    int bondingLanes_;
+    bool striping_;
+    std::vector<HSteamListenSocket> laneListenSocks_;
+    std::map<HSteamNetConnection, int> laneConns_; // Lane connection -> virtual port
+    std::chrono::steady_clock::time_point nextLaneAttempt_;
+    void openLanes();
+    void closeLanes();
+    bool isLaneConnection(const SteamNetConnectionStatusChangedCallback_t *pInfo) const;
+    void handleLaneStatusChanged(SteamNetConnectionStatusChangedCallback_t *pInfo);
+
+    // Mesh. Each pair of members has a connection per direction: the one we
+    // open carries our streams to the peer, the one it opens carries its
+    // streams to us. Until ours is up (or after it failed kMeshAttempts
+    // times) our streams to the peer are relayed through the host.
+    static constexpr int kMeshVirtualPort = 8; // Bonding lanes take 1-3
+    static constexpr int kMeshAttempts = 2;
+    static constexpr std::chrono::seconds kMeshRetry{5};
+    static constexpr std::chrono::seconds kMeshDirectRetry{60}; // Next direct attempt for a relayed peer
+    struct MeshPeer {
+        HSteamNetConnection out = k_HSteamNetConnection_Invalid;
+        HSteamNetConnection in = k_HSteamNetConnection_Invalid;
+        bool direct = false; // out is connected
+        int failures = 0;
+        std::chrono::steady_clock::time_point nextAttempt;
+    };
+    bool meshMode_;
+    HSteamListenSocket meshListenSock_;
+    std::map<uint64, MeshPeer> meshPeers_;
+    std::map<HSteamNetConnection, uint64> meshConns_;
+    void openMesh();
+    void closeMesh();
+    void closeMeshConnection(HSteamNetConnection conn);
+    std::shared_ptr<MultiplexManager> getMeshTunnel(uint64 peer);
+    bool isMeshConnection(const SteamNetConnectionStatusChangedCallback_t *pInfo) const;
+    void handleMeshStatusChanged(SteamNetConnectionStatusChangedCallback_t *pInfo);
+
     // Message handler dependencies
     boost::asio::io_context* io_context_;
     std::unique_ptr<TCPServer>* server_;
     int* localPort_;
     SteamMessageHandler* messageHandler_;
 
+    std::function<void()> stateChangedCallback_;
+    std::vector<PortMapping> portMappings_{{8888, 0}};
+    std::map<int, std::shared_ptr<BackendPool>> backendPools_; // Under connectionsMutex
+
     // Callback
     static void OnSteamNetConnectionStatusChanged(SteamNetConnectionStatusChangedCallback_t *pInfo);
     void handleConnectionStatusChanged(SteamNetConnectionStatusChangedCallback_t *pInfo);
@@ -1,34 +1,35 @@
 #include "steam_room_manager.h"
 #include "steam_networking_manager.h"
-#include <iostream>
+#include "../net/logger.h"
 #include <algorithm>
+#include <isteamnetworkingutils.h>
 
 SteamFriendsCallbacks::SteamFriendsCallbacks(SteamNetworkingManager *manager, SteamRoomManager *roomManager) 
     : manager_(manager), roomManager_(roomManager)
 {
-    std::cout << "SteamFriendsCallbacks constructor called" << std::endl;
+    LOG_INFO("SteamFriendsCallbacks constructor called");
 }
 
 void SteamFriendsCallbacks::OnGameLobbyJoinRequested(GameLobbyJoinRequested_t *pCallback)
 {
-    std::cout << "GameLobbyJoinRequested received" << std::endl;
+    LOG_INFO("GameLobbyJoinRequested received");
     if (manager_)
     {
         CSteamID lobbyID = pCallback->m_steamIDLobby;
-        std::cout << "Lobby ID: " << lobbyID.ConvertToUint64() << std::endl;
-        if (!manager_->isHost() && !manager_->isConnected())
+        LOG_INFO("Lobby ID: {}", lobbyID.ConvertToUint64());
+        if (!manager_->isHost() && !manager_->isConnected() && !manager_->isReconnecting())
         {
-            std::cout << "Joining lobby from request: " << lobbyID.ConvertToUint64() << std::endl;
+            LOG_INFO("Joining lobby from request: {}", lobbyID.ConvertToUint64());
             roomManager_->joinLobby(lobbyID);
         }
         else
         {
-            std::cout << "Already host or connected, ignoring lobby join request" << std::endl;
+            LOG_INFO("Already host or connected, ignoring lobby join request");
         }
     }
     else
     {
-        std::cout << "Manager is null" << std::endl;
+        LOG_INFO("Manager is null");
     }
 }
 
@@ -40,46 +41,32 @@ void SteamMatchmakingCallbacks::OnLobbyCreated(LobbyCreated_t *pCallback, bool b
 {
     if (bIOFailure)
     {
-        std::cerr << "Failed to create lobby - IO Failure" << std::endl;
+        LOG_ERROR("Failed to create lobby - IO Failure");
         return;
     }
     if (pCallback->m_eResult == k_EResultOK)
     {
         roomManager_->setCurrentLobby(pCallback->m_ulSteamIDLobby);
-        std::cout << "Lobby created: " << roomManager_->getCurrentLobby().ConvertToUint64() << std::endl;
+        LOG_INFO("Lobby created: {}", roomManager_->getCurrentLobby().ConvertToUint64());
         
         // Set Rich Presence to enable invite functionality
         SteamFriends()->SetRichPresence("steam_display", "#Status_InLobby");
         SteamFriends()->SetRichPresence("connect", std::to_string(pCallback->m_ulSteamIDLobby).c_str());
+        roomManager_->publishLobbyData();
+        manager_->notifyStateChanged();
     }
     else
     {
-        std::cerr << "Failed to create lobby" << std::endl;
+        LOG_ERROR("Failed to create lobby");
     }
 }
 
-void SteamMatchmakingCallbacks::OnLobbyListReceived(LobbyMatchList_t *pCallback, bool bIOFailure)
-{
-    if (bIOFailure)
-    {
-        std::cerr << "Failed to receive lobby list - IO Failure" << std::endl;
-        return;
-    }
-    roomManager_->clearLobbies();
-    for (uint32 i = 0; i < pCallback->m_nLobbiesMatching; ++i)
-    {
-        CSteamID lobbyID = SteamMatchmaking()->GetLobbyByIndex(i);
-        roomManager_->addLobby(lobbyID);
-    }
-    std::cout << "Received " << pCallback->m_nLobbiesMatching << " lobbies" << std::endl;
-}
-
 void SteamMatchmakingCallbacks::OnLobbyEntered(LobbyEnter_t *pCallback)
 {
     if (pCallback->m_EChatRoomEnterResponse == k_EChatRoomEnterResponseSuccess)
     {
         roomManager_->setCurrentLobby(pCallback->m_ulSteamIDLobby);
-        std::cout << "Entered lobby: " << pCallback->m_ulSteamIDLobby << std::endl;
+        LOG_INFO("Entered lobby: {}", pCallback->m_ulSteamIDLobby);
         
         // Set Rich Presence to enable invite functionality
         SteamFriends()->SetRichPresence("steam_display", "#Status_InLobby");
@@ -88,16 +75,17 @@ void SteamMatchmakingCallbacks::OnLobbyEntered(LobbyEnter_t *pCallback)
         // Only join host if not the host
         if (!manager_->isHost())
         {
+            roomManager_->updateMeshPeers();
             CSteamID hostID = SteamMatchmaking()->GetLobbyOwner(pCallback->m_ulSteamIDLobby);
             if (manager_->joinHost(hostID.ConvertToUint64()))
             {
                 // Start TCP Server if dependencies are set
                 if (manager_->getServer() && !(*manager_->getServer()))
                 {
-                    *manager_->getServer() = std::make_unique<TCPServer>(8888, manager_);
+                    *manager_->getServer() = manager_->createTCPServer();
                     if (!(*manager_->getServer())->start())
                     {
-                        std::cerr << "Failed to start TCP server" << std::endl;
+                        LOG_ERROR("Failed to start TCP server");
                     }
                 }
             }
@@ -105,16 +93,101 @@ void SteamMatchmakingCallbacks::OnLobbyEntered(LobbyEnter_t *pCallback)
     }
     else
     {
-        std::cerr << "Failed to enter lobby" << std::endl;
+        LOG_ERROR("Failed to enter lobby");
+    }
+    manager_->notifyStateChanged();
+}
+
+void SteamMatchmakingCallbacks::OnLobbyChatUpdate(LobbyChatUpdate_t *pCallback)
+{
+    if (CSteamID(pCallback->m_ulSteamIDLobby) == roomManager_->getCurrentLobby() && !manager_->isHost())
+    {
+        roomManager_->updateMeshPeers();
+    }
+}
+
+bool SteamLobbyDirectory::requestLobbyList()
+{
+    // Hosts publish their ping location, so distance is sorted out here
+    // rather than by Steam's region filter
+    SteamMatchmaking()->AddRequestLobbyListStringFilter(kLobbyKeyTag, "1", k_ELobbyComparisonEqual);
+    SteamMatchmaking()->AddRequestLobbyListDistanceFilter(k_ELobbyDistanceFilterWorldwide);
+    SteamAPICall_t hSteamAPICall = SteamMatchmaking()->RequestLobbyList();
+    if (hSteamAPICall == k_uAPICallInvalid)
+    {
+        return false;
     }
+    m_CallResultLobbyMatchList.Set(hSteamAPICall, this, &SteamLobbyDirectory::OnLobbyListReceived);
+    return true;
+}
+
+void SteamLobbyDirectory::OnLobbyListReceived(LobbyMatchList_t *pCallback, bool bIOFailure)
+{
+    std::vector<uint64_t> lobbies;
+    if (!bIOFailure)
+    {
+        for (uint32 i = 0; i < pCallback->m_nLobbiesMatching; ++i)
+        {
+            lobbies.push_back(SteamMatchmaking()->GetLobbyByIndex(i).ConvertToUint64());
+        }
+    }
+    if (onList_)
+    {
+        onList_(!bIOFailure, lobbies);
+    }
+}
+
+bool SteamLobbyDirectory::requestLobbyData(uint64_t lobby)
+{
+    return SteamMatchmaking()->RequestLobbyData(CSteamID(static_cast<uint64>(lobby)));
+}
+
+void SteamLobbyDirectory::OnLobbyDataUpdate(LobbyDataUpdate_t *pCallback)
+{
+    // Member data updates come through here too
+    if (pCallback->m_ulSteamIDLobby == pCallback->m_ulSteamIDMember && onData_)
+    {
+        onData_(pCallback->m_ulSteamIDLobby, pCallback->m_bSuccess != 0);
+    }
+}
+
+std::string SteamLobbyDirectory::lobbyData(uint64_t lobby, const char *key)
+{
+    const char *value = SteamMatchmaking()->GetLobbyData(CSteamID(static_cast<uint64>(lobby)), key);
+    return value ? value : "";
+}
+
+int SteamLobbyDirectory::memberCount(uint64_t lobby)
+{
+    return SteamMatchmaking()->GetNumLobbyMembers(CSteamID(static_cast<uint64>(lobby)));
+}
+
+int SteamLobbyDirectory::memberLimit(uint64_t lobby)
+{
+    return SteamMatchmaking()->GetLobbyMemberLimit(CSteamID(static_cast<uint64>(lobby)));
+}
+
+int SteamLobbyDirectory::estimatePingMs(const std::string &location)
+{
+    SteamNetworkPingLocation_t local;
+    SteamNetworkPingLocation_t remote;
+    if (SteamNetworkingUtils()->GetLocalPingLocation(local) < 0 ||
+        !SteamNetworkingUtils()->ParsePingLocationString(location.c_str(), remote))
+    {
+        return -1;
+    }
+    int ping = SteamNetworkingUtils()->EstimatePingTimeBetweenTwoLocations(local, remote);
+    return ping >= 0 ? ping : -1;
 }
 
 SteamRoomManager::SteamRoomManager(SteamNetworkingManager *networkingManager)
-    : networkingManager_(networkingManager), currentLobby(k_steamIDNil),
+    : networkingManager_(networkingManager), currentLobby(k_steamIDNil), maxMembers_(4),
+      lobbyBrowser_(&lobbyDirectory_), publishedConnections_(-1),
       steamFriendsCallbacks(nullptr), steamMatchmakingCallbacks(nullptr)
 {
     steamFriendsCallbacks = new SteamFriendsCallbacks(networkingManager_, this);
     steamMatchmakingCallbacks = new SteamMatchmakingCallbacks(networkingManager_, this);
+    lobbyBrowser_.setChangedCallback([this]() { networkingManager_->notifyStateChanged(); });
 
     // Clear Rich Presence on initialization to prevent "Invite to game" showing when not in a lobby
     SteamFriends()->ClearRichPresence();
@@ -128,10 +201,10 @@ SteamRoomManager::~SteamRoomManager()
 
 bool SteamRoomManager::createLobby()
 {
-    SteamAPICall_t hSteamAPICall = SteamMatchmaking()->CreateLobby(k_ELobbyTypePublic, 4);
+    SteamAPICall_t hSteamAPICall = SteamMatchmaking()->CreateLobby(k_ELobbyTypePublic, maxMembers_);
     if (hSteamAPICall == k_uAPICallInvalid)
     {
-        std::cerr << "Failed to create lobby" << std::endl;
+        LOG_ERROR("Failed to create lobby");
         return false;
     }
     // Register the call result
@@ -139,6 +212,16 @@ bool SteamRoomManager::createLobby()
     return true;
 }
 
+void SteamRoomManager::setMaxMembers(int members)
+{
+    maxMembers_ = std::max(2, std::min(members, 250));
+    if (currentLobby != k_steamIDNil && networkingManager_->isHost() &&
+        !SteamMatchmaking()->SetLobbyMemberLimit(currentLobby, maxMembers_))
+    {
+        LOG_WARN("Failed to set the lobby member limit to {}", maxMembers_);
+    }
+}
+
 void SteamRoomManager::leaveLobby()
 {
     if (currentLobby != k_steamIDNil)
@@ -153,23 +236,62 @@ void SteamRoomManager::leaveLobby()
 
 bool SteamRoomManager::searchLobbies()
 {
-    lobbies.clear();
-    SteamAPICall_t hSteamAPICall = SteamMatchmaking()->RequestLobbyList();
-    if (hSteamAPICall == k_uAPICallInvalid)
+    return lobbyBrowser_.refresh();
+}
+
+void SteamRoomManager::publishLobbyData()
+{
+    if (currentLobby == k_steamIDNil || !networkingManager_->isHost())
     {
-        std::cerr << "Failed to request lobby list" << std::endl;
-        return false;
+        return;
+    }
+    SteamMatchmaking()->SetLobbyData(currentLobby, kLobbyKeyTag, "1");
+    SteamMatchmaking()->SetLobbyData(currentLobby, kLobbyKeyHostName, SteamFriends()->GetPersonaName());
+    // The rest goes out on the next update
+    publishedPingLocation_.clear();
+    publishedConnections_ = -1;
+    nextPublish_ = std::chrono::steady_clock::time_point();
+}
+
+void SteamRoomManager::update()
+{
+    auto now = std::chrono::steady_clock::now();
+    if (now < nextPublish_)
+    {
+        return;
+    }
+    nextPublish_ = now + std::chrono::seconds(1);
+    lobbyBrowser_.update();
+    if (currentLobby == k_steamIDNil || !networkingManager_->isHost())
+    {
+        return;
+    }
+    // Measured a few seconds after relay access starts, and re-measured
+    // now and then; only changes are sent
+    SteamNetworkPingLocation_t location;
+    if (SteamNetworkingUtils()->GetLocalPingLocation(location) >= 0)
+    {
+        char text[k_cchMaxSteamNetworkingPingLocationString];
+        SteamNetworkingUtils()->ConvertPingLocationToString(location, text, sizeof(text));
+        if (publishedPingLocation_ != text &&
+            SteamMatchmaking()->SetLobbyData(currentLobby, kLobbyKeyPingLocation, text))
+        {
+            publishedPingLocation_ = text;
+        }
+    }
+    int connections = networkingManager_->getClientCount();
+    if (connections != publishedConnections_ &&
+        SteamMatchmaking()->SetLobbyData(currentLobby, kLobbyKeyConnections, std::to_string(connections).c_str()))
+    {
+        publishedConnections_ = connections;
     }
-    // Register the call result
-    steamMatchmakingCallbacks->m_CallResultLobbyMatchList.Set(hSteamAPICall, steamMatchmakingCallbacks, &SteamMatchmakingCallbacks::OnLobbyListReceived);
-    return true;
 }
 
 bool SteamRoomManager::joinLobby(CSteamID lobbyID)
 {
     if (SteamMatchmaking()->JoinLobby(lobbyID) != k_EResultOK)
     {
-        std::cerr << "Failed to join lobby" << std::endl;
+        LOG_ERROR("Failed to join lobby");
         return false;
     }
     // Connection will be handled by callback
@@ -188,12 +310,13 @@ bool SteamRoomManager::startHosting()
     if (networkingManager_->getListenSock() != k_HSteamListenSocket_Invalid)
     {
         networkingManager_->getIsHost() = true;
-        std::cout << "Created listen socket for hosting game room" << std::endl;
+        networkingManager_->openLaneListenSockets();
+        LOG_INFO("Created listen socket for hosting game room");
         return true;
     }
     else
     {
-        std::cerr << "Failed to create listen socket for hosting" << std::endl;
+        LOG_ERROR("Failed to create listen socket for hosting");
         leaveLobby();
         return false;
     }
@@ -206,10 +329,30 @@ void SteamRoomManager::stopHosting()
         networkingManager_->getInterface()->CloseListenSocket(networkingManager_->getListenSock());
         networkingManager_->getListenSock() = k_HSteamListenSocket_Invalid;
     }
+    networkingManager_->closeLaneListenSockets();
     leaveLobby();
     networkingManager_->getIsHost() = false;
 }
 
+void SteamRoomManager::updateMeshPeers()
+{
+    if (currentLobby == k_steamIDNil)
+    {
+        return;
+    }
+    CSteamID self = SteamUser()->GetSteamID();
+    CSteamID owner = SteamMatchmaking()->GetLobbyOwner(currentLobby);
+    std::vector<CSteamID> peers;
+    for (const CSteamID &member : getLobbyMembers())
+    {
+        if (member != self && member != owner)
+        {
+            peers.push_back(member);
+        }
+    }
+    networkingManager_->setMeshPeers(peers);
+}
+
 std::vector<CSteamID> SteamRoomManager::getLobbyMembers() const
 {
     std::vector<CSteamID> members;
@@ -1,8 +1,11 @@
 #pragma once
 #include <steam_api.h>
+#include <chrono>
+#include <string>
 #include <vector>
 #include <iostream>
 #include <mutex>
+#include "lobby_browser.h"
 
 class SteamNetworkingManager; // Forward declaration
 class SteamRoomManager; // Forward declaration for callbacks
@@ -25,16 +28,34 @@ public:
     SteamMatchmakingCallbacks(SteamNetworkingManager *manager, SteamRoomManager *roomManager);
     
     CCallResult<SteamMatchmakingCallbacks, LobbyCreated_t> m_CallResultLobbyCreated;
-    CCallResult<SteamMatchmakingCallbacks, LobbyMatchList_t> m_CallResultLobbyMatchList;
     
     void OnLobbyCreated(LobbyCreated_t *pCallback, bool bIOFailure);
-    void OnLobbyListReceived(LobbyMatchList_t *pCallback, bool bIOFailure);
 
 private:
     SteamNetworkingManager *manager_;
     SteamRoomManager *roomManager_;
     
     STEAM_CALLBACK(SteamMatchmakingCallbacks, OnLobbyEntered, LobbyEnter_t);
+    STEAM_CALLBACK(SteamMatchmakingCallbacks, OnLobbyChatUpdate, LobbyChatUpdate_t);
+};
+
+// LobbyDirectory over ISteamMatchmaking: ConnectTool lobbies worldwide, and
+// ping estimates from the locations hosts publish
+class SteamLobbyDirectory : public LobbyDirectory
+{
+public:
+    bool requestLobbyList() override;
+    bool requestLobbyData(uint64_t lobby) override;
+    std::string lobbyData(uint64_t lobby, const char *key) override;
+    int memberCount(uint64_t lobby) override;
+    int memberLimit(uint64_t lobby) override;
+    int estimatePingMs(const std::string &location) override;
+
+private:
+    void OnLobbyListReceived(LobbyMatchList_t *pCallback, bool bIOFailure);
+
+    CCallResult<SteamLobbyDirectory, LobbyMatchList_t> m_CallResultLobbyMatchList;
+    STEAM_CALLBACK(SteamLobbyDirectory, OnLobbyDataUpdate, LobbyDataUpdate_t);
 };
 
 class SteamRoomManager
@@ -45,23 +66,37 @@ public:
 
     bool createLobby();
     void leaveLobby();
+    // Results land in getLobbyBrowser()
     bool searchLobbies();
     bool joinLobby(CSteamID lobbyID);
     bool startHosting();
     void stopHosting();
+    // Members a hosted lobby takes, the host included (2 to Steam's 250).
+    // Also applies to the lobby we're hosting right now.
+    void setMaxMembers(int members);
+    int getMaxMembers() const { return maxMembers_; }
 
     CSteamID getCurrentLobby() const { return currentLobby; }
-    const std::vector<CSteamID>& getLobbies() const { return lobbies; }
+    LobbyBrowser &getLobbyBrowser() { return lobbyBrowser_; }
     std::vector<CSteamID> getLobbyMembers() const;
+    // Mesh mode: tells the networking manager who the other members are
+    void updateMeshPeers();
 
     void setCurrentLobby(CSteamID lobby) { currentLobby = lobby; }
-    void addLobby(CSteamID lobby) { lobbies.push_back(lobby); }
-    void clearLobbies() { lobbies.clear(); }
+    // Host: keeps the lobby data browsers sort by current; client: retries
+    // browser estimates. Call from the Steam callback thread.
+    void update();
+    void publishLobbyData();
 
 private:
     SteamNetworkingManager *networkingManager_;
     CSteamID currentLobby;
-    std::vector<CSteamID> lobbies;
+    int maxMembers_;
+    SteamLobbyDirectory lobbyDirectory_;
+    LobbyBrowser lobbyBrowser_;
+    std::chrono::steady_clock::time_point nextPublish_;
+    std::string publishedPingLocation_;
+    int publishedConnections_;
     SteamFriendsCallbacks *steamFriendsCallbacks;
     SteamMatchmakingCallbacks *steamMatchmakingCallbacks;
 };
\ No newline at end of file
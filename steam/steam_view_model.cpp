@@ -0,0 +1,125 @@
+#include "steam_view_model.h"
+#include "steam_networking_manager.h"
+#include "steam_room_manager.h"
+#include "steam_utils.h"
+#include <algorithm>
+#include <cctype>
+
+SteamViewModel::SteamViewModel(SteamNetworkingManager *manager, SteamRoomManager *roomManager)
+    : manager_(manager), roomManager_(roomManager), friendsDirty_(true), filterDirty_(true),
+      membersLobby_(k_steamIDNil), membersDirty_(true)
+{
+}
+
+const std::vector<const FriendEntry *> &SteamViewModel::getFilteredFriends(const char *filter)
+{
+    if (friendsDirty_)
+    {
+        rebuildFriends();
+    }
+    if (filterDirty_ || lastFilter_ != filter)
+    {
+        lastFilter_ = filter;
+        std::string lowerFilter = toLower(lastFilter_);
+        filteredFriends_.clear();
+        for (const auto &entry : friends_)
+        {
+            if (lowerFilter.empty() || entry.lowerName.find(lowerFilter) != std::string::npos)
+            {
+                filteredFriends_.push_back(&entry);
+            }
+        }
+        filterDirty_ = false;
+    }
+    return filteredFriends_;
+}
+
+const std::vector<LobbyMemberEntry> &SteamViewModel::getLobbyMembers()
+{
+    if (membersDirty_ || membersLobby_ != roomManager_->getCurrentLobby())
+    {
+        rebuildLobbyMembers();
+    }
+    return lobbyMembers_;
+}
+
+void SteamViewModel::rebuildFriends()
+{
+    friends_.clear();
+    friendIndex_.clear();
+    for (auto &friendPair : SteamUtils::getFriendsList())
+    {
+        FriendEntry entry;
+        entry.steamID = friendPair.first;
+        entry.name = std::move(friendPair.second);
+        entry.lowerName = toLower(entry.name);
+        entry.inviteLabel = "邀请 " + entry.name;
+        friendIndex_[entry.steamID.ConvertToUint64()] = friends_.size();
+        friends_.push_back(std::move(entry));
+    }
+    friendsDirty_ = false;
+    filterDirty_ = true; // friends_ may have reallocated
+}
+
+void SteamViewModel::rebuildLobbyMembers()
+{
+    lobbyMembers_.clear();
+    membersLobby_ = roomManager_->getCurrentLobby();
+    for (const auto &memberID : roomManager_->getLobbyMembers())
+    {
+        lobbyMembers_.push_back({memberID, SteamFriends()->GetFriendPersonaName(memberID)});
+    }
+    membersDirty_ = false;
+}
+
+std::string SteamViewModel::toLower(const std::string &str)
+{
+    std::string lower = str;
+    std::transform(lower.begin(), lower.end(), lower.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return lower;
+}
+
+void SteamViewModel::OnPersonaStateChange(PersonaStateChange_t *pCallback)
+{
+    if (pCallback->m_nChangeFlags & k_EPersonaChangeRelationshipChanged)
+    {
+        // Friend added or removed, reload the whole list on next use
+        friendsDirty_ = true;
+        manager_->notifyStateChanged();
+        return;
+    }
+    // Only name changes are visible; update the affected entries in place
+    if (!(pCallback->m_nChangeFlags & (k_EPersonaChangeName | k_EPersonaChangeNameFirstSet | k_EPersonaChangeNickname)))
+    {
+        return;
+    }
+    CSteamID steamID(pCallback->m_ulSteamID);
+    const char *name = SteamFriends()->GetFriendPersonaName(steamID);
+    auto it = friendIndex_.find(pCallback->m_ulSteamID);
+    if (it != friendIndex_.end())
+    {
+        FriendEntry &entry = friends_[it->second];
+        entry.name = name;
+        entry.lowerName = toLower(entry.name);
+        entry.inviteLabel = "邀请 " + entry.name;
+        filterDirty_ = true;
+    }
+    for (auto &member : lobbyMembers_)
+    {
+        if (member.steamID == steamID)
+        {
+            member.name = name;
+        }
+    }
+    manager_->notifyStateChanged();
+}
+
+void SteamViewModel::OnLobbyChatUpdate(LobbyChatUpdate_t *pCallback)
+{
+    if (CSteamID(pCallback->m_ulSteamIDLobby) == membersLobby_)
+    {
+        membersDirty_ = true;
+        manager_->notifyStateChanged();
+    }
+}
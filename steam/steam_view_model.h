@@ -0,0 +1,60 @@
+#pragma once
+#include <steam_api.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class SteamNetworkingManager; // Forward declaration
+class SteamRoomManager;       // Forward declaration
+
+struct FriendEntry
+{
+    CSteamID steamID;
+    std::string name;
+    std::string lowerName;   // Search index for the filter box
+    std::string inviteLabel; // "邀请 <name>", built once instead of per frame
+};
+
+struct LobbyMemberEntry
+{
+    CSteamID steamID;
+    std::string name;
+};
+
+// Cached friends / lobby-member view for the UI. Refreshed only from
+// PersonaStateChange_t and LobbyChatUpdate_t callbacks instead of walking the
+// Steam friends API every frame. Callbacks and getters must run on the same
+// thread or under the same lock (the UI state mutex).
+class SteamViewModel
+{
+public:
+    SteamViewModel(SteamNetworkingManager *manager, SteamRoomManager *roomManager);
+
+    // Friends whose lowercase name contains the lowercase filter; recomputed
+    // only when the filter text or the friends list changes
+    const std::vector<const FriendEntry *> &getFilteredFriends(const char *filter);
+    const std::vector<LobbyMemberEntry> &getLobbyMembers();
+
+private:
+    void rebuildFriends();
+    void rebuildLobbyMembers();
+    static std::string toLower(const std::string &str);
+
+    STEAM_CALLBACK(SteamViewModel, OnPersonaStateChange, PersonaStateChange_t);
+    STEAM_CALLBACK(SteamViewModel, OnLobbyChatUpdate, LobbyChatUpdate_t);
+
+    SteamNetworkingManager *manager_;
+    SteamRoomManager *roomManager_;
+
+    std::vector<FriendEntry> friends_;
+    std::unordered_map<uint64, size_t> friendIndex_;
+    bool friendsDirty_;
+
+    std::vector<const FriendEntry *> filteredFriends_;
+    std::string lastFilter_;
+    bool filterDirty_;
+
+    std::vector<LobbyMemberEntry> lobbyMembers_;
+    CSteamID membersLobby_;
+    bool membersDirty_;
+};
@@ -0,0 +1,1075 @@
+// Synthetic game-traffic load generator / soak test.
+//
+// Everything runs in one process:
+//   load clients -> TCPServer(:port) -> client MultiplexManager
+//     -> LoopbackTransport (stand-in for the Steam link) -> host MultiplexManager
+//     -> 127.0.0.1:<echo backend> and all the way back.
+// Every frame carries its send timestamp, so the echo gives end-to-end RTT.
+// At the end it reports throughput, tail latency, RSS growth and stream
+// entries still registered after all connections were closed. --drop-every
+// takes the link down now and then to exercise session resumption; every
+// echoed frame is checked for loss, duplication and reordering.
+//
+// --peers N switches to a host-scale run: N clients, each with its own
+// manager pair and link, all on one host io thread, --streams streams each.
+// Streams are in-process endpoints rather than sockets so what's measured is
+// the managers: host CPU per peer and memory per stream.
+//
+// --budget MB / --idle SEC run MultiplexManager::sweep every second the
+// way the Steam handler does, to exercise the memory budget and idle
+// reaping; the report then includes MemoryBudget's accounting.
+//
+// --legacy host|client makes that side advertise protocol version 1, as a
+// build from before the capabilities exchange would, to check mixed rooms.
+#include <boost/asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "backend_pool.h"
+#include "latency_histogram.h"
+#include "logger.h"
+#include "loopback_transport.h"
+#include "memory_budget.h"
+#include "multiplex_manager.h"
+#include "tcp_server.h"
+#include "tunnel_capture.h"
+#include "uring_engine.h"
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <pthread.h>
+#include <time.h>
+#endif
+
+using boost::asio::ip::tcp;
+
+namespace {
+
+enum class Profile { Fps, Chat, Bulk };
+
+struct Options {
+    int connections = 1000;
+    std::string profile = "mixed";
+    int durationSeconds = 60;
+    double churnSeconds = 0; // Mean connection lifetime, 0 = keep connections open
+    int port = 8888;
+    int threads = 2;
+    int reportSeconds = 10;
+    std::string capturePath; // Record tunnel frames for connecttool_replay
+    double dropEverySeconds = 0; // Simulated Steam connection drops, 0 = none
+    int dropMs = 2000;           // How long each drop lasts
+    int peers = 0;               // Host-scale run with this many clients, 0 = off
+    int streamsPerPeer = 100;
+    int rateHz = 20;             // Scale run: frames per second per stream
+    int backends = 1;            // Echo servers behind the host port; >1 puts them in a BackendPool
+    std::string policy = "least";
+    int budgetMb = -1;           // MemoryBudget limit; -1 = no sweeps
+    int idleSeconds = -1;        // Idle timeout; -1 = no sweeps
+    std::string budgetPolicy = "shed";
+    std::string legacy;          // "host" or "client": that side speaks protocol version 1
+};
+
+struct Stats {
+    std::atomic<uint64_t> bytesSent{0};
+    std::atomic<uint64_t> bytesReceived{0};
+    std::atomic<uint64_t> connects{0};
+    std::atomic<uint64_t> connectFailures{0};
+    std::atomic<uint64_t> closes{0};
+    std::atomic<uint64_t> stalls{0}; // Send ticks skipped because the window was full
+    std::atomic<uint64_t> badFrames{0}; // Echoed out of sequence: lost, duplicated or reordered
+    std::atomic<int64_t> active{0};
+    LatencyHistogram rtt;
+    LatencyHistogram windowRtt;
+};
+
+int64_t nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+size_t residentBytes()
+{
+#ifdef __linux__
+    long pages = 0, resident = 0;
+    FILE* f = std::fopen("/proc/self/statm", "r");
+    if (f)
+    {
+        if (std::fscanf(f, "%ld %ld", &pages, &resident) != 2)
+        {
+            resident = 0;
+        }
+        std::fclose(f);
+    }
+    return static_cast<size_t>(resident) * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#else
+    return 0;
+#endif
+}
+
+// FPS: 64 B at 64 Hz. Chat: idle, then a burst of 160 B lines. Bulk: 16 KB
+// frames back to back, limited by the in-flight window.
+struct ProfileSpec {
+    size_t frameSize;
+    int window; // Max frames in flight (sent but not echoed yet)
+};
+
+ProfileSpec specFor(Profile profile)
+{
+    switch (profile)
+    {
+    case Profile::Fps: return {64, 64};
+    case Profile::Chat: return {160, 64};
+    case Profile::Bulk: return {16 * 1024, 8};
+    }
+    return {64, 64};
+}
+
+class LoadConnection : public std::enable_shared_from_this<LoadConnection> {
+public:
+    LoadConnection(boost::asio::io_context& io, tcp::endpoint target, Profile profile, Stats& stats,
+                   std::chrono::milliseconds lifetime, std::function<void()> onClosed)
+        : strand_(boost::asio::make_strand(io)), socket_(strand_), tickTimer_(strand_), lifetimeTimer_(strand_),
+          target_(target), profile_(profile), spec_(specFor(profile)), stats_(stats), lifetime_(lifetime),
+          onClosed_(std::move(onClosed)), txFrame_(spec_.frameSize, 'x'), rxFrame_(spec_.frameSize),
+          rng_(std::random_device{}())
+    {
+    }
+
+    void start()
+    {
+        auto self = shared_from_this();
+        boost::asio::dispatch(strand_, [this, self]() {
+            socket_.async_connect(target_, [this, self](const boost::system::error_code& ec) {
+                if (ec)
+                {
+                    stats_.connectFailures.fetch_add(1, std::memory_order_relaxed);
+                    close();
+                    return;
+                }
+                socket_.set_option(tcp::no_delay(true));
+                stats_.connects.fetch_add(1, std::memory_order_relaxed);
+                stats_.active.fetch_add(1, std::memory_order_relaxed);
+                connected_ = true;
+                if (lifetime_.count() > 0)
+                {
+                    lifetimeTimer_.expires_after(lifetime_);
+                    lifetimeTimer_.async_wait([this, self](const boost::system::error_code& error) {
+                        if (!error)
+                        {
+                            close();
+                        }
+                    });
+                }
+                startRead();
+                if (profile_ == Profile::Bulk)
+                {
+                    pending_ = -1; // Unlimited, the window paces it
+                    pump();
+                }
+                else
+                {
+                    scheduleTick();
+                }
+            });
+        });
+    }
+
+    void stop()
+    {
+        auto self = shared_from_this();
+        boost::asio::dispatch(strand_, [this, self]() { close(); });
+    }
+
+private:
+    void scheduleTick()
+    {
+        std::chrono::microseconds delay;
+        if (profile_ == Profile::Fps)
+        {
+            delay = std::chrono::microseconds(1000000 / 64);
+        }
+        else
+        {
+            delay = std::chrono::microseconds(std::uniform_int_distribution<int>(500000, 3000000)(rng_));
+        }
+        auto self = shared_from_this();
+        tickTimer_.expires_after(delay);
+        tickTimer_.async_wait([this, self](const boost::system::error_code& ec) {
+            if (ec || closed_)
+            {
+                return;
+            }
+            int frames = profile_ == Profile::Fps ? 1 : std::uniform_int_distribution<int>(3, 15)(rng_);
+            if (inFlight() >= spec_.window)
+            {
+                stats_.stalls.fetch_add(1, std::memory_order_relaxed);
+            }
+            else
+            {
+                pending_ += frames;
+            }
+            pump();
+            scheduleTick();
+        });
+    }
+
+    int inFlight() const { return static_cast<int>(framesSent_ - framesReceived_); }
+
+    void pump()
+    {
+        if (writing_ || closed_ || pending_ == 0 || inFlight() >= spec_.window)
+        {
+            return;
+        }
+        writing_ = true;
+        int64_t ts = nowNs();
+        std::memcpy(txFrame_.data(), &ts, sizeof(ts));
+        std::memcpy(txFrame_.data() + sizeof(ts), &framesSent_, sizeof(framesSent_));
+        auto self = shared_from_this();
+        boost::asio::async_write(socket_, boost::asio::buffer(txFrame_), [this, self](const boost::system::error_code& ec, std::size_t n) {
+            writing_ = false;
+            if (ec)
+            {
+                close();
+                return;
+            }
+            stats_.bytesSent.fetch_add(n, std::memory_order_relaxed);
+            ++framesSent_;
+            if (pending_ > 0)
+            {
+                --pending_;
+            }
+            pump();
+        });
+    }
+
+    void startRead()
+    {
+        auto self = shared_from_this();
+        boost::asio::async_read(socket_, boost::asio::buffer(rxFrame_), [this, self](const boost::system::error_code& ec, std::size_t n) {
+            if (ec)
+            {
+                close();
+                return;
+            }
+            int64_t sent;
+            uint64_t sequence;
+            std::memcpy(&sent, rxFrame_.data(), sizeof(sent));
+            std::memcpy(&sequence, rxFrame_.data() + sizeof(sent), sizeof(sequence));
+            if (sequence != framesReceived_)
+            {
+                stats_.badFrames.fetch_add(1, std::memory_order_relaxed);
+            }
+            uint64_t rttUs = static_cast<uint64_t>((nowNs() - sent) / 1000);
+            stats_.rtt.record(rttUs);
+            stats_.windowRtt.record(rttUs);
+            stats_.bytesReceived.fetch_add(n, std::memory_order_relaxed);
+            ++framesReceived_;
+            pump();
+            startRead();
+        });
+    }
+
+    void close()
+    {
+        if (closed_)
+        {
+            return;
+        }
+        closed_ = true;
+        boost::system::error_code ignored;
+        tickTimer_.cancel();
+        lifetimeTimer_.cancel();
+        socket_.close(ignored);
+        if (connected_)
+        {
+            stats_.active.fetch_sub(1, std::memory_order_relaxed);
+        }
+        stats_.closes.fetch_add(1, std::memory_order_relaxed);
+        if (onClosed_)
+        {
+            onClosed_();
+        }
+    }
+
+    boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+    tcp::socket socket_;
+    boost::asio::steady_timer tickTimer_;
+    boost::asio::steady_timer lifetimeTimer_;
+    tcp::endpoint target_;
+    Profile profile_;
+    ProfileSpec spec_;
+    Stats& stats_;
+    std::chrono::milliseconds lifetime_;
+    std::function<void()> onClosed_;
+    std::vector<char> txFrame_;
+    std::vector<char> rxFrame_;
+    std::mt19937 rng_;
+    uint64_t framesSent_ = 0;
+    uint64_t framesReceived_ = 0;
+    int pending_ = 0;
+    bool writing_ = false;
+    bool connected_ = false;
+    bool closed_ = false;
+};
+
+// Stand-in game server: echoes every byte back
+class EchoServer {
+public:
+    explicit EchoServer(boost::asio::io_context& io) : acceptor_(io, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0))
+    {
+        acceptor_.listen(4096);
+        accept();
+    }
+
+    int port() const { return acceptor_.local_endpoint().port(); }
+
+private:
+    void accept()
+    {
+        acceptor_.async_accept([this](const boost::system::error_code& ec, tcp::socket socket) {
+            if (!ec)
+            {
+                auto session = std::make_shared<Session>(std::move(socket));
+                echo(session);
+            }
+            if (acceptor_.is_open())
+            {
+                accept();
+            }
+        });
+    }
+
+    struct Session {
+        explicit Session(tcp::socket s) : socket(std::move(s)) {}
+        tcp::socket socket;
+        std::vector<char> buffer = std::vector<char>(16 * 1024);
+    };
+
+    static void echo(std::shared_ptr<Session> session)
+    {
+        session->socket.async_read_some(boost::asio::buffer(session->buffer), [session](const boost::system::error_code& ec, std::size_t n) {
+            if (ec)
+            {
+                return;
+            }
+            boost::asio::async_write(session->socket, boost::asio::buffer(session->buffer.data(), n), [session](const boost::system::error_code& error, std::size_t) {
+                if (!error)
+                {
+                    echo(session);
+                }
+            });
+        });
+    }
+
+    tcp::acceptor acceptor_;
+};
+
+void raiseFileLimit()
+{
+#ifndef _WIN32
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+#endif
+}
+
+bool parseOptions(int argc, char** argv, Options& opts)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        auto value = [&]() -> const char* { return i + 1 < argc ? argv[++i] : ""; };
+        if (arg == "--connections") opts.connections = std::atoi(value());
+        else if (arg == "--profile") opts.profile = value();
+        else if (arg == "--duration") opts.durationSeconds = std::atoi(value());
+        else if (arg == "--churn") opts.churnSeconds = std::atof(value());
+        else if (arg == "--port") opts.port = std::atoi(value());
+        else if (arg == "--threads") opts.threads = std::max(1, std::atoi(value()));
+        else if (arg == "--report") opts.reportSeconds = std::max(1, std::atoi(value()));
+        else if (arg == "--capture") opts.capturePath = value();
+        else if (arg == "--drop-every") opts.dropEverySeconds = std::atof(value());
+        else if (arg == "--drop-for") opts.dropMs = std::max(0, std::atoi(value()));
+        else if (arg == "--peers") opts.peers = std::max(0, std::atoi(value()));
+        else if (arg == "--streams") opts.streamsPerPeer = std::max(1, std::atoi(value()));
+        else if (arg == "--rate") opts.rateHz = std::max(1, std::atoi(value()));
+        else if (arg == "--backends") opts.backends = std::max(1, std::atoi(value()));
+        else if (arg == "--policy") opts.policy = value();
+        else if (arg == "--budget") opts.budgetMb = std::max(0, std::atoi(value()));
+        else if (arg == "--idle") opts.idleSeconds = std::max(0, std::atoi(value()));
+        else if (arg == "--budget-policy") opts.budgetPolicy = value();
+        else if (arg == "--legacy") opts.legacy = value();
+        else
+        {
+            std::fprintf(stderr,
+                         "usage: connecttool_loadgen [--connections N] [--profile fps|chat|bulk|mixed]\n"
+                         "                           [--duration SEC] [--churn MEAN_LIFETIME_SEC] [--port 8888]\n"
+                         "                           [--threads N] [--report SEC] [--capture FILE]\n"
+                         "                           [--drop-every SEC] [--drop-for MS]\n"
+                         "                           [--backends N] [--policy rr|least|hash]\n"
+                         "                           [--budget MB] [--idle SEC] [--budget-policy shed|pause]\n"
+                         "                           [--legacy host|client]\n"
+                         "       connecttool_loadgen --peers N [--streams PER_PEER] [--rate HZ] [--duration SEC]\n");
+            return false;
+        }
+    }
+    return (opts.profile == "fps" || opts.profile == "chat" || opts.profile == "bulk" || opts.profile == "mixed") &&
+           (opts.policy == "rr" || opts.policy == "least" || opts.policy == "hash") &&
+           (opts.budgetPolicy == "shed" || opts.budgetPolicy == "pause") &&
+           (opts.legacy.empty() || opts.legacy == "host" || opts.legacy == "client");
+}
+
+Profile profileFor(const Options& opts, int index)
+{
+    if (opts.profile == "fps") return Profile::Fps;
+    if (opts.profile == "chat") return Profile::Chat;
+    if (opts.profile == "bulk") return Profile::Bulk;
+    int slot = index % 10; // mixed: 70% fps, 20% chat, 10% bulk
+    return slot < 7 ? Profile::Fps : (slot < 9 ? Profile::Chat : Profile::Bulk);
+}
+
+// Thread CPU time in microseconds (0 where unsupported)
+uint64_t threadCpuUs(std::thread& thread)
+{
+#ifdef __linux__
+    clockid_t clock;
+    timespec ts;
+    if (pthread_getcpuclockid(thread.native_handle(), &clock) == 0 && clock_gettime(clock, &ts) == 0)
+    {
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000 + static_cast<uint64_t>(ts.tv_nsec) / 1000;
+    }
+#else
+    (void)thread;
+#endif
+    return 0;
+}
+
+uint64_t processCpuUs()
+{
+#ifndef _WIN32
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        return static_cast<uint64_t>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+               static_cast<uint64_t>(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+    }
+#endif
+    return 0;
+}
+
+// Scale run, client side: 64 B frames like Profile::Fps, sent by the peer's
+// tick. Everything but close() runs on the client io thread.
+class ScaleStream : public StreamEndpoint {
+public:
+    static constexpr size_t kFrameSize = 64;
+    static constexpr int kWindow = 8;
+
+    explicit ScaleStream(Stats& stats) : stats_(stats) { std::memset(txFrame_, 'x', sizeof(txFrame_)); }
+
+    void setId(StreamId id) { id_ = id; }
+    StreamId id() const { return id_; }
+
+    void tick(MultiplexManager& manager)
+    {
+        if (closed_)
+        {
+            return;
+        }
+        if (framesSent_ - framesReceived_ >= static_cast<uint64_t>(kWindow))
+        {
+            stats_.stalls.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        int64_t ts = nowNs();
+        std::memcpy(txFrame_, &ts, sizeof(ts));
+        std::memcpy(txFrame_ + sizeof(ts), &framesSent_, sizeof(framesSent_));
+        manager.sendFromEndpoint(id_, txFrame_, kFrameSize);
+        stats_.bytesSent.fetch_add(kFrameSize, std::memory_order_relaxed);
+        ++framesSent_;
+    }
+
+    void write(const char* data, size_t len) override
+    {
+        while (len > 0)
+        {
+            size_t n = std::min(len, kFrameSize - rxFill_);
+            std::memcpy(rxFrame_ + rxFill_, data, n);
+            rxFill_ += n;
+            data += n;
+            len -= n;
+            if (rxFill_ < kFrameSize)
+            {
+                break;
+            }
+            rxFill_ = 0;
+            int64_t sent;
+            uint64_t sequence;
+            std::memcpy(&sent, rxFrame_, sizeof(sent));
+            std::memcpy(&sequence, rxFrame_ + sizeof(sent), sizeof(sequence));
+            if (sequence != framesReceived_)
+            {
+                stats_.badFrames.fetch_add(1, std::memory_order_relaxed);
+            }
+            uint64_t rttUs = static_cast<uint64_t>((nowNs() - sent) / 1000);
+            stats_.rtt.record(rttUs);
+            stats_.windowRtt.record(rttUs);
+            stats_.bytesReceived.fetch_add(kFrameSize, std::memory_order_relaxed);
+            ++framesReceived_;
+        }
+    }
+
+    void close() override { closed_ = true; }
+
+private:
+    Stats& stats_;
+    StreamId id_{};
+    std::atomic<bool> closed_{false};
+    uint64_t framesSent_ = 0;
+    uint64_t framesReceived_ = 0;
+    char txFrame_[kFrameSize];
+    char rxFrame_[kFrameSize];
+    size_t rxFill_ = 0;
+};
+
+// Scale run, host side: the game server, echoing on the host io thread
+class EchoEndpoint : public StreamEndpoint {
+public:
+    EchoEndpoint(MultiplexManager& manager, StreamId id) : manager_(manager), id_(id) {}
+    void write(const char* data, size_t len) override { manager_.sendFromEndpoint(id_, data, len); }
+    void close() override {}
+
+private:
+    MultiplexManager& manager_;
+    StreamId id_;
+};
+
+struct ScalePeer {
+    std::unique_ptr<LoopbackTransport> toHost;
+    std::unique_ptr<LoopbackTransport> toClient;
+    std::shared_ptr<MultiplexManager> host;
+    std::shared_ptr<MultiplexManager> client;
+    std::vector<std::shared_ptr<ScaleStream>> streams;
+    std::unique_ptr<boost::asio::steady_timer> tick;
+};
+
+} // namespace
+
+// Both directions of the link go down for `outage`, then the client resumes
+// its session on a "new connection", as SteamMessageHandler would do it
+bool simulateDrop(LoopbackTransport& toHost, LoopbackTransport& toClient, MultiplexManager& hostManager,
+                  MultiplexManager& clientManager, boost::asio::io_context& clientIo, std::chrono::milliseconds outage,
+                  HSteamNetConnection conn)
+{
+    toHost.setLinkUp(false);
+    toClient.setLinkUp(false);
+    bool kept = hostManager.detach() & clientManager.detach();
+    std::this_thread::sleep_for(outage);
+    toHost.setLinkUp(true);
+    toClient.setLinkUp(true);
+    hostManager.attach(conn);
+    boost::asio::post(clientIo, [&clientManager, conn]() { clientManager.resume(conn); });
+    return kept;
+}
+
+// Host-scale run (--peers): one host io thread serving every peer, as the
+// real host's Steam thread does
+int runScale(const Options& opts)
+{
+    size_t rssStart = residentBytes();
+    boost::asio::io_context hostIo;
+    boost::asio::io_context clientIo;
+    auto hostWork = boost::asio::make_work_guard(hostIo);
+    auto clientWork = boost::asio::make_work_guard(clientIo);
+    bool hostIsHost = true;
+    bool clientIsHost = false;
+    int unusedPort = 0;
+    Stats stats;
+
+    std::vector<ScalePeer> peers(opts.peers);
+    for (int i = 0; i < opts.peers; ++i)
+    {
+        ScalePeer& peer = peers[i];
+        HSteamNetConnection conn = static_cast<HSteamNetConnection>(i + 1);
+        peer.toHost.reset(new LoopbackTransport(hostIo));
+        peer.toClient.reset(new LoopbackTransport(clientIo));
+        peer.host = std::make_shared<MultiplexManager>(peer.toClient.get(), conn, hostIo, hostIsHost, unusedPort);
+        peer.client = std::make_shared<MultiplexManager>(peer.toHost.get(), conn, clientIo, clientIsHost, unusedPort);
+        peer.host->setEndpointAcceptor([](MultiplexManager& manager, StreamId id) {
+            return std::make_shared<EchoEndpoint>(manager, id);
+        });
+        peer.toHost->setPeer(peer.host.get());
+        peer.toClient->setPeer(peer.client.get());
+        peer.tick.reset(new boost::asio::steady_timer(clientIo));
+    }
+    size_t rssManagers = residentBytes();
+    std::thread hostThread([&hostIo]() { hostIo.run(); });
+    std::thread clientThread([&clientIo]() { clientIo.run(); });
+
+    auto countStreams = [&peers](bool host) {
+        size_t count = 0;
+        for (auto& peer : peers)
+        {
+            count += host ? peer.host->getClientCount() : peer.client->getClientCount();
+        }
+        return count;
+    };
+    auto waitFor = [](const std::function<bool()>& done) {
+        for (int i = 0; i < 300 && !done(); ++i)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        return done();
+    };
+
+    // Open every stream, ticks start their traffic
+    size_t total = static_cast<size_t>(opts.peers) * opts.streamsPerPeer;
+    auto openStart = std::chrono::steady_clock::now();
+    boost::asio::post(clientIo, [&]() {
+        for (auto& peer : peers)
+        {
+            for (int i = 0; i < opts.streamsPerPeer; ++i)
+            {
+                auto stream = std::make_shared<ScaleStream>(stats);
+                stream->setId(peer.client->addEndpoint(stream));
+                peer.streams.push_back(stream);
+            }
+        }
+    });
+
+    // Each peer's tick sends a frame on all of its streams; ticks are spread
+    // over the period so the host sees a steady load
+    std::atomic<bool> running(true);
+    auto period = std::chrono::microseconds(1000000 / opts.rateHz);
+    std::function<void(ScalePeer&)> tick = [&](ScalePeer& peer) {
+        peer.tick->expires_at(peer.tick->expiry() + period);
+        peer.tick->async_wait([&](const boost::system::error_code& ec) {
+            if (ec || !running)
+            {
+                return;
+            }
+            for (auto& stream : peer.streams)
+            {
+                stream->tick(*peer.client);
+            }
+            tick(peer);
+        });
+    };
+    boost::asio::post(clientIo, [&]() {
+        auto now = std::chrono::steady_clock::now();
+        for (int i = 0; i < opts.peers; ++i)
+        {
+            peers[i].tick->expires_at(now + period * i / opts.peers);
+            tick(peers[i]);
+        }
+    });
+
+    // The host sees a stream when its first frame arrives
+    if (!waitFor([&]() { return countStreams(true) == total; }))
+    {
+        std::fprintf(stderr, "only %zu of %zu streams reached the host\n", countStreams(true), total);
+    }
+    double openSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - openStart).count();
+    size_t rssStreams = residentBytes();
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t hostCpuStart = threadCpuUs(hostThread);
+    uint64_t processCpuStart = processCpuUs();
+    uint64_t lastReceived = 0;
+    uint64_t lastHostCpu = hostCpuStart;
+    for (int elapsed = 0; elapsed < opts.durationSeconds;)
+    {
+        int step = std::min(opts.reportSeconds, opts.durationSeconds - elapsed);
+        std::this_thread::sleep_for(std::chrono::seconds(step));
+        elapsed += step;
+        uint64_t received = stats.bytesReceived.load();
+        uint64_t hostCpu = threadCpuUs(hostThread);
+        std::printf("[%5ds] echoed=%.0f frames/s host thread=%.1f%% rtt p50=%lluus p99=%lluus rss=%.1f MB\n", elapsed,
+                    (received - lastReceived) / static_cast<double>(ScaleStream::kFrameSize) / step,
+                    (hostCpu - lastHostCpu) / 1e4 / step, (unsigned long long)stats.windowRtt.percentile(50),
+                    (unsigned long long)stats.windowRtt.percentile(99), residentBytes() / 1e6);
+        std::fflush(stdout);
+        stats.windowRtt.reset();
+        lastReceived = received;
+        lastHostCpu = hostCpu;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double hostCpuShare = (threadCpuUs(hostThread) - hostCpuStart) / 1e6 / seconds;
+    double processCpuShare = (processCpuUs() - processCpuStart) / 1e6 / seconds;
+
+    // Close every stream from the client side and check nothing is left
+    running = false;
+    boost::asio::post(clientIo, [&]() {
+        for (auto& peer : peers)
+        {
+            peer.tick->cancel();
+            for (auto& stream : peer.streams)
+            {
+                peer.client->closeFromEndpoint(stream->id());
+            }
+        }
+    });
+    waitFor([&]() { return countStreams(true) == 0 && countStreams(false) == 0; });
+    size_t leakedHost = countStreams(true);
+    size_t leakedClient = countStreams(false);
+
+    std::printf("\n=== connecttool_loadgen: %d peers x %d streams, %d Hz, %.0f s ===\n", opts.peers, opts.streamsPerPeer,
+                opts.rateHz, seconds);
+    std::printf("streams open on the host in %.2f s\n", openSeconds);
+    std::printf("throughput: %.0f frames/s echoed, stalled ticks %llu\n",
+                stats.bytesReceived.load() / static_cast<double>(ScaleStream::kFrameSize) / seconds,
+                (unsigned long long)stats.stalls.load());
+    std::printf("rtt: p50 %llu us, p99 %llu us, p99.9 %llu us, max %llu us\n",
+                (unsigned long long)stats.rtt.percentile(50), (unsigned long long)stats.rtt.percentile(99),
+                (unsigned long long)stats.rtt.percentile(99.9), (unsigned long long)stats.rtt.max());
+    std::printf("cpu: host thread %.1f%% of a core, %.2f%% per peer; whole process %.1f%% (both ends)\n",
+                hostCpuShare * 100, hostCpuShare * 100 / opts.peers, processCpuShare * 100);
+    std::printf("memory: %.1f KB per manager pair, %.0f B per stream (both ends), rss %.1f MB\n",
+                (static_cast<double>(rssManagers) - static_cast<double>(rssStart)) / 1e3 / opts.peers,
+                (static_cast<double>(rssStreams) - static_cast<double>(rssManagers)) / total, residentBytes() / 1e6);
+    std::printf("frames echoed out of sequence: %llu\n", (unsigned long long)stats.badFrames.load());
+    std::printf("leaked stream entries: client streams=%zu, host streams=%zu\n", leakedClient, leakedHost);
+
+    hostWork.reset();
+    clientWork.reset();
+    hostIo.stop();
+    clientIo.stop();
+    hostThread.join();
+    clientThread.join();
+    peers.clear();
+    Logger::instance().shutdown();
+    if (stats.badFrames.load() > 0)
+    {
+        return 4;
+    }
+    return leakedHost + leakedClient == 0 ? 0 : 3;
+}
+
+int main(int argc, char** argv)
+{
+    Options opts;
+    if (!parseOptions(argc, argv, opts))
+    {
+        return 2;
+    }
+    Logger::setLevel(LogLevel::Warn);
+    if (opts.peers > 0)
+    {
+        return runScale(opts);
+    }
+    raiseFileLimit();
+    if (!opts.capturePath.empty() && !TunnelCapture::instance().start(opts.capturePath))
+    {
+        return 1;
+    }
+    size_t rssStart = residentBytes();
+
+    // Stand-in game server
+    boost::asio::io_context backendIo;
+    auto backendWork = boost::asio::make_work_guard(backendIo);
+    std::vector<std::unique_ptr<EchoServer>> echoes;
+    for (int i = 0; i < opts.backends; ++i)
+    {
+        echoes.emplace_back(new EchoServer(backendIo));
+    }
+    std::thread backendThread([&backendIo]() { backendIo.run(); });
+
+    // Both ends of the tunnel, each with its own "Steam" io thread
+    boost::asio::io_context hostIo;
+    boost::asio::io_context clientIo;
+    auto hostWork = boost::asio::make_work_guard(hostIo);
+    auto clientWork = boost::asio::make_work_guard(clientIo);
+    LoopbackTransport toHost(hostIo);
+    LoopbackTransport toClient(clientIo);
+    bool hostIsHost = true;
+    bool clientIsHost = false;
+    int backendPort = echoes[0]->port();
+    int unusedPort = 0;
+    auto hostManager = std::make_shared<MultiplexManager>(&toClient, 1, hostIo, hostIsHost, backendPort);
+    auto clientManager = std::make_shared<MultiplexManager>(&toHost, 1, clientIo, clientIsHost, unusedPort);
+    toHost.setPeer(hostManager.get());
+    toClient.setPeer(clientManager.get());
+    if (!opts.legacy.empty())
+    {
+        (opts.legacy == "host" ? hostManager : clientManager)->setLocalCapabilities(Capabilities());
+    }
+    std::shared_ptr<BackendPool> pool;
+    if (opts.backends > 1)
+    {
+        std::vector<tcp::endpoint> endpoints;
+        for (auto& echo : echoes)
+        {
+            endpoints.emplace_back(boost::asio::ip::address_v4::loopback(), static_cast<unsigned short>(echo->port()));
+        }
+        BackendPool::Policy policy = opts.policy == "rr" ? BackendPool::Policy::RoundRobin
+                                     : opts.policy == "hash" ? BackendPool::Policy::PeerHash
+                                                             : BackendPool::Policy::LeastConnections;
+        pool = std::make_shared<BackendPool>(hostIo, std::move(endpoints), policy);
+        pool->start();
+        hostManager->setBackendPools({{backendPort, pool}});
+    }
+    std::thread hostThread([&hostIo]() { hostIo.run(); });
+    std::thread clientThread([&clientIo]() { clientIo.run(); });
+
+    TCPServer server(opts.port, [clientManager](uint64_t) { return clientManager; });
+    server.setLocalBroadcast(false); // Every client only expects its own echo
+    if (!server.start())
+    {
+        std::fprintf(stderr, "failed to listen on port %d\n", opts.port);
+        return 1;
+    }
+
+    // Load clients
+    Stats stats;
+    std::atomic<bool> running(true);
+    boost::asio::io_context loadIo;
+    auto loadWork = boost::asio::make_work_guard(loadIo);
+    tcp::endpoint target(boost::asio::ip::address_v4::loopback(), static_cast<unsigned short>(opts.port));
+    std::mutex connectionsMutex;
+    std::vector<std::shared_ptr<LoadConnection>> connections(opts.connections);
+    std::mt19937 rng(std::random_device{}());
+
+    std::function<void(int)> open = [&](int index) {
+        std::chrono::milliseconds lifetime(0);
+        {
+            std::lock_guard<std::mutex> lock(connectionsMutex);
+            if (opts.churnSeconds > 0)
+            {
+                lifetime = std::chrono::milliseconds(static_cast<int64_t>(
+                    std::uniform_real_distribution<double>(0.5, 1.5)(rng) * opts.churnSeconds * 1000));
+            }
+        }
+        auto conn = std::make_shared<LoadConnection>(loadIo, target, profileFor(opts, index), stats, lifetime, [&, index]() {
+            // Churn: replace the closed connection while the run is on
+            if (running)
+            {
+                boost::asio::post(loadIo, [&, index]() { open(index); });
+            }
+        });
+        {
+            std::lock_guard<std::mutex> lock(connectionsMutex);
+            connections[index] = conn;
+        }
+        conn->start();
+    };
+    for (int i = 0; i < opts.connections; ++i)
+    {
+        open(i);
+    }
+    std::vector<std::thread> loadThreads;
+    for (int i = 0; i < opts.threads; ++i)
+    {
+        loadThreads.emplace_back([&loadIo]() { loadIo.run(); });
+    }
+
+    // What SteamMessageHandler's poll does once a second
+    const bool sweeping = opts.budgetMb >= 0 || opts.idleSeconds >= 0;
+    MemoryBudget& budget = MemoryBudget::instance();
+    if (opts.budgetMb >= 0)
+    {
+        budget.setLimit(static_cast<size_t>(opts.budgetMb) * 1024 * 1024);
+        budget.setPolicy(opts.budgetPolicy == "pause" ? MemoryBudget::Policy::Backpressure
+                                                      : MemoryBudget::Policy::ShedIdle);
+    }
+    if (opts.idleSeconds >= 0)
+    {
+        budget.setIdleTimeout(std::chrono::seconds(opts.idleSeconds));
+    }
+    std::thread sweepThread;
+    if (sweeping)
+    {
+        sweepThread = std::thread([&]() {
+            while (running)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                static int ticks = 0;
+                if (++ticks % 10 == 0)
+                {
+                    MultiplexManager::sweep({clientManager, hostManager});
+                }
+                if (budget.takeStalled())
+                {
+                    clientManager->resumeReading();
+                    hostManager->resumeReading();
+                }
+            }
+        });
+    }
+
+    std::atomic<int> drops(0);
+    std::atomic<int> unresumable(0);
+    std::thread dropThread;
+    if (opts.dropEverySeconds > 0)
+    {
+        dropThread = std::thread([&]() {
+            auto next = std::chrono::steady_clock::now();
+            HSteamNetConnection conn = 1;
+            while (running)
+            {
+                next += std::chrono::milliseconds(static_cast<int64_t>(opts.dropEverySeconds * 1000));
+                while (running && std::chrono::steady_clock::now() < next)
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                }
+                if (!running)
+                {
+                    break;
+                }
+                if (!simulateDrop(toHost, toClient, *hostManager, *clientManager, clientIo,
+                                  std::chrono::milliseconds(opts.dropMs), ++conn))
+                {
+                    unresumable.fetch_add(1);
+                }
+                drops.fetch_add(1);
+            }
+        });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t lastSent = 0, lastReceived = 0;
+    for (int elapsed = 0; elapsed < opts.durationSeconds;)
+    {
+        int step = std::min(opts.reportSeconds, opts.durationSeconds - elapsed);
+        std::this_thread::sleep_for(std::chrono::seconds(step));
+        elapsed += step;
+        uint64_t sent = stats.bytesSent.load(), received = stats.bytesReceived.load();
+        std::printf("[%5ds] active=%lld tx=%.2f MB/s rx=%.2f MB/s rtt p50=%lluus p99=%lluus p99.9=%lluus "
+                    "streams(client=%zu host=%zu) rss=%.1f MB\n",
+                    elapsed, (long long)stats.active.load(), (sent - lastSent) / 1e6 / step,
+                    (received - lastReceived) / 1e6 / step, (unsigned long long)stats.windowRtt.percentile(50),
+                    (unsigned long long)stats.windowRtt.percentile(99), (unsigned long long)stats.windowRtt.percentile(99.9),
+                    clientManager->getClientCount(), hostManager->getClientCount(), residentBytes() / 1e6);
+        if (sweeping)
+        {
+            MemoryBudget::Snapshot memory = budget.snapshot();
+            std::printf("         memory: streams %.1f MB, queued %.1f MB, sessions %.1f MB; shed %llu, idle %llu, "
+                        "stalls %llu\n",
+                        memory.streams / 1e6, memory.writeQueues / 1e6, memory.managers / 1e6,
+                        (unsigned long long)memory.shed, (unsigned long long)memory.reaped,
+                        (unsigned long long)memory.stalls);
+        }
+        if (pool)
+        {
+            std::printf("         streams per backend:");
+            for (const auto& backend : pool->status())
+            {
+                std::printf(" %d%s", backend.streams, backend.up ? "" : " (down)");
+            }
+            std::printf("\n");
+        }
+        std::fflush(stdout);
+        stats.windowRtt.reset();
+        lastSent = sent;
+        lastReceived = received;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Close everything and give the tunnel time to tear the streams down
+    running = false;
+    if (dropThread.joinable())
+    {
+        dropThread.join();
+    }
+    if (sweepThread.joinable())
+    {
+        sweepThread.join();
+    }
+    // Reads stopped for the budget must end with their sockets
+    clientManager->resumeReading();
+    hostManager->resumeReading();
+    {
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        for (auto& conn : connections)
+        {
+            if (conn)
+            {
+                conn->stop();
+            }
+        }
+    }
+    for (int i = 0; i < 50; ++i)
+    {
+        if (clientManager->getClientCount() == 0 && hostManager->getClientCount() == 0 && server.getClientCount() == 0)
+        {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    std::printf("\n=== connecttool_loadgen: %d connections, profile %s, %.0f s, churn %.1f s, io %s ===\n",
+                opts.connections, opts.profile.c_str(), seconds, opts.churnSeconds, UringEngine::backendName());
+    std::printf("connects=%llu failures=%llu closes=%llu stalled ticks=%llu\n",
+                (unsigned long long)stats.connects.load(), (unsigned long long)stats.connectFailures.load(),
+                (unsigned long long)stats.closes.load(), (unsigned long long)stats.stalls.load());
+    std::printf("throughput: tx %.2f MB/s, rx %.2f MB/s, tunnel frames %llu + %llu\n",
+                stats.bytesSent.load() / 1e6 / seconds, stats.bytesReceived.load() / 1e6 / seconds,
+                (unsigned long long)toHost.messageCount(), (unsigned long long)toClient.messageCount());
+    std::printf("rtt: p50 %llu us, p99 %llu us, p99.9 %llu us, max %llu us\n",
+                (unsigned long long)stats.rtt.percentile(50), (unsigned long long)stats.rtt.percentile(99),
+                (unsigned long long)stats.rtt.percentile(99.9), (unsigned long long)stats.rtt.max());
+    if (opts.dropEverySeconds > 0)
+    {
+        std::printf("link drops: %d of %d ms, %d couldn't be resumed\n", drops.load(), opts.dropMs, unresumable.load());
+    }
+    std::printf("frames echoed out of sequence: %llu\n", (unsigned long long)stats.badFrames.load());
+    std::printf("protocol: host sees client v%u, client sees host v%u\n",
+                (unsigned)hostManager->peerCapabilities().version, (unsigned)clientManager->peerCapabilities().version);
+    size_t rssEnd = residentBytes();
+    std::printf("rss: start %.1f MB, end %.1f MB, growth %.1f MB\n", rssStart / 1e6, rssEnd / 1e6,
+                (static_cast<double>(rssEnd) - static_cast<double>(rssStart)) / 1e6);
+    if (sweeping)
+    {
+        MemoryBudget::Snapshot memory = budget.snapshot();
+        std::printf("memory budget: shed %llu, idle-closed %llu, stalls %llu; still charged: streams %zu B, "
+                    "queued %zu B\n",
+                    (unsigned long long)memory.shed, (unsigned long long)memory.reaped,
+                    (unsigned long long)memory.stalls, memory.streams, memory.writeQueues);
+    }
+    size_t leaked = clientManager->getClientCount() + hostManager->getClientCount() + server.getClientCount();
+    std::printf("leaked stream entries: client streams=%zu, host streams=%zu, "
+                "TCPServer clients_=%d\n",
+                clientManager->getClientCount(), hostManager->getClientCount(), server.getClientCount());
+
+    // Teardown
+    loadWork.reset();
+    loadIo.stop();
+    for (auto& t : loadThreads)
+    {
+        t.join();
+    }
+    server.stop();
+    if (pool)
+    {
+        pool->stop();
+    }
+    hostWork.reset();
+    clientWork.reset();
+    hostIo.stop();
+    clientIo.stop();
+    hostThread.join();
+    clientThread.join();
+    backendWork.reset();
+    backendIo.stop();
+    backendThread.join();
+    TunnelCapture::instance().stop();
+    Logger::instance().shutdown();
+    if (stats.badFrames.load() > 0)
+    {
+        return 4;
+    }
+    return leaked == 0 ? 0 : 3;
+}
@@ -0,0 +1,286 @@
+// Offline replay of a tunnel capture (see net/tunnel_capture.h).
+//
+// Frames recorded in one direction are fed back through
+// MultiplexManager::handleTunnelPacket on an io thread, one manager per
+// recorded connection, at the original pacing scaled by --speed (0 = as fast
+// as possible). In host mode new streams connect to 127.0.0.1:<local-port>,
+// so a captured session can be replayed against a game server to reproduce
+// bugs or compare handler changes. Frames the manager sends back are counted
+// and discarded.
+//
+// Frames are routed the way SteamMessageHandler routes them, from what the
+// capture itself shows (both directions are read for it): a hello names its
+// session's connection, and a resume on a new connection goes to the same
+// manager; a lane join ties a bonded connection to its session's manager
+// as that lane; relay frames go to one manager per relayed peer and route,
+// or on the host, which only forwards them, are counted and skipped.
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <tuple>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "logger.h"
+#include "multiplex_manager.h"
+#include "relay_transport.h"
+#include "tunnel_capture.h"
+#include "tunnel_transport.h"
+
+namespace {
+
+struct Options {
+    std::string path;
+    CaptureDirection direction = CaptureDirection::Inbound;
+    double speed = 1.0;
+    bool host = true;
+    int localPort = 0;
+    long long connection = -1; // -1 = all recorded connections
+    int drainMs = 1000;
+    bool help = false;
+};
+
+// A bonded connection: which session connection's manager it feeds, as which lane
+struct LaneRoute {
+    HSteamNetConnection session;
+    int lane;
+};
+
+void printUsage(FILE* out)
+{
+    std::fprintf(out,
+                 "usage: connecttool_replay CAPTURE [--direction in|out] [--speed X (0 = max)]\n"
+                 "                          [--local-port N] [--client] [--conn HANDLE] [--drain-ms MS]\n"
+                 "\n"
+                 "  --direction   replay the frames received (in, default) or sent (out)\n"
+                 "  --speed       multiple of the recorded pacing; 0 replays as fast as possible\n"
+                 "  --local-port  host mode: where new streams connect on 127.0.0.1\n"
+                 "  --client      replay as the client instead of the host\n"
+                 "  --conn        only this recorded connection handle (and its lanes)\n"
+                 "  --drain-ms    time left for local sockets to flush at the end (default 1000)\n");
+}
+
+class CountingTransport : public TunnelTransport {
+public:
+    EResult send(HSteamNetConnection, const void*, uint32 size, int) override
+    {
+        messages_.fetch_add(1, std::memory_order_relaxed);
+        bytes_.fetch_add(size, std::memory_order_relaxed);
+        return k_EResultOK;
+    }
+
+    uint64_t messageCount() const { return messages_.load(std::memory_order_relaxed); }
+    uint64_t byteCount() const { return bytes_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> messages_{0};
+    std::atomic<uint64_t> bytes_{0};
+};
+
+bool parseOptions(int argc, char** argv, Options& opts)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        auto value = [&]() -> const char* { return i + 1 < argc ? argv[++i] : ""; };
+        if (arg == "--direction") opts.direction = std::string(value()) == "out" ? CaptureDirection::Outbound : CaptureDirection::Inbound;
+        else if (arg == "--speed") opts.speed = std::atof(value());
+        else if (arg == "--client") opts.host = false;
+        else if (arg == "--local-port") opts.localPort = std::atoi(value());
+        else if (arg == "--conn") opts.connection = std::atoll(value());
+        else if (arg == "--drain-ms") opts.drainMs = std::atoi(value());
+        else if (arg == "--help" || arg == "-h")
+        {
+            opts.help = true;
+            printUsage(stdout);
+            return false;
+        }
+        else if (!arg.empty() && arg[0] != '-' && opts.path.empty()) opts.path = arg;
+        else
+        {
+            printUsage(stderr);
+            return false;
+        }
+    }
+    if (opts.path.empty())
+    {
+        std::fprintf(stderr, "usage: connecttool_replay CAPTURE [options], see --help\n");
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    Options opts;
+    if (!parseOptions(argc, argv, opts))
+    {
+        return opts.help ? 0 : 2;
+    }
+
+    CaptureReader reader;
+    if (!reader.open(opts.path))
+    {
+        std::fprintf(stderr, "cannot read capture file %s\n", opts.path.c_str());
+        return 1;
+    }
+
+    boost::asio::io_context io;
+    auto work = boost::asio::make_work_guard(io);
+    std::thread ioThread([&io]() { io.run(); });
+
+    CountingTransport transport;
+    bool isHost = opts.host;
+    bool acceptorRole = true; // Relay managers: the side the relayed streams were opened to
+    bool openerRole = false;
+    int localPort = opts.localPort;
+    std::map<HSteamNetConnection, std::shared_ptr<MultiplexManager>> managers;
+    std::map<std::tuple<HSteamNetConnection, uint64_t, uint32_t>, std::shared_ptr<MultiplexManager>> relayManagers;
+    // (direction, session ID) -> the connection its hello came on; a lane join
+    // or a resume goes the same way as the hello
+    std::map<std::pair<uint8_t, uint64_t>, HSteamNetConnection> sessions;
+    std::map<HSteamNetConnection, LaneRoute> lanes;
+    auto managerFor = [&](HSteamNetConnection conn) -> MultiplexManager* {
+        auto& manager = managers[conn];
+        if (!manager)
+        {
+            manager = std::make_shared<MultiplexManager>(&transport, conn, io, isHost, localPort);
+        }
+        return manager.get();
+    };
+
+    uint64_t replayed = 0;
+    uint64_t replayedBytes = 0;
+    uint64_t skipped = 0;
+    uint64_t forwarded = 0; // Relay frames the host passed on
+    size_t attachedLanes = 0;
+    int64_t lastTimestampNs = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    CaptureReader::Record record;
+    while (reader.next(record))
+    {
+        const CaptureRecordHeader& header = record.header;
+        const char* data = record.frame.data();
+        size_t size = record.frame.size();
+        HSteamNetConnection conn = header.connection;
+        bool replayedDirection = header.direction == static_cast<uint8_t>(opts.direction);
+
+        // Routing, from either direction
+        uint64_t sessionId;
+        int joinedLane;
+        if (MultiplexManager::parseHello(data, size, sessionId))
+        {
+            auto known = sessions.emplace(std::make_pair(header.direction, sessionId), conn).first;
+            if (known->second != conn)
+            {
+                lanes[conn] = LaneRoute{known->second, 0}; // Resumed on a new connection
+            }
+        }
+        else if (MultiplexManager::parseLaneJoin(data, size, sessionId, joinedLane))
+        {
+            auto known = sessions.find(std::make_pair(header.direction, sessionId));
+            if (known == sessions.end() || joinedLane <= 0 || joinedLane >= MultiplexManager::kMaxLanes)
+            {
+                std::fprintf(stderr, "lane join on connection %u for a session the capture never opened\n", conn);
+                ++skipped;
+                continue;
+            }
+            lanes[conn] = LaneRoute{known->second, joinedLane};
+            if (replayedDirection &&
+                (opts.connection < 0 || known->second == static_cast<HSteamNetConnection>(opts.connection)))
+            {
+                MultiplexManager* target = managerFor(known->second);
+                ++attachedLanes;
+                boost::asio::post(io, [target, joinedLane, conn]() { target->attachLane(joinedLane, conn); });
+            }
+            continue; // Consumed by the router, as in SteamMessageHandler
+        }
+
+        HSteamNetConnection session = conn;
+        int lane = 0;
+        auto route = lanes.find(conn);
+        if (route != lanes.end())
+        {
+            session = route->second.session;
+            lane = route->second.lane;
+        }
+        if (!replayedDirection ||
+            (opts.connection >= 0 && session != static_cast<HSteamNetConnection>(opts.connection)))
+        {
+            ++skipped;
+            continue;
+        }
+        if (opts.speed > 0)
+        {
+            auto due = start + std::chrono::nanoseconds(static_cast<int64_t>(header.timestampNs / opts.speed));
+            std::this_thread::sleep_until(due);
+        }
+        lastTimestampNs = header.timestampNs;
+
+        MultiplexManager* target;
+        size_t offset = 0;
+        uint64_t relayPeer;
+        uint32_t relayRoute;
+        const char* inner;
+        size_t innerLen;
+        if (MultiplexManager::parseRelay(data, size, relayPeer, relayRoute, inner, innerLen))
+        {
+            if (isHost)
+            {
+                ++forwarded;
+                continue;
+            }
+            auto& manager = relayManagers[std::make_tuple(session, relayPeer, relayRoute)];
+            if (!manager)
+            {
+                bool& role = relayRoute == RelayTransport::kRouteToAcceptor ? acceptorRole : openerRole;
+                manager = std::make_shared<MultiplexManager>(&transport, session, io, role, localPort);
+            }
+            target = manager.get();
+            offset = static_cast<size_t>(inner - data);
+            size = innerLen;
+            lane = 0;
+        }
+        else
+        {
+            target = managerFor(session);
+        }
+        // The manager copies what it keeps, so the frame only has to last
+        // until the handler has run
+        auto frame = std::make_shared<std::vector<char>>(std::move(record.frame));
+        boost::asio::post(io, [target, frame, offset, size, lane]() {
+            target->handleTunnelPacket(frame->data() + offset, size, lane);
+        });
+        ++replayed;
+        replayedBytes += size;
+    }
+    auto fedAt = std::chrono::steady_clock::now();
+
+    // Give local sockets time to flush and the game server time to answer
+    std::this_thread::sleep_for(std::chrono::milliseconds(opts.drainMs));
+    work.reset();
+    io.stop();
+    ioThread.join();
+
+    double wall = std::chrono::duration<double>(fedAt - start).count();
+    std::printf("replayed %llu frames (%llu bytes) from %zu session(s), %zu extra lane(s), %zu relayed peer(s), skipped %llu\n",
+                (unsigned long long)replayed, (unsigned long long)replayedBytes, managers.size(), attachedLanes,
+                relayManagers.size(), (unsigned long long)skipped);
+    if (forwarded > 0)
+    {
+        std::printf("relay frames the host forwarded (not replayed): %llu\n", (unsigned long long)forwarded);
+    }
+    std::printf("capture span %.3f s, replay took %.3f s (%.0f frames/s)\n", lastTimestampNs / 1e9, wall,
+                wall > 0 ? replayed / wall : 0.0);
+    std::printf("frames sent back: %llu (%llu bytes)\n", (unsigned long long)transport.messageCount(),
+                (unsigned long long)transport.byteCount());
+
+    Logger::instance().shutdown();
+    return 0;
+}
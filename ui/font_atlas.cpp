@@ -0,0 +1,366 @@
+#include "font_atlas.h"
+#include "logger.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+// ImGui 1.92 made atlases dynamic: glyphs rasterize on first use, so there
+// is nothing to choose or cache. The cache restores 1.90 and 1.91 atlases.
+#define FONT_ATLAS_DYNAMIC (IMGUI_VERSION_NUM >= 19200)
+#define FONT_ATLAS_CACHEABLE (IMGUI_VERSION_NUM >= 19000 && !FONT_ATLAS_DYNAMIC)
+
+namespace {
+// Next code point of UTF-8 text, advancing past it; malformed bytes give 0xFFFD
+uint32_t nextCodepoint(const char*& text)
+{
+    const unsigned char* s = reinterpret_cast<const unsigned char*>(text);
+    int length = s[0] < 0x80 ? 1 : (s[0] & 0xE0) == 0xC0 ? 2 : (s[0] & 0xF0) == 0xE0 ? 3 : (s[0] & 0xF8) == 0xF0 ? 4 : 0;
+    if (length == 0)
+    {
+        ++text;
+        return 0xFFFD;
+    }
+    uint32_t codepoint = length == 1 ? s[0] : s[0] & (0x7F >> length);
+    for (int i = 1; i < length; ++i)
+    {
+        if ((s[i] & 0xC0) != 0x80)
+        {
+            text += i;
+            return 0xFFFD;
+        }
+        codepoint = (codepoint << 6) | (s[i] & 0x3F);
+    }
+    text += length;
+    return codepoint;
+}
+
+uint64_t fnv1a(uint64_t hash, const void* data, size_t len)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < len; ++i)
+    {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+int64_t millisSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Everything the cache file holds besides the glyph set, glyphs and pixels,
+// which follow it in that order. Only ever read back by the same ImGui
+// version on the same platform, so it's written as is.
+struct CacheHeader {
+    char magic[8];
+    uint32_t imguiVersion;
+    uint32_t glyphSize;
+    uint64_t fontKey;
+    float sizePixels;
+    float ascent;
+    float descent;
+    int32_t texWidth;
+    int32_t texHeight;
+    uint32_t glyphCount;
+    uint32_t usedWords;
+    ImVec2 uvWhitePixel;
+    ImVec4 uvLines[IM_DRAWLIST_TEX_LINES_WIDTH_MAX + 1];
+};
+
+const char kCacheMagic[8] = {'C', 'T', 'F', 'O', 'N', 'T', 0, 1};
+} // namespace
+
+FontAtlas::FontAtlas(std::string fontPath, float sizePixels, std::string cacheDir)
+    : fontPath_(std::move(fontPath)), size_(sizePixels), cacheDir_(std::move(cacheDir))
+{
+    fontKey_ = fontKey();
+}
+
+void FontAtlas::load(ImFontAtlas* atlas, const char* seedText)
+{
+#if FONT_ATLAS_DYNAMIC
+    (void)seedText;
+    if (fontKey_ == 0 || !atlas->AddFontFromFileTTF(fontPath_.c_str(), size_))
+    {
+        LOG_WARN("Font {} not found, Chinese text won't render", fontPath_);
+        atlas->AddFontDefault();
+    }
+#else
+    auto start = std::chrono::steady_clock::now();
+    if (loadCache(atlas))
+    {
+        LOG_INFO("Font atlas: {} glyphs from cache in {} ms", atlas->Fonts[0]->Glyphs.Size, millisSince(start));
+        // Labels added since the cache was written get baked before the first frame
+        if (seedText)
+        {
+            require(seedText);
+        }
+        return;
+    }
+    glyphs_.Clear();
+    glyphs_.AddRanges(atlas->GetGlyphRangesDefault());
+    if (seedText)
+    {
+        glyphs_.AddText(seedText);
+    }
+    else
+    {
+        glyphs_.AddRanges(atlas->GetGlyphRangesChineseSimplifiedCommon());
+    }
+    bake(atlas);
+#endif
+}
+
+void FontAtlas::require(const char* text)
+{
+#if FONT_ATLAS_DYNAMIC
+    (void)text;
+#else
+    while (*text)
+    {
+        if (static_cast<unsigned char>(*text) < 0x80)
+        {
+            ++text; // ASCII is always baked
+            continue;
+        }
+        uint32_t codepoint = nextCodepoint(text);
+        if (codepoint <= IM_UNICODE_CODEPOINT_MAX && !glyphs_.GetBit(codepoint))
+        {
+            glyphs_.SetBit(codepoint);
+            pending_ = true;
+        }
+    }
+#endif
+}
+
+bool FontAtlas::update(ImFontAtlas* atlas)
+{
+    if (!pending_)
+    {
+        return false;
+    }
+    pending_ = false;
+    return bake(atlas);
+}
+
+bool FontAtlas::bake(ImFontAtlas* atlas)
+{
+#if FONT_ATLAS_DYNAMIC
+    (void)atlas;
+    return false;
+#else
+    auto start = std::chrono::steady_clock::now();
+    // The atlas reads the ranges until it's cleared
+    atlas->Clear();
+    ranges_.clear();
+    glyphs_.BuildRanges(&ranges_);
+    ImFont* font = fontKey_ != 0 ? atlas->AddFontFromFileTTF(fontPath_.c_str(), size_, nullptr, ranges_.Data) : nullptr;
+    if (!font)
+    {
+        LOG_WARN("Font {} not found, Chinese text won't render", fontPath_);
+        atlas->AddFontDefault();
+        atlas->Build();
+        return true;
+    }
+    atlas->Build();
+    unsigned char* pixels = nullptr;
+    int width = 0;
+    int height = 0;
+    atlas->GetTexDataAsAlpha8(&pixels, &width, &height);
+    LOG_INFO("Font atlas: baked {} glyphs into {}x{} in {} ms", font->Glyphs.Size, width, height, millisSince(start));
+    saveCache(atlas);
+    return true;
+#endif
+}
+
+bool FontAtlas::loadCache(ImFontAtlas* atlas)
+{
+#if FONT_ATLAS_CACHEABLE
+    if (fontKey_ == 0)
+    {
+        return false;
+    }
+    std::ifstream in(cachePath(), std::ios::binary);
+    if (!in)
+    {
+        return false;
+    }
+    std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    CacheHeader header;
+    if (data.size() < sizeof(header))
+    {
+        return false;
+    }
+    std::memcpy(&header, data.data(), sizeof(header));
+    size_t usedBytes = static_cast<size_t>(header.usedWords) * sizeof(ImU32);
+    size_t glyphBytes = static_cast<size_t>(header.glyphCount) * sizeof(ImFontGlyph);
+    size_t pixelBytes = static_cast<size_t>(header.texWidth) * static_cast<size_t>(header.texHeight);
+    if (std::memcmp(header.magic, kCacheMagic, sizeof(kCacheMagic)) != 0 || header.imguiVersion != IMGUI_VERSION_NUM ||
+        header.glyphSize != sizeof(ImFontGlyph) || header.fontKey != fontKey_ || header.sizePixels != size_ ||
+        header.usedWords != static_cast<uint32_t>(glyphs_.UsedChars.Size) || header.glyphCount == 0 ||
+        header.texWidth <= 0 || header.texHeight <= 0 ||
+        data.size() != sizeof(header) + usedBytes + glyphBytes + pixelBytes)
+    {
+        LOG_INFO("Font atlas cache is stale, rebaking");
+        return false;
+    }
+    const char* cursor = data.data() + sizeof(header);
+
+    // A font as Build() would leave it, minus the TrueType data: the
+    // atlas is never built again, bake() clears it and starts over
+    atlas->Clear();
+    ImFontConfig config;
+    config.SizePixels = size_;
+    config.FontDataOwnedByAtlas = false;
+    std::snprintf(config.Name, sizeof(config.Name), "%s, %.0fpx", fontPath_.c_str(), size_);
+    ImFont* font = IM_NEW(ImFont)();
+    config.DstFont = font;
+    atlas->ConfigData.push_back(config);
+    atlas->Fonts.push_back(font);
+    font->ContainerAtlas = atlas;
+    font->ConfigData = &atlas->ConfigData.back();
+    font->ConfigDataCount = 1;
+    font->FontSize = size_;
+    font->Ascent = header.ascent;
+    font->Descent = header.descent;
+
+    std::memcpy(glyphs_.UsedChars.Data, cursor, usedBytes);
+    cursor += usedBytes;
+    font->Glyphs.resize(static_cast<int>(header.glyphCount));
+    std::memcpy(font->Glyphs.Data, cursor, glyphBytes);
+    cursor += glyphBytes;
+    font->BuildLookupTable();
+
+    atlas->TexWidth = header.texWidth;
+    atlas->TexHeight = header.texHeight;
+    atlas->TexPixelsAlpha8 = static_cast<unsigned char*>(IM_ALLOC(pixelBytes));
+    std::memcpy(atlas->TexPixelsAlpha8, cursor, pixelBytes);
+    atlas->TexUvScale = ImVec2(1.0f / header.texWidth, 1.0f / header.texHeight);
+    atlas->TexUvWhitePixel = header.uvWhitePixel;
+    std::memcpy(atlas->TexUvLines, header.uvLines, sizeof(header.uvLines));
+    atlas->TexReady = true;
+    return true;
+#else
+    (void)atlas;
+    return false;
+#endif
+}
+
+void FontAtlas::saveCache(ImFontAtlas* atlas)
+{
+#if FONT_ATLAS_CACHEABLE
+    if (fontKey_ == 0 || atlas->Fonts.Size != 1)
+    {
+        return;
+    }
+    ImFont* font = atlas->Fonts[0];
+    unsigned char* pixels = nullptr;
+    int width = 0;
+    int height = 0;
+    atlas->GetTexDataAsAlpha8(&pixels, &width, &height);
+
+    CacheHeader header{};
+    std::memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+    header.imguiVersion = IMGUI_VERSION_NUM;
+    header.glyphSize = sizeof(ImFontGlyph);
+    header.fontKey = fontKey_;
+    header.sizePixels = size_;
+    header.ascent = font->Ascent;
+    header.descent = font->Descent;
+    header.texWidth = width;
+    header.texHeight = height;
+    header.glyphCount = static_cast<uint32_t>(font->Glyphs.Size);
+    header.usedWords = static_cast<uint32_t>(glyphs_.UsedChars.Size);
+    header.uvWhitePixel = atlas->TexUvWhitePixel;
+    std::memcpy(header.uvLines, atlas->TexUvLines, sizeof(header.uvLines));
+
+    // Written aside and renamed over, so a crash never leaves half a cache
+    std::error_code ec;
+    std::filesystem::create_directories(cacheDir_, ec);
+    std::string path = cachePath();
+    std::string tempPath = path + ".tmp";
+    {
+        std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(glyphs_.UsedChars.Data),
+                  static_cast<std::streamsize>(glyphs_.UsedChars.Size * sizeof(ImU32)));
+        out.write(reinterpret_cast<const char*>(font->Glyphs.Data),
+                  static_cast<std::streamsize>(font->Glyphs.Size * sizeof(ImFontGlyph)));
+        out.write(reinterpret_cast<const char*>(pixels), static_cast<std::streamsize>(width) * height);
+        if (!out)
+        {
+            LOG_WARN("Couldn't write font atlas cache {}", tempPath);
+            return;
+        }
+    }
+    std::filesystem::rename(tempPath, path, ec);
+    if (ec)
+    {
+        LOG_WARN("Couldn't write font atlas cache {}: {}", path, ec.message());
+        std::filesystem::remove(tempPath, ec);
+    }
+#else
+    (void)atlas;
+#endif
+}
+
+// Identifies the font file without reading all of it (CJK fonts run to
+// tens of MB): size, modification time and the first 64 KB, which hold
+// the font's tables directory and naming. Mixed with the pixel size.
+uint64_t FontAtlas::fontKey() const
+{
+    std::error_code ec;
+    uint64_t fileSize = std::filesystem::file_size(fontPath_, ec);
+    if (ec)
+    {
+        return 0;
+    }
+    int64_t modified = std::filesystem::last_write_time(fontPath_, ec).time_since_epoch().count();
+    uint64_t hash = 0xcbf29ce484222325ull;
+    hash = fnv1a(hash, &fileSize, sizeof(fileSize));
+    hash = fnv1a(hash, &modified, sizeof(modified));
+    hash = fnv1a(hash, &size_, sizeof(size_));
+    std::ifstream in(fontPath_, std::ios::binary);
+    std::vector<char> head(64 * 1024);
+    in.read(head.data(), static_cast<std::streamsize>(head.size()));
+    hash = fnv1a(hash, head.data(), static_cast<size_t>(in.gcount()));
+    return hash == 0 ? 1 : hash;
+}
+
+std::string FontAtlas::cachePath() const
+{
+    char name[48];
+    std::snprintf(name, sizeof(name), "font-%016llx.atlas", static_cast<unsigned long long>(fontKey_));
+    return (std::filesystem::path(cacheDir_) / name).string();
+}
+
+std::string FontAtlas::defaultCacheDir()
+{
+#ifdef _WIN32
+    if (const char* local = std::getenv("LOCALAPPDATA"))
+    {
+        return std::string(local) + "\\ConnectTool";
+    }
+#elif defined(__APPLE__)
+    if (const char* home = std::getenv("HOME"))
+    {
+        return std::string(home) + "/Library/Caches/ConnectTool";
+    }
+#else
+    if (const char* xdg = std::getenv("XDG_CACHE_HOME"))
+    {
+        return std::string(xdg) + "/connecttool";
+    }
+    if (const char* home = std::getenv("HOME"))
+    {
+        return std::string(home) + "/.cache/connecttool";
+    }
+#endif
+    return ".";
+}
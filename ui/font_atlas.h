@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <imgui.h>
+
+// The UI font, baked with only the glyphs the UI shows instead of the
+// ~2500 of ImGui's simplified Chinese range. It starts from Latin-1 plus the
+// seed text (the characters in the UI's own labels) and grows as require()
+// sees text with new characters: player names, typed input. Baked atlases
+// are cached on disk keyed by the font file and size, with the glyph set
+// they hold, so the next start skips both reading the font and rasterizing.
+//
+// With ImGui 1.92+ the atlas rasterizes glyphs on first use by itself; the
+// font is added without ranges and the rest of this class does nothing.
+class FontAtlas {
+public:
+    FontAtlas(std::string fontPath, float sizePixels, std::string cacheDir);
+
+    // Sets up io.Fonts before the renderer first uploads it. seedText null:
+    // no label list was generated, so the full simplified Chinese range is
+    // seeded instead.
+    void load(ImFontAtlas* atlas, const char* seedText);
+    // Text about to be drawn; characters the atlas lacks show as '?' until
+    // the next update()
+    void require(const char* text);
+    void require(const std::string& text) { require(text.c_str()); }
+    bool pending() const { return pending_; }
+    // Between frames: bakes what require() found missing. true if the atlas
+    // changed and the renderer's font texture must be re-created.
+    bool update(ImFontAtlas* atlas);
+
+    // Per-user cache directory for the platform
+    static std::string defaultCacheDir();
+
+private:
+    bool bake(ImFontAtlas* atlas);
+    bool loadCache(ImFontAtlas* atlas);
+    void saveCache(ImFontAtlas* atlas);
+    uint64_t fontKey() const;
+    std::string cachePath() const;
+
+    std::string fontPath_;
+    float size_;
+    std::string cacheDir_;
+    uint64_t fontKey_ = 0; // 0: font file missing
+    ImFontGlyphRangesBuilder glyphs_; // Every character baked or pending
+    ImVector<ImWchar> ranges_;        // The atlas keeps pointing at these
+    bool pending_ = false;
+};